@@ -11,6 +11,7 @@
 #include "PnnLABGAQuantizer.h"
 
 #include <algorithm>
+#include <chrono>
 #include <iostream>
 #include <sstream>
 
@@ -104,21 +105,126 @@ namespace nQuantGA
 		return result;
 	}
 		
+	// Hypervolume dominated by the points, bounded by the reference point (all objectives minimized)
+	static double hypervolume(vector<vector<double> > points, const vector<double>& refPoint, int numObj)
+	{
+		if (points.empty())
+			return 0.0;
+
+		const int f = numObj - 1;
+		if (f == 0) {
+			auto minObj = min_element(points.begin(), points.end(), [](const auto& lhs, const auto& rhs)
+			{
+				return lhs[0] < rhs[0];
+			});
+			return refPoint[0] - (*minObj)[0];
+		}
+
+		// Sweep along the last objective, slicing the dominated region into slabs
+		sort(points.begin(), points.end(), [f](const auto& lhs, const auto& rhs)
+		{
+			return lhs[f] < rhs[f];
+		});
+
+		double volume = 0.0;
+		for (int i = 0; i < points.size(); ++i) {
+			auto upper = (i + 1 < points.size()) ? points[i + 1][f] : refPoint[f];
+			auto height = upper - points[i][f];
+			if (height <= 0)
+				continue;
+
+			vector<vector<double> > slice(points.begin(), points.begin() + i + 1);
+			volume += hypervolume(slice, refPoint, numObj - 1) * height;
+		}
+		return volume;
+	}
+
+	template <class T>
+	static double frontHypervolume(const vector<shared_ptr<T> >& population, const vector<double>& refPoint)
+	{
+		vector<vector<double> > front;
+		for (int i = 0; i < population.size(); ++i) {
+			bool dominated = false;
+			for (int j = 0; !dominated && j < population.size(); ++j)
+				dominated = i != j && population[j]->dominates(population[i].get());
+			if (dominated)
+				continue;
+
+			auto objectives = population[i]->getObjectives();
+			bool inside = true;
+			for (int f = 0; inside && f < objectives.size(); ++f)
+				inside = objectives[f] < refPoint[f];
+			if (inside)
+				front.emplace_back(objectives);
+		}
+		return hypervolume(front, refPoint, refPoint.size());
+	}
+
+	template <class T>
+	static vector<double> nadirPoint(const vector<shared_ptr<T> >& population)
+	{
+		auto refPoint = population[0]->getObjectives();
+		for (auto& chromosome : population) {
+			auto objectives = chromosome->getObjectives();
+			for (int f = 0; f < refPoint.size(); ++f)
+				refPoint[f] = max(refPoint[f], objectives[f]);
+		}
+
+		// leave some room so that the worst members still count
+		for (auto& obj : refPoint)
+			obj = (obj > 0) ? obj * 1.1 : 1.0;
+		return refPoint;
+	}
+
+	template <class T>
+	int APNsgaIII<T>::getGeneration() const
+	{
+		return _currentGeneration;
+	}
+
 	// Starts and executes algorithm
 	template <class T>
 	void APNsgaIII<T>::run(int maxRepeat, double minFitness)
 	{
+		run(maxRepeat, minFitness, 0.0);
+	}
+
+	template <class T>
+	void APNsgaIII<T>::run(int maxRepeat, double minFitness, double timeBudget, int maxStagnation, double minHypervolumeChange)
+	{
+		_stopReason = StopReason::MaxIterations;
 		if (this->_prototype.get() == nullptr)
 			return;
 
+		auto start = chrono::steady_clock::now();
+		auto isTimeUp = [&]() -> bool {
+			if (timeBudget <= 0)
+				return false;
+			auto elapsed = chrono::duration_cast<chrono::milliseconds>(chrono::steady_clock::now() - start).count() / 1000.0;
+			return elapsed >= timeBudget;
+		};
+
 		vector<shared_ptr<T> > pop[2];
 		pop[0] = this->initialize();
+		// start from the best initial chromosome, so a time budget running out in the first generation still leaves a result
+		this->_best = pop[0][0];
+		for (auto& chromosome : pop[0]) {
+			if (chromosome->dominates(this->_best.get()))
+				this->_best = chromosome;
+		}
 		int nMax = (int) (1.5 * this->_populationSize);
 
 		int bestNotEnhance = 0;
 		_currentGeneration = 0;
 		double lastBestFit = 0.0;
 
+		vector<double> refPoint;
+		double lastHypervolume = 0.0;
+		if (minHypervolumeChange > 0) {
+			refPoint = nadirPoint(pop[0]);
+			lastHypervolume = frontHypervolume(pop[0], refPoint);
+		}
+
 		int cur = 0, next = 1;
 		while(_currentGeneration < _max_iterations)
 		{			
@@ -139,13 +245,35 @@ namespace nQuantGA
 					status << "\rFitness: " << showpoint << best->getFitness() << "\t Generation: " << _currentGeneration;
 				wcout << status.str().c_str();
 					
-				if (best->getFitness() > minFitness) 
+				if (best->getFitness() > minFitness) {
+					_stopReason = StopReason::MinFitness;
+					break;
+				}
+
+				if (maxStagnation > 0 && bestNotEnhance >= maxStagnation) {
+					_stopReason = StopReason::Stagnation;
 					break;
+				}
+
+				if (minHypervolumeChange > 0) {
+					auto hv = frontHypervolume(pop[cur], refPoint);
+					auto change = abs(hv - lastHypervolume) / max(lastHypervolume, 1e-12);
+					lastHypervolume = hv;
+					if (change < minHypervolumeChange) {
+						_stopReason = StopReason::Hypervolume;
+						break;
+					}
+				}
 
 				if (bestNotEnhance > (maxRepeat / 50))
 					this->reform();
 			}
 
+			if (isTimeUp()) {
+				_stopReason = StopReason::TimeBudget;
+				break;
+			}
+
 			/******************* crossover *****************/
 			auto offspring = this->crossing(pop[cur]);
 				
@@ -161,10 +289,15 @@ namespace nQuantGA
 			pop[next] = replacement(pop[cur]);
 			this->_best = pop[next][0]->dominates(pop[cur][0].get()) ? pop[next][0] : pop[cur][0];
 
-			dualCtrlStrategy(pop[next], bestNotEnhance, nMax);
-
 			swap(cur, next);
 			++_currentGeneration;
+
+			if (isTimeUp()) {
+				_stopReason = StopReason::TimeBudget;
+				break;
+			}
+
+			dualCtrlStrategy(pop[cur], bestNotEnhance, nMax);
 		}
 
 	}
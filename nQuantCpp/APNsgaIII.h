@@ -3,6 +3,9 @@
 
 namespace nQuantGA
 {
+	// Reasons why APNsgaIII::run returned its best-so-far result
+	enum class StopReason { MaxIterations, MinFitness, TimeBudget, Stagnation, Hypervolume };
+
 	/*
 	 * Wu, M.; Yang, D.; Zhou, B.; Yang, Z.; Liu, T.; Li, L.; Wang, Z.; Hu,
 	 * K. Adaptive Population NSGA-III with Dual Control Strategy for Flexible Job
@@ -18,6 +21,8 @@ namespace nQuantGA
 		// Worst of chromosomes
 		shared_ptr<T> _worst;
 
+		StopReason _stopReason = StopReason::MaxIterations;
+
 		void dualCtrlStrategy(vector<shared_ptr<T> >& population, int bestNotEnhance, int nMax);
 		double ex(T& chromosome);
 		void popDec(vector<shared_ptr<T> >& population);
@@ -29,6 +34,19 @@ namespace nQuantGA
 
 		// Starts and executes algorithm
 		void run(int maxRepeat, double minFitness) override;
+
+		// Starts and executes algorithm, stopping early once timeBudget seconds are spent,
+		// the best fitness has not improved for maxStagnation generations or the hypervolume
+		// of the non-dominated front changes by less than minHypervolumeChange (relative).
+		// Zero disables the corresponding criterion.
+		void run(int maxRepeat, double minFitness, double timeBudget, int maxStagnation = 0, double minHypervolumeChange = 0.0);
+
+		StopReason getStopReason() const
+		{
+			return _stopReason;
+		}
+
+		int getGeneration() const;
 	};
 
 }
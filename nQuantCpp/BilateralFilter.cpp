@@ -0,0 +1,159 @@
+/* Bilateral stencil weights for saliency and edge-aware quantizers.
+Copyright (c) 2018 - 2025 Miller Cy Chan
+* The image is converted to CIELAB planes once, then every window offset is evaluated a row at a time, four pixels per SSE2 instruction. */
+
+#include "stdafx.h"
+#include "BilateralFilter.h"
+#include "CIELABConvertor.h"
+
+#include <algorithm>
+#include <math.h>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define BILA_SSE2
+#endif
+
+namespace BilateralFilter
+{
+	const float LOG2E = 1.44269504f;
+	// 2^f on [0, 1), relative error below 2e-7
+	const float EXP2_POLY[] = { 1.8775767e-3f, 8.9893397e-3f, 5.5826318e-2f, 2.4015361e-1f, 6.9315308e-1f, 9.9999994e-1f };
+
+	// exp(x) as 2^i * 2^f, clamped at 2^-126 so the exponent bits stay normal
+	static inline float fastExp(float x)
+	{
+		x = max(x * LOG2E, -126.0f);
+		const auto xi = floor(x);
+		const auto f = x - xi;
+		auto p = EXP2_POLY[0];
+		for (int k = 1; k < 6; ++k)
+			p = p * f + EXP2_POLY[k];
+
+		union { int i; float f; } scale;
+		scale.i = (static_cast<int>(xi) + 127) << 23;
+		return p * scale.f;
+	}
+
+#ifdef BILA_SSE2
+	static inline __m128 fastExp(__m128 x)
+	{
+		x = _mm_max_ps(_mm_mul_ps(x, _mm_set1_ps(LOG2E)), _mm_set1_ps(-126.0f));
+		auto xi = _mm_cvtepi32_ps(_mm_cvttps_epi32(x));
+		// truncation rounds negative values up, step back to the floor
+		xi = _mm_sub_ps(xi, _mm_and_ps(_mm_cmpgt_ps(xi, x), _mm_set1_ps(1.0f)));
+		const auto f = _mm_sub_ps(x, xi);
+		auto p = _mm_set1_ps(EXP2_POLY[0]);
+		for (int k = 1; k < 6; ++k)
+			p = _mm_add_ps(_mm_mul_ps(p, f), _mm_set1_ps(EXP2_POLY[k]));
+
+		const auto scale = _mm_slli_epi32(_mm_add_epi32(_mm_cvttps_epi32(xi), _mm_set1_epi32(127)), 23);
+		return _mm_mul_ps(p, _mm_castsi128_ps(scale));
+	}
+#endif
+
+	void toLabPlanes(const ARGB* pixels, const UINT area, LabPlanes& lab)
+	{
+		lab.L.resize(area);
+		lab.A.resize(area);
+		lab.B.resize(area);
+		lab.alpha.resize(area);
+
+		const int length = static_cast<int>(area);
+		#pragma omp parallel for
+		for (int i = 0; i < length; ++i) {
+			Color c(pixels[i]);
+			CIELABConvertor::Lab lab1;
+			CIELABConvertor::RGB2LAB(c, lab1);
+			lab.L[i] = lab1.L;
+			lab.A[i] = lab1.A;
+			lab.B[i] = lab1.B;
+			lab.alpha[i] = c.GetA();
+		}
+	}
+
+	void computeWeights(const LabPlanes& lab, const UINT width, const UINT height, float* weightPlanes, const int radius,
+		const bool hasSemiTransparency, const float sigma_s, const float sigma_r)
+	{
+		const int w = static_cast<int>(width), h = static_cast<int>(height);
+		const int size = 2 * radius + 1;
+		const size_t area = (size_t) width * height;
+		const auto colorScale = 1.0f / (2 * sigma_r * sigma_r);
+		const auto spaceScale = 1.0f / (2 * sigma_s * sigma_s);
+		const auto alphaScale = static_cast<float>(1.0 / exp(1.5));
+		auto pL = lab.L.data(), pA = lab.A.data(), pB = lab.B.data(), pAlpha = lab.alpha.data();
+
+		#pragma omp parallel
+		{
+			vector<float> weightSums(width);
+
+			#pragma omp for
+			for (int y = 0; y < h; ++y) {
+				const size_t row = (size_t) y * width;
+				fill(weightSums.begin(), weightSums.end(), 0.0f);
+				for (int dy = -radius; dy <= radius; ++dy) {
+					for (int dx = -radius; dx <= radius; ++dx) {
+						auto pWeight = weightPlanes + ((dy + radius) * size + dx + radius) * area + row;
+						const int yy = y + dy;
+						if (yy < 0 || yy >= h) {
+							fill(pWeight, pWeight + width, 0.0f);
+							continue;
+						}
+
+						// neighbour of pixel i is i + offset, valid for x in [xMin, xMax)
+						const ptrdiff_t offset = (ptrdiff_t) dy * w + dx;
+						const int xMin = max(0, -dx), xMax = min(w, w - dx);
+						const auto spaceTerm = -(dx * dx + dy * dy) * spaceScale;
+						fill(pWeight, pWeight + xMin, 0.0f);
+						fill(pWeight + xMax, pWeight + width, 0.0f);
+
+						int x = xMin;
+#ifdef BILA_SSE2
+						const auto vSpace = _mm_set1_ps(spaceTerm), vColor = _mm_set1_ps(colorScale), vAlpha = _mm_set1_ps(alphaScale);
+						const auto absMask = _mm_castsi128_ps(_mm_set1_epi32(0x7FFFFFFF));
+						for (; x + 4 <= xMax; x += 4) {
+							const auto i = row + x;
+							const auto dL = _mm_sub_ps(_mm_loadu_ps(pL + i + offset), _mm_loadu_ps(pL + i));
+							const auto dA = _mm_sub_ps(_mm_loadu_ps(pA + i + offset), _mm_loadu_ps(pA + i));
+							const auto dB = _mm_sub_ps(_mm_loadu_ps(pB + i + offset), _mm_loadu_ps(pB + i));
+							auto colorD = _mm_add_ps(_mm_mul_ps(dA, dA), _mm_mul_ps(dB, dB));
+							if (hasSemiTransparency) {
+								const auto dAlpha = _mm_sub_ps(_mm_loadu_ps(pAlpha + i + offset), _mm_loadu_ps(pAlpha + i));
+								colorD = _mm_add_ps(colorD, _mm_add_ps(_mm_mul_ps(dL, dL), _mm_mul_ps(_mm_mul_ps(dAlpha, dAlpha), vAlpha)));
+							}
+							else
+								colorD = _mm_add_ps(_mm_and_ps(dL, absMask), _mm_sqrt_ps(colorD));
+
+							_mm_storeu_ps(pWeight + x, fastExp(_mm_sub_ps(vSpace, _mm_mul_ps(colorD, vColor))));
+						}
+#endif
+						for (; x < xMax; ++x) {
+							const auto i = row + x;
+							const auto dL = pL[i + offset] - pL[i];
+							const auto dA = pA[i + offset] - pA[i];
+							const auto dB = pB[i + offset] - pB[i];
+							auto colorD = dA * dA + dB * dB;
+							if (hasSemiTransparency) {
+								const auto dAlpha = pAlpha[i + offset] - pAlpha[i];
+								colorD += dL * dL + dAlpha * dAlpha * alphaScale;
+							}
+							else
+								colorD = abs(dL) + sqrt(colorD);
+
+							pWeight[x] = fastExp(spaceTerm - colorD * colorScale);
+						}
+
+						for (x = xMin; x < xMax; ++x)
+							weightSums[x] += pWeight[x];
+					}
+				}
+
+				for (int k = 0; k < size * size; ++k) {
+					auto pWeight = weightPlanes + k * area + row;
+					for (int x = 0; x < w; ++x)
+						pWeight[x] /= weightSums[x];
+				}
+			}
+		}
+	}
+}
@@ -0,0 +1,19 @@
+#pragma once
+#include "bitmapUtilities.h"
+
+namespace BilateralFilter
+{
+	// CIELAB of every pixel, one plane per channel
+	struct LabPlanes
+	{
+		vector<float> L, A, B, alpha;
+	};
+
+	void toLabPlanes(const ARGB* pixels, const UINT area, LabPlanes& lab);
+
+	// Normalised bilateral weights of a (2 * radius + 1)^2 window around every pixel.
+	// weightPlanes holds one width x height plane per window offset, ordered by dy then dx;
+	// neighbours outside the image get a weight of zero.
+	void computeWeights(const LabPlanes& lab, const UINT width, const UINT height, float* weightPlanes, const int radius = 1,
+		const bool hasSemiTransparency = false, const float sigma_s = 1.0f, const float sigma_r = 2.0f);
+}
@@ -6,8 +6,14 @@
 #include "stdafx.h"
 #include "BlueNoise.h"
 
+#include <float.h>
 #include <memory>
 
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define BLUE_SSE2
+#endif
+
 namespace BlueNoise
 {
 	// Reference mask from: https://tellusim.com/download/noise/64x64_l64_s16.png
@@ -179,6 +185,14 @@ namespace BlueNoise
 		26, -34, 118, 8, -25, 22, -104, 48, -57, 80, 26, -125, -33, 1, 108, -117, 90, -62, -31, 6, -107
 	};
 	
+	// blue noise factor of the pixel at (x, y)
+	static inline float noiseFactor(const float weight, const float strength, const int x, const int y)
+	{
+		auto adj = (TELL_BLUE_NOISE[(x & 63) | (y & 63) << 6] + 0.5f) / 127.5f;
+		adj += ((x + y & 1) - 0.5f) * strength / 8.0f;
+		return adj * weight;
+	}
+
 	ARGB diffuse(const Color& pixel, const Color& qPixel, const float weight, const float strength, const int x, const int y)
 	{
 		int r_pix = pixel.GetR();
@@ -186,9 +200,7 @@ namespace BlueNoise
 		int b_pix = pixel.GetB();
 		int a_pix = pixel.GetA();
 
-		auto adj = (TELL_BLUE_NOISE[(x & 63) | (y & 63) << 6] + 0.5f) / 127.5f;
-		adj += ((x + y & 1) - 0.5f) * strength / 8.0f;
-		adj *= weight;
+		auto adj = noiseFactor(weight, strength, x, y);
 		r_pix = static_cast<BYTE>(min(BYTE_MAX, max(r_pix + (adj * (r_pix - qPixel.GetR())), 0)));
 		g_pix = static_cast<BYTE>(min(BYTE_MAX, max(g_pix + (adj * (g_pix - qPixel.GetG())), 0)));
 		b_pix = static_cast<BYTE>(min(BYTE_MAX, max(b_pix + (adj * (b_pix - qPixel.GetB())), 0)));
@@ -196,20 +208,159 @@ namespace BlueNoise
 
 		return Color::MakeARGB(a_pix, r_pix, g_pix, b_pix);
 	}
-	
+
+#ifdef BLUE_SSE2
+	// diffuse of four pixels in a row, one vector holds the four channels of a pixel
+	static inline void diffuse4(const ARGB* pixels, const ARGB* qColors, const float* adj, ARGB* pDiffused)
+	{
+		const auto zero = _mm_setzero_si128();
+		const auto pix = _mm_loadu_si128((const __m128i*) pixels);
+		const auto q = _mm_loadu_si128((const __m128i*) qColors);
+		const __m128i pix16[] = { _mm_unpacklo_epi8(pix, zero), _mm_unpackhi_epi8(pix, zero) };
+		const __m128i q16[] = { _mm_unpacklo_epi8(q, zero), _mm_unpackhi_epi8(q, zero) };
+
+		__m128i results[4];
+		for (int k = 0; k < 4; ++k) {
+			const auto p32 = (k & 1) ? _mm_unpackhi_epi16(pix16[k >> 1], zero) : _mm_unpacklo_epi16(pix16[k >> 1], zero);
+			const auto q32 = (k & 1) ? _mm_unpackhi_epi16(q16[k >> 1], zero) : _mm_unpacklo_epi16(q16[k >> 1], zero);
+			auto v = _mm_add_ps(_mm_cvtepi32_ps(p32), _mm_mul_ps(_mm_set1_ps(adj[k]), _mm_cvtepi32_ps(_mm_sub_epi32(p32, q32))));
+			v = _mm_min_ps(_mm_max_ps(v, _mm_setzero_ps()), _mm_set1_ps(BYTE_MAX));
+			results[k] = _mm_cvttps_epi32(v);
+		}
+		_mm_storeu_si128((__m128i*) pDiffused, _mm_packus_epi16(_mm_packs_epi32(results[0], results[1]), _mm_packs_epi32(results[2], results[3])));
+	}
+#endif
+
+	// Nearest opaque palette entry by squared RGB distance. The entries sit in float planes padded to a multiple of four
+	// and are only read by the lookup, so one inverse colormap serves every row of the image at once.
+	class InverseColormap
+	{
+		private:
+			vector<float> m_r, m_g, m_b;
+			vector<unsigned short> m_indices;
+
+		public:
+			InverseColormap(const ARGB* pPalette, const unsigned short nMaxColors)
+			{
+				for (unsigned short i = 0; i < nMaxColors; ++i) {
+					Color c(pPalette[i]);
+					if (c.GetA() < BYTE_MAX)
+						continue;
+
+					m_r.emplace_back(c.GetR());
+					m_g.emplace_back(c.GetG());
+					m_b.emplace_back(c.GetB());
+					m_indices.emplace_back(i);
+				}
+
+				// padding entries are too far away to ever be the nearest
+				while (!m_indices.empty() && m_indices.size() % 4) {
+					m_r.emplace_back(1e9f);
+					m_g.emplace_back(1e9f);
+					m_b.emplace_back(1e9f);
+					m_indices.emplace_back(m_indices.back());
+				}
+			}
+
+			bool empty() const
+			{
+				return m_indices.empty();
+			}
+
+			unsigned short nearest(const ARGB argb) const
+			{
+				Color c(argb);
+				const int size = static_cast<int>(m_indices.size());
+				float mindist = FLT_MAX;
+				int k = 0;
+				int i = 0;
+#ifdef BLUE_SSE2
+				const auto r = _mm_set1_ps(c.GetR()), g = _mm_set1_ps(c.GetG()), b = _mm_set1_ps(c.GetB());
+				auto minDists = _mm_set1_ps(FLT_MAX);
+				auto minIndices = _mm_setzero_si128();
+				auto indices = _mm_setr_epi32(0, 1, 2, 3);
+				for (; i < size; i += 4) {
+					const auto dr = _mm_sub_ps(_mm_loadu_ps(m_r.data() + i), r);
+					const auto dg = _mm_sub_ps(_mm_loadu_ps(m_g.data() + i), g);
+					const auto db = _mm_sub_ps(_mm_loadu_ps(m_b.data() + i), b);
+					const auto dists = _mm_add_ps(_mm_add_ps(_mm_mul_ps(dr, dr), _mm_mul_ps(dg, dg)), _mm_mul_ps(db, db));
+					// strictly closer only, so every lane keeps the first of equal entries
+					const auto closer = _mm_cmplt_ps(dists, minDists);
+					minDists = _mm_min_ps(dists, minDists);
+					minIndices = _mm_or_si128(_mm_and_si128(_mm_castps_si128(closer), indices), _mm_andnot_si128(_mm_castps_si128(closer), minIndices));
+					indices = _mm_add_epi32(indices, _mm_set1_epi32(4));
+				}
+
+				float laneDists[4];
+				int laneIndices[4];
+				_mm_storeu_ps(laneDists, minDists);
+				_mm_storeu_si128((__m128i*) laneIndices, minIndices);
+				for (int lane = 0; lane < 4; ++lane) {
+					if (laneDists[lane] < mindist || (laneDists[lane] == mindist && laneIndices[lane] < k)) {
+						mindist = laneDists[lane];
+						k = laneIndices[lane];
+					}
+				}
+#endif
+				for (; i < size; ++i) {
+					const auto dr = m_r[i] - c.GetR(), dg = m_g[i] - c.GetG(), db = m_b[i] - c.GetB();
+					const auto curdist = dr * dr + dg * dg + db * db;
+					if (curdist < mindist) {
+						mindist = curdist;
+						k = i;
+					}
+				}
+				return m_indices[k];
+			}
+	};
+
+	// Every pixel only depends on itself and the noise tile, so rows are diffused in parallel and opaque pixels
+	// are looked up in the shared inverse colormap. The rest go through ditherFn afterwards in raster order,
+	// as its nearest color caches are not thread safe.
 	void dither(const UINT width, const UINT height, const ARGB* pixels, const ARGB* pPalette, const unsigned short nMaxColors, DitherFn ditherFn, GetColorIndexFn getColorIndexFn, unsigned short* qPixels, const float weight)
 	{
-		const float strength = 1 / 3.0f;  	
-		
-		for (UINT y = 0; y < height; ++y) {
-			for (UINT x = 0; x < width; ++x) {
-				UINT bidx = x + y * width;
-				Color pixel(pixels[bidx]);
-				Color c1 = pPalette[qPixels[bidx]];
-
-				c1 = diffuse(pixel, c1, weight, strength, x, y);
-				qPixels[bidx] = ditherFn(pPalette, nMaxColors, c1.GetValue(), bidx);
+		const float strength = 1 / 3.0f;
+		const int w = static_cast<int>(width), h = static_cast<int>(height);
+		const InverseColormap colormap(pPalette, nMaxColors);
+
+		vector<ARGB> diffused((size_t) width * height);
+		auto pDiffused = diffused.data();
+		int deferred = 0;
+
+		#pragma omp parallel for reduction(+:deferred)
+		for (int y = 0; y < h; ++y) {
+			const auto row = (size_t) y * width;
+			int x = 0;
+#ifdef BLUE_SSE2
+			for (; x + 4 <= w; x += 4) {
+				ARGB qColors[4];
+				float adj[4];
+				for (int k = 0; k < 4; ++k) {
+					qColors[k] = pPalette[qPixels[row + x + k]];
+					adj[k] = noiseFactor(weight, strength, x + k, y);
+				}
+				diffuse4(pixels + row + x, qColors, adj, pDiffused + row + x);
+			}
+#endif
+			for (; x < w; ++x)
+				pDiffused[row + x] = diffuse(pixels[row + x], pPalette[qPixels[row + x]], weight, strength, x, y);
+
+			for (x = 0; x < w; ++x) {
+				const auto bidx = row + x;
+				if (colormap.empty() || (pDiffused[bidx] >> 24) < BYTE_MAX)
+					++deferred;
+				else
+					qPixels[bidx] = colormap.nearest(pDiffused[bidx]);
 			}
 		}
-    }
+
+		if (deferred == 0)
+			return;
+
+		const UINT area = width * height;
+		for (UINT bidx = 0; bidx < area; ++bidx) {
+			if (colormap.empty() || (pDiffused[bidx] >> 24) < BYTE_MAX)
+				qPixels[bidx] = ditherFn(pPalette, nMaxColors, pDiffused[bidx], bidx);
+		}
+	}
 }
@@ -7,5 +7,6 @@ namespace BlueNoise
 	
 	ARGB diffuse(const Color& pixel, const Color& qPixel, const float weight, const float strength, const int x, const int y);
 
+	// Opaque pixels map to the nearest opaque palette color by RGB distance, the others through ditherFn
 	void dither(const UINT width, const UINT height, const ARGB* pixels, const ARGB* pPalette, const unsigned short nMaxColors, DitherFn ditherFn, GetColorIndexFn getColorIndexFn, unsigned short* qPixels, const float weight = 1.0f);
 }
@@ -0,0 +1,844 @@
+/* zlib compatible deflate and inflate (RFC 1950, RFC 1951)
+Copyright (c) 2018 - 2025 Miller Cy Chan
+* Matches are found on hash chains with the search effort of zlib levels and every block picks the smallest of
+* dynamic Huffman, fixed Huffman and stored coding. Segments of the input are deflated without a shared window,
+* so they run on separate threads, and each one but the last ends with an empty stored block to realign the bytes. */
+
+#include "stdafx.h"
+#include "Deflate.h"
+
+#include <algorithm>
+#include <queue>
+
+namespace Deflate
+{
+	const int MAX_BITS = 15, MAX_BL_BITS = 7;
+	const int WINDOW_SIZE = 32768, WINDOW_MASK = WINDOW_SIZE - 1;
+	const int HASH_BITS = 15, HASH_SIZE = 1 << HASH_BITS;
+	const int MIN_MATCH = 3, MAX_MATCH = 258;
+	const int END_BLOCK = 256, LITERALS = 286, DISTANCES = 30, BL_CODES = 19;
+	const int MAX_STORED = 65535;
+	// input deflated by one thread, and symbols coded with one set of Huffman codes
+	const size_t SEGMENT_SIZE = 1 << 18;
+	const int BLOCK_SYMBOLS = 1 << 14;
+
+	const unsigned short LENGTH_BASE[] = { 3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31, 35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258 };
+	const BYTE LENGTH_EXTRA[] = { 0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2, 3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0 };
+	const unsigned short DIST_BASE[] = { 1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193, 257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577 };
+	const BYTE DIST_EXTRA[] = { 0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6, 7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13 };
+	const BYTE BL_ORDER[] = { 16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15 };
+
+	// search effort per level after zlib: a match of good length cuts the chain to a quarter,
+	// one of nice length ends the search, and lazy levels look one byte ahead for a longer match
+	struct LevelConfig
+	{
+		int good, nice, chain;
+		bool lazy;
+	};
+
+	const LevelConfig LEVELS[] = {
+		{ 0, 0, 0, false }, { 4, 8, 4, false }, { 4, 16, 8, false }, { 4, 32, 32, false },
+		{ 4, 16, 16, true }, { 8, 32, 32, true }, { 8, 128, 128, true }, { 8, 128, 256, true },
+		{ 32, 258, 1024, true }, { 32, 258, 4096, true }
+	};
+
+	// length and distance to their code numbers
+	struct SymbolTables
+	{
+		BYTE lengthCode[MAX_MATCH + 1];
+		BYTE distCode[512];
+		BYTE fixedLitLengths[288];
+		BYTE fixedDistLengths[DISTANCES];
+
+		SymbolTables()
+		{
+			for (int code = 0; code < 29; ++code) {
+				const int end = min(MAX_MATCH, LENGTH_BASE[code] + (1 << LENGTH_EXTRA[code]) - 1);
+				for (int len = LENGTH_BASE[code]; len <= end; ++len)
+					lengthCode[len] = code;
+			}
+			for (int code = 0; code < DISTANCES; ++code) {
+				const int end = DIST_BASE[code] + (1 << DIST_EXTRA[code]) - 1;
+				for (int dist = DIST_BASE[code]; dist <= end; ++dist) {
+					const int d = dist - 1;
+					distCode[d < 256 ? d : 256 + (d >> 7)] = code;
+				}
+			}
+
+			for (int i = 0; i < 288; ++i)
+				fixedLitLengths[i] = i < 144 ? 8 : i < 256 ? 9 : i < 280 ? 7 : 8;
+			fill(fixedDistLengths, fixedDistLengths + DISTANCES, 5);
+		}
+
+		inline int getDistCode(const int dist) const
+		{
+			const int d = dist - 1;
+			return distCode[d < 256 ? d : 256 + (d >> 7)];
+		}
+	};
+
+	static const SymbolTables& getTables()
+	{
+		static const SymbolTables tables;
+		return tables;
+	}
+
+	UINT adler32(UINT adler, const BYTE* data, size_t size)
+	{
+		UINT a = adler & 0xffff, b = adler >> 16;
+		while (size > 0) {
+			// largest run before b can overflow
+			auto n = min(size, (size_t) 5552);
+			size -= n;
+			while (n-- > 0) {
+				a += *data++;
+				b += a;
+			}
+			a %= 65521;
+			b %= 65521;
+		}
+		return (b << 16) | a;
+	}
+
+	class BitWriter
+	{
+		private:
+			vector<BYTE>& m_out;
+			UINT m_bits = 0;
+			int m_count = 0;
+
+		public:
+			BitWriter(vector<BYTE>& out) : m_out(out) {
+			}
+
+			inline void put(const UINT value, const int length)
+			{
+				m_bits |= value << m_count;
+				m_count += length;
+				while (m_count >= 8) {
+					m_out.emplace_back(m_bits & 0xff);
+					m_bits >>= 8;
+					m_count -= 8;
+				}
+			}
+
+			void align()
+			{
+				if (m_count > 0)
+					m_out.emplace_back(m_bits & 0xff);
+				m_bits = 0;
+				m_count = 0;
+			}
+
+			vector<BYTE>& bytes()
+			{
+				return m_out;
+			}
+	};
+
+	// code lengths of at most maxBits for the frequencies, halving them until the Huffman tree is shallow enough
+	static void buildLengths(const UINT* freqs, const int n, const int maxBits, BYTE* lengths)
+	{
+		fill(lengths, lengths + n, 0);
+		vector<UINT> weights(freqs, freqs + n);
+		int used = 0, last = 0;
+		for (int i = 0; i < n; ++i) {
+			if (weights[i] > 0) {
+				++used;
+				last = i;
+			}
+		}
+		if (used == 0)
+			return;
+		if (used == 1) {
+			lengths[last] = 1;
+			return;
+		}
+
+		vector<int> parents(2 * n);
+		for (;;) {
+			using Node = pair<UINT, int>;
+			priority_queue<Node, vector<Node>, greater<Node> > heap;
+			for (int i = 0; i < n; ++i) {
+				if (weights[i] > 0)
+					heap.emplace(weights[i], i);
+			}
+
+			int next = n;
+			while (heap.size() > 1) {
+				const auto a = heap.top();
+				heap.pop();
+				const auto b = heap.top();
+				heap.pop();
+				parents[a.second] = parents[b.second] = next;
+				heap.emplace(a.first + b.first, next++);
+			}
+			const int root = heap.top().second;
+
+			// depth of a merged node is known before any of its children, as it was created after them
+			vector<int> depths(next, 0);
+			for (int node = root - 1; node >= 0; --node) {
+				if (node < n && weights[node] == 0)
+					continue;
+				depths[node] = depths[parents[node]] + 1;
+			}
+
+			int maxDepth = 0;
+			for (int i = 0; i < n; ++i) {
+				if (weights[i] > 0)
+					maxDepth = max(maxDepth, depths[i]);
+			}
+			if (maxDepth <= maxBits) {
+				for (int i = 0; i < n; ++i) {
+					if (weights[i] > 0)
+						lengths[i] = depths[i];
+				}
+				return;
+			}
+
+			for (int i = 0; i < n; ++i) {
+				if (weights[i] > 0)
+					weights[i] = (weights[i] >> 1) | 1;
+			}
+		}
+	}
+
+	// canonical codes, bit reversed as deflate sends Huffman codes from the most significant bit
+	static void buildCodes(const BYTE* lengths, const int n, unsigned short* codes)
+	{
+		int blCount[MAX_BITS + 1] = { 0 };
+		for (int i = 0; i < n; ++i)
+			++blCount[lengths[i]];
+		blCount[0] = 0;
+
+		int nextCode[MAX_BITS + 1] = { 0 };
+		int code = 0;
+		for (int bits = 1; bits <= MAX_BITS; ++bits) {
+			code = (code + blCount[bits - 1]) << 1;
+			nextCode[bits] = code;
+		}
+
+		for (int i = 0; i < n; ++i) {
+			const int len = lengths[i];
+			if (len == 0)
+				continue;
+
+			int c = nextCode[len]++, reversed = 0;
+			for (int k = 0; k < len; ++k, c >>= 1)
+				reversed = (reversed << 1) | (c & 1);
+			codes[i] = reversed;
+		}
+	}
+
+	// a literal below 256, otherwise the length in the low 9 bits after 256 - MIN_MATCH and the distance above them
+	static inline UINT matchSymbol(const int length, const int dist)
+	{
+		return ((UINT) dist << 9) | (length - MIN_MATCH + 256);
+	}
+
+	static void writeStored(BitWriter& writer, const BYTE* data, const size_t size, const bool final)
+	{
+		size_t pos = 0;
+		do {
+			const auto len = min(size - pos, (size_t) MAX_STORED);
+			const bool last = pos + len == size;
+			writer.put(final && last ? 1 : 0, 1);
+			writer.put(0, 2);
+			writer.align();
+			auto& out = writer.bytes();
+			out.emplace_back(len & 0xff);
+			out.emplace_back(len >> 8);
+			out.emplace_back(~len & 0xff);
+			out.emplace_back((~len >> 8) & 0xff);
+			out.insert(out.end(), data + pos, data + pos + len);
+			pos += len;
+		} while (pos < size);
+	}
+
+	static void writeSymbols(BitWriter& writer, const vector<UINT>& symbols, const BYTE* litLengths, const unsigned short* litCodes,
+		const BYTE* distLengths, const unsigned short* distCodes)
+	{
+		const auto& tables = getTables();
+		for (const auto symbol : symbols) {
+			if (symbol < 256) {
+				writer.put(litCodes[symbol], litLengths[symbol]);
+				continue;
+			}
+
+			const int length = (symbol & 511) - 256 + MIN_MATCH;
+			const int dist = symbol >> 9;
+			const int lcode = tables.lengthCode[length];
+			writer.put(litCodes[257 + lcode], litLengths[257 + lcode]);
+			writer.put(length - LENGTH_BASE[lcode], LENGTH_EXTRA[lcode]);
+			const int dcode = tables.getDistCode(dist);
+			writer.put(distCodes[dcode], distLengths[dcode]);
+			writer.put(dist - DIST_BASE[dcode], DIST_EXTRA[dcode]);
+		}
+		writer.put(litCodes[END_BLOCK], litLengths[END_BLOCK]);
+	}
+
+	// codes the symbols of one block, which came from the raw bytes in data, in the cheapest of the three block types
+	static void writeBlock(BitWriter& writer, const vector<UINT>& symbols, const BYTE* data, const size_t rawSize, const bool final)
+	{
+		const auto& tables = getTables();
+		UINT litFreqs[LITERALS] = { 0 }, distFreqs[DISTANCES] = { 0 };
+		size_t extraBits = 0;
+		for (const auto symbol : symbols) {
+			if (symbol < 256) {
+				++litFreqs[symbol];
+				continue;
+			}
+			const int length = (symbol & 511) - 256 + MIN_MATCH;
+			const int lcode = tables.lengthCode[length];
+			const int dcode = tables.getDistCode(symbol >> 9);
+			++litFreqs[257 + lcode];
+			++distFreqs[dcode];
+			extraBits += LENGTH_EXTRA[lcode] + DIST_EXTRA[dcode];
+		}
+		litFreqs[END_BLOCK] = 1;
+
+		BYTE litLengths[LITERALS], distLengths[DISTANCES];
+		buildLengths(litFreqs, LITERALS, MAX_BITS, litLengths);
+		buildLengths(distFreqs, DISTANCES, MAX_BITS, distLengths);
+		// a block of literals still describes one distance code
+		if (*max_element(distLengths, distLengths + DISTANCES) == 0)
+			distLengths[0] = 1;
+
+		int hlit = LITERALS, hdist = DISTANCES;
+		while (hlit > 257 && litLengths[hlit - 1] == 0)
+			--hlit;
+		while (hdist > 1 && distLengths[hdist - 1] == 0)
+			--hdist;
+
+		// run length coding of the code lengths: 16 repeats the previous length, 17 and 18 repeat zero
+		BYTE allLengths[LITERALS + DISTANCES];
+		copy(litLengths, litLengths + hlit, allLengths);
+		copy(distLengths, distLengths + hdist, allLengths + hlit);
+		const int total = hlit + hdist;
+		vector<pair<BYTE, BYTE> > runs;
+		for (int i = 0; i < total;) {
+			const auto len = allLengths[i];
+			int run = 1;
+			while (i + run < total && allLengths[i + run] == len)
+				++run;
+
+			if (len == 0 && run >= 3) {
+				const int count = min(run, 138);
+				runs.emplace_back(count >= 11 ? 18 : 17, count >= 11 ? count - 11 : count - 3);
+				i += count;
+			}
+			else if (len > 0 && run >= 4) {
+				runs.emplace_back(len, 0);
+				const int count = min(run - 1, 6);
+				runs.emplace_back(16, count - 3);
+				i += count + 1;
+			}
+			else {
+				runs.emplace_back(len, 0);
+				++i;
+			}
+		}
+
+		UINT blFreqs[BL_CODES] = { 0 };
+		for (const auto& run : runs)
+			++blFreqs[run.first];
+		BYTE blLengths[BL_CODES];
+		buildLengths(blFreqs, BL_CODES, MAX_BL_BITS, blLengths);
+		// inflaters reject an incomplete code length code, so a lone symbol gets a sibling
+		if (count_if(blLengths, blLengths + BL_CODES, [](const BYTE len) { return len > 0; }) == 1)
+			blLengths[blLengths[0] > 0 ? 1 : 0] = 1;
+		int hclen = BL_CODES;
+		while (hclen > 4 && blLengths[BL_ORDER[hclen - 1]] == 0)
+			--hclen;
+
+		size_t dynamicBits = 3 + 14 + hclen * 3 + extraBits, fixedBits = 3 + extraBits;
+		for (const auto& run : runs)
+			dynamicBits += blLengths[run.first] + (run.first == 16 ? 2 : run.first == 17 ? 3 : run.first == 18 ? 7 : 0);
+		for (int i = 0; i < LITERALS; ++i) {
+			dynamicBits += (size_t) litFreqs[i] * litLengths[i];
+			fixedBits += (size_t) litFreqs[i] * tables.fixedLitLengths[i];
+		}
+		for (int i = 0; i < DISTANCES; ++i) {
+			dynamicBits += (size_t) distFreqs[i] * distLengths[i];
+			fixedBits += (size_t) distFreqs[i] * tables.fixedDistLengths[i];
+		}
+		const auto storedBits = (rawSize + 5 * (rawSize / MAX_STORED + 1)) * 8 + 7;
+
+		if (storedBits <= min(dynamicBits, fixedBits)) {
+			writeStored(writer, data, rawSize, final);
+			return;
+		}
+
+		unsigned short litCodes[288] = { 0 }, distCodes[DISTANCES] = { 0 };
+		writer.put(final ? 1 : 0, 1);
+		if (fixedBits <= dynamicBits) {
+			writer.put(1, 2);
+			buildCodes(tables.fixedLitLengths, 288, litCodes);
+			buildCodes(tables.fixedDistLengths, DISTANCES, distCodes);
+			writeSymbols(writer, symbols, tables.fixedLitLengths, litCodes, tables.fixedDistLengths, distCodes);
+			return;
+		}
+
+		writer.put(2, 2);
+		writer.put(hlit - 257, 5);
+		writer.put(hdist - 1, 5);
+		writer.put(hclen - 4, 4);
+		for (int i = 0; i < hclen; ++i)
+			writer.put(blLengths[BL_ORDER[i]], 3);
+
+		unsigned short blCodes[BL_CODES] = { 0 };
+		buildCodes(blLengths, BL_CODES, blCodes);
+		for (const auto& run : runs) {
+			writer.put(blCodes[run.first], blLengths[run.first]);
+			if (run.first >= 16)
+				writer.put(run.second, run.first == 16 ? 2 : run.first == 17 ? 3 : 7);
+		}
+
+		buildCodes(litLengths, LITERALS, litCodes);
+		buildCodes(distLengths, DISTANCES, distCodes);
+		writeSymbols(writer, symbols, litLengths, litCodes, distLengths, distCodes);
+	}
+
+	// LZ77 over hash chains of the last WINDOW_SIZE positions, for one segment of the input
+	class Matcher
+	{
+		private:
+			const BYTE* m_data;
+			const int m_size;
+			const LevelConfig& m_config;
+			vector<int> m_head, m_prev;
+
+			inline int hash(const int pos) const
+			{
+				const UINT key = m_data[pos] | (m_data[pos + 1] << 8) | (m_data[pos + 2] << 16);
+				return (key * 2654435761u) >> (32 - HASH_BITS);
+			}
+
+		public:
+			Matcher(const BYTE* data, const int size, const LevelConfig& config) : m_data(data), m_size(size), m_config(config),
+				m_head(HASH_SIZE, -1), m_prev(WINDOW_SIZE, -1) {
+			}
+
+			inline void insert(const int pos)
+			{
+				if (pos + MIN_MATCH > m_size)
+					return;
+				const int h = hash(pos);
+				m_prev[pos & WINDOW_MASK] = m_head[h];
+				m_head[h] = pos;
+			}
+
+			// longest match at pos longer than prevLength among the earlier positions, 0 if there is none
+			int longestMatch(const int pos, const int prevLength, int& dist) const
+			{
+				if (pos + MIN_MATCH > m_size)
+					return 0;
+
+				const int maxLength = min(MAX_MATCH, m_size - pos);
+				int chain = prevLength >= m_config.good ? m_config.chain >> 2 : m_config.chain;
+				int best = max(prevLength, MIN_MATCH - 1);
+				if (best >= maxLength)
+					return 0;
+
+				const auto scan = m_data + pos;
+				int bestLength = 0;
+				for (int candidate = m_head[hash(pos)]; candidate >= 0 && pos - candidate <= WINDOW_SIZE && chain-- > 0; candidate = m_prev[candidate & WINDOW_MASK]) {
+					const auto match = m_data + candidate;
+					if (match[best] != scan[best] || match[0] != scan[0] || match[1] != scan[1])
+						continue;
+
+					int len = 2;
+					while (len < maxLength && match[len] == scan[len])
+						++len;
+					if (len > best) {
+						best = bestLength = len;
+						dist = pos - candidate;
+						if (len >= m_config.nice || len >= maxLength)
+							break;
+					}
+				}
+				return bestLength;
+			}
+	};
+
+	static void deflateSegment(const BYTE* data, const int size, const int level, const bool last, vector<BYTE>& out)
+	{
+		BitWriter writer(out);
+		if (level == 0)
+			writeStored(writer, data, size, last);
+		else {
+			const auto& config = LEVELS[level];
+			Matcher matcher(data, size, config);
+			vector<UINT> symbols;
+			symbols.reserve(BLOCK_SYMBOLS);
+			int blockStart = 0, covered = 0;
+
+			auto emit = [&](const UINT symbol, const int length) {
+				symbols.emplace_back(symbol);
+				covered += length;
+				if (symbols.size() >= BLOCK_SYMBOLS) {
+					writeBlock(writer, symbols, data + blockStart, covered - blockStart, false);
+					symbols.clear();
+					blockStart = covered;
+				}
+			};
+
+			int pos = 0;
+			if (!config.lazy) {
+				while (pos < size) {
+					int dist = 0;
+					const int len = matcher.longestMatch(pos, 0, dist);
+					if (len >= MIN_MATCH) {
+						emit(matchSymbol(len, dist), len);
+						for (int end = pos + len; pos < end; ++pos)
+							matcher.insert(pos);
+					}
+					else {
+						emit(data[pos], 1);
+						matcher.insert(pos++);
+					}
+				}
+			}
+			else {
+				// the match found at the previous position waits to see if this position does better
+				bool pending = false;
+				int prevLength = 0, prevDist = 0;
+				while (pos < size) {
+					int dist = 0, len = 0;
+					if (!pending || prevLength < config.nice)
+						len = matcher.longestMatch(pos, pending ? prevLength : 0, dist);
+					matcher.insert(pos);
+
+					if (pending && prevLength >= MIN_MATCH && len <= prevLength) {
+						emit(matchSymbol(prevLength, prevDist), prevLength);
+						const int end = pos - 1 + prevLength;
+						while (++pos < end)
+							matcher.insert(pos);
+						pending = false;
+						prevLength = 0;
+						continue;
+					}
+
+					if (pending)
+						emit(data[pos - 1], 1);
+					pending = true;
+					prevLength = len;
+					prevDist = dist;
+					++pos;
+				}
+
+				if (pending) {
+					if (prevLength >= MIN_MATCH)
+						emit(matchSymbol(prevLength, prevDist), prevLength);
+					else
+						emit(data[pos - 1], 1);
+				}
+			}
+
+			writeBlock(writer, symbols, data + blockStart, covered - blockStart, last);
+		}
+
+		if (!last) {
+			// sync flush: an empty stored block leaves the stream at a byte boundary for the next segment
+			writer.put(0, 3);
+			writer.align();
+			out.insert(out.end(), { 0, 0, 0xff, 0xff });
+		}
+		else
+			writer.align();
+	}
+
+	void compress(const BYTE* data, const size_t size, vector<BYTE>& out, const int level)
+	{
+		const int lvl = min(max(level, 0), 9);
+		const int cmf = 0x78;
+		int flg = (lvl < 2 ? 0 : lvl < 6 ? 1 : lvl == 6 ? 2 : 3) << 6;
+		flg += 31 - (cmf * 256 + flg) % 31;
+		out.emplace_back(cmf);
+		out.emplace_back(flg);
+
+		const int segments = max(1, static_cast<int>((size + SEGMENT_SIZE - 1) / SEGMENT_SIZE));
+		vector<vector<BYTE> > parts(segments);
+		#pragma omp parallel for schedule(dynamic) if (segments > 1)
+		for (int s = 0; s < segments; ++s) {
+			const auto start = s * SEGMENT_SIZE;
+			const auto length = static_cast<int>(min(SEGMENT_SIZE, size - start));
+			parts[s].reserve(length / 2 + 64);
+			deflateSegment(data + start, length, lvl, s == segments - 1, parts[s]);
+		}
+
+		for (const auto& part : parts)
+			out.insert(out.end(), part.begin(), part.end());
+
+		const auto adler = adler32(1, data, size);
+		for (int shift = 24; shift >= 0; shift -= 8)
+			out.emplace_back((adler >> shift) & 0xff);
+	}
+
+	class BitReader
+	{
+		private:
+			const BYTE* m_data;
+			const size_t m_size;
+			size_t m_pos = 0;
+			unsigned long long m_bits = 0;
+			int m_count = 0, m_padding = 0;
+
+		public:
+			BitReader(const BYTE* data, const size_t size) : m_data(data), m_size(size) {
+			}
+
+			inline void refill()
+			{
+				while (m_count <= 56) {
+					BYTE b = 0;
+					if (m_pos < m_size)
+						b = m_data[m_pos++];
+					else
+						++m_padding;
+					m_bits |= (unsigned long long) b << m_count;
+					m_count += 8;
+				}
+			}
+
+			inline UINT peek(const int n)
+			{
+				if (m_count < n)
+					refill();
+				return (UINT) (m_bits & ((1ull << n) - 1));
+			}
+
+			inline void consume(const int n)
+			{
+				m_bits >>= n;
+				m_count -= n;
+			}
+
+			inline UINT bits(const int n)
+			{
+				if (n == 0)
+					return 0;
+				const auto value = peek(n);
+				consume(n);
+				return value;
+			}
+
+			void align()
+			{
+				consume(m_count & 7);
+			}
+
+			// reading past the end only yields padding zeros, so a stream that needs them is truncated
+			bool overrun() const
+			{
+				return m_padding * 8 > m_count;
+			}
+
+			size_t position() const
+			{
+				return m_pos - m_count / 8 + m_padding;
+			}
+	};
+
+	class Huffman
+	{
+		private:
+			static const int FAST_BITS = 10;
+			// symbol << 4 | length of the codes up to FAST_BITS long, indexed by their bit reversed code
+			unsigned short m_fast[1 << FAST_BITS];
+			unsigned short m_counts[MAX_BITS + 1];
+			unsigned short m_symbols[288];
+
+		public:
+			bool build(const BYTE* lengths, const int n)
+			{
+				fill(m_counts, m_counts + MAX_BITS + 1, 0);
+				for (int i = 0; i < n; ++i)
+					++m_counts[lengths[i]];
+				m_counts[0] = 0;
+
+				int left = 1;
+				for (int len = 1; len <= MAX_BITS; ++len) {
+					left = (left << 1) - m_counts[len];
+					if (left < 0)
+						return false;
+				}
+
+				unsigned short offsets[MAX_BITS + 2] = { 0 };
+				for (int len = 1; len <= MAX_BITS; ++len)
+					offsets[len + 1] = offsets[len] + m_counts[len];
+				for (int i = 0; i < n; ++i) {
+					if (lengths[i] > 0)
+						m_symbols[offsets[lengths[i]]++] = i;
+				}
+
+				fill(m_fast, m_fast + (1 << FAST_BITS), 0);
+				int code = 0, index = 0;
+				for (int len = 1; len <= FAST_BITS; ++len) {
+					for (int k = 0; k < m_counts[len]; ++k, ++code) {
+						int reversed = 0;
+						for (int b = 0, c = code; b < len; ++b, c >>= 1)
+							reversed = (reversed << 1) | (c & 1);
+						const auto entry = (unsigned short) ((m_symbols[index++] << 4) | len);
+						for (int slot = reversed; slot < (1 << FAST_BITS); slot += 1 << len)
+							m_fast[slot] = entry;
+					}
+					code <<= 1;
+				}
+				return true;
+			}
+
+			inline int decode(BitReader& reader) const
+			{
+				const auto entry = m_fast[reader.peek(FAST_BITS)];
+				if (entry > 0) {
+					reader.consume(entry & 15);
+					return entry >> 4;
+				}
+
+				// longer codes, one bit at a time
+				const auto bits = reader.peek(MAX_BITS);
+				int code = 0, first = 0, index = 0;
+				for (int len = 1; len <= MAX_BITS; ++len) {
+					code |= (bits >> (len - 1)) & 1;
+					const int count = m_counts[len];
+					if (code - first < count) {
+						reader.consume(len);
+						return m_symbols[index + code - first];
+					}
+					index += count;
+					first = (first + count) << 1;
+					code <<= 1;
+				}
+				return -1;
+			}
+	};
+
+	// limit is the size out may not exceed
+	static bool inflateBlock(BitReader& reader, const Huffman& lit, const Huffman& dist, vector<BYTE>& out, const size_t limit)
+	{
+		for (;;) {
+			if (reader.overrun())
+				return false;
+
+			int symbol = lit.decode(reader);
+			if (symbol < 0)
+				return false;
+			if (symbol < 256) {
+				if (out.size() >= limit)
+					return false;
+				out.emplace_back(symbol);
+				continue;
+			}
+			if (symbol == END_BLOCK)
+				return true;
+
+			symbol -= 257;
+			if (symbol >= 29)
+				return false;
+			const int length = LENGTH_BASE[symbol] + reader.bits(LENGTH_EXTRA[symbol]);
+			const int dcode = dist.decode(reader);
+			if (dcode < 0 || dcode >= DISTANCES)
+				return false;
+			const size_t distance = DIST_BASE[dcode] + reader.bits(DIST_EXTRA[dcode]);
+			if (distance > out.size() || length > limit - out.size())
+				return false;
+
+			const auto start = out.size();
+			out.resize(start + length);
+			auto pOut = out.data() + start;
+			for (int k = 0; k < length; ++k)
+				pOut[k] = pOut[k - distance];
+		}
+	}
+
+	bool uncompress(const BYTE* data, const size_t size, vector<BYTE>& out, const size_t maxOut)
+	{
+		if (size < 6 || (data[0] & 0x0f) != 8 || (data[0] * 256 + data[1]) % 31 != 0 || (data[1] & 0x20))
+			return false;
+
+		const auto start = out.size();
+		const auto limit = maxOut < (numeric_limits<size_t>::max)() - start ? start + maxOut : (numeric_limits<size_t>::max)();
+		BitReader reader(data + 2, size - 2);
+		Huffman lit, dist;
+		const auto& tables = getTables();
+		bool final = false;
+		while (!final) {
+			final = reader.bits(1) != 0;
+			const auto type = reader.bits(2);
+			if (type == 0) {
+				reader.align();
+				const auto len = reader.bits(16), nlen = reader.bits(16);
+				if ((len ^ 0xffff) != nlen || len > limit - out.size())
+					return false;
+				for (UINT k = 0; k < len; ++k)
+					out.emplace_back(reader.bits(8));
+				if (reader.overrun())
+					return false;
+				continue;
+			}
+
+			if (type == 1) {
+				lit.build(tables.fixedLitLengths, 288);
+				dist.build(tables.fixedDistLengths, DISTANCES);
+			}
+			else if (type == 2) {
+				const int hlit = reader.bits(5) + 257, hdist = reader.bits(5) + 1, hclen = reader.bits(4) + 4;
+				if (hlit > LITERALS || hdist > DISTANCES)
+					return false;
+
+				BYTE blLengths[BL_CODES] = { 0 };
+				for (int i = 0; i < hclen; ++i)
+					blLengths[BL_ORDER[i]] = reader.bits(3);
+				Huffman bl;
+				if (!bl.build(blLengths, BL_CODES))
+					return false;
+
+				BYTE lengths[LITERALS + DISTANCES] = { 0 };
+				for (int i = 0; i < hlit + hdist;) {
+					const int symbol = bl.decode(reader);
+					if (symbol < 0 || reader.overrun())
+						return false;
+					if (symbol < 16) {
+						lengths[i++] = symbol;
+						continue;
+					}
+
+					BYTE len = 0;
+					int repeat;
+					if (symbol == 16) {
+						if (i == 0)
+							return false;
+						len = lengths[i - 1];
+						repeat = 3 + reader.bits(2);
+					}
+					else if (symbol == 17)
+						repeat = 3 + reader.bits(3);
+					else
+						repeat = 11 + reader.bits(7);
+					if (i + repeat > hlit + hdist)
+						return false;
+					fill(lengths + i, lengths + i + repeat, len);
+					i += repeat;
+				}
+
+				if (lengths[END_BLOCK] == 0 || !lit.build(lengths, hlit) || !dist.build(lengths + hlit, hdist))
+					return false;
+			}
+			else
+				return false;
+
+			if (!inflateBlock(reader, lit, dist, out, limit))
+				return false;
+		}
+
+		reader.align();
+		if (reader.overrun())
+			return false;
+		const auto pos = 2 + reader.position();
+		if (pos + 4 > size)
+			return false;
+		const UINT expected = ((UINT) data[pos] << 24) | (data[pos + 1] << 16) | (data[pos + 2] << 8) | data[pos + 3];
+		return adler32(1, out.data() + start, out.size() - start) == expected;
+	}
+}
@@ -0,0 +1,16 @@
+#pragma once
+#include "bitmapUtilities.h"
+#include <limits>
+
+namespace Deflate
+{
+	// Appends the zlib stream of the data at a level from 0 (stored) to 9 (longest match search).
+	// Segments of the input are deflated on separate threads and joined at byte boundaries.
+	void compress(const BYTE* data, const size_t size, vector<BYTE>& out, const int level = 6);
+
+	// Appends the inflated zlib stream, false if it is damaged, its checksum does not match
+	// or it would inflate to more than maxOut bytes
+	bool uncompress(const BYTE* data, const size_t size, vector<BYTE>& out, const size_t maxOut = (numeric_limits<size_t>::max)());
+
+	UINT adler32(UINT adler, const BYTE* data, size_t size);
+}
@@ -21,6 +21,7 @@
 #include <algorithm>
 #include <unordered_map>
 #include <type_traits>
+#include <tuple>
 
 namespace DivQuant
 {
@@ -35,7 +36,7 @@ namespace DivQuant
 
 	struct Bucket
 	{
-		BYTE value = 0;
+		UINT value = 0;
 		ARGB argb = Color::Transparent;
 		shared_ptr<Bucket> next;
 	};
@@ -85,7 +86,7 @@ namespace DivQuant
   
 		for (UINT ir = 0; ir < numRows; ir += dec_factor) {
 			for (UINT ic = 0; ic < numCols; ic += dec_factor) {
-				Color c(inPixels[ic + (ir * numRows)]);
+				Color c(inPixels[ic + (ir * numCols)]);
       
 				/* Determine the bucket */
 				int hash = c.GetValue() % COLOR_HASH_SIZE;
@@ -838,6 +839,316 @@ namespace DivQuant
 		nMaxColors = num_colors - num_empty;
 	}
 	
+	// Componentwise sums over the points of a cluster that fall on the side of the new cluster
+	struct Sums
+	{
+		int count = 0;
+		double weight = 0.0;
+		double alpha = 0.0, L = 0.0, A = 0.0, B = 0.0;
+		double alpha2 = 0.0, L2 = 0.0, A2 = 0.0, B2 = 0.0;
+	};
+
+	// Every data point in Lab, converted once up front so that clusters can be split concurrently without pixelMap
+	struct LabPoints
+	{
+		unique_ptr<float[]> alpha, L, A, B;
+		const double* weightsPtr = nullptr;
+		double data_weight = 0.0;
+
+		inline double weight(const int i) const {
+			return weightsPtr == nullptr ? data_weight : weightsPtr[i];
+		}
+	};
+
+	// A cluster owns the points order[begin..end) of the shared index permutation
+	struct Cluster
+	{
+		int begin = 0, end = 0;
+		double weight = 0.0, tse = 0.0;
+		Pixel<double> mean, var;
+	};
+
+	struct Split
+	{
+		bool valid = false;
+		int mid = 0;
+		double old_weight = 0.0, new_weight = 0.0;
+		Pixel<double> old_mean, old_var, new_mean, new_var;
+	};
+
+	// Points are summed in fixed blocks and the blocks added in order, so the sums do not depend on the number of threads
+	static const int split_block_size = 8192;
+
+	// A round splits every cluster whose TSE is at least this fraction of the largest one
+	static const double split_round_ratio = 0.5;
+
+	// Clusters of at least this many points are split one at a time with their sums spread over all threads
+	static const int split_parallel_size = 8 * split_block_size;
+
+	template <typename IsNew>
+	Sums SumNewSide(const LabPoints& points, const int* order, const int num_points, IsNew isNew)
+	{
+		const int num_blocks = (num_points + split_block_size - 1) / split_block_size;
+		vector<Sums> blocks(num_blocks);
+
+		#pragma omp parallel for
+		for (int ib = 0; ib < num_blocks; ++ib) {
+			auto& sums = blocks[ib];
+			const int end = min(num_points, (ib + 1) * split_block_size);
+			for (int ip = ib * split_block_size; ip < end; ++ip) {
+				const int i = order[ip];
+				if (!isNew(i))
+					continue;
+
+				const double w = points.weight(i);
+				++sums.count;
+				sums.weight += w;
+				sums.alpha += w * points.alpha[i];
+				sums.L += w * points.L[i];
+				sums.A += w * points.A[i];
+				sums.B += w * points.B[i];
+				sums.alpha2 += w * sqr(points.alpha[i]);
+				sums.L2 += w * sqr(points.L[i]);
+				sums.A2 += w * sqr(points.A[i]);
+				sums.B2 += w * sqr(points.B[i]);
+			}
+		}
+
+		Sums total;
+		for (const auto& sums : blocks) {
+			total.count += sums.count;
+			total.weight += sums.weight;
+			total.alpha += sums.alpha;
+			total.L += sums.L;
+			total.A += sums.A;
+			total.B += sums.B;
+			total.alpha2 += sums.alpha2;
+			total.L2 += sums.L2;
+			total.A2 += sums.A2;
+			total.B2 += sums.B2;
+		}
+		return total;
+	}
+
+	static inline void MeanAndVar(const Sums& sums, Pixel<double>& mean, Pixel<double>& var)
+	{
+		mean.alpha = sums.alpha / sums.weight;
+		mean.L = sums.L / sums.weight;
+		mean.A = sums.A / sums.weight;
+		mean.B = sums.B / sums.weight;
+
+		var.alpha = sums.alpha2 / sums.weight - sqr(mean.alpha);
+		var.L = sums.L2 / sums.weight - sqr(mean.L);
+		var.A = sums.A2 / sums.weight - sqr(mean.A);
+		var.B = sums.B2 / sums.weight - sqr(mean.B);
+	}
+
+	// Same steps as one iteration of DivQuantCluster: cut through the mean of the axis with the greatest variance,
+	// refine both halves with local k-means, then partition the points of the cluster in place.
+	void SplitCluster(const LabPoints& points, int* order, const Cluster& cluster, const int max_iters, Split& split)
+	{
+		const auto& total_mean = cluster.mean;
+		const auto& total_var = cluster.var;
+		const double total_weight = cluster.weight;
+		const int num_points = cluster.end - cluster.begin;
+		auto clusterOrder = order + cluster.begin;
+
+		/* Determine the axis with the greatest variance */
+		const float* axis = points.alpha.get();
+		double max_val = total_var.alpha;
+		double cut_pos = total_mean.alpha;
+		if (max_val < total_var.L) {
+			max_val = total_var.L;
+			axis = points.L.get();
+			cut_pos = total_mean.L;
+		}
+		if (max_val < total_var.A) {
+			max_val = total_var.A;
+			axis = points.A.get();
+			cut_pos = total_mean.A;
+		}
+		if (max_val < total_var.B) {
+			max_val = total_var.B;
+			axis = points.B.get();
+			cut_pos = total_mean.B;
+		}
+
+		bool cut = true;
+		double lhs = 0.0, rhs_alpha = 0.0, rhs_L = 0.0, rhs_A = 0.0, rhs_B = 0.0;
+		auto isNew = [&](const int i) {
+			if (cut)
+				return cut_pos < axis[i];
+			return !(lhs < ((rhs_alpha * points.alpha[i]) + (rhs_L * points.L[i]) + (rhs_A * points.A[i]) + (rhs_B * points.B[i])));
+		};
+
+		auto& new_mean = split.new_mean;
+		auto& old_mean = split.old_mean;
+		auto sums = SumNewSide(points, clusterOrder, num_points, isNew);
+		if (sums.count == 0 || sums.count == num_points)
+			return;
+
+		for (int it = 0; ; ++it) {
+			MeanAndVar(sums, new_mean, split.new_var);
+			split.new_weight = sums.weight;
+			split.old_weight = total_weight - sums.weight;
+
+			/* Calculate the mean of the old cluster using the 'combined mean' formula */
+			old_mean.alpha = (total_weight * total_mean.alpha - sums.weight * new_mean.alpha) / split.old_weight;
+			old_mean.L = (total_weight * total_mean.L - sums.weight * new_mean.L) / split.old_weight;
+			old_mean.A = (total_weight * total_mean.A - sums.weight * new_mean.A) / split.old_weight;
+			old_mean.B = (total_weight * total_mean.B - sums.weight * new_mean.B) / split.old_weight;
+
+			if (it >= max_iters)
+				break;
+
+			/* LOCAL K-MEANS */
+			const auto last = make_tuple(cut, lhs, rhs_alpha, rhs_L, rhs_A, rhs_B);
+			lhs = 0.5 * (sqr(old_mean.alpha) - sqr(new_mean.alpha) + sqr(old_mean.L) - sqr(new_mean.L) + sqr(old_mean.A) - sqr(new_mean.A) + sqr(old_mean.B) - sqr(new_mean.B));
+			rhs_alpha = old_mean.alpha - new_mean.alpha;
+			rhs_L = old_mean.L - new_mean.L;
+			rhs_A = old_mean.A - new_mean.A;
+			rhs_B = old_mean.B - new_mean.B;
+			cut = false;
+			sums = SumNewSide(points, clusterOrder, num_points, isNew);
+
+			/* Keep the last split where both sides are non-empty */
+			if (sums.count == 0 || sums.count == num_points) {
+				tie(cut, lhs, rhs_alpha, rhs_L, rhs_A, rhs_B) = last;
+				break;
+			}
+		}
+
+		/* Calculate the variance of the old cluster using the 'combined variance' formula */
+		const auto& new_var = split.new_var;
+		auto& old_var = split.old_var;
+		const double new_weight = split.new_weight, old_weight = split.old_weight;
+		old_var.alpha = ((total_weight * total_var.alpha - new_weight * (new_var.alpha + sqr(new_mean.alpha - total_mean.alpha))) / old_weight) - sqr(old_mean.alpha - total_mean.alpha);
+		old_var.L = ((total_weight * total_var.L - new_weight * (new_var.L + sqr(new_mean.L - total_mean.L))) / old_weight) - sqr(old_mean.L - total_mean.L);
+		old_var.A = ((total_weight * total_var.A - new_weight * (new_var.A + sqr(new_mean.A - total_mean.A))) / old_weight) - sqr(old_mean.A - total_mean.A);
+		old_var.B = ((total_weight * total_var.B - new_weight * (new_var.B + sqr(new_mean.B - total_mean.B))) / old_weight) - sqr(old_mean.B - total_mean.B);
+
+		split.mid = cluster.begin + (int) (partition(clusterOrder, clusterOrder + num_points, [&](const int i) { return !isNew(i); }) - clusterOrder);
+		split.valid = true;
+	}
+
+	// Parallel variant of DivQuantCluster. Instead of always splitting the single cluster with the largest TSE,
+	// each round splits all clusters with a TSE close to the largest. Large clusters, such as the first ones,
+	// are split one after another with data-parallel reductions, the small ones side by side as independent tasks.
+	void DivQuantClusterParallel(const int num_points, const ARGB* data, const double data_weight, double* weightsPtr,
+		const int max_iters, ColorPalette* pPalette, UINT& nMaxColors)
+	{
+		const UINT num_colors = nMaxColors;
+
+		LabPoints points;
+		points.alpha = make_unique<float[]>(num_points);
+		points.L = make_unique<float[]>(num_points);
+		points.A = make_unique<float[]>(num_points);
+		points.B = make_unique<float[]>(num_points);
+		points.weightsPtr = weightsPtr;
+		points.data_weight = data_weight;
+
+		auto order = make_unique<int[]>(num_points);
+
+		#pragma omp parallel for
+		for (int ip = 0; ip < num_points; ++ip) {
+			Color c(data[ip]);
+			CIELABConvertor::Lab lab1;
+			CIELABConvertor::RGB2LAB(c, lab1);
+			points.alpha[ip] = c.GetA();
+			points.L[ip] = lab1.L;
+			points.A[ip] = lab1.A;
+			points.B[ip] = lab1.B;
+			order[ip] = ip;
+		}
+
+		vector<Cluster> clusters(1);
+		clusters.reserve(num_colors);
+		auto& root = clusters[0];
+		root.end = num_points;
+		auto sums = SumNewSide(points, order.get(), num_points, [](const int i) { return true; });
+		MeanAndVar(sums, root.mean, root.var);
+		root.weight = sums.weight;
+		root.tse = root.weight * (root.var.alpha + root.var.L + root.var.A + root.var.B);
+
+		vector<int> round;
+		vector<Split> splits;
+		while (clusters.size() < num_colors) {
+			double max_tse = DBL_MIN;
+			for (const auto& cluster : clusters)
+				max_tse = max(max_tse, cluster.tse);
+			if (max_tse <= DBL_MIN)
+				break;
+
+			round.clear();
+			for (UINT ic = 0; ic < clusters.size(); ++ic) {
+				if (clusters[ic].tse > DBL_MIN && clusters[ic].tse >= max_tse * split_round_ratio)
+					round.emplace_back(ic);
+			}
+			stable_sort(round.begin(), round.end(), [&clusters](const int a, const int b) {
+				return clusters[a].tse > clusters[b].tse;
+			});
+			if (round.size() > num_colors - clusters.size())
+				round.resize(num_colors - clusters.size());
+
+			const int num_splits = (int) round.size();
+			splits.assign(num_splits, Split());
+			// nested parallel regions run on one thread, so the sums of a large cluster are only spread over all threads
+			// when it is split outside the loop over the small ones
+			auto isLarge = [&](const int ir) {
+				return clusters[round[ir]].end - clusters[round[ir]].begin >= split_parallel_size;
+			};
+			for (int ir = 0; ir < num_splits; ++ir) {
+				if (isLarge(ir))
+					SplitCluster(points, order.get(), clusters[round[ir]], max_iters, splits[ir]);
+			}
+
+			#pragma omp parallel for schedule(dynamic)
+			for (int ir = 0; ir < num_splits; ++ir) {
+				if (!isLarge(ir))
+					SplitCluster(points, order.get(), clusters[round[ir]], max_iters, splits[ir]);
+			}
+
+			for (int ir = 0; ir < num_splits; ++ir) {
+				auto& old_cluster = clusters[round[ir]];
+				const auto& split = splits[ir];
+				if (!split.valid) {
+					// All points of the cluster fall on one side, it can be divided no more
+					old_cluster.tse = 0.0;
+					continue;
+				}
+
+				Cluster new_cluster;
+				new_cluster.begin = split.mid;
+				new_cluster.end = old_cluster.end;
+				new_cluster.weight = split.new_weight;
+				new_cluster.mean = split.new_mean;
+				new_cluster.var = split.new_var;
+				new_cluster.tse = split.new_weight * (split.new_var.alpha + split.new_var.L + split.new_var.A + split.new_var.B);
+
+				old_cluster.end = split.mid;
+				old_cluster.weight = split.old_weight;
+				old_cluster.mean = split.old_mean;
+				old_cluster.var = split.old_var;
+				old_cluster.tse = split.old_weight * (split.old_var.alpha + split.old_var.L + split.old_var.A + split.old_var.B);
+				clusters.emplace_back(new_cluster);
+			}
+		}
+
+		/* Determine the final cluster centers */
+		for (UINT k = 0; k < clusters.size(); ++k) {
+			const auto& mean = clusters[k].mean;
+			CIELABConvertor::Lab lab1;
+			lab1.alpha = rint(mean.alpha);
+			lab1.L = mean.L, lab1.A = mean.A, lab1.B = mean.B;
+			pPalette->Entries[k] = CIELABConvertor::LAB2RGB(lab1);
+
+			if (m_transparentPixelIndex >= 0 && pPalette->Entries[k] == m_transparentColor)
+				swap(pPalette->Entries[0], pPalette->Entries[k]);
+		}
+
+		nMaxColors = clusters.size();
+	}
+
 	static inline bool validate_num_bits(const BYTE num_bits)
 	{
 		return (0 < num_bits && num_bits <= 8);
@@ -845,10 +1156,18 @@ namespace DivQuant
 	
 	/* TODO: What if num_bits == 0 */
 
-	// This method will reduce the precision of each component of each pixel by setting
-	// the number of bits on the right side of the value to zero. Note that this method
-	// works properly when inPixels and outPixels are the same buffer to support in
-	// place processing.
+	// Maps every component value to the centre of the bucket it falls in once the bits below shift are dropped
+	static void bucket_centres(BYTE* lut, const BYTE shift)
+	{
+		for (int v = 0; v <= BYTE_MAX; ++v)
+			lut[v] = shift ? ((v >> shift) << shift) | (1 << (shift - 1)) : v;
+	}
+
+	// This method will reduce the precision of each component of each pixel by replacing
+	// the number of bits on the right side of the value with the centre of the bucket they span,
+	// so the reduced colours are not biased dark. Alpha keeps the buckets of fully transparent
+	// and opaque pixels exact. Note that this method works properly when inPixels and outPixels
+	// are the same buffer to support in place processing.
 	void cut_bits(const ARGB* inPixels, const UINT numPixels, ARGB* outPixels,
 		const BYTE num_bits_alpha, const BYTE num_bits_red, const BYTE num_bits_green, const BYTE num_bits_blue)
 	{  
@@ -856,28 +1175,26 @@ namespace DivQuant
 			!validate_num_bits(num_bits_green) || !validate_num_bits(num_bits_blue))
 			return;
   
-		BYTE shift_alpha = 8 - num_bits_alpha;
-		BYTE shift_red = 8 - num_bits_red;
-		BYTE shift_green = 8 - num_bits_green;
-		BYTE shift_blue = 8 - num_bits_blue;
-  
-		if (shift_alpha == shift_red && shift_alpha == shift_green && shift_alpha == shift_blue) {
-			// Shift and mask pixels as whole words when the shift amount
-			// for all 4 channel is the same.    
-			const UINT shift = shift_red;    
-			for (UINT i = 0; i < numPixels; ++i) {
-				Color c(inPixels[i]);
-				outPixels[i] = Color::MakeARGB(c.GetA() >> shift, c.GetR() >> shift, c.GetG() >> shift, c.GetB() >> shift);
-			}
+		BYTE lut_alpha[BYTE_MAX + 1], lut_red[BYTE_MAX + 1], lut_green[BYTE_MAX + 1], lut_blue[BYTE_MAX + 1];
+		bucket_centres(lut_alpha, 8 - num_bits_alpha);
+		bucket_centres(lut_red, 8 - num_bits_red);
+		bucket_centres(lut_green, 8 - num_bits_green);
+		bucket_centres(lut_blue, 8 - num_bits_blue);
+		if (num_bits_alpha < 8) {
+			fill(lut_alpha, lut_alpha + (1 << (8 - num_bits_alpha)), 0);
+			fill(lut_alpha + BYTE_MAX + 1 - (1 << (8 - num_bits_alpha)), lut_alpha + BYTE_MAX + 1, BYTE_MAX);
 		}
-		else {
-			for (UINT i = 0; i < numPixels; ++i) {
-				Color c(inPixels[i]);
-				outPixels[i] = Color::MakeARGB(c.GetA() >> shift_alpha, c.GetR() >> shift_red, c.GetG() >> shift_green, c.GetB() >> shift_blue);
-			}
+
+		for (UINT i = 0; i < numPixels; ++i) {
+			Color c(inPixels[i]);
+			outPixels[i] = Color::MakeARGB(lut_alpha[c.GetA()], lut_red[c.GetR()], lut_green[c.GetG()], lut_blue[c.GetB()]);
 		}
 	}
 
+	// Bits kept per component, pixel decimation in each direction and local k-means iterations of each speed tier.
+	// Tier 0 is the full quality default; the others cluster the distinct colours of a reduced image instead.
+	const SpeedTier speedTiers[] = { { 8, 1, 10 }, { 6, 1, 5 }, { 6, 2, 3 }, { 5, 4, 1 } };
+
 	void DivQuantizer::quant_varpart_fast(const ARGB* inPixels, const UINT numPixels, ColorPalette* pPalette,
 		const UINT numRows, const bool allPixelsUnique,
 		const int num_bits, const int dec_factor, const int max_iters)
@@ -890,28 +1207,29 @@ namespace DivQuant
 	  
 		double weightUniform = 0.0;
 		unique_ptr<double[]> weightsPtr;
+		UINT num_points = numPixels;
 	  
 		if (allPixelsUnique && num_bits == 8 && dec_factor == 1) {
 			// No duplicate pixels and no decimation or bit shifting
 			weightUniform = get_double_scale(numPixels, numRows);
 			std::copy(inPixels, inPixels + numPixels, inputPixels.get());
 		}
-		else if (!allPixelsUnique && num_bits == 8) {
-			// No cut bits, but duplicate pixels, dedup now
-			weightsPtr = calc_color_table(inPixels, numPixels, tmpPixels.get(), numRows, numCols, dec_factor, nMaxColors);
-			std::copy(tmpPixels.get(), tmpPixels.get() + numPixels, inputPixels.get());
+		else if (num_bits == 8) {
+			// No cut bits, but duplicate pixels or decimation, dedup now
+			weightsPtr = calc_color_table(inPixels, numPixels, inputPixels.get(), numRows, numCols, dec_factor, num_points);
 		}
 		else {
-			// cut bits with right shift and dedup to generate significantly smaller sized buffer
+			// cut bits with a mask and dedup to generate significantly smaller sized buffer
 			cut_bits(inPixels, numPixels, tmpPixels.get(), num_bits, num_bits, num_bits, num_bits);
-			weightsPtr = calc_color_table(tmpPixels.get(), numPixels, tmpPixels.get(), numRows, numCols, dec_factor, nMaxColors);
-			std::copy(tmpPixels.get(), tmpPixels.get() + numPixels, inputPixels.get());
+			weightsPtr = calc_color_table(tmpPixels.get(), numPixels, inputPixels.get(), numRows, numCols, dec_factor, num_points);
 		}
 	  
-		if (nMaxColors <= 256)
-			DivQuantCluster<BYTE>(numPixels, inputPixels.get(), tmpPixels.get(), weightUniform, weightsPtr.get(), num_bits, max_iters, pPalette, nMaxColors);
+		if (m_parallel)
+			DivQuantClusterParallel(num_points, inputPixels.get(), weightUniform, weightsPtr.get(), max_iters, pPalette, nMaxColors);
+		else if (nMaxColors <= 256)
+			DivQuantCluster<BYTE>(num_points, inputPixels.get(), tmpPixels.get(), weightUniform, weightsPtr.get(), num_bits, max_iters, pPalette, nMaxColors);
 		else
-			DivQuantCluster<UINT>(numPixels, inputPixels.get(), tmpPixels.get(), weightUniform, weightsPtr.get(), num_bits, max_iters, pPalette, nMaxColors);
+			DivQuantCluster<UINT>(num_points, inputPixels.get(), tmpPixels.get(), weightUniform, weightsPtr.get(), num_bits, max_iters, pPalette, nMaxColors);
 	}
 	
 	unsigned short nearestColorIndex(const ARGB* pPalette, const unsigned short nMaxColor, ARGB argb, const UINT pos)
@@ -1012,6 +1330,27 @@ namespace DivQuant
 		return true;
 	}
 
+	void DivQuantizer::setParallel(bool parallel)
+	{
+		m_parallel = parallel;
+	}
+
+	void DivQuantizer::setSpeedTier(UINT speedTier)
+	{
+		m_speedTier = min(speedTier, (UINT) (sizeof(speedTiers) / sizeof(SpeedTier)) - 1);
+	}
+
+	void DivQuantizer::quant_speed_tier(const ARGB* inPixels, const UINT numPixels, ColorPalette* pPalette, const UINT numRows)
+	{
+		if (m_speedTier == 0) {
+			quant_varpart_fast(inPixels, numPixels, pPalette);
+			return;
+		}
+
+		const auto& tier = speedTiers[m_speedTier];
+		quant_varpart_fast(inPixels, numPixels, pPalette, numRows, false, tier.num_bits, tier.dec_factor, tier.max_iters);
+	}
+
 	bool DivQuantizer::QuantizeImage(Bitmap* pSource, Bitmap* pDest, UINT& nMaxColors, bool dither)
 	{
 		const UINT bitmapWidth = pSource->GetWidth();
@@ -1028,7 +1367,7 @@ namespace DivQuant
 
 		if (nMaxColors > 256) {
 			auto qPixels = make_unique<ARGB[]>(pixels.size());
-			quant_varpart_fast(pixels.data(), pixels.size(), pPalette);
+			quant_speed_tier(pixels.data(), pixels.size(), pPalette, bitmapHeight);
 			if (dither)
 				dithering_image(pixels.data(), pPalette, nearestColorIndex, hasSemiTransparency, m_transparentPixelIndex, nMaxColors, qPixels.get(), bitmapWidth, bitmapHeight);
 			else
@@ -1037,7 +1376,7 @@ namespace DivQuant
 		}		
 
 		if (nMaxColors > 2)
-			quant_varpart_fast(pixels.data(), pixels.size(), pPalette);			
+			quant_speed_tier(pixels.data(), pixels.size(), pPalette, bitmapHeight);			
 		else {
 			if (m_transparentPixelIndex >= 0) {
 				pPalette->Entries[0] = m_transparentColor;
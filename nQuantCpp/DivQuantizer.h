@@ -23,9 +23,25 @@ namespace DivQuant
 	// Use at your own risk!
 	// =============================================================
 
+	struct SpeedTier
+	{
+		int num_bits, dec_factor, max_iters;
+	};
+
 	class DivQuantizer
 	{
+		private:
+			bool m_parallel = false;
+			UINT m_speedTier = 0;
+
+			void quant_speed_tier(const ARGB* inPixels, const UINT numPixels, ColorPalette* pPalette, const UINT numRows);
+
 		public:
+			// Split independent clusters concurrently. Each round splits every cluster with a TSE close to the largest,
+			// so the palette can differ from the serial splitter, but never with the number of threads.
+			void setParallel(bool parallel);
+			// 0 for full quality, up to 3 for a fast preview from a subsampled, bit reduced image with fewer k-means iterations
+			void setSpeedTier(UINT speedTier);
 			void quant_varpart_fast(const ARGB* inPixels, const UINT numPixels, ColorPalette* pPalette,
 				const UINT numRows = 1, const bool allPixelsUnique = true,
 				const int num_bits = 8, const int dec_factor = 1, const int max_iters = 10);
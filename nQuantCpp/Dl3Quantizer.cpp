@@ -57,9 +57,9 @@ namespace Dl3Quant
 	struct CUBE3 {
 		int a, r, g, b;
 		int aa, rr, gg, bb;
-		UINT cc;
 		UINT pixel_count = 0;
 		double err;
+		int nn = 0, fw = 0, bk = 0, tm = 0, mtm = 0;
 	};
 
 	void setARGB(CUBE3& rec)
@@ -71,37 +71,36 @@ namespace Dl3Quant
 		rec.bb = (rec.b + v2) / v;
 	}
 
-	double calc_err(CUBE3* rgb_table3, const int* squares3, const UINT& c1, const UINT& c2)
+	inline double channel_err(const CUBE3& c1, const CUBE3& c2, const int* squares3, const int& sum1, const int& sum2, const int& v1, const int& v2)
 	{
-		auto P1 = rgb_table3[c1].pixel_count;
-		auto P2 = rgb_table3[c2].pixel_count;
+		auto P1 = c1.pixel_count;
+		auto P2 = c2.pixel_count;
 		auto P3 = P1 + P2;
+		int v3 = (sum1 + sum2 + (P3 >> 1)) / P3;
+		return (double) squares3[v3 - v1] * P1 + (double) squares3[v2 - v3] * P2;
+	}
 
-		if (P3 == 0)
+	/* Merge error of two bins, component by component, giving up as soon as it reaches limit */
+	double calc_err(CUBE3* rgb_table3, const int* squares3, const UINT& c1, const UINT& c2, const double limit = UINT_MAX)
+	{
+		auto& bin1 = rgb_table3[c1];
+		auto& bin2 = rgb_table3[c2];
+		if (bin1.pixel_count + bin2.pixel_count == 0)
 			return UINT_MAX;
 
-		int A3 = (rgb_table3[c1].a + rgb_table3[c2].a + (P3 >> 1)) / P3;
-		int R3 = (rgb_table3[c1].r + rgb_table3[c2].r + (P3 >> 1)) / P3;
-		int G3 = (rgb_table3[c1].g + rgb_table3[c2].g + (P3 >> 1)) / P3;
-		int B3 = (rgb_table3[c1].b + rgb_table3[c2].b + (P3 >> 1)) / P3;
-
-		int A1 = rgb_table3[c1].aa;
-		int R1 = rgb_table3[c1].rr;
-		int G1 = rgb_table3[c1].gg;
-		int B1 = rgb_table3[c1].bb;
-
-		int A2 = rgb_table3[c2].aa;
-		int R2 = rgb_table3[c2].rr;
-		int G2 = rgb_table3[c2].gg;
-		int B2 = rgb_table3[c2].bb;
+		auto err = channel_err(bin1, bin2, squares3, bin1.a, bin2.a, bin1.aa, bin2.aa);
+		if (err >= limit)
+			return err;
 
-		double dist1 = squares3[A3 - A1] + squares3[R3 - R1] + squares3[G3 - G1] + squares3[B3 - B1];
-		dist1 *= P1;
+		err += channel_err(bin1, bin2, squares3, bin1.r, bin2.r, bin1.rr, bin2.rr);
+		if (err >= limit)
+			return err;
 
-		double dist2 = squares3[A2 - A3] + squares3[R2 - R3] + squares3[G2 - G3] + squares3[B2 - B3];
-		dist2 *= P2;
+		err += channel_err(bin1, bin2, squares3, bin1.g, bin2.g, bin1.gg, bin2.gg);
+		if (err >= limit)
+			return err;
 
-		return (dist1 + dist2);
+		return err + channel_err(bin1, bin2, squares3, bin1.b, bin2.b, bin1.bb, bin2.bb);
 	}
 
 	void build_table3(CUBE3* rgb_table3, ARGB argb)
@@ -132,80 +131,103 @@ namespace Dl3Quant
 		return tot_colors;
 	}
 
-	void recount_next(CUBE3* rgb_table3, const int* squares3, const UINT& tot_colors, const UINT& i)
+	void find_nn(CUBE3* rgb_table3, const int* squares3, const int idx)
 	{
-		UINT c2 = 0;
+		int nn = 0;
 		double err = UINT_MAX;
-		for (UINT j = i + 1; j < tot_colors; ++j) {
-			auto cur_err = calc_err(rgb_table3, squares3, i, j);
+		for (int i = rgb_table3[idx].fw; i; i = rgb_table3[i].fw) {
+			auto cur_err = calc_err(rgb_table3, squares3, idx, i, err);
 			if (cur_err < err) {
 				err = cur_err;
-				c2 = j;
+				nn = i;
 			}
 		}
-		rgb_table3[i].err = err;
-		rgb_table3[i].cc = c2;
+		rgb_table3[idx].err = err;
+		rgb_table3[idx].nn = nn;
 	}
 
-	void recount_dist(CUBE3* rgb_table3, const int* squares3, const UINT& tot_colors, const UINT& c1)
+	void reduce_table3(CUBE3* rgb_table3, const int* squares3, const UINT tot_colors, const UINT& num_colors)
 	{
-		recount_next(rgb_table3, squares3, tot_colors, c1);
-		for (int i = 0; i < c1; ++i) {
-			if (rgb_table3[i].cc == c1)
-				recount_next(rgb_table3, squares3, tot_colors, i);
-			else {
-				auto cur_err = calc_err(rgb_table3, squares3, i, c1);
-				if (cur_err < rgb_table3[i].err) {
-					rgb_table3[i].err = cur_err;
-					rgb_table3[i].cc = c1;
-				}
+		const int maxbins = tot_colors;
+		int j = 0;
+		for (; j < maxbins - 1; ++j) {
+			rgb_table3[j].fw = j + 1;
+			rgb_table3[j + 1].bk = j;
+		}
+
+		/* Each bin only looks ahead in the chain, so the rows shrink towards the end */
+		#pragma omp parallel for schedule(dynamic, 64)
+		for (int i = 0; i < maxbins; ++i)
+			find_nn(rgb_table3, squares3, i);
+
+		auto heap = make_unique<int[]>(maxbins + 1);
+		int h, l, l2;
+		/* Build heap of nearest neighbors */
+		for (int i = 0; i < maxbins; ++i) {
+			/* Push slot on heap */
+			auto err = rgb_table3[i].err;
+			for (l = ++heap[0]; l > 1; l = l2) {
+				l2 = l >> 1;
+				if (rgb_table3[h = heap[l2]].err <= err)
+					break;
+				heap[l] = h;
 			}
+			heap[l] = i;
 		}
-	}
 
-	void reduce_table3(CUBE3* rgb_table3, const int* squares3, UINT tot_colors, const UINT& num_colors)
-	{
-		UINT i = 0;
-		for (; i < (tot_colors - 1); ++i)
-			recount_next(rgb_table3, squares3, tot_colors, i);
-
-		rgb_table3[i].err = UINT_MAX;
-		rgb_table3[i].cc = tot_colors;
-
-		UINT c1 = 0, grand_total = tot_colors - num_colors;
-		while (tot_colors > num_colors) {
-			UINT err = UINT_MAX;
-			for (i = 0; i < tot_colors; ++i) {
-				if (rgb_table3[i].err < err) {
-					err = rgb_table3[i].err;
-					c1 = i;
+		/* Merge bins which increase error the least */
+		const int extbins = maxbins - num_colors;
+		for (int i = 0; i < extbins; ) {
+			int b1;
+
+			/* Use heap to find which bins to merge */
+			for (;;) {
+				auto& tb = rgb_table3[b1 = heap[1]]; /* One with least error */
+				/* Is stored error up to date? */
+				if ((tb.tm >= tb.mtm) && (rgb_table3[tb.nn].mtm <= tb.tm))
+					break;
+				if (tb.mtm == INT_MAX) /* Deleted node */
+					b1 = heap[1] = heap[heap[0]--];
+				else /* Too old error value */
+				{
+					find_nn(rgb_table3, squares3, b1);
+					tb.tm = i;
 				}
-			}
-			auto c2 = rgb_table3[c1].cc;
-			rgb_table3[c2].a += rgb_table3[c1].a;
-			rgb_table3[c2].r += rgb_table3[c1].r;
-			rgb_table3[c2].g += rgb_table3[c1].g;
-			rgb_table3[c2].b += rgb_table3[c1].b;
-			rgb_table3[c2].pixel_count += rgb_table3[c1].pixel_count;
-			setARGB(rgb_table3[c2]);
-
-			rgb_table3[c1] = rgb_table3[--tot_colors];
-			rgb_table3[tot_colors - 1].err = UINT_MAX;
-			rgb_table3[tot_colors - 1].cc = tot_colors;
-
-			for (i = 0; i < c1; ++i) {
-				if (rgb_table3[i].cc == tot_colors)
-					rgb_table3[i].cc = c1;
+				/* Push slot down */
+				auto err = rgb_table3[b1].err;
+				for (l = 1; (l2 = l + l) <= heap[0]; l = l2) {
+					if ((l2 < heap[0]) && (rgb_table3[heap[l2]].err > rgb_table3[heap[l2 + 1]].err))
+						++l2;
+					if (err <= rgb_table3[h = heap[l2]].err)
+						break;
+					heap[l] = h;
+				}
+				heap[l] = b1;
 			}
 
-			for (i = c1 + 1; i < tot_colors; ++i) {
-				if (rgb_table3[i].cc == tot_colors)
-					recount_next(rgb_table3, squares3, tot_colors, i);
-			}
+			/* Do a merge */
+			auto& tb = rgb_table3[b1];
+			auto& nb = rgb_table3[tb.nn];
+			tb.a += nb.a;
+			tb.r += nb.r;
+			tb.g += nb.g;
+			tb.b += nb.b;
+			tb.pixel_count += nb.pixel_count;
+			setARGB(tb);
+			tb.mtm = ++i;
+
+			/* Unchain deleted bin */
+			rgb_table3[nb.bk].fw = nb.fw;
+			rgb_table3[nb.fw].bk = nb.bk;
+			nb.mtm = INT_MAX;
+		}
 
-			recount_dist(rgb_table3, squares3, tot_colors, c1);
-			if (c2 != tot_colors)
-				recount_dist(rgb_table3, squares3, tot_colors, c2);
+		/* Move the surviving bins to the front of the table */
+		UINT k = 0;
+		for (int i = 0;; ++k) {
+			rgb_table3[k] = rgb_table3[i];
+			if (!(i = rgb_table3[k].fw))
+				break;
 		}
 	}
 
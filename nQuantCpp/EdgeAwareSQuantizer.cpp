@@ -24,6 +24,7 @@ SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
 
 #include "stdafx.h"
 #include "EdgeAwareSQuantizer.h"
+#include "BilateralFilter.h"
 #include "MedianCut.h"
 #include "CIELABConvertor.h"
 #include "GilbertCurve.h"
@@ -127,56 +128,48 @@ namespace EdgeAwareSQuant
 			lab1 = got->second;
 	}
 
-	void compute_b_array_ea_saliency(Mat<Mat<float> >& weightMaps, Mat<Mat<float> >& b, int filterRadius, Mat<float>& saliencyMap)
+	void compute_b_array_ea_saliency(const stencil2d<float>& weightMaps, stencil2d<float>& b, const Mat<float>& saliencyMap)
 	{
-		int imgHeight = weightMaps.get_height();
-		int imgWidth = weightMaps.get_width();
+		const int imgHeight = weightMaps.get_height();
+		const int imgWidth = weightMaps.get_width();
+		const int filterRadius = weightMaps.get_radius();
+		const int extendedFilterRadius = filterRadius * 2;
+		b.reset(imgWidth, imgHeight, extendedFilterRadius);
+		#pragma omp parallel for
 		for (int i_y = 0; i_y < imgHeight; ++i_y) {
 			for (int i_x = 0; i_x < imgWidth; ++i_x) {
-				auto& wmap_i = weightMaps(i_y, i_x);
-				int extendedFilterRadius = filterRadius * 2;
-				auto& b_yx = b(i_y, i_x);
-				b_yx.reset(extendedFilterRadius * 2 + 1, extendedFilterRadius * 2 + 1);
-				int j_y_min = i_y - extendedFilterRadius, j_y_max = i_y + extendedFilterRadius;
-				int j_x_min = i_x - extendedFilterRadius, j_x_max = i_x + extendedFilterRadius;
-				int wmI_y_min = i_y - filterRadius, wmI_y_max = i_y + filterRadius, wmI_x_min = i_x - filterRadius, wmI_x_max = i_x + filterRadius;
-				for (int j_y = max(0, j_y_min); j_y < imgHeight && j_y <= j_y_max; ++j_y) {
-					for (int j_x = max(0, j_x_min); j_x < imgWidth && j_x <= j_x_max; ++j_x) {
-						auto& wmap_j = weightMaps(j_y, j_x);
-						int wmJ_y_min = j_y - filterRadius, wmJ_y_max = j_y + filterRadius, wmJ_x_min = j_x - filterRadius, wmJ_x_max = j_x + filterRadius;
-						for (int wmJ_y = max(0, wmJ_y_min); wmJ_y < imgHeight && wmJ_y <= wmJ_y_max; ++wmJ_y) {
-							for (int wmJ_x = max(0, wmJ_x_min); wmJ_x < imgWidth && wmJ_x <= wmJ_x_max; ++wmJ_x) {
-								// if in overlap area
-								if (abs(wmJ_y - i_y) <= filterRadius && abs(wmJ_x - i_x) <= filterRadius)
-									b_yx(j_y - j_y_min, j_x - j_x_min) += saliencyMap(wmJ_y, wmJ_x) * wmap_i(wmJ_y - wmI_y_min, wmJ_x - wmI_x_min) * wmap_j(wmJ_y - wmJ_y_min, wmJ_x - wmJ_x_min);
-							}
+				for (int j_y = max(0, i_y - extendedFilterRadius); j_y < imgHeight && j_y <= i_y + extendedFilterRadius; ++j_y) {
+					for (int j_x = max(0, i_x - extendedFilterRadius); j_x < imgWidth && j_x <= i_x + extendedFilterRadius; ++j_x) {
+						auto& b_ij = b(i_x, i_y, j_x - i_x, j_y - i_y);
+						// only the overlap of both windows contributes
+						int wm_y_min = max(0, max(i_y, j_y) - filterRadius), wm_y_max = min(imgHeight - 1, min(i_y, j_y) + filterRadius);
+						int wm_x_min = max(0, max(i_x, j_x) - filterRadius), wm_x_max = min(imgWidth - 1, min(i_x, j_x) + filterRadius);
+						for (int wm_y = wm_y_min; wm_y <= wm_y_max; ++wm_y) {
+							for (int wm_x = wm_x_min; wm_x <= wm_x_max; ++wm_x)
+								b_ij += saliencyMap(wm_y, wm_x) * weightMaps(i_x, i_y, wm_x - i_x, wm_y - i_y) * weightMaps(j_x, j_y, wm_x - j_x, wm_y - j_y);
 						}
 
-						if (b_yx(j_y - j_y_min, j_x - j_x_min) == 0)
-							b_yx(j_y - j_y_min, j_x - j_x_min) = 1e-10f;
+						if (b_ij == 0)
+							b_ij = 1e-10f;
 					}
 				}
 			}
 		}
 	}
 
-	float b_value_ea(Mat<Mat<float> >& b, const int i_x, const int i_y, const int j_x, const int j_y)
+	inline float b_value_ea(const stencil2d<float>& b, const int i_x, const int i_y, const int j_x, const int j_y)
 	{
-		auto& b_yx = b(i_y, i_x);
-		int extendedFilterRadius = (b_yx.get_height() - 1) / 2;
-		int k_x = j_x - i_x + extendedFilterRadius;
-		int k_y = j_y - i_y + extendedFilterRadius;
-		if (k_x < 0 || k_y < 0 || k_x >= b_yx.get_width() || k_y >= b_yx.get_height())
+		if (!b.contains(j_x - i_x, j_y - i_y))
 			return 1e-10f;
-		return b_yx(k_y, k_x);
+		return b(i_x, i_y, j_x - i_x, j_y - i_y);
 	}
 
-	void compute_a_image_ea(const vector<ARGB>& image, Mat<Mat<float> >& b, array2d<vector_fixed<float, 4> >& a, const UINT nMaxColors)
+	void compute_a_image_ea(const vector<ARGB>& image, const stencil2d<float>& b, array2d<vector_fixed<float, 4> >& a, const UINT nMaxColors)
 	{
 		Color lastPixel = m_transparentColor;
 		int threshold = 256 / nMaxColors;
 
-		int extendedFilterRadius = (b(0, 0).get_width() - 1) / 2;
+		const int extendedFilterRadius = b.get_radius();
 		for (int i_y = 0; i_y < a.get_height(); ++i_y) {
 			for (int i_x = 0; i_x < a.get_width(); ++i_x) {
 				Color iPixel(image[i_y * a.get_width() + i_x]);
@@ -225,6 +218,18 @@ namespace EdgeAwareSQuant
 		return result;
 	}
 
+	template <typename T, int length>
+	bool equal_vector_layer_2d(const array2d<vector_fixed<T, length> >& s, short k1, short k2)
+	{
+		for (int i = 0; i < s.get_width(); ++i) {
+			for (int j = 0; j < s.get_height(); ++j) {
+				if (s(i, j)[k1] != s(i, j)[k2])
+					return false;
+			}
+		}
+		return true;
+	}
+
 	template <typename T, int length>
 	vector<T> extract_vector_layer_1d(const vector<vector_fixed<T, length> >& s, short k)
 	{
@@ -265,14 +270,13 @@ namespace EdgeAwareSQuant
 		}
 	}
 
-	void compute_initial_s_ea_icm(array2d<vector_fixed<float, 4> >& s, const Mat<BYTE>& indexImg8, Mat<Mat<float> >& b)
+	void compute_initial_s_ea_icm(array2d<vector_fixed<float, 4> >& s, const Mat<BYTE>& indexImg8, const stencil2d<float>& b)
 	{
 		const int length = hasSemiTransparency ? 4 : 3;
 		int palette_size = s.get_width();
 		int coarse_width = indexImg8.get_width();
 		int coarse_height = indexImg8.get_height();
-		int center_x = (b(0, 0).get_height() - 1) / 2, center_y = (b(0, 0).get_height() - 1) / 2;
-		int extendedFilterRadius = (b(0, 0).get_height() - 1) / 2;
+		const int extendedFilterRadius = b.get_radius();
 		vector_fixed<float, 4> zero_vector;
 		for (int v = 0; v < palette_size; ++v) {
 			for (int alpha = v; alpha < palette_size; ++alpha)
@@ -322,12 +326,18 @@ namespace EdgeAwareSQuant
 		const int length = hasSemiTransparency ? 4 : 3;
 		const auto maxDelta = hasSemiTransparency ? 1.0 / palette.size() : 1.0f / 64.0f;
 
-		for (short k = 0; k < length; ++k) {			
+		unique_ptr<array2d<float> > pS;
+		for (short k = 0; k < length; ++k) {
 			auto j = palette.size() > 2 ? k : 3;
 
-			auto& S_k = extract_vector_layer_2d(s, k);
-			auto& R_k = extract_vector_layer_1d(r, k);
-			auto& palette_channel = (-2.0f * S_k).matrix_inverse() * R_k;
+			// every channel of S gets the same b_ij, so one factorization usually serves them all
+			if (!pS || !equal_vector_layer_2d(s, k - 1, k)) {
+				pS = make_unique<array2d<float> >(-2.0f * extract_vector_layer_2d(s, k));
+				pS->ldlt_factor();
+			}
+
+			auto palette_channel = extract_vector_layer_1d(r, k);
+			pS->ldlt_solve(palette_channel);
 			for (UINT v = 0; v < palette.size(); ++v) {
 				auto val = palette_channel[v];
 				if (val < minLabValues[j] || isnan(val))
@@ -346,8 +356,8 @@ namespace EdgeAwareSQuant
 		}
 	}
 
-	void spatial_color_quant_ea_icm_saliency(const vector<ARGB>& image, Mat<Mat<float> >& weightMaps, Mat<float> saliencyMap,
-		unsigned short* quantized_image, vector<vector_fixed<float, 4> >& palette, const int filter_radius = 1)
+	void spatial_color_quant_ea_icm_saliency(const vector<ARGB>& image, stencil2d<float>& weightMaps, const Mat<float>& saliencyMap,
+		unsigned short* quantized_image, vector<vector_fixed<float, 4> >& palette)
 	{
 		const auto length = hasSemiTransparency ? 4 : 3;
 		const auto bitmapWidth = weightMaps.get_width();
@@ -361,49 +371,76 @@ namespace EdgeAwareSQuant
 
 		// Compute a_I^l, b_{IJ}^l according to  Puzicha's (18)
 		auto a_array = make_unique<array2d<vector_fixed<float, 4> >[]>(max_coarse_level + 1);
-		auto b_array = make_unique<Mat<Mat<float> >[]>(max_coarse_level + 1);
+		auto b_array = make_unique<stencil2d<float>[]>(max_coarse_level + 1);
 
 		auto& b0 = b_array[0];
-		b0.reset(bitmapHeight, bitmapWidth);
-		compute_b_array_ea_saliency(weightMaps, b0, filter_radius, saliencyMap);
+		compute_b_array_ea_saliency(weightMaps, b0, saliencyMap);
+		// the weight maps are folded into b0 and no longer needed
+		weightMaps.reset(0, 0, 0);
 
 		auto& a0 = a_array[0];
 		a0.reset(bitmapWidth, bitmapHeight);
 		compute_a_image_ea(image, b0, a0, palette.size());
 
+		int newExtendedFilterSize = b0.get_size() - 2;
+		newExtendedFilterSize = max(length, newExtendedFilterSize);
+		const int newExtendedFilterRadius = (newExtendedFilterSize - 1) / 2;
+		const int fine_width = a0.get_width(), fine_height = a0.get_height();
+
 		for (int coarse_level = 1; coarse_level <= max_coarse_level; ++coarse_level) {
 			auto& ai = a_array[coarse_level];
 			ai.reset(bitmapWidth >> coarse_level, bitmapHeight >> coarse_level);
 
-			int newExtendedFilterSize = b0(0, 0).get_height() - 2;
-			newExtendedFilterSize = max(length, newExtendedFilterSize);
-
 			auto& bi = b_array[coarse_level];
-			bi.reset(ai.get_height(), ai.get_width());
-			int newExtendedFilterRadius = (newExtendedFilterSize - 1) / 2;
-
-			for (int I_y = 0; I_y < ai.get_height(); ++I_y) {
-				for (int I_x = 0; I_x < ai.get_width(); ++I_x) {
-					auto& bi_yx = bi(I_y, I_x);
-					bi_yx.reset(newExtendedFilterSize, newExtendedFilterSize);
-					int J_y_min = I_y - newExtendedFilterRadius, J_y_max = I_y + newExtendedFilterRadius;
-					int J_x_min = I_x - newExtendedFilterRadius, J_x_max = I_x + newExtendedFilterRadius;
-
-					for (int J_y = max(0, J_y_min); J_y < ai.get_height() && J_y <= J_y_max; ++J_y) {
-						for (int J_x = max(0, J_x_min); J_x < ai.get_width() && J_x <= J_x_max; ++J_x) {
-							for (int i_y = I_y * 2; i_y < a0.get_height() && i_y < I_y * 2 + 2; ++i_y) {
-								for (int i_x = I_x * 2; i_x < a0.get_width() && i_x < I_x * 2 + 2; ++i_x) {
-									for (int j_y = J_y * 2; j_y < a0.get_height() && j_y < J_y * 2 + 2; ++j_y) {
-										for (int j_x = J_x * 2; j_x < a0.get_width() && j_x < J_x * 2 + 2; ++j_x) {
-											bi_yx(J_y - J_y_min, J_x - J_x_min) += b_value_ea(b0, i_x, i_y, j_x, j_y);
-										}
+			bi.reset(ai.get_width(), ai.get_height(), newExtendedFilterRadius);
+			const int coarse_width = ai.get_width(), coarse_height = ai.get_height();
+
+			// Every level sums the 2x2 blocks of b0 and a0 at the same I, so deeper levels
+			// are the top-left crop of level 1 and b0 only has to be read once
+			if (coarse_level > 1) {
+				const auto& a1 = a_array[1];
+				const auto& b1 = b_array[1];
+				#pragma omp parallel for
+				for (int I_y = 0; I_y < coarse_height; ++I_y) {
+					const int J_y_min = max(0, I_y - newExtendedFilterRadius), J_y_max = min(coarse_height - 1, I_y + newExtendedFilterRadius);
+					for (int I_x = 0; I_x < coarse_width; ++I_x) {
+						const int J_x_min = max(0, I_x - newExtendedFilterRadius), J_x_max = min(coarse_width - 1, I_x + newExtendedFilterRadius);
+						for (int J_y = J_y_min; J_y <= J_y_max; ++J_y) {
+							for (int J_x = J_x_min; J_x <= J_x_max; ++J_x)
+								bi(I_x, I_y, J_x - I_x, J_y - I_y) = b1(I_x, I_y, J_x - I_x, J_y - I_y);
+						}
+						ai(I_x, I_y) = a1(I_x, I_y);
+					}
+				}
+				continue;
+			}
+
+			// Each fine pixel i belongs to exactly one coarse pixel I, so output rows are independent
+			// and the stencil of i is consumed for every neighbour J of I while it is hot
+			#pragma omp parallel for
+			for (int I_y = 0; I_y < coarse_height; ++I_y) {
+				const int J_y_min = max(0, I_y - newExtendedFilterRadius), J_y_max = min(coarse_height - 1, I_y + newExtendedFilterRadius);
+				for (int I_x = 0; I_x < coarse_width; ++I_x) {
+					const int J_x_min = max(0, I_x - newExtendedFilterRadius), J_x_max = min(coarse_width - 1, I_x + newExtendedFilterRadius);
+					for (int i_y = I_y * 2; i_y < fine_height && i_y < I_y * 2 + 2; ++i_y) {
+						for (int i_x = I_x * 2; i_x < fine_width && i_x < I_x * 2 + 2; ++i_x) {
+							for (int J_y = J_y_min; J_y <= J_y_max; ++J_y) {
+								for (int J_x = J_x_min; J_x <= J_x_max; ++J_x) {
+									auto& bi_IJ = bi(I_x, I_y, J_x - I_x, J_y - I_y);
+									for (int j_y = J_y * 2; j_y < fine_height && j_y < J_y * 2 + 2; ++j_y) {
+										for (int j_x = J_x * 2; j_x < fine_width && j_x < J_x * 2 + 2; ++j_x)
+											bi_IJ += b_value_ea(b0, i_x, i_y, j_x, j_y);
 									}
 								}
 							}
+						}
+					}
 
-							if (bi_yx(J_y - J_y_min, J_x - J_x_min) == 0)
-								bi_yx(J_y - J_y_min, J_x - J_x_min) = 1e-10f;
-
+					for (int J_y = J_y_min; J_y <= J_y_max; ++J_y) {
+						for (int J_x = J_x_min; J_x <= J_x_max; ++J_x) {
+							auto& bi_IJ = bi(I_x, I_y, J_x - I_x, J_y - I_y);
+							if (bi_IJ == 0)
+								bi_IJ = 1e-10f;
 						}
 					}
 				}
@@ -452,10 +489,8 @@ namespace EdgeAwareSQuant
 				sort(centroidDist[l1].begin(), centroidDist[l1].end(), mycmp);
 
 			auto& a = a_array[coarse_level];
-			auto& b = b_array[coarse_level];
-			const auto& b1 = b(0, 0);
-
-			int center_x = (b1.get_width() - 1) / 2, center_y = (b1.get_height() - 1) / 2;
+			const auto& b = b_array[coarse_level];
+			const int center_x = b.get_radius(), center_y = b.get_radius();
 
 			int step_counter = 0;
 			int repeat_outter = 0;
@@ -566,54 +601,6 @@ namespace EdgeAwareSQuant
 		}
 	}
 
-	void filter_bila(const vector<ARGB>& img, Mat<Mat<float> >& weightMaps, const float sigma_s = 1.0f, const float sigma_r = 2.0f)
-	{
-		// pixel-wise filter		
-		const int radius = 1;
-		auto wMin = 100.0f;
-		auto colorDivisor = 2 * sigma_r * sigma_r;
-		auto spacerDivisor = 2 * sigma_s * sigma_s;
-
-		for (int y = 0; y < weightMaps.get_height(); ++y) {
-			for (int x = 0; x < weightMaps.get_width(); ++x) {
-				Color pixelXY(img[y * weightMaps.get_width() + x]);
-				CIELABConvertor::Lab lab1;
-				getLab(pixelXY, lab1);
-
-				auto weightSum = 0.0f;
-				int yyMin = y - radius, yyMax = y + radius, xxMin = x - radius, xxMax = x + radius;
-				auto& weightMaps_yx = weightMaps(y, x);
-				weightMaps_yx.reset(2 * radius + 1, 2 * radius + 1);
-				for (int yy = max(0, yyMin); yy < weightMaps.get_height() && yy <= yyMax; ++yy) {
-					for (int xx = max(0, xxMin); xx < weightMaps.get_width() && xx <= xxMax; ++xx) {
-						auto spaceD = sqr(y - yy) + sqr(x - xx);
-
-						Color pixelXXYY(img[yy * weightMaps.get_width() + xx]);
-						CIELABConvertor::Lab lab2;
-						getLab(pixelXXYY, lab2);
-
-						auto colorD = sqr(lab2.A - lab1.A) + sqr(lab2.B - lab2.B);
-						if (hasSemiTransparency)
-							colorD += sqr(lab2.L - lab1.L) + sqr(pixelXY.GetA() - pixelXXYY.GetA()) / exp(1.5);
-						else
-							colorD = abs(lab2.L - lab1.L) + _sqrt(colorD);
-
-						auto tmpW = exp(-spaceD / spacerDivisor - colorD / colorDivisor);
-
-						weightSum += tmpW;
-
-						weightMaps_yx(xx - xxMin, yy - yyMin) = tmpW;
-
-						if (tmpW < wMin)
-							wMin = tmpW;
-					}
-				}
-
-				weightMaps_yx /= weightSum;
-			}
-		}
-	}
-
 	unsigned short nearestColorIndex(const ARGB* pPalette, const UINT nMaxColors, ARGB argb, const UINT pos)
 	{
 		auto got = nearestMap.find(argb);
@@ -697,18 +684,19 @@ namespace EdgeAwareSQuant
 		vector<ARGB> pixels(area);
 		GrabPixels(pSource, pixels, hasSemiTransparency, m_transparentPixelIndex, m_transparentColor, 0xF, nMaxColors);
 
-		UINT pixelIndex = 0;
-		// see equation (7) in the paper
+		stencil2d<float> weightMaps(bitmapWidth, bitmapHeight, 1);
 		Mat<float> saliencyMap(bitmapHeight, bitmapWidth);
-		auto saliencyBase = 0.1f;
-		for (int y = 0; y < saliencyMap.get_height(); ++y) {
-			for (int x = 0; x < saliencyMap.get_width(); ++x, ++pixelIndex) {
-				Color c(pixels[pixelIndex]);
+		{
+			BilateralFilter::LabPlanes labPlanes;
+			BilateralFilter::toLabPlanes(pixels.data(), area, labPlanes);
 
-				CIELABConvertor::Lab lab1;
-				getLab(c, lab1);
-				saliencyMap(y, x) = saliencyBase + (1 - saliencyBase) * lab1.L / 100.0f;
-			}
+			// see equation (7) in the paper
+			auto saliencyBase = 0.1f;
+			auto pSaliency = saliencyMap.get();
+			for (UINT pixelIndex = 0; pixelIndex < area; ++pixelIndex)
+				pSaliency[pixelIndex] = saliencyBase + (1 - saliencyBase) * labPlanes.L[pixelIndex] / 100.0f;
+
+			BilateralFilter::computeWeights(labPlanes, bitmapWidth, bitmapHeight, weightMaps.plane(-1, -1), weightMaps.get_radius(), hasSemiTransparency);
 		}
 
 		if (nMaxColors > 256)
@@ -734,8 +722,6 @@ namespace EdgeAwareSQuant
 			palette[k][3] = c.GetA() / divisor;
 		}
 
-		Mat<Mat<float> > weightMaps(bitmapHeight, bitmapWidth);
-		filter_bila(pixels, weightMaps);
 		auto qPixels = make_unique<unsigned short[]>(pixels.size());
 		spatial_color_quant_ea_icm_saliency(pixels, weightMaps, saliencyMap, qPixels.get(), palette);
 
@@ -186,52 +186,59 @@ namespace EdgeAwareSQuant
 			return result;
 		}
 
-		array2d<T>& multiply_row_scalar(int row, T mult) {
-			for (int i = 0; i < get_width(); ++i)
-				(*this)(i, row) *= mult;
+		// Factors this symmetric K x K matrix in place as L D L^T: the strict lower triangle
+		// receives L and the diagonal receives D. Every update is a dot product of two
+		// contiguous rows, so the K^3 / 6 multiply-adds stay cache friendly, and the factors
+		// serve any number of right-hand sides through ldlt_solve.
+		array2d<T>& ldlt_factor() {
+			const int n = get_width();
+			vector<double> ld(n); // L(i, k) * D(k) of the current row
+			for (int i = 0; i < n; ++i) {
+				T* row_i = &data[i * width];
+				for (int j = 0; j < i; ++j) {
+					const T* row_j = &data[j * width];
+					double sum = row_i[j];
+					for (int k = 0; k < j; ++k)
+						sum -= ld[k] * row_j[k];
+
+					if (row_j[j] != 0) {
+						ld[j] = sum;
+						row_i[j] = static_cast<T>(sum / row_j[j]);
+					}
+					else
+						ld[j] = row_i[j] = 0;
+				}
 
+				double diagonal = row_i[i];
+				for (int k = 0; k < i; ++k)
+					diagonal -= ld[k] * row_i[k];
+				row_i[i] = static_cast<T>(diagonal);
+			}
 			return *this;
 		}
 
-		array2d<T>& add_row_multiple(int from_row, int to_row, T mult) {
-			if (mult != 0) {
-				for (int i = 0; i < get_width(); ++i)
-					(*this)(i, to_row) += mult * (*this)(i, from_row);
+		// Solves A x = b in place from the factors of ldlt_factor;
+		// an unknown whose pivot vanished is left at zero
+		void ldlt_solve(vector<T>& b) const {
+			const int n = get_width();
+			for (int i = 0; i < n; ++i) {
+				const T* row_i = &data[i * width];
+				double sum = b[i];
+				for (int k = 0; k < i; ++k)
+					sum -= row_i[k] * b[k];
+				b[i] = static_cast<T>(sum);
 			}
 
-			return *this;
-		}
-
-		// We use simple Gaussian elimination - perf doesn't matter since
-		// the matrices will be K x K, where K = number of palette entries.
-		array2d<T> matrix_inverse() {
-			array2d<T> result(get_width(), get_height());
-			auto& a = *this;
-
-			// Set result to identity matrix
-			for (int i = 0; i < get_width(); ++i)
-				result(i, i) = 1;
-
-			// Reduce to echelon form, mirroring in result
-			for (int i = 0; i < get_width(); ++i) {
-				auto detA = a(i, i);
-				float val = (detA != 0.0f) ? 1.0f / detA : 0.0f;
-				result.multiply_row_scalar(i, val);
-				multiply_row_scalar(i, val);
-				for (int j = i + 1; j < get_height(); ++j) {
-					result.add_row_multiple(i, j, -a(i, j));
-					add_row_multiple(i, j, -a(i, j));
-				}
+			for (int i = 0; i < n; ++i) {
+				const auto diagonal = data[i * width + i];
+				b[i] = (diagonal != 0) ? b[i] / diagonal : 0;
 			}
-			// Back substitute, mirroring in result
-			for (int i = get_width() - 1; i >= 0; --i) {
-				for (int j = i - 1; j >= 0; --j) {
-					result.add_row_multiple(i, j, -a(i, j));
-					add_row_multiple(i, j, -a(i, j));
-				}
+
+			for (int i = n - 1; i > 0; --i) {
+				const T* row_i = &data[i * width];
+				for (int k = 0; k < i; ++k)
+					b[k] -= row_i[k] * b[i];
 			}
-			// result is now the inverse
-			return result;
 		}
 
 	private:
@@ -344,6 +351,65 @@ namespace EdgeAwareSQuant
 		return a * scalar;
 	}
 
+	// (2 * radius + 1)^2 coefficients for every pixel, stored as one contiguous
+	// width x height plane per stencil offset rather than one small heap block per pixel
+	template <typename T>
+	class stencil2d
+	{
+	public:
+		stencil2d()
+		{
+			this->width = 0;
+			this->height = 0;
+			this->radius = 0;
+			this->area = 0;
+		}
+
+		stencil2d(int width, int height, int radius)
+		{
+			reset(width, height, radius);
+		}
+
+		inline T& operator()(int col, int row, int dx, int dy)
+		{
+			return plane(dx, dy)[row * width + col];
+		}
+
+		inline const T& operator()(int col, int row, int dx, int dy) const
+		{
+			return plane(dx, dy)[row * width + col];
+		}
+
+		inline T* plane(int dx, int dy) const
+		{
+			return data.get() + ((dy + radius) * get_size() + dx + radius) * area;
+		}
+
+		inline bool contains(int dx, int dy) const
+		{
+			return abs(dx) <= radius && abs(dy) <= radius;
+		}
+
+		inline int get_width() const { return width; }
+		inline int get_height() const { return height; }
+		inline int get_radius() const { return radius; }
+		inline int get_size() const { return 2 * radius + 1; }
+
+		void reset(int width, int height, int radius)
+		{
+			this->width = width;
+			this->height = height;
+			this->radius = radius;
+			area = (size_t) width * height;
+			data = make_unique<T[]>(area * get_size() * get_size());
+		}
+
+	private:
+		unique_ptr<T[]> data;
+		size_t area;
+		int width, height, radius;
+	};
+
 	// =============================================================
 	// Quantizer objects and functions
 	//
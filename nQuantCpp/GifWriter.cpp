@@ -1,84 +1,294 @@
 #include "stdafx.h"
 #include "GifWriter.h"
+#include "ImageCodec.h"
+
+#include <algorithm>
+#include <filesystem>
+#include <thread>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define GIF_SSE2
+#endif
 
 namespace GifEncode
 {
-	const int UintBytes = sizeof(long);
-
 	GifWriter::GifWriter(const wstring& destPath, const bool hasAlpha, const long delay, const bool loop)
 	{
 		_destPath = destPath;
 		_hasAlpha = hasAlpha;
 		_delay = delay;
 		_loop = loop;
+		// a few frames per thread keeps every thread busy while memory stays bounded by the batch
+		_batchSize = 2 * max(1u, thread::hardware_concurrency());
+	}
+
+	GifWriter::~GifWriter()
+	{
+		Close();
 	}
 
-	static GUID GetEncoder()
+	static inline void WriteShort(vector<BYTE>& out, const UINT value)
 	{
-		const CLSID gifEncoderClsId = { 0x557cf402, 0x1a04, 0x11d3,{ 0x9a,0x73,0x00,0x00,0xf8,0x1e,0xf3,0x2e } };
-		return gifEncoderClsId;
+		out.emplace_back(value & 0xff);
+		out.emplace_back((value >> 8) & 0xff);
 	}
 
-	static void SetFrameDelay(Bitmap* pFirstBitmap, PropertyItem& frameDelay, vector<long>& frameDelays)
+	// Index of the first pixel in [x, end) that differs between the rows, end if none does
+	static UINT FirstDiff(const ARGB* a, const ARGB* b, UINT x, const UINT end)
 	{
-		// PropertyItem for the frame delay (apparently, no other way to create a fresh instance).
-		frameDelay.id = PropertyTagFrameDelay;
-		frameDelay.type = PropertyTagTypeLong;
-		// Length of the value in bytes.
-		frameDelay.length = frameDelays.size() * UintBytes;
-		// The value is an array of 4-byte entries: one per frame.
-		// Every entry is the frame delay in 1/100-s of a second, in little endian.
-		// E.g., here, we're setting the delay of every frame to 1 second.
-		frameDelay.value = frameDelays.data();
-		pFirstBitmap->SetPropertyItem(&frameDelay);
+#ifdef GIF_SSE2
+		for (; x + 4 <= end; x += 4) {
+			const auto equal = _mm_cmpeq_epi32(_mm_loadu_si128((const __m128i*) (a + x)), _mm_loadu_si128((const __m128i*) (b + x)));
+			if (_mm_movemask_epi8(equal) != 0xFFFF)
+				break;
+		}
+#endif
+		for (; x < end; ++x) {
+			if (a[x] != b[x])
+				return x;
+		}
+		return end;
 	}
 
-	static void SetLoop(Bitmap* pFirstBitmap, PropertyItem& loopPropertyItem, const bool loop)
+	// One past the last pixel in [begin, end) that differs between the rows, begin if none does
+	static UINT LastDiff(const ARGB* a, const ARGB* b, const UINT begin, UINT end)
 	{
-		if (!loop)
-			return;
-
-		loopPropertyItem.id = PropertyTagLoopCount;
-		loopPropertyItem.type = PropertyTagTypeShort;
-		loopPropertyItem.length = 2;
-		// 0 means to animate forever.
-		short sValue = 0;
-		loopPropertyItem.value = &sValue;
-		pFirstBitmap->SetPropertyItem(&loopPropertyItem);
+#ifdef GIF_SSE2
+		for (; end >= begin + 4; end -= 4) {
+			const auto equal = _mm_cmpeq_epi32(_mm_loadu_si128((const __m128i*) (a + end - 4)), _mm_loadu_si128((const __m128i*) (b + end - 4)));
+			if (_mm_movemask_epi8(equal) != 0xFFFF)
+				break;
+		}
+#endif
+		for (; end > begin; --end) {
+			if (a[end - 1] != b[end - 1])
+				return end;
+		}
+		return begin;
+	}
+
+	// Bounding rectangle of the pixels that differ, false if the frames are identical
+	static bool DiffRect(const ARGB* colors, const ARGB* previous, const UINT width, const UINT height,
+		UINT& left, UINT& top, UINT& right, UINT& bottom)
+	{
+		top = 0;
+		while (top < height && FirstDiff(colors + (size_t) top * width, previous + (size_t) top * width, 0, width) == width)
+			++top;
+		if (top >= height)
+			return false;
+
+		bottom = height;
+		while (FirstDiff(colors + (size_t) (bottom - 1) * width, previous + (size_t) (bottom - 1) * width, 0, width) == width)
+			--bottom;
+
+		// every row only has to be searched outside the columns already known to change
+		left = width;
+		right = 0;
+		for (UINT y = top; y < bottom; ++y) {
+			const auto row = colors + (size_t) y * width, previousRow = previous + (size_t) y * width;
+			left = FirstDiff(row, previousRow, 0, left);
+			right = LastDiff(row, previousRow, right, width);
+		}
+		return true;
+	}
+
+	void GifWriter::EncodeFrame(Frame& frame) const
+	{
+		auto& out = frame.bytes;
+		const int bits = ImageCodec::gifBitDepth(static_cast<UINT>(frame.palette.size()));
+		const auto hasTransparent = frame.transparentIndex >= 0;
+
+		// Graphic control extension: disposal 2 clears the frame to the background before the next one, 1 keeps it
+		const UINT frameDelay = _delay / 10;
+		out.insert(out.end(), { 0x21, 0xF9, 4, static_cast<BYTE>((frame.disposal << 2) | (hasTransparent ? 1 : 0)) });
+		WriteShort(out, frameDelay);
+		out.insert(out.end(), { static_cast<BYTE>(hasTransparent ? frame.transparentIndex : 0), 0 });
+
+		// Image descriptor with a local color table, as every frame has its own palette
+		out.emplace_back(0x2C);
+		WriteShort(out, frame.left);
+		WriteShort(out, frame.top);
+		WriteShort(out, frame.width);
+		WriteShort(out, frame.height);
+		out.emplace_back(0x80 | (bits - 1));
+		for (int i = 0; i < (1 << bits); ++i) {
+			Color c(i < static_cast<int>(frame.palette.size()) ? frame.palette[i] : Color::Black);
+			out.insert(out.end(), { c.GetR(), c.GetG(), c.GetB() });
+		}
+
+		const int minCodeSize = max(2, bits);
+		out.emplace_back(minCodeSize);
+		vector<BYTE> codes;
+		ImageCodec::lzwEncode(frame.qPixels.data(), frame.qPixels.size(), minCodeSize, codes);
+		ImageCodec::writeSubBlocks(codes, out);
+
+		frame.qPixels.clear();
+		frame.qPixels.shrink_to_fit();
+	}
+
+	bool GifWriter::Flush()
+	{
+		const int count = static_cast<int>(_pending.size());
+		#pragma omp parallel for schedule(dynamic)
+		for (int i = 0; i < count; ++i)
+			EncodeFrame(_pending[i]);
+
+		for (const auto& frame : _pending)
+			_file.write(reinterpret_cast<const char*>(frame.bytes.data()), frame.bytes.size());
+		_pending.clear();
+		return _file.good();
+	}
+
+	bool GifWriter::AddFrame(vector<unsigned short>& qPixels, const UINT width, const UINT height, const vector<ARGB>& palette, const int transparentIndex)
+	{
+		if (!_file.is_open()) {
+			_file.open(filesystem::path(_destPath), ios::binary);
+			if (!_file)
+				return false;
+
+			// The logical screen takes the size of the first frame, without a global color table
+			_width = width;
+			_height = height;
+			vector<BYTE> header;
+			const char* signature = "GIF89a";
+			header.insert(header.end(), signature, signature + 6);
+			WriteShort(header, _width);
+			WriteShort(header, _height);
+			header.insert(header.end(), { 0x70, 0, 0 });
+
+			if (_loop) {
+				// NETSCAPE2.0 application extension, a loop count of 0 animates forever
+				const char* application = "NETSCAPE2.0";
+				header.insert(header.end(), { 0x21, 0xFF, 11 });
+				header.insert(header.end(), application, application + 11);
+				header.insert(header.end(), { 3, 1, 0, 0, 0 });
+			}
+			_file.write(reinterpret_cast<const char*>(header.data()), header.size());
+		}
+
+		Frame frame;
+		frame.qPixels.swap(qPixels);
+		frame.palette = palette;
+		frame.width = min(width, _width);
+		frame.height = min(height, _height);
+		frame.transparentIndex = transparentIndex;
+		if (frame.width < width) {
+			for (UINT y = 0; y < frame.height; ++y)
+				copy_n(frame.qPixels.begin() + (size_t) y * width, frame.width, frame.qPixels.begin() + (size_t) y * frame.width);
+		}
+		frame.qPixels.resize((size_t) frame.width * frame.height);
+
+		// The disposal of the held frame depends on whether this one has transparent pixels of its own
+		auto succeeded = true;
+		if (_holding)
+			succeeded = QueueHeld(frame.transparentIndex >= 0);
+		_held = move(frame);
+		_holding = true;
+		return succeeded && _file.good();
+	}
+
+	bool GifWriter::QueueHeld(const bool clearAfter)
+	{
+		auto frame = move(_held);
+		_holding = false;
+		// Disposal 2 clears the frame before the next one is drawn, so the transparent pixels of that one show
+		// the background instead of this frame
+		frame.disposal = clearAfter ? 2 : 1;
+
+		// Only an opaque frame covering the whole screen and kept for the next one is stored as a change of the one before,
+		// as clearing a rectangle would leave the rest of the screen showing older frames
+		if (frame.disposal == 1 && frame.transparentIndex < 0 && frame.width == _width && frame.height == _height) {
+			vector<ARGB> colors(frame.qPixels.size());
+			for (size_t i = 0; i < colors.size(); ++i)
+				colors[i] = frame.palette[frame.qPixels[i]] | Color::AlphaMask;
+
+			if (!_previous.empty()) {
+				UINT left, top, right, bottom;
+				if (!DiffRect(colors.data(), _previous.data(), _width, _height, left, top, right, bottom)) {
+					// nothing changed, a single unchanged pixel keeps the frame and its delay
+					left = top = 0;
+					right = bottom = 1;
+				}
+
+				// Unchanged pixels inside the rectangle take an index no changed pixel uses and become transparent,
+				// so they show the previous frame and leave long runs for LZW
+				const UINT rectWidth = right - left, rectHeight = bottom - top;
+				vector<bool> used(frame.palette.size());
+				for (UINT y = top; y < bottom; ++y) {
+					const size_t offset = (size_t) y * _width;
+					for (UINT x = left; x < right; ++x) {
+						if (colors[offset + x] != _previous[offset + x])
+							used[frame.qPixels[offset + x]] = true;
+					}
+				}
+				auto unused = find(used.begin(), used.end(), false);
+				int maskIndex = static_cast<int>(unused - used.begin());
+				if (unused == used.end()) {
+					if (frame.palette.size() < 256)
+						frame.palette.emplace_back(Color::Transparent);
+					else
+						maskIndex = -1;
+				}
+
+				vector<unsigned short> rect((size_t) rectWidth * rectHeight);
+				auto pRect = rect.data();
+				for (UINT y = top; y < bottom; ++y) {
+					const size_t offset = (size_t) y * _width;
+					for (UINT x = left; x < right; ++x) {
+						const auto unchanged = maskIndex >= 0 && colors[offset + x] == _previous[offset + x];
+						*pRect++ = unchanged ? maskIndex : frame.qPixels[offset + x];
+					}
+				}
+
+				frame.qPixels.swap(rect);
+				frame.left = left;
+				frame.top = top;
+				frame.width = rectWidth;
+				frame.height = rectHeight;
+				frame.transparentIndex = maskIndex;
+			}
+			_previous.swap(colors);
+		}
+		else
+			_previous.clear();
+
+		_pending.emplace_back(move(frame));
+		if (_pending.size() >= _batchSize)
+			return Flush();
+		return true;
+	}
+
+	bool GifWriter::AddFrame(Bitmap* pBitmap)
+	{
+		vector<unsigned short> qPixels;
+		vector<ARGB> palette;
+		int transparentIndex;
+		if (!ImageCodec::GetIndices(pBitmap, qPixels, palette, transparentIndex))
+			return false;
+		return AddFrame(qPixels, pBitmap->GetWidth(), pBitmap->GetHeight(), palette, transparentIndex);
 	}
 
 	Status GifWriter::AddImages(vector<shared_ptr<Bitmap> >& bitmaps)
 	{
-		auto& pFirstBitmap = bitmaps[0];
-		auto gifGUID = GetEncoder();
-
-		// Params of the first frame.
-		EncoderParameters encoderParams;
-		encoderParams.Count = 1;
-		encoderParams.Parameter[0].Guid = EncoderSaveFlag;
-		encoderParams.Parameter[0].NumberOfValues = 1;
-		encoderParams.Parameter[0].Type = EncoderParameterValueTypeLong;
-		auto valueMultiFrame = EncoderValueMultiFrame;
-		encoderParams.Parameter[0].Value = &valueMultiFrame;
-
-		PropertyItem frameDelay;
-		vector<long> frameDelays(bitmaps.size(), _delay / 10);
-		SetFrameDelay(pFirstBitmap.get(), frameDelay, frameDelays);
-		PropertyItem loopPropertyItem;
-		SetLoop(pFirstBitmap.get(), loopPropertyItem, _loop);
-		pFirstBitmap->Save(_destPath.c_str(), &gifGUID, &encoderParams);
-
-		// Params of other frames.
-		auto valueFrameDimensionTime = EncoderValueFrameDimensionTime;
-		encoderParams.Parameter[0].Value = &valueFrameDimensionTime;
-		Status status;
-		for (int i = 1; i < bitmaps.size(); ++i)
-			status = pFirstBitmap->SaveAdd(bitmaps[i].get(), &encoderParams);
-
-		// Params for the finalizing call.
-		encoderParams.Parameter[0].Type = EncoderParameterValueTypeLong;
-		auto valueFlush = EncoderValueFlush;
-		encoderParams.Parameter[0].Value = &valueFlush;
-		return pFirstBitmap->SaveAdd(&encoderParams);
+		for (auto& pBitmap : bitmaps) {
+			if (!AddFrame(pBitmap.get()))
+				return GenericError;
+		}
+		return Close();
+	}
+
+	Status GifWriter::Close()
+	{
+		if (!_file.is_open())
+			return _pending.empty() ? Ok : GenericError;
+
+		// before the animation starts over, the last frame is cleared if the frames have transparent pixels
+		auto succeeded = !_holding || QueueHeld(_hasAlpha);
+		succeeded &= Flush();
+		_file.put(0x3B);
+		succeeded &= _file.good();
+		_file.close();
+		return succeeded ? Ok : Win32Error;
 	}
 }
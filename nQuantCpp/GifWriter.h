@@ -1,17 +1,50 @@
 #pragma once
 #include "bitmapUtilities.h"
+#include <fstream>
 
 namespace GifEncode
 {
 	class GifWriter
 	{
 		private:
+			struct Frame
+			{
+				vector<unsigned short> qPixels;
+				vector<ARGB> palette;
+				UINT left = 0, top = 0, width, height;
+				int transparentIndex;
+				BYTE disposal = 1;
+				vector<BYTE> bytes;
+			};
+
 			bool _hasAlpha, _loop;
 			wstring _destPath;
 			long _delay;
-		
+			ofstream _file;
+			UINT _width = 0, _height = 0;
+			// frames waiting for their LZW codes, never more than _batchSize of them
+			vector<Frame> _pending;
+			size_t _batchSize;
+			// colors left on screen by the last frame, empty if it is not kept for the next one to draw over
+			vector<ARGB> _previous;
+			// the last frame added, held back until the next one decides its disposal
+			Frame _held;
+			bool _holding = false;
+
+			void EncodeFrame(Frame& frame) const;
+			bool QueueHeld(const bool clearAfter);
+			bool Flush();
+
 			public:
 				GifWriter(const wstring& destPath, const bool hasAlpha, const long delay = 850, const bool loop = true);
+				~GifWriter();
+				// Queues a frame of palette indices, taking over qPixels, transparentIndex is -1 if no index is transparent.
+				// Frames are compressed a batch at a time in parallel and written in the order they were added.
+				// An opaque frame drawn over an opaque one only stores the rectangle that changed.
+				bool AddFrame(vector<unsigned short>& qPixels, const UINT width, const UINT height, const vector<ARGB>& palette, const int transparentIndex = -1);
+				bool AddFrame(Bitmap* pBitmap);
 				Status AddImages(vector<shared_ptr<Bitmap> >& bitmaps);
+				// Writes the frames still queued and ends the file
+				Status Close();
 	};
 }
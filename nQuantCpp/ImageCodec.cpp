@@ -0,0 +1,1125 @@
+/* Native PNG, GIF and BMP codecs for the quantizer input and output.
+Copyright (c) 2018 - 2025 Miller Cy Chan
+* Images are decoded straight into ARGB pixels and indexed output is encoded from the palette and one index per pixel,
+* so neither side goes through the pixel format conversions of GDI+. Rows are converted, packed and filtered in parallel. */
+
+#include "stdafx.h"
+#include "ImageCodec.h"
+#include "Deflate.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <cwctype>
+#include <filesystem>
+#include <fstream>
+
+namespace ImageCodec
+{
+	const BYTE PNG_SIGNATURE[] = { 137, 80, 78, 71, 13, 10, 26, 10 };
+	// start and step of the seven Adam7 passes: x0, y0, dx, dy
+	const BYTE ADAM7[7][4] = { { 0, 0, 8, 8 }, { 4, 0, 8, 8 }, { 0, 4, 4, 8 }, { 2, 0, 4, 4 }, { 0, 2, 2, 4 }, { 1, 0, 2, 2 }, { 0, 1, 1, 2 } };
+	const int LZW_MAX_CODES = 4096;
+	// prime over 4096 codes, as in the UNIX compress encoder most GIF encoders derive from
+	const int LZW_HASH_SIZE = 5003;
+	const size_t MAX_PIXELS = (size_t) 1 << 30;
+
+	static inline UINT readBE32(const BYTE* p)
+	{
+		return ((UINT) p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+	}
+
+	static inline UINT readLE16(const BYTE* p)
+	{
+		return p[0] | (p[1] << 8);
+	}
+
+	static inline UINT readLE32(const BYTE* p)
+	{
+		return p[0] | (p[1] << 8) | (p[2] << 16) | ((UINT) p[3] << 24);
+	}
+
+	static inline void writeBE32(vector<BYTE>& out, const UINT value)
+	{
+		for (int shift = 24; shift >= 0; shift -= 8)
+			out.emplace_back((value >> shift) & 0xff);
+	}
+
+	static inline void writeLE16(vector<BYTE>& out, const UINT value)
+	{
+		out.emplace_back(value & 0xff);
+		out.emplace_back((value >> 8) & 0xff);
+	}
+
+	static inline void writeLE32(vector<BYTE>& out, const UINT value)
+	{
+		writeLE16(out, value & 0xffff);
+		writeLE16(out, value >> 16);
+	}
+
+	static UINT crc32(UINT crc, const BYTE* data, const size_t size)
+	{
+		static const vector<UINT> table = [] {
+			vector<UINT> entries(256);
+			for (UINT n = 0; n < 256; ++n) {
+				auto c = n;
+				for (int k = 0; k < 8; ++k)
+					c = (c & 1) ? 0xedb88320 ^ (c >> 1) : c >> 1;
+				entries[n] = c;
+			}
+			return entries;
+		}();
+
+		crc = ~crc;
+		for (size_t i = 0; i < size; ++i)
+			crc = table[(crc ^ data[i]) & 0xff] ^ (crc >> 8);
+		return ~crc;
+	}
+
+	struct PngInfo
+	{
+		UINT width = 0, height = 0;
+		int depth = 0, colorType = -1, channels = 0;
+		bool interlaced = false;
+		vector<ARGB> palette;
+		// transparent sample values of gray or truecolour images without alpha
+		bool hasKey = false;
+		UINT keyR = 0, keyG = 0, keyB = 0;
+	};
+
+	// Pixels of an Adam7 pass, or of the whole image if it is not interlaced, false if the pass is empty
+	static bool passSize(const PngInfo& info, const int pass, UINT& pw, UINT& ph)
+	{
+		const UINT x0 = info.interlaced ? ADAM7[pass][0] : 0, y0 = info.interlaced ? ADAM7[pass][1] : 0;
+		const UINT dx = info.interlaced ? ADAM7[pass][2] : 1, dy = info.interlaced ? ADAM7[pass][3] : 1;
+		if (info.width <= x0 || info.height <= y0)
+			return false;
+
+		pw = (info.width - x0 + dx - 1) / dx;
+		ph = (info.height - y0 + dy - 1) / dy;
+		return true;
+	}
+
+	static inline int paeth(const int a, const int b, const int c)
+	{
+		const int p = a + b - c;
+		const int pa = abs(p - a), pb = abs(p - b), pc = abs(p - c);
+		if (pa <= pb && pa <= pc)
+			return a;
+		return pb <= pc ? b : c;
+	}
+
+	// reverses the filters of the rows in place, each row being a filter type followed by rowBytes
+	static bool unfilter(BYTE* raw, const UINT rows, const size_t rowBytes, const int bpp)
+	{
+		const BYTE* prev = nullptr;
+		for (UINT y = 0; y < rows; ++y) {
+			auto row = raw + y * (rowBytes + 1);
+			auto cur = row + 1;
+			const int bytes = static_cast<int>(rowBytes);
+			switch (row[0]) {
+			case 0:
+				break;
+			case 1:
+				for (int i = bpp; i < bytes; ++i)
+					cur[i] += cur[i - bpp];
+				break;
+			case 2:
+				if (prev) {
+					for (int i = 0; i < bytes; ++i)
+						cur[i] += prev[i];
+				}
+				break;
+			case 3:
+				for (int i = 0; i < bytes; ++i) {
+					const int a = i >= bpp ? cur[i - bpp] : 0;
+					const int b = prev ? prev[i] : 0;
+					cur[i] += (a + b) >> 1;
+				}
+				break;
+			case 4:
+				for (int i = 0; i < bytes; ++i) {
+					const int a = i >= bpp ? cur[i - bpp] : 0;
+					const int b = prev ? prev[i] : 0;
+					const int c = prev && i >= bpp ? prev[i - bpp] : 0;
+					cur[i] += paeth(a, b, c);
+				}
+				break;
+			default:
+				return false;
+			}
+			prev = cur;
+		}
+		return true;
+	}
+
+	// count pixels of an unfiltered row, written step pixels apart
+	static void convertRow(const BYTE* row, const UINT count, const PngInfo& info, ARGB* pDest, const UINT step)
+	{
+		const int depth = info.depth;
+		const UINT maxValue = (1u << depth) - 1;
+		auto sample = [&](const size_t k) -> UINT {
+			if (depth == 8)
+				return row[k];
+			if (depth == 16)
+				return (row[2 * k] << 8) | row[2 * k + 1];
+			const auto bit = k * depth;
+			return (row[bit >> 3] >> (8 - depth - (bit & 7))) & maxValue;
+		};
+		auto to8 = [&](const UINT value) -> BYTE {
+			if (depth == 16)
+				return value >> 8;
+			return depth == 8 ? value : value * BYTE_MAX / maxValue;
+		};
+
+		for (UINT i = 0; i < count; ++i) {
+			ARGB argb;
+			switch (info.colorType) {
+			case 0: {
+				const auto gray = sample(i);
+				const auto g = to8(gray);
+				argb = Color::MakeARGB(info.hasKey && gray == info.keyR ? 0 : BYTE_MAX, g, g, g);
+				break;
+			}
+			case 2: {
+				const auto r = sample(3 * i), g = sample(3 * i + 1), b = sample(3 * i + 2);
+				const bool key = info.hasKey && r == info.keyR && g == info.keyG && b == info.keyB;
+				argb = Color::MakeARGB(key ? 0 : BYTE_MAX, to8(r), to8(g), to8(b));
+				break;
+			}
+			case 3: {
+				const auto index = sample(i);
+				argb = index < info.palette.size() ? info.palette[index] : Color::Black;
+				break;
+			}
+			case 4: {
+				const auto g = to8(sample(2 * i));
+				argb = Color::MakeARGB(to8(sample(2 * i + 1)), g, g, g);
+				break;
+			}
+			default:
+				argb = Color::MakeARGB(to8(sample(4 * i + 3)), to8(sample(4 * i)), to8(sample(4 * i + 1)), to8(sample(4 * i + 2)));
+			}
+			pDest[i * step] = argb;
+		}
+	}
+
+	static bool decodePng(const BYTE* data, const size_t size, UINT& width, UINT& height, vector<ARGB>& pixels)
+	{
+		PngInfo info;
+		vector<BYTE> idat;
+		for (size_t pos = sizeof(PNG_SIGNATURE); pos + 12 <= size;) {
+			const auto length = readBE32(data + pos);
+			if (length > size - pos - 12)
+				return false;
+
+			const auto type = reinterpret_cast<const char*>(data + pos + 4);
+			const auto chunk = data + pos + 8;
+			if (!memcmp(type, "IHDR", 4)) {
+				if (length < 13)
+					return false;
+				info.width = readBE32(chunk);
+				info.height = readBE32(chunk + 4);
+				info.depth = chunk[8];
+				info.colorType = chunk[9];
+				info.interlaced = chunk[12] == 1;
+				const int channels[] = { 1, 0, 3, 1, 2, 0, 4 };
+				if (info.colorType > 6 || channels[info.colorType] == 0 || chunk[10] != 0 || chunk[11] != 0 || chunk[12] > 1)
+					return false;
+				info.channels = channels[info.colorType];
+				const int depth = info.depth;
+				if (depth != 1 && depth != 2 && depth != 4 && depth != 8 && depth != 16)
+					return false;
+				if ((info.colorType == 3 && depth > 8) || (info.colorType != 0 && info.colorType != 3 && depth < 8))
+					return false;
+			}
+			else if (!memcmp(type, "PLTE", 4)) {
+				info.palette.resize(min(length / 3, 256u));
+				for (UINT i = 0; i < info.palette.size(); ++i)
+					info.palette[i] = Color::MakeARGB(BYTE_MAX, chunk[3 * i], chunk[3 * i + 1], chunk[3 * i + 2]);
+			}
+			else if (!memcmp(type, "tRNS", 4)) {
+				if (info.colorType == 3) {
+					for (UINT i = 0; i < length && i < info.palette.size(); ++i)
+						info.palette[i] = (info.palette[i] & 0xffffff) | ((ARGB) chunk[i] << 24);
+				}
+				else if (info.colorType == 0 && length >= 2) {
+					info.hasKey = true;
+					info.keyR = (chunk[0] << 8) | chunk[1];
+				}
+				else if (info.colorType == 2 && length >= 6) {
+					info.hasKey = true;
+					info.keyR = (chunk[0] << 8) | chunk[1];
+					info.keyG = (chunk[2] << 8) | chunk[3];
+					info.keyB = (chunk[4] << 8) | chunk[5];
+				}
+			}
+			else if (!memcmp(type, "IDAT", 4))
+				idat.insert(idat.end(), chunk, chunk + length);
+			else if (!memcmp(type, "IEND", 4))
+				break;
+			pos += 12 + length;
+		}
+
+		const UINT w = info.width, h = info.height;
+		if (info.colorType < 0 || w == 0 || h == 0 || (size_t) w * h > MAX_PIXELS || idat.empty())
+			return false;
+
+		// The image data holds a filter byte and the packed pixels of every row of every pass, no more and no less,
+		// so a stream inflating beyond that is rejected before it can exhaust memory
+		const int bitsPerPixel = info.channels * info.depth;
+		const int passes = info.interlaced ? 7 : 1;
+		size_t expected = 0;
+		for (int pass = 0; pass < passes; ++pass) {
+			UINT pw, ph;
+			if (passSize(info, pass, pw, ph))
+				expected += ph * (((size_t) pw * bitsPerPixel + 7) / 8 + 1);
+		}
+
+		vector<BYTE> raw;
+		raw.reserve(expected);
+		if (!Deflate::uncompress(idat.data(), idat.size(), raw, expected) || raw.size() != expected)
+			return false;
+		idat.clear();
+
+		pixels.assign((size_t) w * h, 0);
+		const int bpp = max(1, bitsPerPixel / 8);
+		size_t offset = 0;
+		for (int pass = 0; pass < passes; ++pass) {
+			UINT pw, ph;
+			if (!passSize(info, pass, pw, ph))
+				continue;
+
+			const UINT x0 = info.interlaced ? ADAM7[pass][0] : 0, y0 = info.interlaced ? ADAM7[pass][1] : 0;
+			const UINT dx = info.interlaced ? ADAM7[pass][2] : 1, dy = info.interlaced ? ADAM7[pass][3] : 1;
+			const size_t rowBytes = ((size_t) pw * bitsPerPixel + 7) / 8;
+			const auto passBytes = ph * (rowBytes + 1);
+
+			auto pPass = raw.data() + offset;
+			if (!unfilter(pPass, ph, rowBytes, bpp))
+				return false;
+
+			#pragma omp parallel for
+			for (int j = 0; j < static_cast<int>(ph); ++j)
+				convertRow(pPass + j * (rowBytes + 1) + 1, pw, info, pixels.data() + (size_t) (y0 + j * dy) * w + x0, dx);
+			offset += passBytes;
+		}
+
+		width = w;
+		height = h;
+		return true;
+	}
+
+	// GIF image data to indices, stopping early at the end of the data or an invalid code
+	static void lzwDecode(const BYTE* data, const size_t size, const int minCodeSize, BYTE* out, const size_t count)
+	{
+		const int clearCode = 1 << minCodeSize, endCode = clearCode + 1;
+		vector<unsigned short> prefix(LZW_MAX_CODES);
+		vector<BYTE> suffix(LZW_MAX_CODES), stack(LZW_MAX_CODES + 1);
+		for (int i = 0; i < clearCode; ++i)
+			suffix[i] = i;
+
+		int codeSize = minCodeSize + 1, nextCode = clearCode + 2, prev = -1;
+		BYTE first = 0;
+		UINT bits = 0;
+		int bitCount = 0;
+		size_t pos = 0, written = 0;
+		while (written < count) {
+			while (bitCount < codeSize) {
+				if (pos >= size)
+					return;
+				bits |= (UINT) data[pos++] << bitCount;
+				bitCount += 8;
+			}
+			const int code = bits & ((1 << codeSize) - 1);
+			bits >>= codeSize;
+			bitCount -= codeSize;
+
+			if (code == clearCode) {
+				codeSize = minCodeSize + 1;
+				nextCode = clearCode + 2;
+				prev = -1;
+				continue;
+			}
+			if (code == endCode)
+				return;
+			if (prev < 0) {
+				if (code > clearCode)
+					return;
+				out[written++] = first = code;
+				prev = code;
+				continue;
+			}
+			if (code > nextCode || code == LZW_MAX_CODES)
+				return;
+
+			int top = 0, cur = code;
+			// the code being defined is the previous string and its own first index
+			if (code == nextCode) {
+				stack[top++] = first;
+				cur = prev;
+			}
+			while (cur > endCode) {
+				stack[top++] = suffix[cur];
+				cur = prefix[cur];
+			}
+			stack[top++] = first = cur;
+
+			if (nextCode < LZW_MAX_CODES) {
+				prefix[nextCode] = prev;
+				suffix[nextCode] = first;
+				if (++nextCode == (1 << codeSize) && codeSize < 12)
+					++codeSize;
+			}
+			while (top > 0 && written < count)
+				out[written++] = stack[--top];
+			prev = code;
+		}
+	}
+
+	static bool decodeGif(const BYTE* data, const size_t size, UINT& width, UINT& height, vector<ARGB>& pixels)
+	{
+		if (size < 13)
+			return false;
+
+		const UINT w = readLE16(data + 6), h = readLE16(data + 8);
+		const auto flags = data[10], background = data[11];
+		if (w == 0 || h == 0 || (size_t) w * h > MAX_PIXELS)
+			return false;
+
+		size_t pos = 13;
+		vector<ARGB> globalTable;
+		auto readTable = [&](const int bits, vector<ARGB>& table) {
+			const size_t n = (size_t) 2 << bits;
+			if (pos + 3 * n > size)
+				return false;
+			table.resize(n);
+			for (size_t i = 0; i < n; ++i, pos += 3)
+				table[i] = Color::MakeARGB(BYTE_MAX, data[pos], data[pos + 1], data[pos + 2]);
+			return true;
+		};
+		auto skipSubBlocks = [&]() {
+			while (pos < size && data[pos] != 0)
+				pos += data[pos] + 1;
+			++pos;
+		};
+
+		if ((flags & 0x80) && !readTable(flags & 7, globalTable))
+			return false;
+
+		int transparentIndex = -1;
+		while (pos < size) {
+			const auto block = data[pos++];
+			if (block == 0x21) {
+				if (pos >= size)
+					return false;
+				const auto label = data[pos++];
+				if (label == 0xF9 && pos + 5 < size && data[pos] >= 4 && (data[pos + 1] & 1))
+					transparentIndex = data[pos + 4];
+				skipSubBlocks();
+				continue;
+			}
+			if (block != 0x2C)
+				return false;
+
+			if (pos + 9 > size)
+				return false;
+			const int left = readLE16(data + pos), top = readLE16(data + pos + 2);
+			const UINT fw = readLE16(data + pos + 4), fh = readLE16(data + pos + 6);
+			const auto frameFlags = data[pos + 8];
+			pos += 9;
+			if (fw == 0 || fh == 0 || (size_t) fw * fh > MAX_PIXELS)
+				return false;
+
+			auto table = globalTable;
+			if ((frameFlags & 0x80) && !readTable(frameFlags & 7, table))
+				return false;
+			if (table.empty() || pos >= size)
+				return false;
+			const int minCodeSize = data[pos++];
+			if (minCodeSize < 1 || minCodeSize > 11)
+				return false;
+
+			vector<BYTE> codes;
+			while (pos < size && data[pos] != 0) {
+				const auto length = min((size_t) data[pos], size - pos - 1);
+				codes.insert(codes.end(), data + pos + 1, data + pos + 1 + length);
+				pos += data[pos] + 1;
+			}
+
+			vector<BYTE> indices((size_t) fw * fh, 0);
+			lzwDecode(codes.data(), codes.size(), minCodeSize, indices.data(), indices.size());
+
+			if (transparentIndex >= 0 && transparentIndex < (int) table.size())
+				table[transparentIndex] &= 0xffffff;
+			ARGB fill = transparentIndex >= 0 ? Color::Transparent : Color::Black;
+			if (transparentIndex < 0 && background < globalTable.size())
+				fill = globalTable[background];
+			pixels.assign((size_t) w * h, fill);
+
+			// source row of each canvas row, in the four passes of an interlaced frame
+			vector<int> rowOf(fh);
+			if (frameFlags & 0x40) {
+				UINT j = 0;
+				const UINT starts[] = { 0, 4, 2, 1 }, steps[] = { 8, 8, 4, 2 };
+				for (int pass = 0; pass < 4; ++pass) {
+					for (UINT y = starts[pass]; y < fh; y += steps[pass])
+						rowOf[y] = j++;
+				}
+			}
+			else {
+				for (UINT y = 0; y < fh; ++y)
+					rowOf[y] = y;
+			}
+
+			const int xMin = max(0, left), xMax = min((int) w, left + (int) fw);
+			#pragma omp parallel for
+			for (int y = 0; y < static_cast<int>(fh); ++y) {
+				const int canvasY = top + y;
+				if (canvasY >= static_cast<int>(h))
+					continue;
+				auto pIndices = indices.data() + (size_t) rowOf[y] * fw;
+				auto pDest = pixels.data() + (size_t) canvasY * w;
+				for (int x = xMin; x < xMax; ++x) {
+					const auto index = pIndices[x - left];
+					pDest[x] = index < table.size() ? table[index] : Color::Black;
+				}
+			}
+
+			width = w;
+			height = h;
+			return true;
+		}
+		return false;
+	}
+
+	// position and width of a bit field mask
+	struct Channel
+	{
+		UINT mask = 0, maxValue = 0;
+		int shift = 0;
+
+		Channel(const UINT bitMask = 0) : mask(bitMask) {
+			if (mask == 0)
+				return;
+			while (!((mask >> shift) & 1))
+				++shift;
+			maxValue = mask >> shift;
+		}
+
+		inline BYTE extract(const UINT value, const BYTE missing = 0) const
+		{
+			if (mask == 0)
+				return missing;
+			return static_cast<BYTE>((unsigned long long) ((value & mask) >> shift) * BYTE_MAX / maxValue);
+		}
+	};
+
+	static bool decodeBmp(const BYTE* data, const size_t size, UINT& width, UINT& height, vector<ARGB>& pixels)
+	{
+		if (size < 26)
+			return false;
+
+		const auto offBits = readLE32(data + 10), headerSize = readLE32(data + 14);
+		if (headerSize > size - 14)
+			return false;
+
+		const auto header = data + 14;
+		int w, h, bitCount, entrySize = 4;
+		UINT compression = 0, clrUsed = 0, masks[4] = { 0 };
+		size_t palettePos = 14 + headerSize;
+		if (headerSize == 12) {
+			w = readLE16(header + 4);
+			h = static_cast<short>(readLE16(header + 6));
+			bitCount = readLE16(header + 10);
+			entrySize = 3;
+		}
+		else if (headerSize >= 40) {
+			w = static_cast<int>(readLE32(header + 4));
+			h = static_cast<int>(readLE32(header + 8));
+			bitCount = readLE16(header + 14);
+			compression = readLE32(header + 16);
+			clrUsed = readLE32(header + 32);
+			// BI_BITFIELDS or BI_ALPHABITFIELDS, the masks follow a plain info header
+			if (compression == 3 || compression == 6) {
+				const int maskCount = headerSize >= 56 || compression == 6 ? 4 : 3;
+				const auto pMasks = headerSize >= 52 ? header + 40 : data + palettePos;
+				if (pMasks + 4 * maskCount > data + size)
+					return false;
+				for (int k = 0; k < maskCount; ++k)
+					masks[k] = readLE32(pMasks + 4 * k);
+				if (headerSize < 52)
+					palettePos += 4 * maskCount;
+			}
+		}
+		else
+			return false;
+
+		// run length and embedded JPEG or PNG are left to GDI+
+		if (compression != 0 && compression != 3 && compression != 6)
+			return false;
+		if (bitCount != 1 && bitCount != 4 && bitCount != 8 && bitCount != 16 && bitCount != 24 && bitCount != 32)
+			return false;
+
+		const bool topDown = h < 0;
+		h = abs(h);
+		if (w <= 0 || h == 0 || (size_t) w * h > MAX_PIXELS)
+			return false;
+
+		vector<ARGB> palette;
+		if (bitCount <= 8) {
+			const size_t n = min(clrUsed > 0 ? clrUsed : 1u << bitCount, 256u);
+			if (palettePos + n * entrySize > size)
+				return false;
+			palette.resize(n);
+			for (size_t i = 0; i < n; ++i) {
+				const auto p = data + palettePos + i * entrySize;
+				palette[i] = Color::MakeARGB(BYTE_MAX, p[2], p[1], p[0]);
+			}
+		}
+		else if (compression == 0) {
+			masks[0] = bitCount == 16 ? 0x7C00 : 0xFF0000;
+			masks[1] = bitCount == 16 ? 0x03E0 : 0xFF00;
+			masks[2] = bitCount == 16 ? 0x001F : 0xFF;
+		}
+
+		const size_t stride = (((size_t) w * bitCount + 31) / 32) * 4;
+		if (offBits > size || stride * h > size - offBits)
+			return false;
+
+		const Channel red(masks[0]), green(masks[1]), blue(masks[2]), alpha(masks[3]);
+		pixels.resize((size_t) w * h);
+		#pragma omp parallel for
+		for (int y = 0; y < h; ++y) {
+			const auto pRow = data + offBits + (topDown ? y : h - 1 - y) * stride;
+			auto pDest = pixels.data() + (size_t) y * w;
+			for (int x = 0; x < w; ++x) {
+				if (bitCount <= 8) {
+					const int bit = x * bitCount;
+					const UINT index = (pRow[bit >> 3] >> (8 - bitCount - (bit & 7))) & ((1 << bitCount) - 1);
+					pDest[x] = index < palette.size() ? palette[index] : Color::Black;
+				}
+				else if (bitCount == 24)
+					pDest[x] = Color::MakeARGB(BYTE_MAX, pRow[3 * x + 2], pRow[3 * x + 1], pRow[3 * x]);
+				else {
+					const auto value = bitCount == 16 ? readLE16(pRow + 2 * x) : readLE32(pRow + 4 * x);
+					pDest[x] = Color::MakeARGB(alpha.extract(value, BYTE_MAX), red.extract(value), green.extract(value), blue.extract(value));
+				}
+			}
+		}
+
+		width = w;
+		height = h;
+		return true;
+	}
+
+	bool decode(const BYTE* data, const size_t size, UINT& width, UINT& height, vector<ARGB>& pixels)
+	{
+		if (size >= sizeof(PNG_SIGNATURE) && !memcmp(data, PNG_SIGNATURE, sizeof(PNG_SIGNATURE)))
+			return decodePng(data, size, width, height, pixels);
+		if (size >= 6 && (!memcmp(data, "GIF87a", 6) || !memcmp(data, "GIF89a", 6)))
+			return decodeGif(data, size, width, height, pixels);
+		if (size >= 2 && data[0] == 'B' && data[1] == 'M')
+			return decodeBmp(data, size, width, height, pixels);
+		return false;
+	}
+
+	bool decode(const wstring& path, UINT& width, UINT& height, vector<ARGB>& pixels)
+	{
+		ifstream file(filesystem::path(path), ios::binary | ios::ate);
+		if (!file)
+			return false;
+
+		const auto size = static_cast<size_t>(file.tellg());
+		vector<BYTE> data(size);
+		file.seekg(0);
+		if (!file.read(reinterpret_cast<char*>(data.data()), size))
+			return false;
+		return decode(data.data(), size, width, height, pixels);
+	}
+
+	static void writeChunk(vector<BYTE>& out, const char* type, const BYTE* data, const size_t length)
+	{
+		writeBE32(out, static_cast<UINT>(length));
+		const auto start = out.size();
+		out.insert(out.end(), type, type + 4);
+		out.insert(out.end(), data, data + length);
+		writeBE32(out, crc32(0, out.data() + start, out.size() - start));
+	}
+
+	static void writePngHeader(vector<BYTE>& out, const UINT width, const UINT height, const int depth, const int colorType)
+	{
+		out.insert(out.end(), PNG_SIGNATURE, PNG_SIGNATURE + sizeof(PNG_SIGNATURE));
+		vector<BYTE> ihdr;
+		writeBE32(ihdr, width);
+		writeBE32(ihdr, height);
+		ihdr.insert(ihdr.end(), { static_cast<BYTE>(depth), static_cast<BYTE>(colorType), 0, 0, 0 });
+		writeChunk(out, "IHDR", ihdr.data(), ihdr.size());
+	}
+
+	static void writePngData(vector<BYTE>& out, const vector<BYTE>& raw, const int level)
+	{
+		vector<BYTE> idat;
+		idat.reserve(raw.size() / 2 + 64);
+		Deflate::compress(raw.data(), raw.size(), idat, level);
+		writeChunk(out, "IDAT", idat.data(), idat.size());
+		writeChunk(out, "IEND", nullptr, 0);
+	}
+
+	void encodePng(const unsigned short* qPixels, const UINT width, const UINT height, const ARGB* pPalette, const UINT nColors,
+		vector<BYTE>& out, const int level)
+	{
+		const int depth = nColors <= 2 ? 1 : nColors <= 4 ? 2 : nColors <= 16 ? 4 : 8;
+		const size_t rowBytes = ((size_t) width * depth + 7) / 8;
+		// every row keeps filter type 0, palette indices rarely gain from prediction
+		vector<BYTE> raw((rowBytes + 1) * height, 0);
+		#pragma omp parallel for
+		for (int y = 0; y < static_cast<int>(height); ++y) {
+			auto pRow = raw.data() + y * (rowBytes + 1) + 1;
+			auto pIndices = qPixels + (size_t) y * width;
+			if (depth == 8) {
+				for (UINT x = 0; x < width; ++x)
+					pRow[x] = static_cast<BYTE>(pIndices[x]);
+				continue;
+			}
+			for (UINT x = 0; x < width; ++x) {
+				const UINT bit = x * depth;
+				pRow[bit >> 3] |= pIndices[x] << (8 - depth - (bit & 7));
+			}
+		}
+
+		writePngHeader(out, width, height, depth, 3);
+		vector<BYTE> plte(3 * nColors), trns(nColors);
+		int lastTransparent = -1;
+		for (UINT i = 0; i < nColors; ++i) {
+			Color c(pPalette[i]);
+			plte[3 * i] = c.GetR();
+			plte[3 * i + 1] = c.GetG();
+			plte[3 * i + 2] = c.GetB();
+			trns[i] = c.GetA();
+			if (c.GetA() < BYTE_MAX)
+				lastTransparent = i;
+		}
+		writeChunk(out, "PLTE", plte.data(), plte.size());
+		if (lastTransparent >= 0)
+			writeChunk(out, "tRNS", trns.data(), lastTransparent + 1);
+		writePngData(out, raw, level);
+	}
+
+	void encodePng(const ARGB* pixels, const UINT width, const UINT height, vector<BYTE>& out, const int level)
+	{
+		const int length = static_cast<int>(width * height);
+		int translucent = 0;
+		#pragma omp parallel for reduction(+:translucent)
+		for (int i = 0; i < length; ++i) {
+			if ((pixels[i] >> 24) < BYTE_MAX)
+				++translucent;
+		}
+
+		const int channels = translucent > 0 ? 4 : 3;
+		const size_t rowBytes = (size_t) width * channels;
+		vector<BYTE> plain(rowBytes * height), raw((rowBytes + 1) * height);
+		#pragma omp parallel for
+		for (int y = 0; y < static_cast<int>(height); ++y) {
+			auto pRow = plain.data() + y * rowBytes;
+			for (UINT x = 0; x < width; ++x) {
+				Color c(pixels[(size_t) y * width + x]);
+				*pRow++ = c.GetR();
+				*pRow++ = c.GetG();
+				*pRow++ = c.GetB();
+				if (channels == 4)
+					*pRow++ = c.GetA();
+			}
+		}
+
+		// each row takes the filter with the smallest sum of absolute differences
+		#pragma omp parallel
+		{
+			vector<BYTE> candidates(5 * rowBytes);
+
+			#pragma omp for
+			for (int y = 0; y < static_cast<int>(height); ++y) {
+				const auto cur = plain.data() + y * rowBytes;
+				const auto prev = y > 0 ? cur - rowBytes : nullptr;
+				size_t bestSum = SIZE_MAX;
+				int bestFilter = 0;
+				for (int filter = 0; filter < 5; ++filter) {
+					auto pOut = candidates.data() + filter * rowBytes;
+					size_t sum = 0;
+					for (size_t i = 0; i < rowBytes; ++i) {
+						const int a = i >= (size_t) channels ? cur[i - channels] : 0;
+						const int b = prev ? prev[i] : 0;
+						const int c = prev && i >= (size_t) channels ? prev[i - channels] : 0;
+						const int predictor = filter == 0 ? 0 : filter == 1 ? a : filter == 2 ? b : filter == 3 ? (a + b) >> 1 : paeth(a, b, c);
+						const auto value = static_cast<BYTE>(cur[i] - predictor);
+						pOut[i] = value;
+						sum += abs(static_cast<signed char>(value));
+					}
+					if (sum < bestSum) {
+						bestSum = sum;
+						bestFilter = filter;
+					}
+				}
+
+				auto pRow = raw.data() + y * (rowBytes + 1);
+				pRow[0] = bestFilter;
+				auto pBest = candidates.data() + bestFilter * rowBytes;
+				copy(pBest, pBest + rowBytes, pRow + 1);
+			}
+		}
+		plain.clear();
+
+		writePngHeader(out, width, height, 8, channels == 4 ? 6 : 2);
+		writePngData(out, raw, level);
+	}
+
+	int gifBitDepth(const UINT nColors)
+	{
+		int bits = 1;
+		while ((1u << bits) < nColors && bits < 8)
+			++bits;
+		return bits;
+	}
+
+	void lzwEncode(const unsigned short* qPixels, const size_t count, const int minCodeSize, vector<BYTE>& out)
+	{
+		const int clearCode = 1 << minCodeSize, endCode = clearCode + 1;
+		// (prefix code << 8 | index) of every string in the table, probed with the secondary hash of compress
+		vector<int> keys(LZW_HASH_SIZE, -1);
+		vector<unsigned short> codes(LZW_HASH_SIZE);
+		int codeSize = minCodeSize + 1, nextCode = clearCode + 2;
+
+		UINT bits = 0;
+		int bitCount = 0;
+		auto put = [&](const int code) {
+			bits |= (UINT) code << bitCount;
+			for (bitCount += codeSize; bitCount >= 8; bitCount -= 8) {
+				out.emplace_back(bits & 0xff);
+				bits >>= 8;
+			}
+		};
+		// a decoder adds the string of each code when it reads the next one, so it widens its codes one code later
+		auto addCode = [&]() {
+			if (nextCode >= LZW_MAX_CODES)
+				return false;
+			if (++nextCode > (1 << codeSize))
+				++codeSize;
+			return true;
+		};
+
+		put(clearCode);
+		if (count > 0) {
+			int prefix = qPixels[0];
+			for (size_t i = 1; i < count; ++i) {
+				const int index = qPixels[i];
+				const int key = (prefix << 8) | index;
+				int h = ((index << 4) ^ prefix) % LZW_HASH_SIZE;
+				const int step = h == 0 ? 1 : LZW_HASH_SIZE - h;
+				while (keys[h] >= 0 && keys[h] != key) {
+					if ((h -= step) < 0)
+						h += LZW_HASH_SIZE;
+				}
+				if (keys[h] == key) {
+					prefix = codes[h];
+					continue;
+				}
+
+				put(prefix);
+				const int code = nextCode;
+				if (addCode()) {
+					keys[h] = key;
+					codes[h] = code;
+				}
+				else {
+					put(clearCode);
+					fill(keys.begin(), keys.end(), -1);
+					codeSize = minCodeSize + 1;
+					nextCode = clearCode + 2;
+				}
+				prefix = index;
+			}
+			put(prefix);
+			addCode();
+		}
+		put(endCode);
+		if (bitCount > 0)
+			out.emplace_back(bits & 0xff);
+	}
+
+	void writeSubBlocks(const vector<BYTE>& data, vector<BYTE>& out)
+	{
+		for (size_t pos = 0; pos < data.size(); pos += 255) {
+			const auto length = min(data.size() - pos, (size_t) 255);
+			out.emplace_back(static_cast<BYTE>(length));
+			out.insert(out.end(), data.begin() + pos, data.begin() + pos + length);
+		}
+		out.emplace_back(0);
+	}
+
+	void encodeGif(const unsigned short* qPixels, const UINT width, const UINT height, const ARGB* pPalette, const UINT nColors,
+		const int transparentIndex, vector<BYTE>& out)
+	{
+		const int bits = gifBitDepth(nColors);
+		const char* signature = "GIF89a";
+		out.insert(out.end(), signature, signature + 6);
+		writeLE16(out, width);
+		writeLE16(out, height);
+		// global color table of 2^bits entries, 8 bits of color resolution
+		out.insert(out.end(), { static_cast<BYTE>(0xF0 | (bits - 1)), 0, 0 });
+		for (int i = 0; i < (1 << bits); ++i) {
+			Color c(i < static_cast<int>(nColors) ? pPalette[i] : Color::Black);
+			out.insert(out.end(), { c.GetR(), c.GetG(), c.GetB() });
+		}
+
+		if (transparentIndex >= 0)
+			out.insert(out.end(), { 0x21, 0xF9, 4, 1, 0, 0, static_cast<BYTE>(transparentIndex), 0 });
+
+		out.emplace_back(0x2C);
+		writeLE32(out, 0);
+		writeLE16(out, width);
+		writeLE16(out, height);
+		out.emplace_back(0);
+
+		const int minCodeSize = max(2, bits);
+		out.emplace_back(minCodeSize);
+		vector<BYTE> codes;
+		lzwEncode(qPixels, (size_t) width * height, minCodeSize, codes);
+		writeSubBlocks(codes, out);
+		out.emplace_back(0x3B);
+	}
+
+	static void writeBmpHeaders(vector<BYTE>& out, const UINT width, const UINT height, const int bitCount, const UINT nColors,
+		const size_t imageSize, const bool alphaMasks)
+	{
+		const UINT infoSize = alphaMasks ? 108 : 40;
+		const UINT offBits = 14 + infoSize + 4 * nColors;
+		out.insert(out.end(), { 'B', 'M' });
+		writeLE32(out, static_cast<UINT>(offBits + imageSize));
+		writeLE32(out, 0);
+		writeLE32(out, offBits);
+
+		writeLE32(out, infoSize);
+		writeLE32(out, width);
+		writeLE32(out, height);
+		writeLE16(out, 1);
+		writeLE16(out, bitCount);
+		writeLE32(out, alphaMasks ? 3 : 0);
+		writeLE32(out, static_cast<UINT>(imageSize));
+		// 72 dpi
+		writeLE32(out, 2835);
+		writeLE32(out, 2835);
+		writeLE32(out, nColors);
+		writeLE32(out, 0);
+		if (alphaMasks) {
+			for (const UINT mask : { 0x00FF0000u, 0x0000FF00u, 0x000000FFu, 0xFF000000u })
+				writeLE32(out, mask);
+			// LCS_sRGB, with unused endpoints and gamma
+			writeLE32(out, 0x73524742);
+			out.insert(out.end(), 48, 0);
+		}
+	}
+
+	void encodeBmp(const unsigned short* qPixels, const UINT width, const UINT height, const ARGB* pPalette, const UINT nColors, vector<BYTE>& out)
+	{
+		const int bitCount = nColors <= 2 ? 1 : nColors <= 16 ? 4 : 8;
+		const size_t stride = (((size_t) width * bitCount + 31) / 32) * 4;
+		writeBmpHeaders(out, width, height, bitCount, nColors, stride * height, false);
+		for (UINT i = 0; i < nColors; ++i) {
+			Color c(pPalette[i]);
+			out.insert(out.end(), { c.GetB(), c.GetG(), c.GetR(), 0 });
+		}
+
+		const auto start = out.size();
+		out.resize(start + stride * height, 0);
+		auto pBits = out.data() + start;
+		#pragma omp parallel for
+		for (int y = 0; y < static_cast<int>(height); ++y) {
+			auto pRow = pBits + (height - 1 - y) * stride;
+			auto pIndices = qPixels + (size_t) y * width;
+			for (UINT x = 0; x < width; ++x) {
+				const UINT bit = x * bitCount;
+				pRow[bit >> 3] |= pIndices[x] << (8 - bitCount - (bit & 7));
+			}
+		}
+	}
+
+	void encodeBmp(const ARGB* pixels, const UINT width, const UINT height, vector<BYTE>& out)
+	{
+		const int length = static_cast<int>(width * height);
+		int translucent = 0;
+		#pragma omp parallel for reduction(+:translucent)
+		for (int i = 0; i < length; ++i) {
+			if ((pixels[i] >> 24) < BYTE_MAX)
+				++translucent;
+		}
+
+		// BGR rows when opaque, otherwise BGRA with the masks of a version 4 header
+		const int bitCount = translucent > 0 ? 32 : 24;
+		const size_t stride = (((size_t) width * bitCount + 31) / 32) * 4;
+		writeBmpHeaders(out, width, height, bitCount, 0, stride * height, translucent > 0);
+
+		const auto start = out.size();
+		out.resize(start + stride * height, 0);
+		auto pBits = out.data() + start;
+		#pragma omp parallel for
+		for (int y = 0; y < static_cast<int>(height); ++y) {
+			auto pRow = pBits + (height - 1 - y) * stride;
+			for (UINT x = 0; x < width; ++x) {
+				Color c(pixels[(size_t) y * width + x]);
+				*pRow++ = c.GetB();
+				*pRow++ = c.GetG();
+				*pRow++ = c.GetR();
+				if (bitCount == 32)
+					*pRow++ = c.GetA();
+			}
+		}
+	}
+
+	Bitmap* FromFile(const wstring& path)
+	{
+		UINT width = 0, height = 0;
+		vector<ARGB> pixels;
+		if (!decode(path, width, height, pixels))
+			return nullptr;
+
+		auto pBitmap = new Bitmap(width, height, PixelFormat32bppARGB);
+		BitmapData data;
+		if (pBitmap->LockBits(&Rect(0, 0, width, height), ImageLockModeWrite, PixelFormat32bppARGB, &data) != Ok) {
+			delete pBitmap;
+			return nullptr;
+		}
+
+		for (UINT y = 0; y < height; ++y) {
+			auto pRow = (LPBYTE) data.Scan0 + (ptrdiff_t) y * data.Stride;
+			memcpy(pRow, pixels.data() + (size_t) y * width, width * sizeof(ARGB));
+		}
+		pBitmap->UnlockBits(&data);
+		return pBitmap;
+	}
+
+	// one palette index per pixel of an indexed bitmap
+	static bool readIndices(Bitmap* pBitmap, vector<unsigned short>& qPixels)
+	{
+		const auto width = pBitmap->GetWidth(), height = pBitmap->GetHeight();
+		const auto format = pBitmap->GetPixelFormat();
+		const int bpp = GetPixelFormatSize(format);
+		BitmapData data;
+		if (pBitmap->LockBits(&Rect(0, 0, width, height), ImageLockModeRead, format, &data) != Ok)
+			return false;
+
+		qPixels.resize((size_t) width * height);
+		#pragma omp parallel for
+		for (int y = 0; y < static_cast<int>(height); ++y) {
+			auto pRow = (LPBYTE) data.Scan0 + (ptrdiff_t) y * data.Stride;
+			auto pIndices = qPixels.data() + (size_t) y * width;
+			for (UINT x = 0; x < width; ++x) {
+				const UINT bit = x * bpp;
+				pIndices[x] = bpp == 8 ? pRow[x] : (pRow[bit >> 3] >> (8 - bpp - (bit & 7))) & ((1 << bpp) - 1);
+			}
+		}
+		return pBitmap->UnlockBits(&data) == Ok;
+	}
+
+	static bool readPixels(Bitmap* pBitmap, vector<ARGB>& pixels)
+	{
+		const auto width = pBitmap->GetWidth(), height = pBitmap->GetHeight();
+		BitmapData data;
+		if (pBitmap->LockBits(&Rect(0, 0, width, height), ImageLockModeRead, PixelFormat32bppARGB, &data) != Ok)
+			return false;
+
+		pixels.resize((size_t) width * height);
+		for (UINT y = 0; y < height; ++y) {
+			auto pRow = (LPBYTE) data.Scan0 + (ptrdiff_t) y * data.Stride;
+			memcpy(pixels.data() + (size_t) y * width, pRow, width * sizeof(ARGB));
+		}
+		return pBitmap->UnlockBits(&data) == Ok;
+	}
+
+	bool GetIndices(Bitmap* pBitmap, vector<unsigned short>& qPixels, vector<ARGB>& palette, int& transparentIndex)
+	{
+		if (!(pBitmap->GetPixelFormat() & PixelFormatIndexed))
+			return false;
+
+		const auto paletteSize = pBitmap->GetPaletteSize();
+		if (paletteSize <= 0)
+			return false;
+		auto pPaletteBytes = make_unique<BYTE[]>(paletteSize);
+		auto pPalette = (ColorPalette*) pPaletteBytes.get();
+		pBitmap->GetPalette(pPalette, paletteSize);
+
+		if (!readIndices(pBitmap, qPixels))
+			return false;
+
+		transparentIndex = -1;
+		auto nSize = pBitmap->GetPropertyItemSize(PropertyTagIndexTransparent);
+		if (nSize > 0) {
+			auto pPropertyItem = make_unique<PropertyItem[]>(nSize);
+			pBitmap->GetPropertyItem(PropertyTagIndexTransparent, nSize, pPropertyItem.get());
+			if (pPropertyItem.get()->length > 0)
+				transparentIndex = *(BYTE*) pPropertyItem.get()->value;
+		}
+
+		const auto maxIndex = qPixels.empty() ? 0 : *max_element(qPixels.begin(), qPixels.end());
+		const UINT nColors = min(pPalette->Count, (UINT) maxIndex + 1);
+		palette.assign(pPalette->Entries, pPalette->Entries + nColors);
+		if (transparentIndex >= static_cast<int>(nColors))
+			transparentIndex = -1;
+		if (transparentIndex >= 0)
+			palette[transparentIndex] &= 0xffffff;
+		else {
+			for (UINT i = 0; i < nColors; ++i) {
+				if ((palette[i] >> 24) == 0) {
+					transparentIndex = i;
+					break;
+				}
+			}
+		}
+		return true;
+	}
+
+	bool Save(Bitmap* pDest, const wstring& path, const int pngLevel)
+	{
+		auto extension = filesystem::path(path).extension().wstring();
+		transform(extension.begin(), extension.end(), extension.begin(), ::towlower);
+		const bool png = extension == L".png", gif = extension == L".gif", bmp = extension == L".bmp";
+		if (!png && !gif && !bmp)
+			return false;
+
+		const auto width = pDest->GetWidth(), height = pDest->GetHeight();
+		vector<BYTE> out;
+		if (pDest->GetPixelFormat() & PixelFormatIndexed) {
+			vector<unsigned short> qPixels;
+			vector<ARGB> palette;
+			int transparentIndex;
+			if (!GetIndices(pDest, qPixels, palette, transparentIndex))
+				return false;
+
+			const auto nColors = static_cast<UINT>(palette.size());
+			if (png)
+				encodePng(qPixels.data(), width, height, palette.data(), nColors, out, pngLevel);
+			else if (gif)
+				encodeGif(qPixels.data(), width, height, palette.data(), nColors, transparentIndex, out);
+			else
+				encodeBmp(qPixels.data(), width, height, palette.data(), nColors, out);
+		}
+		else {
+			// truecolour GIF needs a palette of its own, left to GDI+
+			if (gif)
+				return false;
+
+			vector<ARGB> pixels;
+			if (!readPixels(pDest, pixels))
+				return false;
+			if (png)
+				encodePng(pixels.data(), width, height, out, pngLevel);
+			else
+				encodeBmp(pixels.data(), width, height, out);
+		}
+
+		ofstream file(filesystem::path(path), ios::binary);
+		if (!file)
+			return false;
+		file.write(reinterpret_cast<const char*>(out.data()), out.size());
+		return file.good();
+	}
+}
@@ -0,0 +1,40 @@
+#pragma once
+#include "bitmapUtilities.h"
+
+namespace ImageCodec
+{
+	// Decodes a PNG, the first frame of a GIF or an uncompressed BMP into 32bpp ARGB pixels,
+	// false for any other format so the caller can fall back to GDI+.
+	bool decode(const BYTE* data, const size_t size, UINT& width, UINT& height, vector<ARGB>& pixels);
+	bool decode(const wstring& path, UINT& width, UINT& height, vector<ARGB>& pixels);
+
+	// Indexed PNG of 1, 2, 4 or 8 bits per pixel, the fewest that hold nColors
+	void encodePng(const unsigned short* qPixels, const UINT width, const UINT height, const ARGB* pPalette, const UINT nColors,
+		vector<BYTE>& out, const int level = 6);
+	// Truecolour PNG, with an alpha channel only if a pixel is not opaque
+	void encodePng(const ARGB* pixels, const UINT width, const UINT height, vector<BYTE>& out, const int level = 6);
+
+	// Single frame GIF89a, transparentIndex is -1 if no index is transparent
+	void encodeGif(const unsigned short* qPixels, const UINT width, const UINT height, const ARGB* pPalette, const UINT nColors,
+		const int transparentIndex, vector<BYTE>& out);
+
+	void encodeBmp(const unsigned short* qPixels, const UINT width, const UINT height, const ARGB* pPalette, const UINT nColors, vector<BYTE>& out);
+	void encodeBmp(const ARGB* pixels, const UINT width, const UINT height, vector<BYTE>& out);
+
+	// Bits per GIF color table index for nColors, at least 1
+	int gifBitDepth(const UINT nColors);
+	// Appends the LZW codes of the indices as GIF image data: the minimum code size is not included,
+	// the codes are not split into sub-blocks yet
+	void lzwEncode(const unsigned short* qPixels, const size_t count, const int minCodeSize, vector<BYTE>& out);
+	// Splits the data into GIF sub-blocks followed by the block terminator
+	void writeSubBlocks(const vector<BYTE>& data, vector<BYTE>& out);
+
+	// A new 32bpp ARGB bitmap decoded without GDI+, nullptr if the format is not supported
+	Bitmap* FromFile(const wstring& path);
+	// Palette indices of an indexed bitmap, with its palette trimmed to the highest index in use
+	// and the transparent index, -1 if there is none. False for other pixel formats.
+	bool GetIndices(Bitmap* pBitmap, vector<unsigned short>& qPixels, vector<ARGB>& palette, int& transparentIndex);
+	// Saves the bitmap as PNG, GIF or BMP by the extension of the path, false if it is another format
+	// or the bitmap cannot be written without GDI+
+	bool Save(Bitmap* pDest, const wstring& path, const int pngLevel = 6);
+}
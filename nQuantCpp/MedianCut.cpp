@@ -138,6 +138,11 @@ namespace MedianCutQuant
 	};
 
 	static const double internal_gamma = 0.5499;
+	// Voronoi passes accumulate per block of this many items and merge the blocks in order,
+	// so the palette does not depend on the number of threads.
+	// Every block keeps a sum per color, so their number is capped for large images.
+	static const int viter_block_size = 4096;
+	static const int viter_max_blocks = 64;
 
 	static void toFloatSetGamma(float* gamma_lut, const double gamma, const UINT nMaxColors)
 	{
@@ -205,134 +210,175 @@ namespace MedianCutQuant
 	class ColorHistArrItem {
 	public:
 		ARGB color;
+		UINT first_index = 0; // scan position of the first pixel with this color
 		float perceptual_weight = 0;
-		vector<pair<int, int> > pixLocation;
 	};
 
-	class ColorHistArrHead {
-	public:
-		UINT used = 0, capacity = 0;
-		ColorHistArrItem inline1, inline2;
-		unique_ptr<ColorHistArrItem[]> other_items;
-	};
+	inline UINT colorHash(ARGB color)
+	{
+		// finalizer of MurmurHash3, spreads nearby colors over the whole range
+		UINT hash = color;
+		hash ^= hash >> 16;
+		hash *= 0x85ebca6b;
+		hash ^= hash >> 13;
+		hash *= 0xc2b2ae35;
+		hash ^= hash >> 16;
+		return hash;
+	}
+
+	// HyperLogLog estimate of the number of distinct colors, used to size the hash table up front
+	UINT estimateColors(const vector<ARGB>& pixels)
+	{
+		const int precision = 12;
+		const int registers = 1 << precision;
+		const int numPixel = pixels.size();
+		const int parts = max(1, min((int) omp_get_max_threads(), numPixel / registers));
+		auto ranks = make_unique<BYTE[]>(parts * registers);
+
+		#pragma omp parallel for
+		for (int part = 0; part < parts; ++part) {
+			auto rank = ranks.get() + part * registers;
+			const int end = (int) ((long long) numPixel * (part + 1) / parts);
+			for (int i = (int) ((long long) numPixel * part / parts); i < end; ++i) {
+				const UINT hash = colorHash(pixels[i]);
+				UINT bits = hash << precision | (1U << (precision - 1));
+				BYTE r = 1;
+				for (; !(bits & 0x80000000U); bits <<= 1)
+					++r;
+
+				auto& reg = rank[hash >> (32 - precision)];
+				if (r > reg)
+					reg = r;
+			}
+		}
+
+		double sum = 0;
+		int zeros = 0;
+		for (int j = 0; j < registers; ++j) {
+			BYTE r = 0;
+			for (int part = 0; part < parts; ++part)
+				r = max(r, ranks[part * registers + j]);
+			sum += ldexp(1.0, -r);
+			if (!r)
+				++zeros;
+		}
+
+		double estimate = 0.7213 / (1 + 1.079 / registers) * registers * registers / sum;
+		if (estimate <= 2.5 * registers && zeros > 0)
+			estimate = registers * log((double) registers / zeros);
+		return static_cast<UINT>(estimate) + 1;
+	}
 
 	class ColorHashTable {
 	public:
-		UINT ignorebits, maxcolors, colors;
-		UINT hash_size;
-		unique_ptr<ColorHistArrHead[]> buckets;
-
-		ColorHashTable(UINT _hash_size, UINT _maxcolors, UINT _ignorebits) {
-			hash_size = _hash_size;
-			maxcolors = _maxcolors;
-			ignorebits = _ignorebits;
-			colors = 0;
-			buckets = make_unique<ColorHistArrHead[]>(hash_size);
+		// open addressing table, split by hash so that every thread fills its own part
+		struct Part {
+			vector<UINT> slots; // 1-based index into items, 0 if empty
+			vector<ColorHistArrItem> items;
+			UINT mask = 0;
+		};
+
+		vector<Part> parts;
+		UINT colors = 0;
+
+		ColorHashTable(UINT estimated_colors, UINT num_parts) {
+			parts.resize(num_parts);
+			UINT capacity = 16;
+			while (capacity < 2 * (estimated_colors / num_parts + 1))
+				capacity <<= 1;
+
+			for (auto& part : parts) {
+				part.slots.assign(capacity, 0);
+				part.mask = capacity - 1;
+				part.items.reserve(capacity / 2);
+			}
 		}
 
-		bool computeColorHash(const vector<ARGB>& pixels, const UINT& width, Mat<float>& importanceMap) {
-			const UINT height = pixels.size() / width;
-			const UINT channel_mask = 255U >> ignorebits << ignorebits;
-			const UINT channel_hmask = (255U >> ignorebits) ^ 0xFFU;
-			const UINT posterize_mask = channel_mask << 24 | channel_mask << 16 | channel_mask << 8 | channel_mask;
-			const UINT posterize_high_mask = channel_hmask << 24 | channel_hmask << 16 | channel_hmask << 8 | channel_hmask;
+		void computeColorHash(const vector<ARGB>& pixels, const UINT& width, Mat<float>& importanceMap) {
+			const int numPixels = pixels.size();
+			const int num_parts = parts.size();
+
+			/* Hash every pixel once and sort the pixel indices by part with a stable counting sort:
+			the image is cut into chunks, and the pixels of a part are laid out chunk after chunk in scan order. */
+			const int chunks = num_parts;
+			vector<UINT> hashes(numPixels), order(numPixels);
+			vector<int> starts(chunks * num_parts); // part major, chunk minor
+			#pragma omp parallel for
+			for (int c = 0; c < chunks; ++c) {
+				const int end = (int) ((long long) numPixels * (c + 1) / chunks);
+				for (int pixelIndex = (int) ((long long) numPixels * c / chunks); pixelIndex < end; ++pixelIndex) {
+					hashes[pixelIndex] = colorHash(pixels[pixelIndex]);
+					++starts[(hashes[pixelIndex] % num_parts) * chunks + c];
+				}
+			}
 
-			/* Go through the entire image, building a hash table of colors. */
-			UINT pixelIndex = 0;
-			for (int row = 0; row < height; ++row) {
-				for (int col = 0; col < width; ++col) {
-					float boost = 0.5 + importanceMap(row, col);
-					/*if (importance_map) {
-						boost = 0.5f + (double)*importance_map++ / 255.f;
-					}*/
-
-					// RGBA color is casted to long for easier hasing/comparisons
-					auto& color = pixels[pixelIndex++];
-					UINT hash = color % hash_size;
-
-					/* head of the hash function stores first 2 colors inline (achl->used = 1..2),
-					to reduce number of allocations of achl->other_items.
-					*/
-					auto& hashHead = buckets[hash];
-					if (hashHead.inline1.color == color && hashHead.used) {
-						hashHead.inline1.perceptual_weight += boost;
-						hashHead.inline1.pixLocation.emplace_back(row, col);
-						continue;
-					}
-					if (hashHead.used) {
-						if (hashHead.used > 1) {
-							if (hashHead.inline2.color == color) {
-								hashHead.inline2.perceptual_weight += boost;
-								hashHead.inline2.pixLocation.emplace_back(row, col);
-								continue;
-							}
-							// other items are stored as an array (which gets reallocated if needed)
-							auto other_items = hashHead.other_items.get();
-							UINT i = 0;
-							for (; i < hashHead.used - 2; ++i) {
-								if (other_items[i].color == color) {
-									other_items[i].perceptual_weight += boost;
-									other_items[i].pixLocation.emplace_back(row, col);
-									goto continue_outer_loop;
-								}
-							}
-
-							// the array was allocated with spare items
-							if (i < hashHead.capacity) {
-								other_items[i].color = color;
-								other_items[i].perceptual_weight = boost;
-								other_items[i].pixLocation.emplace_back(row, col);
-								hashHead.used++;
-								++colors;
-								continue;
-							}
-
-							if (++colors > maxcolors)
-								return false;
-
-							unique_ptr<ColorHistArrItem[]> pNew_items;
-							UINT capacity;
-							if (!other_items) { // there was no array previously, alloc "small" array
-								capacity = 8;
-								pNew_items = make_unique<ColorHistArrItem[]>(capacity);
-							}
-							else {
-								// simply reallocs and copies array to larger capacity
-								capacity = hashHead.capacity * 2 + 16;
-								pNew_items = make_unique<ColorHistArrItem[]>(capacity);
-								for (int i = 0; i < hashHead.capacity; ++i)
-									pNew_items[i] = other_items[i];
-							}
-							pNew_items[i].color = color;
-							pNew_items[i].perceptual_weight = boost;
-							pNew_items[i].pixLocation.emplace_back(row, col);
-
-							hashHead.other_items = move(pNew_items);
-							hashHead.capacity = capacity;
-							hashHead.used++;
+			int offset = 0;
+			for (auto& start : starts) {
+				const int count = start;
+				start = offset;
+				offset += count;
+			}
+
+			#pragma omp parallel for
+			for (int c = 0; c < chunks; ++c) {
+				vector<int> next(num_parts);
+				for (int p = 0; p < num_parts; ++p)
+					next[p] = starts[p * chunks + c];
+				const int end = (int) ((long long) numPixels * (c + 1) / chunks);
+				for (int pixelIndex = (int) ((long long) numPixels * c / chunks); pixelIndex < end; ++pixelIndex)
+					order[next[hashes[pixelIndex] % num_parts]++] = pixelIndex;
+			}
+
+			/* Go through the entire image, building a hash table of colors.
+			Each part walks only its own pixels, so every color is still accumulated in scan order. */
+			#pragma omp parallel for
+			for (int p = 0; p < num_parts; ++p) {
+				auto& part = parts[p];
+				const int end = p + 1 < num_parts ? starts[(p + 1) * chunks] : numPixels;
+				for (int k = starts[p * chunks]; k < end; ++k) {
+					const UINT pixelIndex = order[k];
+					const auto& color = pixels[pixelIndex];
+					const UINT hash = hashes[pixelIndex];
+
+					float boost = 0.5 + importanceMap(pixelIndex / width, pixelIndex % width);
+					for (UINT i = (hash / num_parts) & part.mask; ; i = (i + 1) & part.mask) {
+						auto& slot = part.slots[i];
+						if (!slot) {
+							ColorHistArrItem item;
+							item.color = color;
+							item.first_index = pixelIndex;
+							item.perceptual_weight = boost;
+							part.items.emplace_back(item);
+							slot = part.items.size();
+							if (part.items.size() * 10 > part.slots.size() * 7)
+								grow(part, num_parts);
+							break;
 						}
-						else {
-							// these are elses for first checks whether first and second inline-stored colors are used
-							hashHead.inline2.color = color;
-							hashHead.inline2.perceptual_weight = boost;
-							hashHead.inline2.pixLocation.emplace_back(row, col);
-							hashHead.used = 2;
-							++colors;
+
+						auto& item = part.items[slot - 1];
+						if (item.color == color) {
+							item.perceptual_weight += boost;
+							break;
 						}
 					}
-					else {
-						hashHead.inline1.color = color;
-						hashHead.inline1.perceptual_weight = boost;
-						hashHead.inline1.pixLocation.emplace_back(row, col);
-						hashHead.used = 1;
-						++colors;
-					}
-
-				continue_outer_loop:;
 				}
+			}
 
+			colors = 0;
+			for (const auto& part : parts)
+				colors += part.items.size();
+		}
+
+	private:
+		static void grow(Part& part, const UINT num_parts) {
+			part.slots.assign(part.slots.size() * 2, 0);
+			part.mask = part.slots.size() - 1;
+			for (UINT k = 0; k < part.items.size(); ++k) {
+				UINT i = (colorHash(part.items[k].color) / num_parts) & part.mask;
+				while (part.slots[i])
+					i = (i + 1) & part.mask;
+				part.slots[i] = k + 1;
 			}
-			return true;
 		}
 	};
 
@@ -348,8 +394,6 @@ namespace MedianCutQuant
 			BYTE likely_colormap_index;
 		} tmp;
 
-		vector<pair<int, int> > pixLocation;
-
 		HistItem()
 		{
 			fcolor.a = 0;
@@ -369,7 +413,6 @@ namespace MedianCutQuant
 			perceptual_weight = ref.perceptual_weight;
 			color_weight = ref.color_weight;
 			tmp = ref.tmp;
-			pixLocation = ref.pixLocation;
 		}
 
 		HistItem operator=(const HistItem& ref)
@@ -379,7 +422,6 @@ namespace MedianCutQuant
 			perceptual_weight = ref.perceptual_weight;
 			color_weight = ref.color_weight;
 			tmp = ref.tmp;
-			pixLocation = ref.pixLocation;
 			return *this;
 		}
 	};
@@ -390,39 +432,36 @@ namespace MedianCutQuant
 		float max_perceptual_weight;
 		double total_perceptual_weight;
 		UINT size;
-		UINT ignorebits;
 
 		Histogram(const vector<ARGB>& pixels, const UINT& width, Mat<float>& importanceMap) {
-			UINT ignorebits = 0;
-			UINT maxcolors = 1966080;
-
-			unique_ptr<ColorHashTable> ht;
-			do {
-				const UINT numPixel = pixels.size();
-				UINT estimated_colors = min(maxcolors, numPixel / (ignorebits + (numPixel > 512 * 512 ? 5 : 4)));
-				UINT hash_size = estimated_colors < 66000 ? 6673 : (estimated_colors < 200000 ? 12011 : 24019);
-				ht = make_unique<ColorHashTable>(hash_size, maxcolors, ignorebits);
-
-				// histogram uses noise contrast map for importance. Color accuracy in noisy areas is not very important.
-				// noise map does not include edges to avoid ruining anti-aliasing
-
-				bool added_ok = ht->computeColorHash(pixels, width, importanceMap);
-				if (added_ok)
-					break;
-				if (!added_ok)
-					++ignorebits;
-
-			} while (!ht.get());
-
-			hashToHist(*ht);
+			// histogram uses noise contrast map for importance. Color accuracy in noisy areas is not very important.
+			// noise map does not include edges to avoid ruining anti-aliasing
+			ColorHashTable ht(estimateColors(pixels), omp_get_max_threads());
+			ht.computeColorHash(pixels, width, importanceMap);
+
+			// items are listed in the bucket order of the former chained table of this size,
+			// which the median cut has been tuned with
+			const UINT numPixel = pixels.size();
+			UINT estimated_colors = min(1966080U, numPixel / (numPixel > 512 * 512 ? 5 : 4));
+			UINT hash_size = estimated_colors < 66000 ? 6673 : (estimated_colors < 200000 ? 12011 : 24019);
+			hashToHist(ht, hash_size);
 		}
 
 	private:
-		void hashToHist(const ColorHashTable& ht) {
+		void hashToHist(const ColorHashTable& ht, const UINT hash_size) {
 			max_perceptual_weight = 0;
-			ignorebits = ht.ignorebits;
 			size = ht.colors;
-			histIterms.reserve(size);
+
+			vector<const ColorHistArrItem*> items;
+			items.reserve(size);
+			for (const auto& part : ht.parts) {
+				for (const auto& item : part.items)
+					items.emplace_back(&item);
+			}
+			sort(items.begin(), items.end(), [hash_size](const ColorHistArrItem* a, const ColorHistArrItem* b) {
+				const UINT hashA = a->color % hash_size, hashB = b->color % hash_size;
+				return hashA < hashB || (hashA == hashB && a->first_index < b->first_index);
+			});
 
 			/* Limit perceptual weight to 1/10th of the image surface area to prevent
 			a single color from dominating all others. */
@@ -431,41 +470,19 @@ namespace MedianCutQuant
 
 			auto gamma_lut = make_unique<float[]>(size);
 			toFloatSetGamma(gamma_lut.get(), 1 / 2.2f, size);
-			auto buckets = ht.buckets.get();
-			for (UINT i = 0; i < ht.hash_size; ++i) {
-				auto& achl = buckets[i];
-				if (achl.used) {
-					HistItem hi;
-					rgbaToFloat(gamma_lut.get(), achl.inline1.color, hi.fcolor);
-					hi.adjusted_weight = hi.perceptual_weight = min(achl.inline1.perceptual_weight, perceptualWeightLimit);
-					hi.pixLocation = achl.inline1.pixLocation;
-					if (hi.perceptual_weight > max_perceptual_weight)
-						max_perceptual_weight = hi.perceptual_weight;
-					total_weight += hi.adjusted_weight;
-					histIterms.emplace_back(hi);
-
-					if (achl.used > 1) {
-						HistItem hi;
-						rgbaToFloat(gamma_lut.get(), achl.inline2.color, hi.fcolor);
-						hi.adjusted_weight = hi.perceptual_weight = min(achl.inline2.perceptual_weight, perceptualWeightLimit);
-						hi.pixLocation = achl.inline2.pixLocation;
-						if (hi.perceptual_weight > max_perceptual_weight)
-							max_perceptual_weight = hi.perceptual_weight;
-						total_weight += hi.adjusted_weight;
-						histIterms.emplace_back(hi);
-						auto other_items = achl.other_items.get();
-						for (UINT k = 0; k < achl.used - 2; ++k) {
-							HistItem hi;
-							rgbaToFloat(gamma_lut.get(), other_items[k].color, hi.fcolor);
-							hi.adjusted_weight = hi.perceptual_weight = min(other_items[k].perceptual_weight, perceptualWeightLimit);
-							hi.pixLocation = other_items[k].pixLocation;
-							if (hi.perceptual_weight > max_perceptual_weight)
-								max_perceptual_weight = hi.perceptual_weight;
-							total_weight += hi.adjusted_weight;
-							histIterms.emplace_back(hi);
-						}
-					}
-				}
+			histIterms.resize(size);
+			const int histSize = size;
+			#pragma omp parallel for
+			for (int i = 0; i < histSize; ++i) {
+				auto& hi = histIterms[i];
+				rgbaToFloat(gamma_lut.get(), items[i]->color, hi.fcolor);
+				hi.adjusted_weight = hi.perceptual_weight = min(items[i]->perceptual_weight, perceptualWeightLimit);
+			}
+
+			for (const auto& hi : histIterms) {
+				if (hi.perceptual_weight > max_perceptual_weight)
+					max_perceptual_weight = hi.perceptual_weight;
+				total_weight += hi.adjusted_weight;
 			}
 
 			total_perceptual_weight = total_weight;
@@ -951,20 +968,21 @@ namespace MedianCutQuant
 		return map;
 	}
 
-	void viterFinalize(ColorMap& map, ViterState* average_color)
+	void viterFinalize(ColorMap& map, ViterState* average_color, const UINT blocks)
 	{
 		for (UINT i = 0; i < map.colors; ++i) {
 			double a = 0, r = 0, g = 0, b = 0, total = 0;
 
-			// Aggregate results from all threads
-			//for (UINT t = 0; t < max_threads; t++) {
-			const UINT offset = i;
+			// Aggregate results from all blocks
+			for (UINT t = 0; t < blocks; ++t) {
+				const UINT offset = t * map.colors + i;
 
-			a += average_color[offset].a;
-			r += average_color[offset].r;
-			g += average_color[offset].g;
-			b += average_color[offset].b;
-			total += average_color[offset].total;
+				a += average_color[offset].a;
+				r += average_color[offset].r;
+				g += average_color[offset].g;
+				b += average_color[offset].b;
+				total += average_color[offset].total;
+			}
 
 			if (total)
 				map.palette[i].fcolor = FloatPixel(a / total, r / total, g / total, b / total);
@@ -975,7 +993,6 @@ namespace MedianCutQuant
 
 	void viterUpdateColor(const FloatPixel& acolor, const float value, const ColorMap& map, UINT match, ViterState* average_color)
 	{
-		//match += thread * (VITER_CACHE_LINE_GAP + map.colors);
 		const auto val = (double) value;
 		average_color[match].a += acolor.a * val;
 		average_color[match].r += acolor.r * val;
@@ -1169,29 +1186,39 @@ namespace MedianCutQuant
 
 	double viterDoIteration(Histogram& hist, ColorMap& map, const bool first_run)
 	{
-		const UINT max_threads = omp_get_max_threads();
-		auto average_color = make_unique<ViterState[]>(map.colors);
 		NearestMap n;
 		nearestInit(map, n);
 		auto achv = hist.histIterms.data();
 		const int hist_size = hist.size;
 
-		double total_diff = 0;
-		//#pragma omp parallel for if (hist_size > 3000) \
-		//        schedule(static) default(none) shared(average_color,callback) reduction(+:total_diff)
-		for (int j = 0; j < hist_size; ++j) {
-			float diff = 0;
-			UINT match = nearestSearch(n, achv[j].fcolor, achv[j].tmp.likely_colormap_index, diff);
-			achv[j].tmp.likely_colormap_index = match; // which centroid it belongs to
-			total_diff += (double) diff * achv[j].perceptual_weight;
-
-			viterUpdateColor(achv[j].fcolor, achv[j].perceptual_weight, map, match, average_color.get());
-
-			if (!first_run)
-				adjustHistogramCallback(&achv[j], diff);
+		const int blocks = max(1, min(viter_max_blocks, (hist_size + viter_block_size - 1) / viter_block_size));
+		auto average_color = make_unique<ViterState[]>(blocks * map.colors);
+		auto block_diff = make_unique<double[]>(blocks);
+
+		#pragma omp parallel for if (hist_size > 3000) schedule(dynamic)
+		for (int block = 0; block < blocks; ++block) {
+			auto block_color = average_color.get() + block * map.colors;
+			const int end = (int) ((long long) hist_size * (block + 1) / blocks);
+			double total_diff = 0;
+			for (int j = (int) ((long long) hist_size * block / blocks); j < end; ++j) {
+				float diff = 0;
+				UINT match = nearestSearch(n, achv[j].fcolor, achv[j].tmp.likely_colormap_index, diff);
+				achv[j].tmp.likely_colormap_index = match; // which centroid it belongs to
+				total_diff += (double) diff * achv[j].perceptual_weight;
+
+				viterUpdateColor(achv[j].fcolor, achv[j].perceptual_weight, map, match, block_color);
+
+				if (!first_run)
+					adjustHistogramCallback(&achv[j], diff);
+			}
+			block_diff[block] = total_diff;
 		}
 
-		viterFinalize(map, average_color.get());
+		double total_diff = 0;
+		for (int block = 0; block < blocks; ++block)
+			total_diff += block_diff[block];
+
+		viterFinalize(map, average_color.get(), blocks);
 		return total_diff / hist.total_perceptual_weight;
 	}
 
@@ -1275,25 +1302,38 @@ namespace MedianCutQuant
 
 		NearestMap n;
 		nearestInit(*pFinalColorMap, n);
-		//const UINT max_threads = omp_get_max_threads();
-		auto average_color = make_unique<ViterState[]>(nMaxColors);
 
-		const UINT height = pixels.size() / width;
-		UINT pixelIndex = 0;
-		for (UINT row = 0; row < height; ++row) {
-			UINT last_match = 0;
-			for (UINT col = 0; col < width; ++col) {
-				FloatPixel px;
-				rgbaToFloat(gamma_lut.get(), pixels[pixelIndex++], px);
-				float diff = 0;
-				last_match = nearestSearch(n, px, last_match, diff);
-
-				remapping_error += diff;
-				viterUpdateColor(px, 1.0, *pFinalColorMap, last_match, average_color.get());
+		const int height = pixels.size() / width;
+		const int rows_per_block = max(1, viter_block_size / (int) width);
+		const int blocks = max(1, min(viter_max_blocks, (height + rows_per_block - 1) / rows_per_block));
+		auto average_color = make_unique<ViterState[]>(blocks * nMaxColors);
+		auto block_error = make_unique<double[]>(blocks);
+
+		#pragma omp parallel for schedule(dynamic)
+		for (int block = 0; block < blocks; ++block) {
+			auto block_color = average_color.get() + block * nMaxColors;
+			const int end = height * (block + 1) / blocks;
+			double block_remapping_error = 0;
+			for (int row = height * block / blocks; row < end; ++row) {
+				UINT pixelIndex = row * width;
+				UINT last_match = 0;
+				for (UINT col = 0; col < width; ++col) {
+					FloatPixel px;
+					rgbaToFloat(gamma_lut.get(), pixels[pixelIndex++], px);
+					float diff = 0;
+					last_match = nearestSearch(n, px, last_match, diff);
+
+					block_remapping_error += diff;
+					viterUpdateColor(px, 1.0, *pFinalColorMap, last_match, block_color);
+				}
 			}
+			block_error[block] = block_remapping_error;
 		}
 
-		viterFinalize(*pFinalColorMap, average_color.get());
+		for (int block = 0; block < blocks; ++block)
+			remapping_error += block_error[block];
+
+		viterFinalize(*pFinalColorMap, average_color.get(), blocks);
 		return remapping_error / pixels.size();
 	}
 
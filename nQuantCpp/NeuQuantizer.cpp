@@ -3,6 +3,11 @@
 #include "CIELABConvertor.h"
 #include <unordered_map>
 
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define NEU_SSE2
+#endif
+
 namespace NeuralNet
 {
 	//====================
@@ -65,18 +70,25 @@ namespace NeuralNet
 	const double beta = (1.0 / (double)(1 << betashift));/* beta = 1/1024 */
 	const double betagamma = (double)(1 << (gammashift - betashift));
 
-	struct nq_pixel
+	/* The network is kept as one float array per component, padded to a multiple of 4 neurons so that Contest and
+	* Alterneigh can work on 4 neurons per SSE2 instruction. Padding neurons sit far away from every colour and never win. */
+	struct nq_network
 	{
-		double al, L, A, B;
+		unique_ptr<float[]> al, L, A, B;
 	};
 
-	unique_ptr<nq_pixel[]> network; // the network itself
+	nq_network network; // the network itself
+	int netcapacity = netsize;
+	const float far_away = 1e30f;
 
-	unique_ptr<unsigned short[]> netindex; // for network lookup - really 256
+	unique_ptr<unsigned short[]> netindex; // for palette lookup on L - really 101
+	unique_ptr<unsigned short[]> sortedpos; // palette entries in ascending L
+	unique_ptr<CIELABConvertor::Lab[]> sortedlab;
 
-	unique_ptr<double[]> bias;  // bias and freq arrays for learning
-	unique_ptr<double[]> freq;
+	unique_ptr<float[]> bias;  // bias and freq arrays for learning
+	unique_ptr<float[]> freq;
 	unique_ptr<double[]> radpower;
+	unique_ptr<float[]> learning_rates; // radpower / alpharadbias mirrored around the winner, 0 at the winner itself
 
 	double gamma_correction = 1.0;         // 1.0/2.2 usually
 
@@ -103,24 +115,44 @@ namespace NeuralNet
 	}
 
 	void SetUpArrays() {
-		network = make_unique<nq_pixel[]>(netsize);
+		netcapacity = (netsize + 3) & ~3;
+		network.al = make_unique<float[]>(netcapacity);
+		network.L = make_unique<float[]>(netcapacity);
+		network.A = make_unique<float[]>(netcapacity);
+		network.B = make_unique<float[]>(netcapacity);
 		netindex = make_unique<unsigned short[]>(max(netsize, 256));
 		repel_points = make_unique<unsigned short[]>(max(netsize, 256));
-		bias = make_unique<double[]>(netsize);
-		freq = make_unique<double[]>(netsize);
-		radpower = make_unique<double[]>(initrad);
+		bias = make_unique<float[]>(netcapacity);
+		freq = make_unique<float[]>(netcapacity);
+		radpower = make_unique<double[]>(initrad + 1);
+		learning_rates = make_unique<float[]>(2 * initrad + 1);
 
 		for (int i = specials; i < netsize; ++i) {
-			network[i].L = network[i].A = network[i].B = i / netsize;
+			network.L[i] = network.A[i] = network.B[i] = i / netsize;
 
 			/*  Sets alpha values at 0 for dark pixels. */
 			if (i < 16)
-				network[i].al = i * 16.0;
+				network.al[i] = i * 16.0f;
 			else
-				network[i].al = BYTE_MAX;
+				network.al[i] = BYTE_MAX;
 
-			freq[i] = 1.0 / netsize;
+			freq[i] = 1.0f / netsize;
 		}
+
+		for (int i = netsize; i < netcapacity; ++i)
+			network.al[i] = network.L[i] = network.A[i] = network.B[i] = far_away;
+	}
+
+	void SetRadPower(double alpha, UINT rad) {
+		for (UINT i = 0; i < rad; ++i)
+			radpower[i] = floor(alpha * (((sqr(rad) - sqr(i)) * radiusbias) / sqr(rad)));
+
+		auto rates = learning_rates.get() + rad;
+		rates[0] = 0;
+		for (int d = 1; d < (int) rad; ++d)
+			rates[d] = rates[-d] = (float) (radpower[d] / alpharadbias);
+		if (rad > 0)
+			rates[rad] = rates[-(int) rad] = 0;
 	}
 
 	void getLab(const Color& c, CIELABConvertor::Lab& lab1)
@@ -145,45 +177,49 @@ namespace NeuralNet
 		return (UINT)temp;
 	}
 
-	void Altersingle(double alpha, UINT i, BYTE al, double L, double A, double B) {
+	void Altersingle(double alpha, UINT i, BYTE al, float L, float A, float B) {
 		auto colorimp = 1.0;//0.5;// + 0.7 * colorimportance(al);
 
 		alpha /= initalpha;
 
 		/* alter hit neuron */
-		network[i].al -= alpha * (network[i].al - al);
-		network[i].L -= colorimp * alpha * (network[i].L - L);
-		network[i].A -= colorimp * alpha * (network[i].A - A);
-		network[i].B -= colorimp * alpha * (network[i].B - B);
+		network.al[i] -= alpha * (network.al[i] - al);
+		network.L[i] -= colorimp * alpha * (network.L[i] - L);
+		network.A[i] -= colorimp * alpha * (network.A[i] - A);
+		network.B[i] -= colorimp * alpha * (network.B[i] - B);
 	}
 
-	void Alterneigh(UINT rad, UINT i, BYTE al, double L, double A, double B) {
+	void Alterneigh(UINT rad, UINT i, BYTE al, float L, float A, float B) {
 		int lo = i - rad;
 		if (lo < 0)
 			lo = 0;
-		UINT hi = i + rad;
+		int hi = i + rad;
 		if (hi > maxnetpos)
 			hi = maxnetpos;
 
-		UINT j = i + 1;
-		int k = i - 1;
-		auto learning_rate_table = radpower.get();
-		while ((j <= hi) || (k >= lo)) {
-			double learning_rate = (*(++learning_rate_table)) / alpharadbias;
-			if (j <= hi) {
-				network[j].al -= learning_rate * (network[j].al - al);
-				network[j].L -= learning_rate * (network[j].L - L);
-				network[j].A -= learning_rate * (network[j].A - A);
-				network[j].B -= learning_rate * (network[j].B - B);
-				j++;
-			}
-			if (k >= lo) {
-				network[k].al -= learning_rate * (network[k].al - al);
-				network[k].L -= learning_rate * (network[k].L - L);
-				network[k].A -= learning_rate * (network[k].A - A);
-				network[k].B -= learning_rate * (network[k].B - B);
-				k--;
-			}
+		/* Neuron j moves by learning_rates[rad + j - i]; the rate of neuron i itself is 0, which leaves it untouched. */
+		auto rates = learning_rates.get() + rad - i;
+		int j = lo;
+#ifdef NEU_SSE2
+		const auto val = _mm_set1_ps(al), vL = _mm_set1_ps(L), vA = _mm_set1_ps(A), vB = _mm_set1_ps(B);
+		for (; j + 3 <= hi; j += 4) {
+			auto learning_rate = _mm_loadu_ps(&rates[j]);
+			auto x = _mm_loadu_ps(&network.al[j]);
+			_mm_storeu_ps(&network.al[j], _mm_sub_ps(x, _mm_mul_ps(learning_rate, _mm_sub_ps(x, val))));
+			x = _mm_loadu_ps(&network.L[j]);
+			_mm_storeu_ps(&network.L[j], _mm_sub_ps(x, _mm_mul_ps(learning_rate, _mm_sub_ps(x, vL))));
+			x = _mm_loadu_ps(&network.A[j]);
+			_mm_storeu_ps(&network.A[j], _mm_sub_ps(x, _mm_mul_ps(learning_rate, _mm_sub_ps(x, vA))));
+			x = _mm_loadu_ps(&network.B[j]);
+			_mm_storeu_ps(&network.B[j], _mm_sub_ps(x, _mm_mul_ps(learning_rate, _mm_sub_ps(x, vB))));
+		}
+#endif
+		for (; j <= hi; ++j) {
+			auto learning_rate = rates[j];
+			network.al[j] -= learning_rate * (network.al[j] - al);
+			network.L[j] -= learning_rate * (network.L[j] - L);
+			network.A[j] -= learning_rate * (network.A[j] - A);
+			network.B[j] -= learning_rate * (network.B[j] - B);
 		}
 	}
 
@@ -197,133 +233,182 @@ namespace NeuralNet
 	 * that only every 4th function call will result in a full pass.
  	*/
 	void Repelcoincident(int i) {
-		/* Use brute force to precompute the distance vectors between our neuron and each neuron. */
-
 		if (repel_points[i] > REPEL_THRESHOLD) {
 			repel_points[i] -= REPEL_STEP_DOWN;
 			return;
 		}
 
-		auto diffs = make_unique<nq_pixel[]>(netsize);
-		for (int vdx = 0; vdx < netsize; ++vdx) {
-			diffs[vdx].al = abs(network[vdx].al - network[i].al);
-			diffs[vdx].L = abs(network[vdx].L - network[i].L);
-			diffs[vdx].A = abs(network[vdx].A - network[i].A);
-			diffs[vdx].B = abs(network[vdx].B - network[i].B);
-		}
-
-
 		/* Identify which neurons are too close to neuron[i] and shift them away.
+		 * Neuron i is copied first as it is close to itself and moves along with the others.
 		 * */
+		const auto al = network.al[i], L = network.L[i], A = network.A[i], B = network.B[i];
 
 		 /* repel_step is the amount we move the neurons away by in each component.
 		  * radpower[0]/alpharadbias is similar to the proportion alterneigh uses.
 		  * */
-		auto repel_step = exclusion_threshold * (radpower[0] / alpharadbias);
+		auto repel_step = (float) (exclusion_threshold * (radpower[0] / alpharadbias));
 
 		for (int j = 0; j < netsize; ++j) {
-
-			if (diffs[j].al < exclusion_threshold
-				&& diffs[j].L < exclusion_threshold
-				&& diffs[j].A < exclusion_threshold
-				&& diffs[j].B < exclusion_threshold
+			if (abs(network.al[j] - al) < exclusion_threshold
+				&& abs(network.L[j] - L) < exclusion_threshold
+				&& abs(network.A[j] - A) < exclusion_threshold
+				&& abs(network.B[j] - B) < exclusion_threshold
 				) {
-
-				nq_pixel repel_vec;
-				repel_vec.al = posneg(diffs[j].al), repel_vec.L = posneg(diffs[j].L), repel_vec.A = posneg(diffs[j].A), repel_vec.B = posneg(diffs[j].B);
-
-				network[j].al += repel_vec.al * repel_step;
-				network[j].L += repel_vec.L * repel_step;
-				network[j].A += repel_vec.A * repel_step;
-				network[j].B += repel_vec.B * repel_step;
+				/* The component-wise distances are absolute values, so every component is pushed up. */
+				network.al[j] += repel_step;
+				network.L[j] += repel_step;
+				network.A[j] += repel_step;
+				network.B[j] += repel_step;
 			}
 		}
 
 		repel_points[i] += REPEL_STEP_UP;
 	}
 
-	int Contest(BYTE al, double L, double A, double B) {
-		/* Calculate the component-wise differences between target_pix colour and every colour in the network, and weight according
-		* to component relevance.
+	/* finds closest neuron (min dist) and updates freq */
+	/* finds best neuron (min dist-bias) and returns position */
+	/* for frequently chosen neurons, freq[i] is high and bias[i] is negative */
+	/* bias[i] = gamma*((1/netsize)-freq[i]) */
+	/* With frozen set, the network, bias and freq arrays are only read, so several winners can be found in parallel. */
+	int Contest(BYTE al, float L, float A, float B, const bool frozen = false) {
+		/* The distance is the manhattan distance over alpha and Lab. Using colorimportance(al) here was causing problems
+		* with images that were close to monocolor. See bug reports: 3149791, 2938728, 2896731 and 2938710
 		*/
-		auto diffs = make_unique<nq_pixel[]>(netsize);
-		for (int vdx = 0; vdx < netsize; ++vdx) {
-			diffs[vdx].al = abs(network[vdx].al - al);
-			diffs[vdx].L = abs(network[vdx].L - L);
-			diffs[vdx].A = abs(network[vdx].A - A);
-			diffs[vdx].B = abs(network[vdx].B - B);
-		}
-
-		/* finds closest neuron (min dist) and updates freq */
-		/* finds best neuron (min dist-bias) and returns position */
-		/* for frequently chosen neurons, freq[i] is high and bias[i] is negative */
-		/* bias[i] = gamma*((1/netsize)-freq[i]) */
-
 		int bestpos = 0, bestbiaspos = bestpos;
-		double bestd = INT_MAX, bestbiasd = bestd;
+		float bestd = INT_MAX, bestbiasd = bestd;
+
+		/* The first neuron within exclusion_threshold in every component is a perfect match and ends the search. */
+		int perfectpos = -1;
+
+		int i = 0;
+#ifdef NEU_SSE2
+		const auto absmask = _mm_castsi128_ps(_mm_set1_epi32(0x7FFFFFFF));
+		const auto threshold = _mm_set1_ps(exclusion_threshold);
+		const auto val = _mm_set1_ps(al), vL = _mm_set1_ps(L), vA = _mm_set1_ps(A), vB = _mm_set1_ps(B);
+		auto vbestd = _mm_set1_ps(bestd), vbestbiasd = vbestd;
+		auto vbestpos = _mm_setzero_si128(), vbestbiaspos = vbestpos;
+		auto vpos = _mm_setr_epi32(0, 1, 2, 3);
+		const auto four = _mm_set1_epi32(4);
+		for (; i < netsize; i += 4) {
+			auto dal = _mm_and_ps(_mm_sub_ps(_mm_loadu_ps(&network.al[i]), val), absmask);
+			auto dL = _mm_and_ps(_mm_sub_ps(_mm_loadu_ps(&network.L[i]), vL), absmask);
+			auto dA = _mm_and_ps(_mm_sub_ps(_mm_loadu_ps(&network.A[i]), vA), absmask);
+			auto dB = _mm_and_ps(_mm_sub_ps(_mm_loadu_ps(&network.B[i]), vB), absmask);
+
+			auto perfect = _mm_and_ps(_mm_and_ps(_mm_cmplt_ps(dal, threshold), _mm_cmplt_ps(dL, threshold)),
+				_mm_and_ps(_mm_cmplt_ps(dA, threshold), _mm_cmplt_ps(dB, threshold)));
+			auto mask = _mm_movemask_ps(perfect);
+			if (mask) {
+				for (perfectpos = i; !(mask & 1); mask >>= 1)
+					++perfectpos;
+				break;
+			}
 
-		/* Using colorimportance(al) here was causing problems with images that were close to monocolor.
-		See bug reports: 3149791, 2938728, 2896731 and 2938710
-		*/
-		bool perfect = false; /* Is bestpos a perfect match for the colour. */
+			/* Each lane keeps the first of its neurons with the smallest distance, as the scalar loop does. */
+			auto dist = _mm_add_ps(_mm_add_ps(dL, dA), _mm_add_ps(dB, dal));
+			auto better = _mm_castps_si128(_mm_cmplt_ps(dist, vbestd));
+			vbestd = _mm_min_ps(dist, vbestd);
+			vbestpos = _mm_or_si128(_mm_and_si128(better, vpos), _mm_andnot_si128(better, vbestpos));
+
+			auto biasdist = _mm_sub_ps(dist, _mm_loadu_ps(&bias[i]));
+			better = _mm_castps_si128(_mm_cmplt_ps(biasdist, vbestbiasd));
+			vbestbiasd = _mm_min_ps(biasdist, vbestbiasd);
+			vbestbiaspos = _mm_or_si128(_mm_and_si128(better, vpos), _mm_andnot_si128(better, vbestbiaspos));
+			vpos = _mm_add_epi32(vpos, four);
+		}
 
-		for (int i = 0; i < netsize; ++i) {
-			if (!perfect) {
-				double bestbiasd_biased = bestbiasd + bias[i];
-				double dist = 0;
-
-				/*Detect perfect matches. */
-				if (diffs[i].al < exclusion_threshold
-					&& diffs[i].L < exclusion_threshold
-					&& diffs[i].A < exclusion_threshold
-					&& diffs[i].B < exclusion_threshold
-					) {
-					perfect = true;
-
-					/* If we don't have a perfect match, the distance between the
-						* target and the neuron is the manhattan distance. */
+		if (perfectpos < 0) {
+			float lanebestd[4], lanebestbiasd[4];
+			int lanebestpos[4], lanebestbiaspos[4];
+			_mm_storeu_ps(lanebestd, vbestd);
+			_mm_storeu_ps(lanebestbiasd, vbestbiasd);
+			_mm_storeu_si128((__m128i*) lanebestpos, vbestpos);
+			_mm_storeu_si128((__m128i*) lanebestbiaspos, vbestbiaspos);
+			for (int lane = 0; lane < 4; ++lane) {
+				if (lanebestd[lane] < bestd || (lanebestd[lane] == bestd && lanebestpos[lane] < bestpos)) {
+					bestd = lanebestd[lane];
+					bestpos = lanebestpos[lane];
 				}
-				else {
-					dist = diffs[i].L;
-					dist += diffs[i].A;
-
-					if (dist < bestd || dist < bestbiasd_biased) {
-						dist += diffs[i].B;
-						dist += diffs[i].al;						
-					}
+				if (lanebestbiasd[lane] < bestbiasd || (lanebestbiasd[lane] == bestbiasd && lanebestbiaspos[lane] < bestbiaspos)) {
+					bestbiasd = lanebestbiasd[lane];
+					bestbiaspos = lanebestbiaspos[lane];
 				}
+			}
+		}
+#else
+		for (; i < netsize; ++i) {
+			auto dal = abs(network.al[i] - al);
+			auto dL = abs(network.L[i] - L);
+			auto dA = abs(network.A[i] - A);
+			auto dB = abs(network.B[i] - B);
+
+			if (dal < exclusion_threshold && dL < exclusion_threshold && dA < exclusion_threshold && dB < exclusion_threshold) {
+				perfectpos = i;
+				break;
+			}
 
-				/* See if the current neuron is better. */
-				if (dist < bestd) {
-					bestd = dist;
-					bestpos = i;
-				}
-				if (dist < bestbiasd_biased) {
-					bestbiasd = dist - bias[i];
-					bestbiaspos = i;
-				}
+			auto dist = (dL + dA) + (dB + dal);
+			if (dist < bestd) {
+				bestd = dist;
+				bestpos = i;
+			}
+			auto biasdist = dist - bias[i];
+			if (biasdist < bestbiasd) {
+				bestbiasd = biasdist;
+				bestbiaspos = i;
+			}
+		}
+#endif
+
+		if (perfectpos >= 0)
+			bestpos = perfectpos;
+
+		if (!frozen) {
+			/* Age (decay) every neurons bias and freq values. */
+			i = 0;
+#ifdef NEU_SSE2
+			const auto vbeta = _mm_set1_ps(beta), vgamma = _mm_set1_ps(gamma);
+			for (; i < netsize; i += 4) {
+				auto betafreq = _mm_mul_ps(_mm_loadu_ps(&freq[i]), vbeta);
+				_mm_storeu_ps(&freq[i], _mm_sub_ps(_mm_loadu_ps(&freq[i]), betafreq));
+				_mm_storeu_ps(&bias[i], _mm_add_ps(_mm_loadu_ps(&bias[i]), _mm_mul_ps(betafreq, vgamma)));
+			}
+#endif
+			for (; i < netsize; ++i) {
+				auto betafreq = freq[i] * (float) beta;
+				freq[i] -= betafreq;
+				bias[i] += betafreq * (float) gamma;
 			}
 
-			/* Age (decay) the current neurons bias and freq values. */
-			auto betafreq = freq[i] * beta;
-			freq[i] -= betafreq;
-			bias[i] += betafreq * gamma;
+			/* Increase the freq and bias values for the chosen neuron. */
+			freq[bestpos] += beta;
+			bias[bestpos] -= betagamma;
 		}
 
-		/* Increase the freq and bias values for the chosen neuron. */
-		freq[bestpos] += beta;
-		bias[bestpos] -= betagamma;
-		
 		/* If our bestpos pixel is a 'perfect' match, we return bestpos, not bestbiaspos.  That is, we only decide to look at
 		* bestbiaspos if the current target pixel wasn't a good enough match with the bestpos neuron, and there is some hope that
 		* we can train the bestbiaspos neuron to become a better match. */
-		if (perfect)
+		if (perfectpos >= 0)
 			return -bestpos - 1;  /* flag this was a perfect match */
 
 		return bestbiaspos;
 	}
 
-	void Learn(const int samplefac, const vector<ARGB>& pixels) {
+	/* Ages freq and bias as count sequential Contest calls would, given their closest neurons.
+	* freq decays by (1 - beta) per call and gains beta per win, bias moves by gamma times the freq lost. */
+	void AgeNeurons(const int* closest, const int count, const double* decay) {
+		auto gain = make_unique<double[]>(netsize);
+		for (int s = 0; s < count; ++s)
+			gain[closest[s]] += beta * decay[count - 1 - s];
+
+		for (int i = 0; i < netsize; ++i) {
+			auto newfreq = freq[i] * decay[count] + gain[i];
+			bias[i] += (freq[i] - newfreq) * gamma;
+			freq[i] = newfreq;
+		}
+	}
+
+	void Learn(const int samplefac, const vector<ARGB>& pixels, const UINT batchSize) {
 		UINT stepIndex = 0;
 
 		int pos = 0;
@@ -342,8 +427,7 @@ namespace NeuralNet
 		if (rad <= 1)
 			rad = 0;
 
-		for (UINT i = 0; i < rad; ++i)
-			radpower[i] = floor(alpha * (((sqr(rad) - sqr(i)) * radiusbias) / sqr(rad)));
+		SetRadPower(alpha, rad);
 
 		UINT step = ((float)rand() / (float)RAND_MAX) * lengthcount;
 
@@ -352,17 +436,7 @@ namespace NeuralNet
 			learning_extension = 2 + ((extra_long_colour_threshold - netsize) / extra_long_divisor);
 
 		UINT i = 0;
-		while (i < learning_extension * samplepixels) {
-			Color c(pixels[pos]);
-
-			auto al = c.GetA();
-			if (c.GetA() <= alphaThreshold)
-				c = m_transparentColor;
-			CIELABConvertor::Lab lab1;
-			getLab(c, lab1);
-
-			auto j = Contest(al, lab1.L, lab1.A, lab1.B);
-
+		auto train = [&](int j, BYTE al, const CIELABConvertor::Lab& lab1) {
 			/* Determine if the colour was a perfect match.  j contains a factor encoded boolean. Horrible code to extract it. */
 			bool was_perfect = (j < 0);
 			j = (j < 0 ? -(j + 1) : j);
@@ -373,66 +447,174 @@ namespace NeuralNet
 			else if (rad && was_perfect)
 				Repelcoincident(j);  /* repel neighbours in colour space */
 
-			pos += step;
-			while (pos >= lengthcount)
-				pos -= lengthcount;
-
 			if (++i % delta == 0) {                    /* FPE here if delta=0*/
 				alpha -= alpha / (learning_extension * (double) alphadec);
 				radius -= radius / (double)radiusdec;
 				rad = (UINT)radius;
 				if (rad <= 1)
 					rad = 0;
-				for (UINT j = 0; j < rad; ++j)
-					radpower[j] = floor(alpha * (((sqr(rad) - sqr(j)) * radiusbias) / sqr(rad)));
+				SetRadPower(alpha, rad);
+			}
+		};
+
+		auto sample = [&](BYTE& al, CIELABConvertor::Lab& lab1) {
+			Color c(pixels[pos]);
+
+			al = c.GetA();
+			if (c.GetA() <= alphaThreshold)
+				c = m_transparentColor;
+			getLab(c, lab1);
+
+			pos += step;
+			while (pos >= lengthcount)
+				pos -= lengthcount;
+		};
+
+		const UINT totalSteps = learning_extension * samplepixels;
+		if (batchSize <= 1) {
+			while (i < totalSteps) {
+				BYTE al;
+				CIELABConvertor::Lab lab1;
+				sample(al, lab1);
+				train(Contest(al, lab1.L, lab1.A, lab1.B), al, lab1);
+			}
+			return;
+		}
+
+		/* Mini-batch: the winners of a whole batch are found in parallel against the network as it stood at the start of
+		* the batch, then the neuron updates are applied in sample order, so the result does not depend on the thread count. */
+		auto als = make_unique<BYTE[]>(batchSize);
+		auto labs = make_unique<CIELABConvertor::Lab[]>(batchSize);
+		auto winners = make_unique<int[]>(batchSize);
+		auto closest = make_unique<int[]>(batchSize);
+		auto decay = make_unique<double[]>(batchSize + 1);
+		decay[0] = 1.0;
+		for (UINT k = 1; k <= batchSize; ++k)
+			decay[k] = decay[k - 1] * (1.0 - beta);
+
+		while (i < totalSteps) {
+			const int count = (int) min(batchSize, totalSteps - i);
+			for (int s = 0; s < count; ++s)
+				sample(als[s], labs[s]);
+
+			#pragma omp parallel for
+			for (int s = 0; s < count; ++s) {
+				auto& lab1 = labs[s];
+				winners[s] = Contest(als[s], lab1.L, lab1.A, lab1.B, true);
 			}
+
+			for (int s = 0; s < count; ++s) {
+				const int j = winners[s];
+				closest[s] = j < 0 ? -(j + 1) : j;
+			}
+			AgeNeurons(closest.get(), count, decay.get());
+
+			for (int s = 0; s < count; ++s)
+				train(winners[s], als[s], labs[s]);
 		}
 	}
 
 	void Inxbuild(ColorPalette* pPalette) {
 		UINT nMaxColors = pPalette->Count;		
 
-		int previouscol = 0;
-		int startpos = 0;
-
 		for (int i = 0; i < nMaxColors; ++i) {
-			Color c(pPalette->Entries[i]);
 			int smallpos = i;
-			auto smallval = network[i].L;			// index on L
+			auto smallval = network.L[i];			// index on L
 											// find smallest in i..netsize-1
 			for (int j = i + 1; j < nMaxColors; ++j) {
-				if (network[j].L < smallval) {		// index on L				
+				if (network.L[j] < smallval) {		// index on L				
 					smallpos = j;
-					smallval = network[j].L;	// index on L
+					smallval = network.L[j];	// index on L
 				}
 			}
 			// swap p (i) and q (smallpos) entries
-			if (i != smallpos)
-				swap(network[smallpos], network[i]);
-
-			// smallval entry is now in position i
-			if (smallval != previouscol) {
-				netindex[previouscol] = (startpos + i) >> 1;
-				for (int j = previouscol + 1; j < smallval; ++j)
-					netindex[j] = i;
-				previouscol = smallval;
-				startpos = i;
+			if (i != smallpos) {
+				swap(network.al[smallpos], network.al[i]);
+				swap(network.L[smallpos], network.L[i]);
+				swap(network.A[smallpos], network.A[i]);
+				swap(network.B[smallpos], network.B[i]);
 			}
 		}
 
-		netindex[previouscol] = (startpos + maxnetpos) >> 1;
-		for (int j = previouscol + 1; j < netsize; ++j)
-			netindex[j] = maxnetpos;
-
 		for (UINT k = 0; k < nMaxColors; ++k) {
 			CIELABConvertor::Lab lab1;
-			lab1.alpha = round_biased(network[k].al);
-			lab1.L = network[k].L, lab1.A = network[k].A, lab1.B = network[k].B;
+			lab1.alpha = round_biased(network.al[k]);
+			lab1.L = network.L[k], lab1.A = network.A[k], lab1.B = network.B[k];
 			pPalette->Entries[k] = CIELABConvertor::LAB2RGB(lab1);
 
 			if (m_transparentPixelIndex >= 0 && pPalette->Entries[k] == m_transparentColor)
 				swap(pPalette->Entries[0], pPalette->Entries[k]);
 		}
+
+		/* The palette colours no longer match the network exactly once converted to RGB, so sort them again on their own L.
+		* netindex[l] is the first sorted entry whose L is at least l. */
+		sortedpos = make_unique<unsigned short[]>(nMaxColors);
+		sortedlab = make_unique<CIELABConvertor::Lab[]>(nMaxColors);
+		auto labs = make_unique<CIELABConvertor::Lab[]>(nMaxColors);
+		for (UINT k = 0; k < nMaxColors; ++k) {
+			sortedpos[k] = k;
+			getLab(Color(pPalette->Entries[k]), labs[k]);
+		}
+		stable_sort(sortedpos.get(), sortedpos.get() + nMaxColors, [&labs](const unsigned short a, const unsigned short b) {
+			return labs[a].L < labs[b].L;
+		});
+
+		int l = 0;
+		for (UINT k = 0; k < nMaxColors; ++k) {
+			sortedlab[k] = labs[sortedpos[k]];
+			for (; l <= 100 && l <= sortedlab[k].L; ++l)
+				netindex[l] = k;
+		}
+		for (; l <= 100; ++l)
+			netindex[l] = nMaxColors;
+	}
+
+	/* Search for the palette entry with the smallest alpha + Lab distance, moving both ways from netindex on L.
+	* The L difference alone bounds the distance, so each direction stops once it exceeds the best so far.
+	* Ties go to the highest palette index, as the full scan does. Semi-transparent images keep the full scan,
+	* whose alpha check before scaling makes its result depend on the scan order. */
+	unsigned short Inxsearch(const ARGB* pPalette, const unsigned short nMaxColors, const Color& c, const CIELABConvertor::Lab& lab1)
+	{
+		unsigned short k = 0;
+		double mindist = INT_MAX;
+
+		auto test = [&](const int pos) {
+			auto i = sortedpos[pos];
+			Color c2(pPalette[i]);
+			double curdist = sqr(c2.GetA() - c.GetA());
+			if (curdist > mindist)
+				return;
+
+			auto& lab2 = sortedlab[pos];
+			curdist += abs(lab2.L - lab1.L);
+			if (curdist > mindist)
+				return;
+
+			curdist += _sqrt(sqr(lab2.A - lab1.A) + sqr(lab2.B - lab1.B));
+			if (curdist > mindist || (curdist == mindist && i < k))
+				return;
+
+			mindist = curdist;
+			k = i;
+		};
+
+		int i = netindex[min(max((int) lab1.L, 0), 100)];
+		int j = i - 1;
+		while (i < nMaxColors || j >= 0) {
+			if (i < nMaxColors) {
+				if (sortedlab[i].L - lab1.L > mindist)
+					i = nMaxColors;
+				else
+					test(i++);
+			}
+			if (j >= 0) {
+				if (lab1.L - sortedlab[j].L > mindist)
+					j = -1;
+				else
+					test(j--);
+			}
+		}
+		return k;
 	}
 
 	unsigned short nearestColorIndex(const ARGB* pPalette, const unsigned short nMaxColors, ARGB argb, const UINT pos)
@@ -448,6 +630,12 @@ namespace NeuralNet
 		CIELABConvertor::Lab lab1, lab2;
 		getLab(c, lab1);
 
+		if (nMaxColors > 32 && !hasSemiTransparency) {
+			k = Inxsearch(pPalette, nMaxColors, c, lab1);
+			nearestMap[argb] = k;
+			return k;
+		}
+
 		for (UINT i = 0; i < nMaxColors; ++i) {
 			Color c2(pPalette[i]);
 			double curdist = sqr(c2.GetA() - c.GetA());
@@ -527,16 +715,27 @@ namespace NeuralNet
 	}
 
 	void Clear() {
-		network.reset();
+		network.al.reset();
+		network.L.reset();
+		network.A.reset();
+		network.B.reset();
 		netindex.reset();
+		sortedpos.reset();
+		sortedlab.reset();
 		bias.reset();
 		freq.reset();
 		radpower.reset();
+		learning_rates.reset();
 
 		pixelMap.clear();
 		nearestMap.clear();
 	}
 
+	void NeuQuantizer::setBatchSize(UINT batchSize)
+	{
+		m_batchSize = batchSize;
+	}
+
 	// The work horse for NeuralNet color quantizing.
 	bool NeuQuantizer::QuantizeImage(Bitmap* pSource, Bitmap* pDest, UINT& nMaxColors, bool dither)
 	{
@@ -558,7 +757,7 @@ namespace NeuralNet
 			initradius = initrad * 1.0;
 
 			SetUpArrays();
-			Learn(dither ? 5 : 1, pixels);
+			Learn(dither ? 5 : 1, pixels, m_batchSize);
 			Inxbuild(pPalette);
 
 			if (nMaxColors > 256) {
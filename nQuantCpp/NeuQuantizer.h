@@ -21,7 +21,12 @@ namespace NeuralNet
 
 	class NeuQuantizer
 	{
+		private:
+			UINT m_batchSize = 0;
+
 		public:
+			// Trade quality for speed: above 1, winners are searched in parallel for this many samples at a time, e.g. 64
+			void setBatchSize(UINT batchSize);
 			bool QuantizeImage(Bitmap* pSource, Bitmap *pDest, UINT& nMaxColors, bool dither = true);
 	};
 }
\ No newline at end of file
@@ -8,8 +8,14 @@
 #include "GilbertCurve.h"
 #define _USE_MATH_DEFINES
 #include <math.h>
+#include <memory>
 #include <unordered_map>
 
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define OTSU_SSE2
+#endif
+
 namespace OtsuThreshold
 {
 	BYTE alphaThreshold = 0xF;
@@ -18,25 +24,9 @@ namespace OtsuThreshold
 	ARGB m_transparentColor = Color::Transparent;
 	unordered_map<ARGB, unsigned short > nearestMap;
 
-	// function is used to compute the q values in the equation
-	static float px(int init, int end, int* hist)
-	{
-		int sum = 0;
-		for (int i = init; i <= end; ++i)
-			sum += hist[i];
-
-		return (float) sum;
-	}
-
-	// function is used to compute the mean values in the equation (mu)
-	static float mx(int init, int end, int* hist)
-	{
-		int sum = 0;
-		for (int i = init; i <= end; ++i)
-			sum += i * hist[i];
-
-		return (float) sum;
-	}
+	const UINT MIN_TILE_SIZE = 16;
+	// tiles whose two classes are closer than this in grey level are treated as flat paper or flat ink
+	const float MIN_TILE_CONTRAST = 32.0f;
 
 	// finds the maximum element in a vector
 	static short findMax(float* vec, int n)
@@ -53,39 +43,69 @@ namespace OtsuThreshold
 		return idx;
 	}
 
-	// simply computes the image histogram
+	// simply computes the image histogram, one partial histogram per thread
 	void getHistogram(const vector<ARGB>& pixels, int* hist)
 	{
-		for (auto pixel : pixels) {
-			Color c(pixel);
-			if (c.GetA() <= alphaThreshold)
-				continue;
+		const int length = static_cast<int>(pixels.size());
+		#pragma omp parallel
+		{
+			int localHist[256] = { 0 };
+			#pragma omp for nowait
+			for (int i = 0; i < length; ++i) {
+				Color c(pixels[i]);
+				if (c.GetA() <= alphaThreshold)
+					continue;
 
-			hist[c.GetR()]++;
-			hist[c.GetG()]++;
-			hist[c.GetB()]++;
+				localHist[c.GetR()]++;
+				localHist[c.GetG()]++;
+				localHist[c.GetB()]++;
+			}
+
+			#pragma omp critical
+			for (int k = 0; k < 256; ++k)
+				hist[k] += localHist[k];
 		}
 	}
 		
-	short getOtsuThreshold(const vector<ARGB>& pixels)
+	// maximizes the between class variance of a histogram, optionally giving the distance between the means of the two classes
+	short getOtsuThreshold(const int* hist, float* meanGap = nullptr)
 	{
 		float vet[256] = { 0 };
-		int hist[256] = { 0 };
-		
-		getHistogram(pixels, hist);
+
+		// prefix sums of the q values (px) and of the mean values (mx) in the equation
+		long long px[256], mx[256];
+		long long q = 0, mu = 0;
+		for (int i = 0; i <= BYTE_MAX; ++i) {
+			q += hist[i];
+			mu += (long long) i * hist[i];
+			px[i] = q;
+			mx[i] = mu;
+		}
 
 		// loop through all possible t values and maximize between class variance
 		for (int k = 1; k != BYTE_MAX; ++k) {
-			float p1 = px(0, k, hist);
-			float p2 = px(k + 1, BYTE_MAX, hist);
+			float p1 = (float) px[k];
+			float p2 = (float) (px[BYTE_MAX] - px[k]);
 			float p12 = p1 * p2;
 			if (p12 == 0) 
 				p12 = 1;
-			float diff = (mx(0, k, hist) * p2) - (mx(k + 1, BYTE_MAX, hist) * p1);
+			float diff = ((float) mx[k] * p2) - ((float) (mx[BYTE_MAX] - mx[k]) * p1);
 			vet[k] = diff * diff / p12;
 		}
 
-		return findMax(vet, 256);
+		auto thresh = findMax(vet, 256);
+		if (meanGap) {
+			const auto lowCount = px[thresh], highCount = px[BYTE_MAX] - px[thresh];
+			*meanGap = (lowCount > 0 && highCount > 0) ? (float) (mx[BYTE_MAX] - mx[thresh]) / highCount - (float) mx[thresh] / lowCount : 0.0f;
+		}
+		return thresh;
+	}
+
+	short getOtsuThreshold(const vector<ARGB>& pixels)
+	{
+		int hist[256] = { 0 };
+		getHistogram(pixels, hist);
+		return getOtsuThreshold(hist);
 	}
 	
 	void threshold(const vector<ARGB>& pixels, vector<ARGB>& dest, short thresh, float weight = 1.0f)
@@ -100,7 +120,9 @@ namespace OtsuThreshold
 
 		auto minThresh = (BYTE)(thresh * (m_transparentPixelIndex >= 0 ? .9f : weight));
 		const auto shadow = m_transparentPixelIndex >= 0 ? 3.5 : 3;
-		for (int i = 0; i < pixels.size(); ++i) {
+		const int length = static_cast<int>(pixels.size());
+		#pragma omp parallel for
+		for (int i = 0; i < length; ++i) {
 			Color c(pixels[i]);
 			if (c.GetA() < alphaThreshold && c.GetR() + c.GetG() + c.GetB() > maxThresh * 3)
 				dest[i] = Color::MakeARGB(c.GetA(), BYTE_MAX, BYTE_MAX, BYTE_MAX);
@@ -109,102 +131,153 @@ namespace OtsuThreshold
 		}
 	}
 
+	// 45 degree sector of the gradient direction, the same as (int) (180 + atan2(gy, gx) in degrees) / 45
+	// for the integer gradients of 8-bit pixels, without calling atan2
+	static inline int gradientSector(const int gx, const int gy)
+	{
+		if (gy >= 0) {
+			if (gx > 0)
+				return gy < gx ? 4 : 5;
+			if (gx == 0)
+				return gy == 0 ? 4 : 6;
+			if (gy == 0)
+				return 8;
+			return gy > -gx ? 6 : 7;
+		}
+		if (gx >= 0)
+			return -gy > gx ? 2 : 3;
+		return -gy >= -gx ? 1 : 0;
+	}
+
+	static inline void sobel(const short* green, const int width, const int center, int& gxValue, int& gyValue)
+	{
+		const auto above = green + center - width, row = green + center, below = green + center + width;
+		gxValue = (above[-1] - above[1]) + 2 * (row[-1] - row[1]) + (below[-1] - below[1]);
+		gyValue = (above[-1] + 2 * above[0] + above[1]) - (below[-1] + 2 * below[0] + below[1]);
+	}
+
+	static inline int rawTheta(const short* green, const int width, const int center)
+	{
+		int gxValue, gyValue;
+		sobel(green, width, center, gxValue, gyValue);
+		auto atanResult = atan2((double) gyValue, (double) gxValue) * 180.0 / M_PI;
+		return (int)(180.0 + atanResult);
+	}
+
 	vector<ARGB> cannyFilter(const UINT width, const vector<ARGB>& pixelsGray, double lowerThreshold, double higherThreshold) {
-		const auto height = pixelsGray.size() / width;
+		const int w = static_cast<int>(width);
+		const int height = static_cast<int>(pixelsGray.size() / width);
 		const auto area = (size_t)(width * height);
 
 		vector<ARGB> pixelsCanny(area, Color::White);
 
-		int gx[3][3] = {{-1, 0, 1}, {-2, 0, 2}, {-1, 0, 1}};
-		int gy[3][3] = {{-1, -2, -1}, {0, 0, 0}, {1, 2, 1}};
+		auto green = make_unique<short[]>(area);
+		const int length = static_cast<int>(area);
+		#pragma omp parallel for
+		for (int i = 0; i < length; ++i)
+			green[i] = (pixelsGray[i] >> 8) & 0xff;
+
 		auto G = make_unique<double[]>(area);
 		vector<int> theta(area);
 		auto largestG = 0.0;
 
-		// perform canny edge detection on everything but the edges
-		for (int i = 1; i < height - 1; ++i) {
-			for (int j = 1; j < width - 1; ++j) {
-				// find gx and gy for each pixel
-				auto gxValue = 0.0;
-				auto gyValue = 0.0;
-				for (int x = -1; x <= 1; ++x) {
-					for (int y = -1; y <= 1; ++y) {
-						const Color c = pixelsGray[(i + x) * width +  j + y];
-						gxValue += gx[1 - x][1 - y] * c.GetG();
-						gyValue += gy[1 - x][1 - y] * c.GetG();
-					}
-				}
-
-				const int center = i * width + j;
-				// calculate G and theta
-				G[center] = sqrt(pow(gxValue, 2) + pow(gyValue, 2));
-				auto atanResult = atan2(gyValue, gxValue) * 180.0 / M_PI;
-				theta[center] = (int)(180.0 + atanResult);
-
-				if (G[center] > largestG)
-					largestG = G[center];
+		// perform canny edge detection on everything but the edges, with integer Sobel gradients
+		#pragma omp parallel
+		{
+			auto localLargestG = 0.0;
+			int gxs[8], gys[8], magnitudes[8];
 
-				// setting the edges
-				if (i == 1) {
-					G[center - 1] = G[center];
-					theta[center - 1] = theta[center];
-				}
-				else if (j == 1) {
-					G[center - width] = G[center];
-					theta[center - width] = theta[center];
-				}
-				else if (i == height - 1) {
-					G[center + 1] = G[center];
-					theta[center + 1] = theta[center];
+			#pragma omp for nowait
+			for (int i = 1; i < height - 1; ++i) {
+				int j = 1;
+#ifdef OTSU_SSE2
+				const auto above = green.get() + (i - 1) * w, row = green.get() + i * w, below = green.get() + (i + 1) * w;
+				for (; j + 8 <= w - 1; j += 8) {
+					const auto a0 = _mm_loadu_si128((const __m128i*) (above + j - 1));
+					const auto a1 = _mm_loadu_si128((const __m128i*) (above + j));
+					const auto a2 = _mm_loadu_si128((const __m128i*) (above + j + 1));
+					const auto r0 = _mm_loadu_si128((const __m128i*) (row + j - 1));
+					const auto r2 = _mm_loadu_si128((const __m128i*) (row + j + 1));
+					const auto b0 = _mm_loadu_si128((const __m128i*) (below + j - 1));
+					const auto b1 = _mm_loadu_si128((const __m128i*) (below + j));
+					const auto b2 = _mm_loadu_si128((const __m128i*) (below + j + 1));
+
+					const auto r02 = _mm_sub_epi16(r0, r2);
+					const auto gx = _mm_add_epi16(_mm_add_epi16(_mm_sub_epi16(a0, a2), _mm_sub_epi16(b0, b2)), _mm_add_epi16(r02, r02));
+					const auto gy = _mm_sub_epi16(_mm_add_epi16(_mm_add_epi16(a0, a2), _mm_add_epi16(a1, a1)),
+						_mm_add_epi16(_mm_add_epi16(b0, b2), _mm_add_epi16(b1, b1)));
+					// gx * gx + gy * gy in 32-bit lanes
+					const auto lo = _mm_unpacklo_epi16(gx, gy), hi = _mm_unpackhi_epi16(gx, gy);
+					_mm_storeu_si128((__m128i*) magnitudes, _mm_madd_epi16(lo, lo));
+					_mm_storeu_si128((__m128i*) (magnitudes + 4), _mm_madd_epi16(hi, hi));
+					_mm_storeu_si128((__m128i*) gxs, _mm_srai_epi32(_mm_unpacklo_epi16(gx, gx), 16));
+					_mm_storeu_si128((__m128i*) (gxs + 4), _mm_srai_epi32(_mm_unpackhi_epi16(gx, gx), 16));
+					_mm_storeu_si128((__m128i*) gys, _mm_srai_epi32(_mm_unpacklo_epi16(gy, gy), 16));
+					_mm_storeu_si128((__m128i*) (gys + 4), _mm_srai_epi32(_mm_unpackhi_epi16(gy, gy), 16));
+
+					for (int k = 0; k < 8; ++k) {
+						const int center = i * w + j + k;
+						G[center] = sqrt((double) magnitudes[k]);
+						theta[center] = gradientSector(gxs[k], gys[k]) * 45;
+						if (G[center] > localLargestG)
+							localLargestG = G[center];
+					}
 				}
-				else if (j == width - 1) {
-					G[center + width] = G[center];
-					theta[center + width] = theta[center];
+#endif
+				for (; j < w - 1; ++j) {
+					const int center = i * w + j;
+					int gxValue, gyValue;
+					sobel(green.get(), w, center, gxValue, gyValue);
+					G[center] = sqrt((double) (gxValue * gxValue + gyValue * gyValue));
+					theta[center] = gradientSector(gxValue, gyValue) * 45;
+					if (G[center] > localLargestG)
+						localLargestG = G[center];
 				}
+			}
 
-				// setting the corners
-				if (i == 1 && j == 1) {
-					G[center - width - 1] = G[center];
-					theta[center - width - 1] = theta[center];
-				}
-				else if (i == 1 && j == width - 1) {
-					G[center - width + 1] = G[center];
-					theta[center - width + 1] = theta[center];
-				}
-				else if (i == height - 1 && j == 1) {
-					G[center + width - 1] = G[center];
-					theta[center + width - 1] = theta[center];
-				}
-				else if (i == height - 1 && j == width - 1) {
-					G[center + width + 1] = G[center];
-					theta[center + width + 1] = theta[center];
-				}
+			#pragma omp critical
+			if (localLargestG > largestG)
+				largestG = localLargestG;
+		}
 
-				// to the nearest 45 degrees
-				theta[center] = rint(theta[center] / 45) * 45;
+		if (height > 2 && w > 2) {
+			// setting the edges: pixels of row 1 hand their magnitude and unrounded angle to their left neighbour,
+			// pixels of column 1 below row 1 to the pixel above, in the order of a raster scan.
+			// The corner takes pixel (1, 1) before row 1 shifts it left.
+			G[0] = G[w + 1];
+			theta[0] = rawTheta(green.get(), w, w + 1);
+			for (int j = 1; j < w - 1; ++j) {
+				const int center = w + j;
+				G[center - 1] = G[center];
+				theta[center - 1] = rawTheta(green.get(), w, center);
+			}
+			for (int i = 2; i < height - 1; ++i) {
+				const int center = i * w + 1;
+				G[center - w] = G[center];
+				theta[center - w] = rawTheta(green.get(), w, center);
 			}
 		}
 
 		largestG *= .5;
 
-		// non-maximum suppression
+		// non-maximum suppression, in place and in raster order
 		for (int i = 1; i < height - 1; ++i) {
-			for (int j = 1; j < width - 1; ++j) {
-				const int center = i * width + j;
+			for (int j = 1; j < w - 1; ++j) {
+				const int center = i * w + j;
 				if (theta[center] == 0 || theta[center] == 180) {
 					if (G[center] < G[center - 1] || G[center] < G[center + 1])
 						G[center] = 0;
 				}
 				else if (theta[center] == 45 || theta[center] == 225) {
-					if (G[center] < G[center + width + 1] || G[center] < G[center - width - 1])
+					if (G[center] < G[center + w + 1] || G[center] < G[center - w - 1])
 						G[center] = 0;
 				}
 				else if (theta[center] == 90 || theta[center] == 270) {
-					if (G[center] < G[center + width] || G[center] < G[center - width])
+					if (G[center] < G[center + w] || G[center] < G[center - w])
 						G[center] = 0;
 				}
 				else {
-					if (G[center] < G[center + width - 1] || G[center] < G[center - width + 1])
+					if (G[center] < G[center + w - 1] || G[center] < G[center - w + 1])
 						G[center] = 0;
 				}
 
@@ -214,41 +287,155 @@ namespace OtsuThreshold
 			}
 		}
 
-		int k = 0;
+		// hysteresis: one pass either promotes or clears every weak pixel,
+		// so a further pass would find nothing left to change
 		auto minThreshold = lowerThreshold * largestG, maxThreshold = higherThreshold * largestG;
-		do {
-			for (int i = 1; i < height - 1; ++i) {
-				for (int j = 1; j < width - 1; ++j) {
-					const int center = i * width + j;
-					if (G[center] < minThreshold)
-						G[center] = 0;
-					else if (G[center] >= maxThreshold)
-						continue;
-					else if (G[center] < maxThreshold) {
-						G[center] = 0;
-						for (int x = -1; x <= 1; ++x) {
-							for (int y = -1; y <= 1; y++) {
-								if (x == 0 && y == 0)
-									continue;
-								if (G[center + x * width + y] >= maxThreshold) {
-									G[center] = higherThreshold * largestG;
-									k = 0;
-									x = 2;
-									break;
-								}
+		for (int i = 1; i < height - 1; ++i) {
+			for (int j = 1; j < w - 1; ++j) {
+				const int center = i * w + j;
+				if (G[center] < minThreshold)
+					G[center] = 0;
+				else if (G[center] >= maxThreshold)
+					continue;
+				else if (G[center] < maxThreshold) {
+					G[center] = 0;
+					for (int x = -1; x <= 1; ++x) {
+						for (int y = -1; y <= 1; y++) {
+							if (x == 0 && y == 0)
+								continue;
+							if (G[center + x * w + y] >= maxThreshold) {
+								G[center] = higherThreshold * largestG;
+								x = 2;
+								break;
 							}
 						}
 					}
-					
-					auto grey = ~(BYTE)(G[center] * 255.0 / largestG);
-					Color c(pixelsGray[center]);
-					pixelsCanny[center] = Color::MakeARGB(c.GetA(), grey, grey, grey);
 				}
+
+				auto grey = ~(BYTE)(G[center] * 255.0 / largestG);
+				Color c(pixelsGray[center]);
+				pixelsCanny[center] = Color::MakeARGB(c.GetA(), grey, grey, grey);
 			}
-		} while (k++ < 100);
+		}
 		return pixelsCanny;
 	}
 
+	// binarizes grey pixels in one pass against thresholds interpolated bilinearly between the centres of tileSize x tileSize tiles,
+	// tiles without enough contrast of their own borrow the thresholds of their neighbours
+	void thresholdTiles(const UINT width, const vector<ARGB>& pixelsGray, const UINT tileSize,
+		const unsigned short blackIndex, const unsigned short whiteIndex, unsigned short* qPixels)
+	{
+		const int w = static_cast<int>(width);
+		const int h = static_cast<int>(pixelsGray.size() / width);
+		const int ts = static_cast<int>(tileSize);
+		const int tilesX = (w + ts - 1) / ts, tilesY = (h + ts - 1) / ts;
+		const int nTiles = tilesX * tilesY;
+
+		// grey histogram of every tile, each row of tiles is counted by one thread
+		vector<int> tileHists((size_t) nTiles * 256, 0);
+		#pragma omp parallel for
+		for (int ty = 0; ty < tilesY; ++ty) {
+			const int yEnd = min(h, (ty + 1) * ts);
+			for (int y = ty * ts; y < yEnd; ++y) {
+				auto pRow = pixelsGray.data() + (size_t) y * width;
+				for (int tx = 0; tx < tilesX; ++tx) {
+					auto pHist = tileHists.data() + (size_t) (ty * tilesX + tx) * 256;
+					const int xEnd = min(w, (tx + 1) * ts);
+					for (int x = tx * ts; x < xEnd; ++x) {
+						if (((pRow[x] >> 24) & 0xff) <= alphaThreshold)
+							continue;
+						pHist[(pRow[x] >> 8) & 0xff]++;
+					}
+				}
+			}
+		}
+
+		vector<float> thresholds(nTiles);
+		vector<BYTE> known(nTiles);
+		int nKnown = 0;
+		#pragma omp parallel for reduction(+:nKnown)
+		for (int k = 0; k < nTiles; ++k) {
+			float meanGap;
+			thresholds[k] = getOtsuThreshold(tileHists.data() + (size_t) k * 256, &meanGap);
+			known[k] = meanGap >= MIN_TILE_CONTRAST;
+			if (known[k])
+				++nKnown;
+		}
+
+		if (nKnown == 0) {
+			// nothing stands out anywhere, so every tile shares the threshold of the whole image
+			int hist[256] = { 0 };
+			for (int k = 0; k < nTiles; ++k) {
+				auto pHist = tileHists.data() + (size_t) k * 256;
+				for (int i = 0; i < 256; ++i)
+					hist[i] += pHist[i];
+			}
+			fill(thresholds.begin(), thresholds.end(), (float) getOtsuThreshold(hist));
+		}
+		else {
+			// flat paper or flat ink: grow the known thresholds outwards, one ring of tiles at a time
+			while (nKnown < nTiles) {
+				auto grown = known;
+				for (int ty = 0; ty < tilesY; ++ty) {
+					for (int tx = 0; tx < tilesX; ++tx) {
+						const int k = ty * tilesX + tx;
+						if (known[k])
+							continue;
+
+						float sum = 0;
+						int count = 0;
+						if (tx > 0 && known[k - 1]) { sum += thresholds[k - 1]; ++count; }
+						if (tx < tilesX - 1 && known[k + 1]) { sum += thresholds[k + 1]; ++count; }
+						if (ty > 0 && known[k - tilesX]) { sum += thresholds[k - tilesX]; ++count; }
+						if (ty < tilesY - 1 && known[k + tilesX]) { sum += thresholds[k + tilesX]; ++count; }
+						if (count > 0) {
+							thresholds[k] = sum / count;
+							grown[k] = 1;
+							++nKnown;
+						}
+					}
+				}
+				known.swap(grown);
+			}
+		}
+
+		// the two tile columns around every pixel column and the weight of the right one
+		vector<int> x0s(w), x1s(w);
+		vector<float> wxs(w);
+		for (int x = 0; x < w; ++x) {
+			const auto fx = min(max((x + .5f) / ts - .5f, 0.0f), (float) (tilesX - 1));
+			x0s[x] = (int) fx;
+			x1s[x] = min(x0s[x] + 1, tilesX - 1);
+			wxs[x] = fx - x0s[x];
+		}
+
+		#pragma omp parallel
+		{
+			vector<float> rowThresholds(tilesX);
+
+			#pragma omp for
+			for (int y = 0; y < h; ++y) {
+				const auto fy = min(max((y + .5f) / ts - .5f, 0.0f), (float) (tilesY - 1));
+				const int y0 = (int) fy, y1 = min(y0 + 1, tilesY - 1);
+				const auto wy = fy - y0;
+				for (int tx = 0; tx < tilesX; ++tx)
+					rowThresholds[tx] = thresholds[y0 * tilesX + tx] * (1 - wy) + thresholds[y1 * tilesX + tx] * wy;
+
+				const auto offset = (size_t) y * width;
+				auto pRow = pixelsGray.data() + offset;
+				for (int x = 0; x < w; ++x) {
+					if (((pRow[x] >> 24) & 0xff) <= alphaThreshold) {
+						qPixels[offset + x] = whiteIndex;
+						continue;
+					}
+
+					const auto thresh = rowThresholds[x0s[x]] * (1 - wxs[x]) + rowThresholds[x1s[x]] * wxs[x];
+					qPixels[offset + x] = ((pRow[x] >> 8) & 0xff) <= thresh ? blackIndex : whiteIndex;
+				}
+			}
+		}
+	}
+
 	unsigned short nearestColorIndex(const ARGB* pPalette, const UINT nMaxColors, const ARGB argb, const UINT pos)
 	{
 		auto got = nearestMap.find(argb);
@@ -293,31 +480,50 @@ namespace OtsuThreshold
 
 	void convertToGrayScale(const vector<ARGB>& pixels, vector<ARGB>& dest)
 	{
-		float min1 = BYTE_MAX;
-		float max1 = .0f;
+		int minGreen = BYTE_MAX;
+		int maxGreen = 0;
+		const int length = static_cast<int>(pixels.size());
 
-		for (const auto& pixel : pixels)
+		#pragma omp parallel
 		{
-			int alfa = (pixel >> 24) & 0xff;
-			if (alfa <= alphaThreshold)
-				continue;
+			int localMin = BYTE_MAX, localMax = 0;
+			#pragma omp for nowait
+			for (int i = 0; i < length; ++i)
+			{
+				int alfa = (pixels[i] >> 24) & 0xff;
+				if (alfa <= alphaThreshold)
+					continue;
+
+				int green = (pixels[i] >> 8) & 0xff;
+				if (localMin > green)
+					localMin = green;
 
-			int green = (pixel >> 8) & 0xff;
-			if (min1 > green)
-				min1 = green;
+				if (localMax < green)
+					localMax = green;
+			}
 
-			if (max1 < green)
-				max1 = green;
+			#pragma omp critical
+			{
+				minGreen = min(minGreen, localMin);
+				maxGreen = max(maxGreen, localMax);
+			}
 		}
 
-		for (int i = 0; i < pixels.size(); ++i)
+		// the stretched grey only depends on the green level
+		float min1 = minGreen;
+		float max1 = maxGreen;
+		int greys[256];
+		for (int green = 0; green <= BYTE_MAX; ++green)
+			greys[green] = (int)((green - min1) * (BYTE_MAX / (max1 - min1)));
+
+		#pragma omp parallel for
+		for (int i = 0; i < length; ++i)
 		{
 			int alfa = (pixels[i] >> 24) & 0xff;
 			if (alfa <= alphaThreshold)
 				continue;
 
-			int green = (pixels[i] >> 8) & 0xff;
-			auto grey = (int)((green - min1) * (BYTE_MAX / (max1 - min1)));
+			auto grey = greys[(pixels[i] >> 8) & 0xff];
 			dest[i] = Color::MakeARGB(alfa, grey, grey, grey);
 		}
 	}
@@ -385,6 +591,11 @@ namespace OtsuThreshold
 	}
 
 
+	void Otsu::setTileSize(UINT tileSize)
+	{
+		m_tileSize = tileSize > 0 ? max(tileSize, MIN_TILE_SIZE) : 0;
+	}
+
 	bool Otsu::ConvertGrayScaleToBinary(Bitmap* pSrcImg, Bitmap* pDest, bool isGrayscale)
 	{		
 		const auto bitmapWidth = pSrcImg->GetWidth();
@@ -398,11 +609,6 @@ namespace OtsuThreshold
 		if (!isGrayscale)
 			convertToGrayScale(pixels, pixelsGray);
 
-		auto otsuThreshold = getOtsuThreshold(pixelsGray);
-		auto lowerThreshold = 0.03, higherThreshold = 0.1;
-		pixels = cannyFilter(bitmapWidth, pixelsGray, lowerThreshold, higherThreshold);
-		threshold(pixelsGray, pixels, otsuThreshold);
-
 		auto pPaletteBytes = make_unique<BYTE[]>(sizeof(ColorPalette) + 2 * sizeof(ARGB));
 		auto pPalette = (ColorPalette*)pPaletteBytes.get();
 		pPalette->Count = 2;
@@ -416,7 +622,18 @@ namespace OtsuThreshold
 		}
 
 		auto qPixels = make_unique<unsigned short[]>(pixels.size());
-		Peano::GilbertCurve::dither(bitmapWidth, bitmapHeight, pixels.data(), pPalette->Entries, pPalette->Count, nearestColorIndex, GetColorIndex, qPixels.get(), nullptr, 3.0f);
+		if (m_tileSize > 0) {
+			// the transparent color takes the place of white
+			const unsigned short blackIndex = m_transparentPixelIndex >= 0 ? 1 : 0;
+			thresholdTiles(bitmapWidth, pixelsGray, m_tileSize, blackIndex, 1 - blackIndex, qPixels.get());
+		}
+		else {
+			auto otsuThreshold = getOtsuThreshold(pixelsGray);
+			auto lowerThreshold = 0.03, higherThreshold = 0.1;
+			pixels = cannyFilter(bitmapWidth, pixelsGray, lowerThreshold, higherThreshold);
+			threshold(pixelsGray, pixels, otsuThreshold);
+			Peano::GilbertCurve::dither(bitmapWidth, bitmapHeight, pixels.data(), pPalette->Entries, pPalette->Count, nearestColorIndex, GetColorIndex, qPixels.get(), nullptr, 3.0f);
+		}
 		if (m_transparentPixelIndex >= 0)
 		{
 			auto k = qPixels[m_transparentPixelIndex];
@@ -21,8 +21,13 @@ namespace OtsuThreshold
 
 	class Otsu
 	{
+		private:
+			UINT m_tileSize = 0;
+
 		public:
 			static Bitmap* ConvertToGrayScale(Bitmap* pSrcImg);
+			// Threshold tiles of this many pixels square against their own histograms, interpolated between tile centres; 0 keeps one global threshold
+			void setTileSize(UINT tileSize);
 			bool ConvertGrayScaleToBinary(Bitmap* pSrcImg, Bitmap* pDest, bool isGrayscale = false);
 	};
 }
\ No newline at end of file
@@ -37,16 +37,18 @@ namespace PnnLABQuant
 
 		clear();
 		_nMaxColors = nMaxColors;
-		m_pixelsList.clear();
 
 		bool hasSemiTransparency = false;
+		vector<vector<ARGB> > pixelsList;
 		for(auto& pSource : pSources) {
 			_bitmapWidths.emplace_back(pSource->GetWidth());
 			const auto area = (size_t) (pSource->GetWidth() * pSource->GetHeight());
 			vector<ARGB> pixels(area);
 			m_pq->grabPixels(pSource.get(), pixels, _nMaxColors, hasSemiTransparency);
-			m_pixelsList.emplace_back(pixels);
+			pixelsList.emplace_back(move(pixels));
 		}
+		m_pixelsList = make_shared<const vector<vector<ARGB> > >(move(pixelsList));
+		m_pq->shareLabCache(*m_pixelsList);
 		minRatio = (hasSemiTransparency || nMaxColors < 64) ? .0111 : .85;
 		maxRatio = min(1.0, nMaxColors / ((nMaxColors < 64) ? 400.0 : 50.0));
 		if (nMaxColors < 16)
@@ -55,13 +57,18 @@ namespace PnnLABQuant
 	}
 
 	PnnLABGAQuantizer::PnnLABGAQuantizer(PnnLABQuantizer& pq, const vector<vector<ARGB> >& pixelsList, const vector<UINT>& bitmapWidths, UINT nMaxColors)
+		: PnnLABGAQuantizer(pq, make_shared<const vector<vector<ARGB> > >(pixelsList), bitmapWidths, nMaxColors)
+	{
+	}
+
+	PnnLABGAQuantizer::PnnLABGAQuantizer(PnnLABQuantizer& pq, const shared_ptr<const vector<vector<ARGB> > >& pPixelsList, const vector<UINT>& bitmapWidths, UINT nMaxColors)
 	{
 		m_pq = make_unique<PnnLABQuantizer>(pq);
 		// increment value when criteria violation occurs
 		_objectives.resize(4);
-		m_pixelsList = pixelsList;
+		m_pixelsList = pPixelsList;
 		_bitmapWidths = bitmapWidths;
-		srand(m_pixelsList[0].size());
+		srand((*m_pixelsList)[0].size());
 		_nMaxColors = nMaxColors;
 	}
 
@@ -92,7 +99,7 @@ namespace PnnLABQuant
 			maxError = 1;
 
 		auto fitness = 0.0;
-		int length = accumulate(begin(m_pixelsList), end(m_pixelsList), 0, [](int i, const vector<ARGB>& pixels){
+		int length = accumulate(begin(*m_pixelsList), end(*m_pixelsList), 0, [](int i, const vector<ARGB>& pixels){
 			return pixels.size() + i;
 		});
 		for (int i = 0; i < errors.size(); ++i)
@@ -123,13 +130,13 @@ namespace PnnLABQuant
 		auto pPaletteBytes = make_unique<BYTE[]>(sizeof(ColorPalette) + _nMaxColors * sizeof(ARGB));
 		auto pPalette = (ColorPalette*)pPaletteBytes.get();
 		pPalette->Count = _nMaxColors;
-		m_pq->pnnquan(m_pixelsList[0], pPalette->Entries, _nMaxColors);
+		m_pq->pnnquan((*m_pixelsList)[0], pPalette->Entries, _nMaxColors);
 
 		auto errors = _objectives;
 		fill(errors.begin(), errors.end(), 0);
 
 		int threshold = maxRatio < .1 ? -64 : -112;
-		for (auto& pixels : m_pixelsList) {
+		for (auto& pixels : *m_pixelsList) {
 			for (int i = 0; i < pixels.size(); ++i)
 			{
 				if (BlueNoise::TELL_BLUE_NOISE[i & 4095] > threshold)
@@ -157,6 +164,8 @@ namespace PnnLABQuant
 		}
 		
 		calculateError(errors);
+		// release the per-pixel buffers of this evaluation, they are rebuilt by QuantizeImage
+		m_pq->clear();
 		lock_guard<mutex> lock(_mutex);
 		_fitnessMap.insert({ ratioKey, _objectives });
 	}
@@ -166,9 +175,9 @@ namespace PnnLABQuant
 		if (_nMaxColors > 256) {
 			auto pPalettes = make_unique<ARGB[]>(_nMaxColors);
 			auto pPalette = pPalettes.get();
-			m_pq->pnnquan(m_pixelsList[0], pPalette, _nMaxColors);
+			m_pq->pnnquan((*m_pixelsList)[0], pPalette, _nMaxColors);
 			int i = 0;
-			for (auto& pixels : m_pixelsList) {
+			for (auto& pixels : *m_pixelsList) {
 				m_pq->QuantizeImageByPal(pixels, _bitmapWidths[i], pPalette, pBitmaps[i].get(), _nMaxColors, dither);
 				++i;
 			}
@@ -179,10 +188,10 @@ namespace PnnLABQuant
 		auto pPaletteBytes = make_unique<BYTE[]>(sizeof(ColorPalette) + _nMaxColors * sizeof(ARGB));
 		auto pPalette = (ColorPalette*)pPaletteBytes.get();
 		pPalette->Count = _nMaxColors;
-		m_pq->pnnquan(m_pixelsList[0], pPalette->Entries, _nMaxColors);
+		m_pq->pnnquan((*m_pixelsList)[0], pPalette->Entries, _nMaxColors);
 
 		int i = 0;
-		for(auto& pixels : m_pixelsList) {
+		for(auto& pixels : *m_pixelsList) {
 			m_pq->QuantizeImage(pixels, _bitmapWidths[i], pPalette->Entries, pBitmaps[i].get(), _nMaxColors, dither);
 			pBitmaps[i++]->SetPalette((ColorPalette*) pPalette);
 		}
@@ -192,7 +201,7 @@ namespace PnnLABQuant
 
 	void PnnLABGAQuantizer::clear() {
 		lock_guard<mutex> lock(_mutex);
-		m_pixelsList.clear();
+		m_pixelsList.reset();
 		_fitnessMap.clear();
 	}
 
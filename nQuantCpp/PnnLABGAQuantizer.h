@@ -32,7 +32,8 @@ namespace PnnLABQuant
 		double _ratioX = 0, _ratioY = 0;
 		vector<double> _convertedObjectives;
 		vector<double> _objectives;
-		vector<vector<ARGB> > m_pixelsList;
+		// Pixels of all frames, shared read-only by every chromosome of the population
+		shared_ptr<const vector<vector<ARGB> > > m_pixelsList;
 		unique_ptr<PnnLABQuantizer> m_pq;
 
 		void calculateError(vector<double>& errors);
@@ -44,6 +45,7 @@ namespace PnnLABQuant
 	public:
 		PnnLABGAQuantizer(PnnLABQuantizer& pq, const vector<shared_ptr<Bitmap> >& pSources, UINT nMaxColors);
 		PnnLABGAQuantizer(PnnLABQuantizer& pq, const vector<vector<ARGB> >& pixelsList, const vector<UINT>& bitmapWidths, UINT nMaxColors);
+		PnnLABGAQuantizer(PnnLABQuantizer& pq, const shared_ptr<const vector<vector<ARGB> > >& pPixelsList, const vector<UINT>& bitmapWidths, UINT nMaxColors);
 
 		float getFitness();
 		shared_ptr<PnnLABGAQuantizer> crossover(const PnnLABGAQuantizer& mother, int numberOfCrossoverPoints, float crossoverProbability);
@@ -31,6 +31,7 @@ namespace PnnLABQuant
 		hasSemiTransparency = quantizer.hasSemiTransparency;
 		m_transparentPixelIndex = quantizer.m_transparentPixelIndex;
 		saliencies = quantizer.saliencies;
+		sharedPixelMap = quantizer.sharedPixelMap;
 		pixelMap.insert(quantizer.pixelMap.begin(), quantizer.pixelMap.end());
 		isGA = true;
 		proportional = quantizer.proportional;
@@ -38,6 +39,14 @@ namespace PnnLABQuant
 
 	void PnnLABQuantizer::getLab(const Color& c, CIELABConvertor::Lab& lab1)
 	{
+		if (sharedPixelMap) {
+			auto shared = sharedPixelMap->find(c.GetValue());
+			if (shared != sharedPixelMap->end()) {
+				lab1 = shared->second;
+				return;
+			}
+		}
+
 		auto got = pixelMap.find(c.GetValue());
 		if (got == pixelMap.end()) {
 			CIELABConvertor::RGB2LAB(c, lab1);
@@ -47,6 +56,29 @@ namespace PnnLABQuant
 			lab1 = got->second;
 	}
 
+	// Converts the colors of all pixels once, copies of this quantizer then share the read-only result
+	void PnnLABQuantizer::shareLabCache(const vector<vector<ARGB> >& pixelsList)
+	{
+		auto labMap = make_shared<unordered_map<ARGB, CIELABConvertor::Lab> >(pixelMap);
+		for (const auto& pixels : pixelsList) {
+			for (const auto& pixel : pixels) {
+				Color c(pixel);
+				if (c.GetA() <= alphaThreshold && labMap->find(m_transparentColor) == labMap->end())
+					CIELABConvertor::RGB2LAB(Color(m_transparentColor), (*labMap)[m_transparentColor]);
+
+				if (labMap->find(pixel) == labMap->end())
+					CIELABConvertor::RGB2LAB(c, (*labMap)[pixel]);
+			}
+		}
+		pixelMap.clear();
+		sharedPixelMap = labMap;
+	}
+
+	size_t PnnLABQuantizer::getPixelMapSize() const
+	{
+		return sharedPixelMap ? sharedPixelMap->size() + pixelMap.size() : pixelMap.size();
+	}
+
 	void PnnLABQuantizer::find_nn(pnnbin* bins, int idx, bool texicab)
 	{
 		int nn = 0;
@@ -199,18 +231,23 @@ namespace PnnLABQuant
 				quan_rt = 2;
 		}
 
-		if (pixelMap.size() <= nMaxColors) {
+		if (getPixelMapSize() <= nMaxColors) {
 			/* Fill palette */
-			nMaxColors = pixelMap.size();
+			nMaxColors = getPixelMapSize();
 			int k = 0;
-			for (const auto& [pixel, lab] : pixelMap) {
-				Color c(pPalette[k]);
-				pPalette[k++] = pixel;
+			auto fillPalette = [&](const unordered_map<ARGB, CIELABConvertor::Lab>& labMap) {
+				for (const auto& [pixel, lab] : labMap) {
+					Color c(pPalette[k]);
+					pPalette[k++] = pixel;
 
 
-				if (k > 1 && c.GetA() == 0)
-					swap(pPalette[k - 1], pPalette[0]);
-			}
+					if (k > 1 && c.GetA() == 0)
+						swap(pPalette[k - 1], pPalette[0]);
+				}
+			};
+			if (sharedPixelMap)
+				fillPalette(*sharedPixelMap);
+			fillPalette(pixelMap);
 
 			return;
 		}
@@ -602,7 +639,7 @@ namespace PnnLABQuant
 		Peano::GilbertCurve::dither(bitmapWidth, bitmapHeight, pixels.data(), pPalette, nMaxColors, NearestColorIndex, GetColorIndex, qPixels.get(), saliencies.data(), weight, dither);
 
 		if (!dither && nMaxColors > 32) {
-			const auto delta = sqr(nMaxColors) / pixelMap.size();
+			const auto delta = sqr(nMaxColors) / getPixelMapSize();
 			auto weight = delta > 0.023 ? 1.0f : (float)(36.921 * delta + 0.906);
 			BlueNoise::dither(bitmapWidth, bitmapHeight, pixels.data(), pPalette, nMaxColors, NearestColorIndex, GetColorIndex, qPixels.get(), weight);
 		}
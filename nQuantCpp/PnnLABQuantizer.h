@@ -31,6 +31,7 @@ namespace PnnLABQuant
 			bool isGA = false;
 			double proportional = 1.0, ratio = .5, ratioY = .5;
 			unordered_map<ARGB, CIELABConvertor::Lab> pixelMap;
+			shared_ptr<const unordered_map<ARGB, CIELABConvertor::Lab> > sharedPixelMap;
 			unordered_map<ARGB, vector<unsigned short> > closestMap;
 			unordered_map<ARGB, unsigned short> nearestMap;
 			vector<float> saliencies;
@@ -42,6 +43,7 @@ namespace PnnLABQuant
 			};
 
 			void find_nn(pnnbin* bins, int idx, bool texicab);
+			size_t getPixelMapSize() const;
 			unsigned short closestColorIndex(const ARGB* pPalette, const UINT nMaxColors, ARGB argb, const UINT pos);
 			bool quantize_image(const ARGB* pixels, const ARGB* pPalette, const UINT nMaxColors, unsigned short* qPixels, const UINT width, const UINT height, const bool dither);
 
@@ -52,6 +54,7 @@ namespace PnnLABQuant
 			void pnnquan(const vector<ARGB>& pixels, ARGB* pPalette, UINT& nMaxColors);
 			bool IsGA() const;
 			void getLab(const Color& c, CIELABConvertor::Lab& lab1);
+			void shareLabCache(const vector<vector<ARGB> >& pixelsList);
 			bool hasAlpha() const;
 			unsigned short nearestColorIndex(const ARGB* pPalette, const UINT nMaxColors, ARGB argb, const UINT pos);
 			void setRatio(double ratioX, double ratioY);
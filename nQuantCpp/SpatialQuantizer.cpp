@@ -35,8 +35,14 @@ SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
 #include <limits>
 #include <unordered_map>
 
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define SPA_SSE2
+#endif
+
 namespace SpatialQuant
 {
+	const int MAX_TOP_COLORS = 16;
 	BYTE alphaThreshold = 0xF;
 	bool hasSemiTransparency = false;
 	int m_transparentPixelIndex = -1;
@@ -227,50 +233,59 @@ namespace SpatialQuant
 			return result;
 		}
 
-		array2d<T>& multiply_row_scalar(int row, T mult) {
-			for (int i = 0; i < get_width(); ++i)
-				(*this)(i, row) *= mult;
-
-			return *this;
-		}
+		// Factors this symmetric K x K matrix in place as L D L^T: the strict lower triangle
+		// receives L and the diagonal receives D. Every update is a dot product of two
+		// contiguous rows, so the K^3 / 6 multiply-adds stay cache friendly, and the factors
+		// serve any number of right-hand sides through ldlt_solve.
+		array2d<T>& ldlt_factor() {
+			const int n = get_width();
+			vector<double> ld(n); // L(i, k) * D(k) of the current row
+			for (int i = 0; i < n; ++i) {
+				T* row_i = &data[i * width];
+				for (int j = 0; j < i; ++j) {
+					const T* row_j = &data[j * width];
+					double sum = row_i[j];
+					for (int k = 0; k < j; ++k)
+						sum -= ld[k] * row_j[k];
+
+					if (row_j[j] != 0) {
+						ld[j] = sum;
+						row_i[j] = static_cast<T>(sum / row_j[j]);
+					}
+					else
+						ld[j] = row_i[j] = 0;
+				}
 
-		array2d<T>& add_row_multiple(int from_row, int to_row, T mult) {
-			if (mult != 0) {
-				for (int i = 0; i < get_width(); ++i)
-					(*this)(i, to_row) += mult * (*this)(i, from_row);
+				double diagonal = row_i[i];
+				for (int k = 0; k < i; ++k)
+					diagonal -= ld[k] * row_i[k];
+				row_i[i] = static_cast<T>(diagonal);
 			}
-
 			return *this;
 		}
 
-		// We use simple Gaussian elimination - perf doesn't matter since
-		// the matrices will be K x K, where K = number of palette entries.
-		array2d<T> matrix_inverse() {
-			array2d<T> result(get_width(), get_height());
-			auto& a = *this;
-
-			// Set result to identity matrix
-			for (int i = 0; i < get_width(); ++i)
-				result(i, i) = 1;
+		// Solves A x = b in place from the factors of ldlt_factor;
+		// an unknown whose pivot vanished is left at zero
+		void ldlt_solve(vector<T>& b) const {
+			const int n = get_width();
+			for (int i = 0; i < n; ++i) {
+				const T* row_i = &data[i * width];
+				double sum = b[i];
+				for (int k = 0; k < i; ++k)
+					sum -= row_i[k] * b[k];
+				b[i] = static_cast<T>(sum);
+			}
 
-			// Reduce to echelon form, mirroring in result
-			for (int i = 0; i < get_width(); ++i) {
-				result.multiply_row_scalar(i, 1 / a(i, i));
-				multiply_row_scalar(i, 1 / a(i, i));
-				for (int j = i + 1; j < get_height(); ++j) {
-					result.add_row_multiple(i, j, -a(i, j));
-					add_row_multiple(i, j, -a(i, j));
-				}
+			for (int i = 0; i < n; ++i) {
+				const auto diagonal = data[i * width + i];
+				b[i] = (diagonal != 0) ? b[i] / diagonal : 0;
 			}
-			// Back substitute, mirroring in result
-			for (int i = get_width() - 1; i >= 0; --i) {
-				for (int j = i - 1; j >= 0; --j) {
-					result.add_row_multiple(i, j, -a(i, j));
-					add_row_multiple(i, j, -a(i, j));
-				}
+
+			for (int i = n - 1; i > 0; --i) {
+				const T* row_i = &data[i * width];
+				for (int k = 0; k < i; ++k)
+					b[k] -= row_i[k] * b[i];
 			}
-			// result is now the inverse
-			return result;
 		}
 
 	private:
@@ -337,6 +352,126 @@ namespace SpatialQuant
 		int width, height, depth;
 	};
 
+	// Keeps only the top few palette probabilities of every pixel,
+	// all the other colors are taken to have probability 0
+	class sparse_array3d
+	{
+	public:
+		sparse_array3d(int width, int height, int depth, int top)
+		{
+			this->width = width;
+			this->height = height;
+			this->depth = depth;
+			this->top = top;
+			const auto volume = (size_t) (width * height * top);
+			indices = make_unique<unsigned short[]>(volume);
+			values = make_unique<float[]>(volume);
+		}
+
+		inline unsigned short* index(int col, int row)
+		{
+			return &indices[(row * width + col) * top];
+		}
+
+		inline const unsigned short* index(int col, int row) const
+		{
+			return &indices[(row * width + col) * top];
+		}
+
+		inline float* value(int col, int row)
+		{
+			return &values[(row * width + col) * top];
+		}
+
+		inline const float* value(int col, int row) const
+		{
+			return &values[(row * width + col) * top];
+		}
+
+		void fill_random(int length) {
+			const int area = width * height;
+			for (int i = 0; i < area; ++i) {
+				const int start = rand() % depth;
+				for (int t = 0; t < top; ++t) {
+					indices[i * top + t] = (start + t * depth / top) % depth;
+					values[i * top + t] = getRandom(t % length);
+				}
+			}
+		}
+
+		inline int get_width()  const { return width; }
+		inline int get_height() const { return height; }
+		inline int get_depth() const { return depth; }
+		inline int get_top() const { return top; }
+
+	private:
+		unique_ptr<unsigned short[]> indices;
+		unique_ptr<float[]> values;
+		int width, height, depth, top;
+	};
+
+	template <class Variables>
+	unique_ptr<Variables> make_variables(const int width, const int height, const int depth, const int top);
+
+	template <>
+	unique_ptr<array3d<double> > make_variables(const int width, const int height, const int depth, const int top)
+	{
+		return make_unique<array3d<double> >(width, height, depth);
+	}
+
+	template <>
+	unique_ptr<sparse_array3d> make_variables(const int width, const int height, const int depth, const int top)
+	{
+		return make_unique<sparse_array3d>(width, height, depth, top);
+	}
+
+	template <typename Fn>
+	inline void for_each_variable(const array3d<double>& vars, const int i_x, const int i_y, Fn fn)
+	{
+		for (int v = 0; v < vars.get_depth(); ++v)
+			fn(v, vars(i_x, i_y, v));
+	}
+
+	template <typename Fn>
+	inline void for_each_variable(const sparse_array3d& vars, const int i_x, const int i_y, Fn fn)
+	{
+		auto index = vars.index(i_x, i_y);
+		auto value = vars.value(i_x, i_y);
+		for (int t = 0; t < vars.get_top(); ++t)
+			fn(index[t], value[t]);
+	}
+
+	// Writes the largest of count weights, scaled to add up to 1, into the slots of pixel i.
+	// Slots left over get unused colors of probability 0. The weights are overwritten.
+	void store_top(const unsigned short* indices, double* weights, const int count, sparse_array3d& vars, const int i_x, const int i_y)
+	{
+		const int top = vars.get_top();
+		auto index = vars.index(i_x, i_y);
+		auto value = vars.value(i_x, i_y);
+
+		int t = 0;
+		double sum = 0, picked[MAX_TOP_COLORS];
+		for (; t < top && t < count; ++t) {
+			int best = 0;
+			for (int k = 1; k < count; ++k) {
+				if (weights[k] > weights[best])
+					best = k;
+			}
+			index[t] = indices ? indices[best] : best;
+			sum += picked[t] = weights[best];
+			weights[best] = -numeric_limits<double>::infinity();
+		}
+		for (int k = 0; k < t; ++k)
+			value[k] = (float) (sum > 0 ? picked[k] / sum : picked[k]);
+
+		for (int v = 0; t < top; ++v) {
+			if (find(index, index + t, v) != index + t)
+				continue;
+			index[t] = v;
+			value[t++] = 0;
+		}
+	}
+
 	int compute_max_coarse_level(int width, int height) {
 		// We want the coarsest layer to have at most MAX_PIXELS pixels
 		const int MAX_PIXELS = 4000;
@@ -473,6 +608,18 @@ namespace SpatialQuant
 		return result;
 	}
 
+	template <typename T, int length>
+	bool equal_vector_layer_2d(const array2d<vector_fixed<T, length> >& s, short k1, short k2)
+	{
+		for (int i = 0; i < s.get_width(); ++i) {
+			for (int j = 0; j < s.get_height(); ++j) {
+				if (s(i, j)[k1] != s(i, j)[k2])
+					return false;
+			}
+		}
+		return true;
+	}
+
 	template <typename T, int length>
 	vector<T> extract_vector_layer_1d(const vector<vector_fixed<T, length> >& s, short k)
 	{
@@ -483,103 +630,242 @@ namespace SpatialQuant
 		return result;
 	}
 
-	UINT best_match_color(const array3d<double>& vars, const int i_x, const int i_y, const UINT nMaxColor)
+	template <class Variables>
+	UINT best_match_color(const Variables& vars, const int i_x, const int i_y)
 	{
 		UINT max_v = 0;
-
-		auto max_weight = vars(i_x, i_y, max_v);
-		for (UINT v = 1; v < nMaxColor; ++v) {
-			const auto& weight = vars(i_x, i_y, v);
+		auto max_weight = -numeric_limits<double>::infinity();
+		for_each_variable(vars, i_x, i_y, [&](const int v, const double weight) {
 			if (weight > max_weight) {
 				max_v = v;
 				max_weight = weight;
 			}
-		}
+		});
 
 		return max_v;
 	}
 
+	// Simple scaling of the weights array based on mixing the four
+	// pixels falling under each fine pixel, weighted by area.
+	// To mix the pixels a little, we assume each fine pixel
+	// is 1.2 fine pixels wide and high.
+	// Returns how many of the coarse pixels xs, ys are mixed into fine pixel (x, y).
+	int zoom_taps(const int small_width, const int small_height, const int x, const int y, int* xs, int* ys, double* weights)
+	{
+		const auto top = max(0.0, (y - 0.1) / 2.0), bottom = min(small_height - 0.001, (y + 1.1) / 2.0);
+		const auto y_top = (int)floor(top), y_bottom = (int)floor(bottom);
+		const auto left = max(0.0, (x - 0.1) / 2.0), right = min(small_width - 0.001, (x + 1.1) / 2.0);
+		const auto x_left = (int)floor(left), x_right = (int)floor(right);
+		const auto area = (right - left) * (bottom - top);
+		if (x_left == x_right && y_top == y_bottom) {
+			xs[0] = x_left, ys[0] = y_top, weights[0] = 1;
+			return 1;
+		}
+		if (x_left == x_right) {
+			xs[0] = x_left, ys[0] = y_top, weights[0] = (right - left) * (ceil(top) - top) / area;
+			xs[1] = x_left, ys[1] = y_bottom, weights[1] = (right - left) * (bottom - floor(bottom)) / area;
+			return 2;
+		}
+		if (y_top == y_bottom) {
+			xs[0] = x_left, ys[0] = y_top, weights[0] = (bottom - top) * (ceil(left) - left) / area;
+			xs[1] = x_right, ys[1] = y_top, weights[1] = (bottom - top) * (right - floor(right)) / area;
+			return 2;
+		}
+		xs[0] = x_left, ys[0] = y_top, weights[0] = (ceil(left) - left) * (ceil(top) - top) / area;
+		xs[1] = x_right, ys[1] = y_top, weights[1] = (right - floor(right)) * (ceil(top) - top) / area;
+		xs[2] = x_left, ys[2] = y_bottom, weights[2] = (ceil(left) - left) * (bottom - floor(bottom)) / area;
+		xs[3] = x_right, ys[3] = y_bottom, weights[3] = (right - floor(right)) * (bottom - floor(bottom)) / area;
+		return 4;
+	}
+
 	void zoom_double(const array3d<double>& smallVal, array3d<double>& big)
 	{
 		const int coarse_width = big.get_width(), coarse_height = big.get_height();
-		// Simple scaling of the weights array based on mixing the four
-		// pixels falling under each fine pixel, weighted by area.
-		// To mix the pixels a little, we assume each fine pixel
-		// is 1.2 fine pixels wide and high.
+		int xs[4], ys[4];
+		double weights[4];
 		for (int y = 0; y < coarse_height; ++y) {
-			const auto top = max(0.0, (y - 0.1) / 2.0), bottom = min(smallVal.get_height() - 0.001, (y + 1.1) / 2.0);
-			const auto y_top = (int)floor(top), y_bottom = (int)floor(bottom);
 			for (int x = 0; x < coarse_width; ++x) {
-				const auto left = max(0.0, (x - 0.1) / 2.0), right = min(smallVal.get_width() - 0.001, (x + 1.1) / 2.0);
-				const auto x_left = (int)floor(left), x_right = (int)floor(right);
-				const auto area = (right - left) * (bottom - top);
-				const auto top_left_weight = (ceil(left) - left) * (ceil(top) - top) / area;
-				const auto top_right_weight = (right - floor(right)) * (ceil(top) - top) / area;
-				const auto bottom_left_weight = (ceil(left) - left) * (bottom - floor(bottom)) / area;
-				const auto bottom_right_weight = (right - floor(right)) * (bottom - floor(bottom)) / area;
-				const auto top_weight = (right - left) * (ceil(top) - top) / area;
-				const auto bottom_weight = (right - left) * (bottom - floor(bottom)) / area;
-				const auto left_weight = (bottom - top) * (ceil(left) - left) / area;
-				const auto right_weight = (bottom - top) * (right - floor(right)) / area;
+				const int taps = zoom_taps(smallVal.get_width(), smallVal.get_height(), x, y, xs, ys, weights);
 				for (int z = 0; z < big.get_depth(); ++z) {
-					if (x_left == x_right && y_top == y_bottom)
-						big(x, y, z) = smallVal(x_left, y_top, z);
-					else if (x_left == x_right)
-						big(x, y, z) = top_weight * smallVal(x_left, y_top, z) + bottom_weight * smallVal(x_left, y_bottom, z);
-					else if (y_top == y_bottom)
-						big(x, y, z) = left_weight * smallVal(x_left, y_top, z) + right_weight * smallVal(x_right, y_top, z);
-					else {
-						big(x, y, z) = top_left_weight * smallVal(x_left, y_top, z) + top_right_weight * smallVal(x_right, y_top, z) +
-							bottom_left_weight * smallVal(x_left, y_bottom, z) + bottom_right_weight * smallVal(x_right, y_bottom, z);
-					}
+					auto val = weights[0] * smallVal(xs[0], ys[0], z);
+					for (int k = 1; k < taps; ++k)
+						val += weights[k] * smallVal(xs[k], ys[k], z);
+					big(x, y, z) = val;
 				}
 			}
 		}
 	}
 
-	void compute_initial_s(array2d<vector_fixed<double, 4> >& s, const array3d<double>& coarse_variables, array2d<vector_fixed<double, 4> >& b)
+	void zoom_double(const sparse_array3d& smallVal, sparse_array3d& big)
+	{
+		const int coarse_width = big.get_width(), coarse_height = big.get_height();
+		int xs[4], ys[4];
+		double weights[4];
+		auto indices = make_unique<unsigned short[]>(4 * smallVal.get_top());
+		auto values = make_unique<double[]>(4 * smallVal.get_top());
+		for (int y = 0; y < coarse_height; ++y) {
+			for (int x = 0; x < coarse_width; ++x) {
+				const int taps = zoom_taps(smallVal.get_width(), smallVal.get_height(), x, y, xs, ys, weights);
+				int count = 0;
+				for (int k = 0; k < taps; ++k) {
+					for_each_variable(smallVal, xs[k], ys[k], [&](const int v, const double m) {
+						auto pos = find(indices.get(), indices.get() + count, v) - indices.get();
+						if (pos == count) {
+							indices[count] = v;
+							values[count++] = 0;
+						}
+						values[pos] += weights[k] * m;
+					});
+				}
+				store_top(indices.get(), values.get(), count, big, x, y);
+			}
+		}
+	}
+
+	// Adds m_{iv} m_{j alpha} b_ij to the half of S above the diagonal
+	inline void add_s_pair(array2d<vector_fixed<double, 4> >& s, const array3d<double>& coarse_variables, const int i_x, const int i_y,
+		const int j_x, const int j_y, const vector_fixed<double, 4>& b_ij, const int length)
 	{
-		const int length = hasSemiTransparency ? 4 : 3;
 		const int palette_size = s.get_width();
-		const int coarse_width = coarse_variables.get_width(), coarse_height = coarse_variables.get_height();
-		const int center_x = (b.get_width() - 1) / 2, center_y = (b.get_height() - 1) / 2;
-		const auto& center_b = b_value(b, 0, 0, 0, 0);
-		vector_fixed<double, 4> zero_vector;
 		for (int v = 0; v < palette_size; ++v) {
-			for (int alpha = v; alpha < palette_size; ++alpha)
-				s(v, alpha) = zero_vector;
+			auto v1 = coarse_variables(i_x, i_y, v);
+			for (int alpha = v; alpha < palette_size; ++alpha) {
+				auto mult = v1 * coarse_variables(j_x, j_y, alpha);
+				for (int p = 0; p < length; ++p)
+					s(v, alpha)[p] += mult * b_ij[p];
+			}
+		}
+	}
+
+	inline void add_s_pair(array2d<vector_fixed<double, 4> >& s, const sparse_array3d& coarse_variables, const int i_x, const int i_y,
+		const int j_x, const int j_y, const vector_fixed<double, 4>& b_ij, const int length)
+	{
+		const int top = coarse_variables.get_top();
+		auto index_i = coarse_variables.index(i_x, i_y), index_j = coarse_variables.index(j_x, j_y);
+		auto value_i = coarse_variables.value(i_x, i_y), value_j = coarse_variables.value(j_x, j_y);
+		for (int t = 0; t < top; ++t) {
+			const int v = index_i[t];
+			const double v1 = value_i[t];
+			for (int u = 0; u < top; ++u) {
+				const int alpha = index_j[u];
+				if (alpha < v)
+					continue;
+				auto mult = v1 * value_j[u];
+				for (int p = 0; p < length; ++p)
+					s(v, alpha)[p] += mult * b_ij[p];
+			}
 		}
+	}
+
+	inline void add_s_floor(array2d<vector_fixed<double, 4> >& s, const array3d<double>& coarse_variables, array2d<vector_fixed<double, 4> >& b)
+	{
+	}
+
+	// The full variables never drop below 1e-10, which keeps S regular and gives colors no pixel
+	// wants a sensible place. Add what that floor contributes to S to first order, for all colors.
+	void add_s_floor(array2d<vector_fixed<double, 4> >& s, const sparse_array3d& coarse_variables, array2d<vector_fixed<double, 4> >& b)
+	{
+		const double min_m = 1e-10;
+		const int palette_size = s.get_width();
+		const int coarse_width = coarse_variables.get_width(), coarse_height = coarse_variables.get_height();
+		const int center_x = (b.get_width() - 1) / 2, center_y = (b.get_height() - 1) / 2;
+		// c_v = sum over i of m_{iv} sum over j != i of b_ij
+		vector<vector_fixed<double, 4> > c(palette_size);
 		for (int i_y = 0; i_y < coarse_height; ++i_y) {
 			int max_j_y = min(coarse_height, i_y - center_y + b.get_height());
 			for (int i_x = 0; i_x < coarse_width; ++i_x) {
 				int max_j_x = min(coarse_width, i_x - center_x + b.get_width());
+				vector_fixed<double, 4> b_i;
 				for (int j_y = max(0, i_y - center_y); j_y < max_j_y; ++j_y) {
 					for (int j_x = max(0, i_x - center_x); j_x < max_j_x; ++j_x) {
-						if (i_x == j_x && i_y == j_y)
-							continue;
+						if (i_x != j_x || i_y != j_y)
+							b_i += b_value(b, i_x, i_y, j_x, j_y);
+					}
+				}
+				for_each_variable(coarse_variables, i_x, i_y, [&](const int v, const double m) {
+					c[v] += m * b_i;
+				});
+			}
+		}
 
-						auto& b_ij = b_value(b, i_x, i_y, j_x, j_y);
-						for (int v = 0; v < palette_size; ++v) {
-							auto v1 = coarse_variables(i_x, i_y, v);
-							for (int alpha = v; alpha < palette_size; ++alpha) {
-								auto mult = v1 * coarse_variables(j_x, j_y, alpha);
-								for (int p = 0; p < length; ++p)
-									s(v, alpha)[p] += mult * b_ij[p];
-							}
+		const auto floor_b = (min_m * coarse_width * coarse_height) * b_value(b, 0, 0, 0, 0);
+		for (int v = 0; v < palette_size; ++v) {
+			s(v, v) += floor_b;
+			for (int alpha = v; alpha < palette_size; ++alpha)
+				s(v, alpha) += min_m * (c[v] + c[alpha]);
+		}
+	}
+
+	inline void add_r_floor(vector<vector_fixed<double, 4> >& r, const array3d<double>& coarse_variables, const array2d<vector_fixed<double, 4> >& a)
+	{
+	}
+
+	// Same floor for R, the part of every color that no pixel keeps
+	void add_r_floor(vector<vector_fixed<double, 4> >& r, const sparse_array3d& coarse_variables, const array2d<vector_fixed<double, 4> >& a)
+	{
+		vector_fixed<double, 4> sum_a;
+		for (int i_y = 0; i_y < coarse_variables.get_height(); ++i_y) {
+			for (int i_x = 0; i_x < coarse_variables.get_width(); ++i_x)
+				sum_a += a(i_x, i_y);
+		}
+		for (auto& r_v : r)
+			r_v += 1e-10 * sum_a;
+	}
+
+	template <class Variables>
+	void compute_initial_s(array2d<vector_fixed<double, 4> >& s, const Variables& coarse_variables, array2d<vector_fixed<double, 4> >& b)
+	{
+		const int length = hasSemiTransparency ? 4 : 3;
+		const int palette_size = s.get_width();
+		const int coarse_width = coarse_variables.get_width(), coarse_height = coarse_variables.get_height();
+		const int center_x = (b.get_width() - 1) / 2, center_y = (b.get_height() - 1) / 2;
+		const auto& center_b = b_value(b, 0, 0, 0, 0);
+		// Each block of rows sums into its own copy of S, added up in order afterwards
+		const int blocks = min(16, coarse_height);
+		vector<array2d<vector_fixed<double, 4> > > s_blocks;
+		s_blocks.reserve(blocks);
+		for (int block = 0; block < blocks; ++block)
+			s_blocks.emplace_back(palette_size, palette_size);
+
+		#pragma omp parallel for schedule(dynamic)
+		for (int block = 0; block < blocks; ++block) {
+			auto& s_block = s_blocks[block];
+			const int top = block * coarse_height / blocks, bottom = (block + 1) * coarse_height / blocks;
+			for (int i_y = top; i_y < bottom; ++i_y) {
+				int max_j_y = min(coarse_height, i_y - center_y + b.get_height());
+				for (int i_x = 0; i_x < coarse_width; ++i_x) {
+					int max_j_x = min(coarse_width, i_x - center_x + b.get_width());
+					for (int j_y = max(0, i_y - center_y); j_y < max_j_y; ++j_y) {
+						for (int j_x = max(0, i_x - center_x); j_x < max_j_x; ++j_x) {
+							if (i_x == j_x && i_y == j_y)
+								continue;
+
+							add_s_pair(s_block, coarse_variables, i_x, i_y, j_x, j_y, b_value(b, i_x, i_y, j_x, j_y), length);
 						}
 					}
+					for_each_variable(coarse_variables, i_x, i_y, [&](const int v, const double m) {
+						s_block(v, v) += m * center_b;
+					});
 				}
-				for (int v = 0; v < palette_size; ++v)
-					s(v, v) += coarse_variables(i_x, i_y, v) * center_b;
 			}
 		}
+
+		vector_fixed<double, 4> zero_vector;
+		for (int v = 0; v < palette_size; ++v) {
+			for (int alpha = v; alpha < palette_size; ++alpha) {
+				s(v, alpha) = zero_vector;
+				for (const auto& s_block : s_blocks)
+					s(v, alpha) += s_block(v, alpha);
+			}
+		}
+		add_s_floor(s, coarse_variables, b);
 	}
 
-	void update_s(array2d<vector_fixed<double, 4> >& s, const array3d<double>& coarse_variables, array2d<vector_fixed<double, 4> >& b,
+	template <class Variables>
+	void update_s(array2d<vector_fixed<double, 4> >& s, const Variables& coarse_variables, array2d<vector_fixed<double, 4> >& b,
 		const int j_x, const int j_y, const int alpha, const double delta)
 	{
 		const int length = hasSemiTransparency ? 4 : 3;
-		const int palette_size = s.get_width();
 		const int coarse_width = coarse_variables.get_width(), coarse_height = coarse_variables.get_height();
 		const int center_x = (b.get_width() - 1) / 2, center_y = (b.get_height() - 1) / 2;
 		const int min_i_x = max(0, j_x - center_x), min_i_y = max(0, j_y - center_y);
@@ -589,22 +875,23 @@ namespace SpatialQuant
 				auto delta_b_ij = delta * b_value(b, i_x, i_y, j_x, j_y);
 				if (i_x == j_x && i_y == j_y)
 					continue;
-				for (int v = 0; v <= alpha; ++v) {
-					auto mult = coarse_variables(i_x, i_y, v);
-					for (int p = 0; p < length; ++p)
-						s(v, alpha)[p] += mult * delta_b_ij[p];
-				}
-				for (int v = alpha; v < palette_size; ++v) {
-					auto mult = coarse_variables(i_x, i_y, v);
-					for (int p = 0; p < length; ++p)
-						s(alpha, v)[p] += mult * delta_b_ij[p];
-				}
+				for_each_variable(coarse_variables, i_x, i_y, [&](const int v, const double mult) {
+					if (v <= alpha) {
+						for (int p = 0; p < length; ++p)
+							s(v, alpha)[p] += mult * delta_b_ij[p];
+					}
+					if (v >= alpha) {
+						for (int p = 0; p < length; ++p)
+							s(alpha, v)[p] += mult * delta_b_ij[p];
+					}
+				});
 			}
 		}
 		s(alpha, alpha) += delta * b_value(b, 0, 0, 0, 0);
 	}
 
-	void refine_palette(array2d<vector_fixed<double, 4> >& s, const array3d<double>& coarse_variables,
+	template <class Variables>
+	void refine_palette(array2d<vector_fixed<double, 4> >& s, const Variables& coarse_variables,
 		const array2d<vector_fixed<double, 4> >& a, vector<vector_fixed<double, 4> >& palette)
 	{
 		// We only computed the half of S above the diagonal - reflect it
@@ -619,16 +906,24 @@ namespace SpatialQuant
 		for (int i_y = 0; i_y < coarse_height; ++i_y) {
 			for (int i_x = 0; i_x < coarse_width; ++i_x) {
 				const auto& ai = a(i_x, i_y);
-				for (int v = 0; v < nMaxColor; ++v)
-					r[v] += coarse_variables(i_x, i_y, v) * ai;
+				for_each_variable(coarse_variables, i_x, i_y, [&](const int v, const double m) {
+					r[v] += m * ai;
+				});
 			}
 		}
+		add_r_floor(r, coarse_variables, a);
 
 		const short length = hasSemiTransparency ? 4 : 3;
-		for (int k = 0; k < length; ++k) {
-			auto& S_k = extract_vector_layer_2d(s, k);
-			auto& R_k = extract_vector_layer_1d(r, k);
-			auto& palette_channel = (-2.0 * S_k).matrix_inverse() * R_k;
+		unique_ptr<array2d<double> > pS;
+		for (short k = 0; k < length; ++k) {
+			// S comes from the same filter weights in every channel, so one factorization usually serves them all
+			if (!pS || !equal_vector_layer_2d(s, k - 1, k)) {
+				pS = make_unique<array2d<double> >(-2.0 * extract_vector_layer_2d(s, k));
+				pS->ldlt_factor();
+			}
+
+			auto palette_channel = extract_vector_layer_1d(r, k);
+			pS->ldlt_solve(palette_channel);
 			for (UINT v = 0; v < nMaxColor; ++v) {
 				auto val = palette_channel[v];
 				auto j = palette.size() > 2 ? k : 3;
@@ -644,22 +939,287 @@ namespace SpatialQuant
 		}
 	}
 
-	void compute_initial_j_palette_sum(array2d<vector_fixed<double, 4> >& j_palette_sum, const array3d<double>& coarse_variables, const vector<vector_fixed<double, 4> >& palette)
+	template <class Variables>
+	void compute_initial_j_palette_sum(array2d<vector_fixed<double, 4> >& j_palette_sum, const Variables& coarse_variables, const vector<vector_fixed<double, 4> >& palette)
 	{
 		const int coarse_width = coarse_variables.get_width(), coarse_height = coarse_variables.get_height();
-		const UINT nMaxColor = palette.size();
 		for (int j_y = 0; j_y < coarse_height; ++j_y) {
 			for (int j_x = 0; j_x < coarse_width; ++j_x) {
 				vector_fixed<double, 4> palette_sum;
-				for (UINT alpha = 0; alpha < nMaxColor; ++alpha)
-					palette_sum += coarse_variables(j_x, j_y, alpha) * palette[alpha];
+				for_each_variable(coarse_variables, j_x, j_y, [&](const int alpha, const double m) {
+					palette_sum += m * palette[alpha];
+				});
 				j_palette_sum(j_x, j_y) = palette_sum;
 			}
 		}
 	}
 
+	// The palette one channel after another and padded to an even number of colors,
+	// along with the palette[v] . (middle_b palette[v]) term of (23)
+	struct meanfield_palette
+	{
+		int stride = 0;
+		unique_ptr<double[]> channels, self_energy;
+	};
+
+	void load_meanfield_color(meanfield_palette& mp, const vector<vector_fixed<double, 4> >& palette, const vector_fixed<double, 4>& middle_b, const int v)
+	{
+		double self_energy = 0;
+		for (int p = 0; p < 4; ++p) {
+			mp.channels[p * mp.stride + v] = palette[v][p];
+			self_energy += middle_b[p] * palette[v][p] * palette[v][p];
+		}
+		mp.self_energy[v] = self_energy;
+	}
+
+	void load_meanfield_palette(meanfield_palette& mp, const vector<vector_fixed<double, 4> >& palette, const vector_fixed<double, 4>& middle_b)
+	{
+		const int nMaxColor = palette.size();
+		if (mp.stride == 0) {
+			mp.stride = (nMaxColor + 1) & ~1;
+			mp.channels = make_unique<double[]>(4 * mp.stride);
+			mp.self_energy = make_unique<double[]>(mp.stride);
+		}
+		for (int v = 0; v < nMaxColor; ++v)
+			load_meanfield_color(mp, palette, middle_b, v);
+	}
+
+	// Fills in the unnormalized mean fields of pixel i for every color and returns their sum
+	double compute_meanfields(const array2d<vector_fixed<double, 4> >& palette_sum, const vector_fixed<double, 4>& a_i, array2d<vector_fixed<double, 4> >& b,
+		const meanfield_palette& mp, const UINT nMaxColor, double* meanfields, const double temperature, const int i_x, const int i_y)
+	{
+		const int length = hasSemiTransparency ? 4 : 3;
+		const int coarse_width = palette_sum.get_width(), coarse_height = palette_sum.get_height();
+		const int b_width = b.get_width(), b_height = b.get_height();
+		const int center_x = (b_width - 1) / 2, center_y = (b_height - 1) / 2;
+
+		// Compute (25)
+		vector_fixed<double, 4> p_i;
+		for (int y = 0; y < b_height; ++y) {
+			int j_y = y - center_y + i_y;
+			if (j_y < 0 || j_y >= coarse_height)
+				continue;
+			for (int x = 0; x < b_width; ++x) {
+				int j_x = x - center_x + i_x;
+				if (i_x == j_x && i_y == j_y)
+					continue;
+				if (j_x < 0 || j_x >= coarse_width)
+					continue;
+				auto& b_ij = b_value(b, i_x, i_y, j_x, j_y);
+				auto& j_pal = palette_sum(j_x, j_y);
+				for (int p = 0; p < length; ++p)
+					p_i[p] += b_ij[p] * j_pal[p];
+			}
+		}
+		p_i *= 2.0;
+		p_i += a_i;
+
+		// Update m_{pi(i)v}^I according to (23)
+		const auto ch0 = mp.channels.get(), ch1 = ch0 + mp.stride, ch2 = ch1 + mp.stride, ch3 = ch2 + mp.stride;
+		int v = 0;
+#ifdef SPA_SSE2
+		const auto t = _mm_set1_pd(temperature);
+		const auto p0 = _mm_set1_pd(p_i[0]), p1 = _mm_set1_pd(p_i[1]), p2 = _mm_set1_pd(p_i[2]), p3 = _mm_set1_pd(p_i[3]);
+		for (; v < mp.stride; v += 2) {
+			auto e = _mm_add_pd(_mm_loadu_pd(&mp.self_energy[v]), _mm_mul_pd(p0, _mm_loadu_pd(&ch0[v])));
+			e = _mm_add_pd(e, _mm_mul_pd(p1, _mm_loadu_pd(&ch1[v])));
+			e = _mm_add_pd(e, _mm_mul_pd(p2, _mm_loadu_pd(&ch2[v])));
+			e = _mm_add_pd(e, _mm_mul_pd(p3, _mm_loadu_pd(&ch3[v])));
+			_mm_storeu_pd(&meanfields[v], _mm_div_pd(_mm_sub_pd(_mm_setzero_pd(), e), t));
+		}
+#endif
+		for (; v < nMaxColor; ++v)
+			meanfields[v] = -(mp.self_energy[v] + p_i[0] * ch0[v] + p_i[1] * ch1[v] + p_i[2] * ch2[v] + p_i[3] * ch3[v]) / temperature;
+
+		// We can subtract an arbitrary factor to prevent overflow,
+		// since only the weight relative to the sum matters, so we
+		// will choose a value that makes the maximum e^100.
+		auto max_meanfield_log = -numeric_limits<double>::infinity();
+		for (v = 0; v < nMaxColor; ++v) {
+			if (meanfields[v] > max_meanfield_log)
+				max_meanfield_log = meanfields[v];
+		}
+
+		auto meanfield_sum = 0.0;
+		for (v = 0; v < nMaxColor; ++v) {
+			meanfields[v] = exp(meanfields[v] - max_meanfield_log + 100);
+			meanfield_sum += meanfields[v];
+		}
+		return meanfield_sum;
+	}
+
+	// Updates the mean field of pixel i and returns the color now matching it best,
+	// or -1 if the mean fields vanished. S is left alone when s is null.
+	int update_pixel(array3d<double>& coarse_variables, array2d<vector_fixed<double, 4> >& palette_sum, const vector_fixed<double, 4>& a_i,
+		array2d<vector_fixed<double, 4> >& b, const vector<vector_fixed<double, 4> >& palette, const meanfield_palette& mp,
+		array2d<vector_fixed<double, 4> >* s, double* meanfields, const double temperature, const int i_x, const int i_y, UINT& old_max_v)
+	{
+		const int length = hasSemiTransparency ? 4 : 3;
+		const UINT nMaxColor = palette.size();
+		auto meanfield_sum = compute_meanfields(palette_sum, a_i, b, mp, nMaxColor, meanfields, temperature, i_x, i_y);
+		if (meanfield_sum == 0)
+			return -1;
+
+		old_max_v = best_match_color(coarse_variables, i_x, i_y);
+		auto& j_pal = palette_sum(i_x, i_y);
+		for (UINT v = 0; v < nMaxColor; ++v) {
+			auto new_val = meanfields[v] / meanfield_sum;
+			// Prevent the matrix S from becoming singular
+			if (new_val <= 0)
+				new_val = 1e-10;
+			if (new_val >= 1)
+				new_val = 1 - 1e-10;
+
+			auto delta_m_iv = new_val - coarse_variables(i_x, i_y, v);
+
+			coarse_variables(i_x, i_y, v) = new_val;
+			for (int p = 0; p < length; ++p)
+				j_pal[p] += delta_m_iv * palette[v][p];
+
+			if (abs(delta_m_iv) > 0.001 && s != nullptr)
+				update_s(*s, coarse_variables, b, i_x, i_y, v, delta_m_iv);
+		}
+
+		return best_match_color(coarse_variables, i_x, i_y);
+	}
+
+	// Same as above, keeping only the most likely colors
+	int update_pixel(sparse_array3d& coarse_variables, array2d<vector_fixed<double, 4> >& palette_sum, const vector_fixed<double, 4>& a_i,
+		array2d<vector_fixed<double, 4> >& b, const vector<vector_fixed<double, 4> >& palette, const meanfield_palette& mp,
+		array2d<vector_fixed<double, 4> >* s, double* meanfields, const double temperature, const int i_x, const int i_y, UINT& old_max_v)
+	{
+		const int length = hasSemiTransparency ? 4 : 3;
+		const UINT nMaxColor = palette.size();
+		if (compute_meanfields(palette_sum, a_i, b, mp, nMaxColor, meanfields, temperature, i_x, i_y) == 0)
+			return -1;
+
+		old_max_v = best_match_color(coarse_variables, i_x, i_y);
+		const int top = coarse_variables.get_top();
+		auto index = coarse_variables.index(i_x, i_y);
+		auto value = coarse_variables.value(i_x, i_y);
+		unsigned short old_index[MAX_TOP_COLORS];
+		float old_value[MAX_TOP_COLORS];
+		copy(index, index + top, old_index);
+		copy(value, value + top, old_value);
+		store_top(nullptr, meanfields, nMaxColor, coarse_variables, i_x, i_y);
+
+		auto& j_pal = palette_sum(i_x, i_y);
+		auto apply_delta = [&](const int v, const double delta_m_iv) {
+			for (int p = 0; p < length; ++p)
+				j_pal[p] += delta_m_iv * palette[v][p];
+
+			if (abs(delta_m_iv) > 0.001 && s != nullptr)
+				update_s(*s, coarse_variables, b, i_x, i_y, v, delta_m_iv);
+		};
+		for (int t = 0; t < top; ++t) {
+			auto pos = find(old_index, old_index + top, index[t]) - old_index;
+			apply_delta(index[t], value[t] - (pos < top ? old_value[pos] : 0.0));
+		}
+		for (int t = 0; t < top; ++t) {
+			if (find(index, index + top, old_index[t]) == index + top)
+				apply_delta(old_index[t], -old_value[t]);
+		}
+
+		return best_match_color(coarse_variables, i_x, i_y);
+	}
+
+	// Visits the pixels in 9 classes interleaved on a 3x3 grid. The filter reaches at most 2 pixels away,
+	// so pixels of one class never see each other and a whole class can be updated in parallel, which
+	// amounts to one particular serial visiting order. Changes to S are gathered per block of rows and the
+	// alpha fix-ups of the palette wait until the class is done, so threads do not affect the result.
+	template <class Variables>
+	bool colored_sweep(Variables& coarse_variables, array2d<vector_fixed<double, 4> >& palette_sum, const array2d<vector_fixed<double, 4> >& a,
+		array2d<vector_fixed<double, 4> >& b, vector<vector_fixed<double, 4> >& palette, meanfield_palette& mp,
+		array2d<vector_fixed<double, 4> >* s, const double temperature)
+	{
+		const int length = hasSemiTransparency ? 4 : 3;
+		const int nMaxColor = palette.size();
+		const int coarse_width = coarse_variables.get_width(), coarse_height = coarse_variables.get_height();
+		const int center_x = (b.get_width() - 1) / 2, center_y = (b.get_height() - 1) / 2;
+		const int min_x = min(1, center_x - 1), min_y = min(1, center_y - 1);
+		const int max_x = max(b.get_width() - 1, center_x + 1), max_y = max(b.get_height() - 1, center_y + 1);
+		const auto middle_b = b_value(b, 0, 0, 0, 0);
+
+		const int blocks = min(16, coarse_height);
+		vector<array2d<vector_fixed<double, 4> > > s_blocks;
+		if (s != nullptr) {
+			s_blocks.reserve(blocks);
+			for (int block = 0; block < blocks; ++block)
+				s_blocks.emplace_back(nMaxColor, nMaxColor);
+		}
+		vector<BYTE> raise_alpha(blocks * nMaxColor);
+		vector<BYTE> pending(coarse_width * coarse_height, 1), failed(blocks);
+		bool visiting = true;
+		while (visiting) {
+			for (int phase = 0; phase < 9; ++phase) {
+				const int phase_x = phase % 3, phase_y = phase / 3;
+				#pragma omp parallel for
+				for (int block = 0; block < blocks; ++block) {
+					auto meanfields = make_unique<double[]>(mp.stride);
+					const int top = block * coarse_height / blocks, bottom = (block + 1) * coarse_height / blocks;
+					for (int i_y = top + (phase_y - top % 3 + 3) % 3; i_y < bottom; i_y += 3) {
+						for (int i_x = phase_x; i_x < coarse_width; i_x += 3) {
+							auto& visit = pending[i_y * coarse_width + i_x];
+							if (!visit || failed[block])
+								continue;
+							visit = 0;
+
+							UINT old_max_v;
+							auto max_v = update_pixel(coarse_variables, palette_sum, a(i_x, i_y), b, palette, mp, s ? &s_blocks[block] : nullptr,
+								meanfields.get(), temperature, i_x, i_y, old_max_v);
+							if (max_v < 0) {
+								failed[block] = 1;
+								continue;
+							}
+							if (length > 3)
+								raise_alpha[block * nMaxColor + max_v] = 1;
+
+							// Only consider it a change if the colors are different enough
+							if ((palette[max_v] - palette[old_max_v]).norm_squared() >= length) {
+								for (int y = min_y; y < max_y; ++y) {
+									int j_y = y - center_y + i_y;
+									if (j_y < 0 || j_y >= coarse_height)
+										continue;
+									for (int x = min_x; x < max_x; ++x) {
+										int j_x = x - center_x + i_x;
+										if (j_x >= 0 && j_x < coarse_width)
+											pending[j_y * coarse_width + j_x] = 1;
+									}
+								}
+							}
+						}
+					}
+				}
+
+				for (int v = 0; v < nMaxColor; ++v) {
+					for (int block = 0; block < blocks; ++block) {
+						if (!raise_alpha[block * nMaxColor + v])
+							continue;
+						raise_alpha[block * nMaxColor + v] = 0;
+						const auto alpha = palette[v][3];
+						palette[v][3] = max(alphaThreshold + 1, palette[v][3]);
+						if (palette[v][3] != alpha)
+							load_meanfield_color(mp, palette, middle_b, v);
+					}
+				}
+			}
+			if (find(failed.begin(), failed.end(), 1) != failed.end())
+				return false;
+			visiting = find(pending.begin(), pending.end(), 1) != pending.end();
+		}
+
+		for (const auto& s_block : s_blocks) {
+			for (int v = 0; v < nMaxColor; ++v) {
+				for (int alpha = v; alpha < nMaxColor; ++alpha)
+					(*s)(v, alpha) += s_block(v, alpha);
+			}
+		}
+		return true;
+	}
+
+	template <class Variables>
 	bool spatial_color_quant(const vector<ARGB>& image, array2d<vector_fixed<double, 4> >& filter_weights,
-		unsigned short* quantized_image, const int bitmapWidth, vector<vector_fixed<double, 4> >& palette,
+		unsigned short* quantized_image, const int bitmapWidth, vector<vector_fixed<double, 4> >& palette, const bool parallel, const int top_colors,
 		const double initial_temperature = 1.0, const double final_temperature = 0.001, const int temps_per_level = 3, const int repeats_per_temp = 1)
 	{
 		const int length = hasSemiTransparency ? 4 : 3;
@@ -667,10 +1227,10 @@ namespace SpatialQuant
 
 		const auto nMaxColor = palette.size();
 		int max_coarse_level = compute_max_coarse_level(bitmapWidth, bitmapHeight);
-		auto p_coarse_variables = make_unique<array3d<double> >(
+		auto p_coarse_variables = make_variables<Variables>(
 			bitmapWidth >> max_coarse_level,
 			bitmapHeight >> max_coarse_level,
-			nMaxColor);
+			nMaxColor, top_colors);
 
 		p_coarse_variables->fill_random(length);
 
@@ -742,13 +1302,18 @@ namespace SpatialQuant
 			const int min_x = min(1, center_x - 1), min_y = min(1, center_y - 1);
 			const int max_x = max(b_width - 1, center_x + 1), max_y = max(b_height - 1, center_y + 1);
 
-			int step_counter = 0;
+			meanfield_palette mp;
+			auto meanfields = make_unique<double[]>((nMaxColor + 1) & ~1);
 			for (int repeat = 0; repeat < repeats_per_temp; ++repeat) {
-				int pixels_changed = 0, pixels_visited = 0;
-				deque<pair<int, int> > visit_queue;
-				random_permutation_2d(coarse_width, coarse_height, visit_queue);
+				load_meanfield_palette(mp, palette, middle_b);
+				if (parallel) {
+					if (!colored_sweep(coarse_variables, *p_palette_sum, a, b, palette, mp, skip_palette_maintenance ? nullptr : &s, temperature))
+						return false;
+				}
 
-				// Compute 2*sum(j in extended neighborhood of i, j != i) b_ij
+				deque<pair<int, int> > visit_queue;
+				if (!parallel)
+					random_permutation_2d(coarse_width, coarse_height, visit_queue);
 
 				while (!visit_queue.empty()) {
 					// If we get to 10% above initial size, just revisit them all
@@ -761,79 +1326,21 @@ namespace SpatialQuant
 					int i_x = pos.first, i_y = pos.second;
 					visit_queue.pop_front();
 
-					// Compute (25)
-					vector_fixed<double, 4> p_i;
-					for (int y = 0; y < b_height; ++y) {
-						int j_y = y - center_y + i_y;
-						if (j_y < 0 || j_y >= coarse_height)
-							continue;
-						for (int x = 0; x < b_width; ++x) {
-							int j_x = x - center_x + i_x;
-							if (i_x == j_x && i_y == j_y)
-								continue;
-							if (j_x < 0 || j_x >= coarse_width)
-								continue;
-							auto& b_ij = b_value(b, i_x, i_y, j_x, j_y);
-							auto& j_pal = (*p_palette_sum)(j_x, j_y);
-							for (int p = 0; p < length; ++p)
-								p_i[p] += b_ij[p] * j_pal[p];
-						}
-					}
-					p_i *= 2.0;
-					p_i += a(i_x, i_y);
-
-					auto max_meanfield_log = -numeric_limits<double>::infinity();
-					auto meanfield_sum = 0.0;
-					auto meanfield_logs = make_unique<double[]>(nMaxColor);
-
-					for (UINT v = 0; v < nMaxColor; ++v) {
-						// Update m_{pi(i)v}^I according to (23)
-						// We can subtract an arbitrary factor to prevent overflow,
-						// since only the weight relative to the sum matters, so we
-						// will choose a value that makes the maximum e^100.
-						meanfield_logs[v] = -(palette[v].dot_product(p_i + middle_b.direct_product(palette[v]))) / temperature;
-						if (meanfield_logs[v] > max_meanfield_log)
-							max_meanfield_log = meanfield_logs[v];
-					}
-
-					auto meanfields = make_unique<double[]>(nMaxColor);
-					for (UINT v = 0; v < nMaxColor; ++v) {
-						meanfields[v] = exp(meanfield_logs[v] - max_meanfield_log + 100);
-						meanfield_sum += meanfields[v];
-					}
-					meanfield_logs.reset();
-
-					if (meanfield_sum == 0)
+					UINT old_max_v;
+					auto max_v = update_pixel(coarse_variables, *p_palette_sum, a(i_x, i_y), b, palette, mp, skip_palette_maintenance ? nullptr : &s,
+						meanfields.get(), temperature, i_x, i_y, old_max_v);
+					if (max_v < 0)
 						return false;
 
-					auto old_max_v = best_match_color(coarse_variables, i_x, i_y, nMaxColor);
-					auto& j_pal = (*p_palette_sum)(i_x, i_y);
-					for (UINT v = 0; v < nMaxColor; ++v) {
-						auto new_val = meanfields[v] / meanfield_sum;
-						// Prevent the matrix S from becoming singular
-						if (new_val <= 0)
-							new_val = 1e-10;
-						if (new_val >= 1)
-							new_val = 1 - 1e-10;
-
-						auto delta_m_iv = new_val - coarse_variables(i_x, i_y, v);
-
-						coarse_variables(i_x, i_y, v) = new_val;
-						for (int p = 0; p < length; ++p)
-							j_pal[p] += delta_m_iv * palette[v][p];
-
-						if (abs(delta_m_iv) > 0.001 && !skip_palette_maintenance)
-							update_s(s, coarse_variables, b, i_x, i_y, v, delta_m_iv);
-					}
-					meanfields.reset();
-
-					auto max_v = best_match_color(coarse_variables, i_x, i_y, nMaxColor);
-					if (length > 3)
+					if (length > 3) {
+						const auto alpha = palette[max_v][3];
 						palette[max_v][3] = max(alphaThreshold + 1, palette[max_v][3]);
+						if (palette[max_v][3] != alpha)
+							load_meanfield_color(mp, palette, middle_b, max_v);
+					}
 
 					// Only consider it a change if the colors are different enough
 					if ((palette[max_v] - palette[old_max_v]).norm_squared() >= length) {
-						++pixels_changed;
 						// We don't add the outer layer of pixels , because
 						// there isn't much weight there, and if it does need
 						// to be visited, it'll probably be added when we visit
@@ -852,13 +1359,7 @@ namespace SpatialQuant
 								visit_queue.emplace_front(j_x, j_y);
 							}
 						}
-					}					
-					++pixels_visited;
-
-					// Show progress with dots - in a graphical interface,
-					// we'd show progressive refinements of the image instead,
-					// and maybe a palette preview.
-					++step_counter;
+					}
 				}
 				if (skip_palette_maintenance)
 					compute_initial_s(s, *p_coarse_variables, b_vec[coarse_level]);
@@ -873,7 +1374,7 @@ namespace SpatialQuant
 				if (--coarse_level < 0)
 					break;
 
-				auto p_old_coarse_variables = make_unique<array3d<double> >(bitmapWidth >> coarse_level, bitmapHeight >> coarse_level, nMaxColor);
+				auto p_old_coarse_variables = make_variables<Variables>(bitmapWidth >> coarse_level, bitmapHeight >> coarse_level, nMaxColor, top_colors);
 				swap(p_old_coarse_variables, p_coarse_variables);
 				zoom_double(*p_old_coarse_variables, *p_coarse_variables);
 				iters_at_current_level = 0;
@@ -888,7 +1389,7 @@ namespace SpatialQuant
 		int pixelIndex = 0;
 		for (int i_y = 0; i_y < bitmapHeight; ++i_y) {
 			for (int i_x = 0; i_x < bitmapWidth; ++i_x)
-				quantized_image[pixelIndex++] = best_match_color(*p_coarse_variables, i_x, i_y, nMaxColor);
+				quantized_image[pixelIndex++] = best_match_color(*p_coarse_variables, i_x, i_y);
 		}
 
 		return true;
@@ -966,6 +1467,16 @@ namespace SpatialQuant
 		}
 	}
 
+	void SpatialQuantizer::setParallel(bool parallel)
+	{
+		m_parallel = parallel;
+	}
+
+	void SpatialQuantizer::setTopColors(UINT topColors)
+	{
+		m_topColors = min(topColors, (UINT) MAX_TOP_COLORS);
+	}
+
 	bool SpatialQuantizer::QuantizeImage(Bitmap* pSource, Bitmap* pDest, UINT& nMaxColors, bool dither)
 	{
 		const auto bitDepth = GetPixelFormatSize(pSource->GetPixelFormat());
@@ -1013,7 +1524,9 @@ namespace SpatialQuant
 			pDest->ConvertFormat(PixelFormat8bppIndexed, DitherTypeSolid, PaletteTypeCustom, pPalette, 0);
 
 		auto qPixels = make_unique<unsigned short[]>(pixels.size());
-		if (!spatial_color_quant(pixels, filter3_weights, qPixels.get(), bitmapWidth, palette)) {
+		const bool sparse = m_topColors > 0 && m_topColors < nMaxColors;
+		if (!(sparse ? spatial_color_quant<sparse_array3d>(pixels, filter3_weights, qPixels.get(), bitmapWidth, palette, m_parallel, m_topColors)
+			: spatial_color_quant<array3d<double> >(pixels, filter3_weights, qPixels.get(), bitmapWidth, palette, m_parallel, 0))) {
 			pixelMap.clear();
 			return false;
 		}		
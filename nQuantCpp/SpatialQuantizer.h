@@ -21,7 +21,15 @@ namespace SpatialQuant
 
 	class SpatialQuantizer
 	{
+		private:
+			bool m_parallel = false;
+			UINT m_topColors = 0;
+
 		public:
+			// Update non-adjacent pixels of the annealing sweeps in parallel instead of in random order
+			void setParallel(bool parallel);
+			// Keep only this many of the most likely colors per pixel, up to 16, so memory grows with the pixels alone; 0 keeps all
+			void setTopColors(UINT topColors);
 			bool QuantizeImage(Bitmap* pSource, Bitmap* pDest, UINT& nMaxColors, bool dither = true);
 	};
 }
\ No newline at end of file
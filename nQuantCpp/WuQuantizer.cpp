@@ -24,6 +24,12 @@
 #include "BlueNoise.h"
 #include <unordered_map>
 
+#ifdef _OPENMP
+#include <omp.h>
+#else
+#define omp_get_max_threads() 1
+#endif
+
 namespace nQuant
 {
 	/// <summary><para>Shift color values right this many bits.</para><para>This reduces the granularity of the color maps produced, making it much faster.</para></summary>
@@ -67,39 +73,41 @@ namespace nQuant
 		}
 	};
 
-	struct ColorData {
-		unique_ptr<long[]> weights;
-		unique_ptr<long[]> momentsAlpha;
-		unique_ptr<long[]> momentsRed;
-		unique_ptr<long[]> momentsGreen;
-		unique_ptr<long[]> momentsBlue;
-		unique_ptr<float[]> moments;
-
-		unique_ptr<ARGB[]> pixels;
+	template <typename T>
+	struct Moment {
+		T weight = 0;
+		T momentAlpha = 0;
+		T momentRed = 0;
+		T momentGreen = 0;
+		T momentBlue = 0;
+		float moment = 0.0f;
+	};
 
-		UINT pixelsCount = 0;
-		UINT pixelFillingCounter = 0;
+	template <typename T>
+	struct ColorData {
+		unique_ptr<Moment<T>[]> moments;
 
-		ColorData(UINT sideSize, UINT bitmapWidth, UINT bitmapHeight) {
+		ColorData(UINT sideSize) {
 			const int TOTAL_SIDESIZE = sideSize * sideSize * sideSize * sideSize;
-			weights = make_unique<long[]>(TOTAL_SIDESIZE);
-			momentsAlpha = make_unique<long[]>(TOTAL_SIDESIZE);
-			momentsRed = make_unique<long[]>(TOTAL_SIDESIZE);
-			momentsGreen = make_unique<long[]>(TOTAL_SIDESIZE);
-			momentsBlue = make_unique<long[]>(TOTAL_SIDESIZE);
-			moments = make_unique<float[]>(TOTAL_SIDESIZE);
-			pixelsCount = bitmapWidth * bitmapHeight;
-			pixels = make_unique<ARGB[]>(pixelsCount);
+			moments = make_unique<Moment<T>[]>(TOTAL_SIDESIZE);
 		}
+	};
 
-		inline ARGB* GetPixels() {
-			return pixels.get();
+	struct PixelData {
+		Bitmap* pSource;
+		BitmapData data;
+		bool locked = false;
+		unique_ptr<ARGB[]> buffer;
+		const ARGB* pixels = nullptr;
+		UINT pixelsCount = 0;
+
+		PixelData(Bitmap* pSource) : pSource(pSource) {
+			pixelsCount = pSource->GetWidth() * pSource->GetHeight();
 		}
 
-		inline void AddPixel(ARGB pixel)
-		{
-			pixels[pixelFillingCounter] = pixel;
-			++pixelFillingCounter;
+		~PixelData() {
+			if (locked)
+				pSource->UnlockBits(&data);
 		}
 	};
 
@@ -111,182 +119,243 @@ namespace nQuant
 		return alpha + red * SIDESIZE + green * SIDESIZE * SIDESIZE + blue * SIDESIZE * SIDESIZE * SIDESIZE;
 	}
 
-	inline float Volume(const Box& cube, long* moment)
-	{
-		return (moment[Index(cube.AlphaMaximum, cube.RedMaximum, cube.GreenMaximum, cube.BlueMaximum)] -
-			moment[Index(cube.AlphaMaximum, cube.RedMaximum, cube.GreenMinimum, cube.BlueMaximum)] -
-			moment[Index(cube.AlphaMaximum, cube.RedMinimum, cube.GreenMaximum, cube.BlueMaximum)] +
-			moment[Index(cube.AlphaMaximum, cube.RedMinimum, cube.GreenMinimum, cube.BlueMaximum)] -
-			moment[Index(cube.AlphaMinimum, cube.RedMaximum, cube.GreenMaximum, cube.BlueMaximum)] +
-			moment[Index(cube.AlphaMinimum, cube.RedMaximum, cube.GreenMinimum, cube.BlueMaximum)] +
-			moment[Index(cube.AlphaMinimum, cube.RedMinimum, cube.GreenMaximum, cube.BlueMaximum)] -
-			moment[Index(cube.AlphaMinimum, cube.RedMinimum, cube.GreenMinimum, cube.BlueMaximum)]) -
-			(moment[Index(cube.AlphaMaximum, cube.RedMaximum, cube.GreenMaximum, cube.BlueMinimum)] -
-				moment[Index(cube.AlphaMinimum, cube.RedMaximum, cube.GreenMaximum, cube.BlueMinimum)] -
-				moment[Index(cube.AlphaMaximum, cube.RedMaximum, cube.GreenMinimum, cube.BlueMinimum)] +
-				moment[Index(cube.AlphaMinimum, cube.RedMaximum, cube.GreenMinimum, cube.BlueMinimum)] -
-				moment[Index(cube.AlphaMaximum, cube.RedMinimum, cube.GreenMaximum, cube.BlueMinimum)] +
-				moment[Index(cube.AlphaMinimum, cube.RedMinimum, cube.GreenMaximum, cube.BlueMinimum)] +
-				moment[Index(cube.AlphaMaximum, cube.RedMinimum, cube.GreenMinimum, cube.BlueMinimum)] -
-				moment[Index(cube.AlphaMinimum, cube.RedMinimum, cube.GreenMinimum, cube.BlueMinimum)]);
-	}
+	// Integer components are widened before the inclusion-exclusion sums, which may go negative
+	template <typename M>
+	using Summand = conditional_t<is_floating_point<M>::value, float, long long>;
 
-	inline float Volume(const Box& cube, float* moment)
+	template <typename T, typename M>
+	inline float Volume(const Box& cube, const Moment<T>* moments, M Moment<T>::* member)
 	{
-		return (moment[Index(cube.AlphaMaximum, cube.RedMaximum, cube.GreenMaximum, cube.BlueMaximum)] -
-			moment[Index(cube.AlphaMaximum, cube.RedMaximum, cube.GreenMinimum, cube.BlueMaximum)] -
-			moment[Index(cube.AlphaMaximum, cube.RedMinimum, cube.GreenMaximum, cube.BlueMaximum)] +
-			moment[Index(cube.AlphaMaximum, cube.RedMinimum, cube.GreenMinimum, cube.BlueMaximum)] -
-			moment[Index(cube.AlphaMinimum, cube.RedMaximum, cube.GreenMaximum, cube.BlueMaximum)] +
-			moment[Index(cube.AlphaMinimum, cube.RedMaximum, cube.GreenMinimum, cube.BlueMaximum)] +
-			moment[Index(cube.AlphaMinimum, cube.RedMinimum, cube.GreenMaximum, cube.BlueMaximum)] -
-			moment[Index(cube.AlphaMinimum, cube.RedMinimum, cube.GreenMinimum, cube.BlueMaximum)]) -
-			(moment[Index(cube.AlphaMaximum, cube.RedMaximum, cube.GreenMaximum, cube.BlueMinimum)] -
-				moment[Index(cube.AlphaMinimum, cube.RedMaximum, cube.GreenMaximum, cube.BlueMinimum)] -
-				moment[Index(cube.AlphaMaximum, cube.RedMaximum, cube.GreenMinimum, cube.BlueMinimum)] +
-				moment[Index(cube.AlphaMinimum, cube.RedMaximum, cube.GreenMinimum, cube.BlueMinimum)] -
-				moment[Index(cube.AlphaMaximum, cube.RedMinimum, cube.GreenMaximum, cube.BlueMinimum)] +
-				moment[Index(cube.AlphaMinimum, cube.RedMinimum, cube.GreenMaximum, cube.BlueMinimum)] +
-				moment[Index(cube.AlphaMaximum, cube.RedMinimum, cube.GreenMinimum, cube.BlueMinimum)] -
-				moment[Index(cube.AlphaMinimum, cube.RedMinimum, cube.GreenMinimum, cube.BlueMinimum)]);
+		auto moment = [&](BYTE alpha, BYTE red, BYTE green, BYTE blue) {
+			return static_cast<Summand<M> >(moments[Index(alpha, red, green, blue)].*member);
+		};
+
+		return (moment(cube.AlphaMaximum, cube.RedMaximum, cube.GreenMaximum, cube.BlueMaximum) -
+			moment(cube.AlphaMaximum, cube.RedMaximum, cube.GreenMinimum, cube.BlueMaximum) -
+			moment(cube.AlphaMaximum, cube.RedMinimum, cube.GreenMaximum, cube.BlueMaximum) +
+			moment(cube.AlphaMaximum, cube.RedMinimum, cube.GreenMinimum, cube.BlueMaximum) -
+			moment(cube.AlphaMinimum, cube.RedMaximum, cube.GreenMaximum, cube.BlueMaximum) +
+			moment(cube.AlphaMinimum, cube.RedMaximum, cube.GreenMinimum, cube.BlueMaximum) +
+			moment(cube.AlphaMinimum, cube.RedMinimum, cube.GreenMaximum, cube.BlueMaximum) -
+			moment(cube.AlphaMinimum, cube.RedMinimum, cube.GreenMinimum, cube.BlueMaximum)) -
+			(moment(cube.AlphaMaximum, cube.RedMaximum, cube.GreenMaximum, cube.BlueMinimum) -
+				moment(cube.AlphaMinimum, cube.RedMaximum, cube.GreenMaximum, cube.BlueMinimum) -
+				moment(cube.AlphaMaximum, cube.RedMaximum, cube.GreenMinimum, cube.BlueMinimum) +
+				moment(cube.AlphaMinimum, cube.RedMaximum, cube.GreenMinimum, cube.BlueMinimum) -
+				moment(cube.AlphaMaximum, cube.RedMinimum, cube.GreenMaximum, cube.BlueMinimum) +
+				moment(cube.AlphaMinimum, cube.RedMinimum, cube.GreenMaximum, cube.BlueMinimum) +
+				moment(cube.AlphaMaximum, cube.RedMinimum, cube.GreenMinimum, cube.BlueMinimum) -
+				moment(cube.AlphaMinimum, cube.RedMinimum, cube.GreenMinimum, cube.BlueMinimum));
 	}
 
-	inline float Top(const Box& cube, Pixel direction, BYTE position, long* moment)
+	template <typename T>
+	inline float Top(const Box& cube, Pixel direction, BYTE position, const Moment<T>* moments, T Moment<T>::* member)
 	{
+		auto moment = [&](BYTE alpha, BYTE red, BYTE green, BYTE blue) {
+			return static_cast<Summand<T> >(moments[Index(alpha, red, green, blue)].*member);
+		};
+
 		switch (direction)
 		{
 		case Alpha:
-			return (moment[Index(position, cube.RedMaximum, cube.GreenMaximum, cube.BlueMaximum)] -
-				moment[Index(position, cube.RedMaximum, cube.GreenMinimum, cube.BlueMaximum)] -
-				moment[Index(position, cube.RedMinimum, cube.GreenMaximum, cube.BlueMaximum)] +
-				moment[Index(position, cube.RedMinimum, cube.GreenMinimum, cube.BlueMaximum)]) -
-				(moment[Index(position, cube.RedMaximum, cube.GreenMaximum, cube.BlueMinimum)] -
-					moment[Index(position, cube.RedMaximum, cube.GreenMinimum, cube.BlueMinimum)] -
-					moment[Index(position, cube.RedMinimum, cube.GreenMaximum, cube.BlueMinimum)] +
-					moment[Index(position, cube.RedMinimum, cube.GreenMinimum, cube.BlueMinimum)]);
+			return (moment(position, cube.RedMaximum, cube.GreenMaximum, cube.BlueMaximum) -
+				moment(position, cube.RedMaximum, cube.GreenMinimum, cube.BlueMaximum) -
+				moment(position, cube.RedMinimum, cube.GreenMaximum, cube.BlueMaximum) +
+				moment(position, cube.RedMinimum, cube.GreenMinimum, cube.BlueMaximum)) -
+				(moment(position, cube.RedMaximum, cube.GreenMaximum, cube.BlueMinimum) -
+					moment(position, cube.RedMaximum, cube.GreenMinimum, cube.BlueMinimum) -
+					moment(position, cube.RedMinimum, cube.GreenMaximum, cube.BlueMinimum) +
+					moment(position, cube.RedMinimum, cube.GreenMinimum, cube.BlueMinimum));
 
 		case Red:
-			return (moment[Index(cube.AlphaMaximum, position, cube.GreenMaximum, cube.BlueMaximum)] -
-				moment[Index(cube.AlphaMaximum, position, cube.GreenMinimum, cube.BlueMaximum)] -
-				moment[Index(cube.AlphaMinimum, position, cube.GreenMaximum, cube.BlueMaximum)] +
-				moment[Index(cube.AlphaMinimum, position, cube.GreenMinimum, cube.BlueMaximum)]) -
-				(moment[Index(cube.AlphaMaximum, position, cube.GreenMaximum, cube.BlueMinimum)] -
-					moment[Index(cube.AlphaMaximum, position, cube.GreenMinimum, cube.BlueMinimum)] -
-					moment[Index(cube.AlphaMinimum, position, cube.GreenMaximum, cube.BlueMinimum)] +
-					moment[Index(cube.AlphaMinimum, position, cube.GreenMinimum, cube.BlueMinimum)]);
+			return (moment(cube.AlphaMaximum, position, cube.GreenMaximum, cube.BlueMaximum) -
+				moment(cube.AlphaMaximum, position, cube.GreenMinimum, cube.BlueMaximum) -
+				moment(cube.AlphaMinimum, position, cube.GreenMaximum, cube.BlueMaximum) +
+				moment(cube.AlphaMinimum, position, cube.GreenMinimum, cube.BlueMaximum)) -
+				(moment(cube.AlphaMaximum, position, cube.GreenMaximum, cube.BlueMinimum) -
+					moment(cube.AlphaMaximum, position, cube.GreenMinimum, cube.BlueMinimum) -
+					moment(cube.AlphaMinimum, position, cube.GreenMaximum, cube.BlueMinimum) +
+					moment(cube.AlphaMinimum, position, cube.GreenMinimum, cube.BlueMinimum));
 
 		case Green:
-			return (moment[Index(cube.AlphaMaximum, cube.RedMaximum, position, cube.BlueMaximum)] -
-				moment[Index(cube.AlphaMaximum, cube.RedMinimum, position, cube.BlueMaximum)] -
-				moment[Index(cube.AlphaMinimum, cube.RedMaximum, position, cube.BlueMaximum)] +
-				moment[Index(cube.AlphaMinimum, cube.RedMinimum, position, cube.BlueMaximum)]) -
-				(moment[Index(cube.AlphaMaximum, cube.RedMaximum, position, cube.BlueMinimum)] -
-					moment[Index(cube.AlphaMaximum, cube.RedMinimum, position, cube.BlueMinimum)] -
-					moment[Index(cube.AlphaMinimum, cube.RedMaximum, position, cube.BlueMinimum)] +
-					moment[Index(cube.AlphaMinimum, cube.RedMinimum, position, cube.BlueMinimum)]);
+			return (moment(cube.AlphaMaximum, cube.RedMaximum, position, cube.BlueMaximum) -
+				moment(cube.AlphaMaximum, cube.RedMinimum, position, cube.BlueMaximum) -
+				moment(cube.AlphaMinimum, cube.RedMaximum, position, cube.BlueMaximum) +
+				moment(cube.AlphaMinimum, cube.RedMinimum, position, cube.BlueMaximum)) -
+				(moment(cube.AlphaMaximum, cube.RedMaximum, position, cube.BlueMinimum) -
+					moment(cube.AlphaMaximum, cube.RedMinimum, position, cube.BlueMinimum) -
+					moment(cube.AlphaMinimum, cube.RedMaximum, position, cube.BlueMinimum) +
+					moment(cube.AlphaMinimum, cube.RedMinimum, position, cube.BlueMinimum));
 
 		case Blue:
-			return (moment[Index(cube.AlphaMaximum, cube.RedMaximum, cube.GreenMaximum, position)] -
-				moment[Index(cube.AlphaMaximum, cube.RedMaximum, cube.GreenMinimum, position)] -
-				moment[Index(cube.AlphaMaximum, cube.RedMinimum, cube.GreenMaximum, position)] +
-				moment[Index(cube.AlphaMaximum, cube.RedMinimum, cube.GreenMinimum, position)]) -
-				(moment[Index(cube.AlphaMinimum, cube.RedMaximum, cube.GreenMaximum, position)] -
-					moment[Index(cube.AlphaMinimum, cube.RedMaximum, cube.GreenMinimum, position)] -
-					moment[Index(cube.AlphaMinimum, cube.RedMinimum, cube.GreenMaximum, position)] +
-					moment[Index(cube.AlphaMinimum, cube.RedMinimum, cube.GreenMinimum, position)]);
+			return (moment(cube.AlphaMaximum, cube.RedMaximum, cube.GreenMaximum, position) -
+				moment(cube.AlphaMaximum, cube.RedMaximum, cube.GreenMinimum, position) -
+				moment(cube.AlphaMaximum, cube.RedMinimum, cube.GreenMaximum, position) +
+				moment(cube.AlphaMaximum, cube.RedMinimum, cube.GreenMinimum, position)) -
+				(moment(cube.AlphaMinimum, cube.RedMaximum, cube.GreenMaximum, position) -
+					moment(cube.AlphaMinimum, cube.RedMaximum, cube.GreenMinimum, position) -
+					moment(cube.AlphaMinimum, cube.RedMinimum, cube.GreenMaximum, position) +
+					moment(cube.AlphaMinimum, cube.RedMinimum, cube.GreenMinimum, position));
 
 		default:
 			return 0;
 		}
 	}
 
-	inline float Bottom(const Box& cube, Pixel direction, long* moment)
+	template <typename T>
+	inline float Bottom(const Box& cube, Pixel direction, const Moment<T>* moments, T Moment<T>::* member)
 	{
+		auto moment = [&](BYTE alpha, BYTE red, BYTE green, BYTE blue) {
+			return static_cast<Summand<T> >(moments[Index(alpha, red, green, blue)].*member);
+		};
+
 		switch (direction)
 		{
 		case Alpha:
-			return (-moment[Index(cube.AlphaMinimum, cube.RedMaximum, cube.GreenMaximum, cube.BlueMaximum)] +
-				moment[Index(cube.AlphaMinimum, cube.RedMaximum, cube.GreenMinimum, cube.BlueMaximum)] +
-				moment[Index(cube.AlphaMinimum, cube.RedMinimum, cube.GreenMaximum, cube.BlueMaximum)] -
-				moment[Index(cube.AlphaMinimum, cube.RedMinimum, cube.GreenMinimum, cube.BlueMaximum)]) -
-				(-moment[Index(cube.AlphaMinimum, cube.RedMaximum, cube.GreenMaximum, cube.BlueMinimum)] +
-					moment[Index(cube.AlphaMinimum, cube.RedMaximum, cube.GreenMinimum, cube.BlueMinimum)] +
-					moment[Index(cube.AlphaMinimum, cube.RedMinimum, cube.GreenMaximum, cube.BlueMinimum)] -
-					moment[Index(cube.AlphaMinimum, cube.RedMinimum, cube.GreenMinimum, cube.BlueMinimum)]);
+			return (-moment(cube.AlphaMinimum, cube.RedMaximum, cube.GreenMaximum, cube.BlueMaximum) +
+				moment(cube.AlphaMinimum, cube.RedMaximum, cube.GreenMinimum, cube.BlueMaximum) +
+				moment(cube.AlphaMinimum, cube.RedMinimum, cube.GreenMaximum, cube.BlueMaximum) -
+				moment(cube.AlphaMinimum, cube.RedMinimum, cube.GreenMinimum, cube.BlueMaximum)) -
+				(-moment(cube.AlphaMinimum, cube.RedMaximum, cube.GreenMaximum, cube.BlueMinimum) +
+					moment(cube.AlphaMinimum, cube.RedMaximum, cube.GreenMinimum, cube.BlueMinimum) +
+					moment(cube.AlphaMinimum, cube.RedMinimum, cube.GreenMaximum, cube.BlueMinimum) -
+					moment(cube.AlphaMinimum, cube.RedMinimum, cube.GreenMinimum, cube.BlueMinimum));
 
 		case Red:
-			return (-moment[Index(cube.AlphaMaximum, cube.RedMinimum, cube.GreenMaximum, cube.BlueMaximum)] +
-				moment[Index(cube.AlphaMaximum, cube.RedMinimum, cube.GreenMinimum, cube.BlueMaximum)] +
-				moment[Index(cube.AlphaMinimum, cube.RedMinimum, cube.GreenMaximum, cube.BlueMaximum)] -
-				moment[Index(cube.AlphaMinimum, cube.RedMinimum, cube.GreenMinimum, cube.BlueMaximum)]) -
-				(-moment[Index(cube.AlphaMaximum, cube.RedMinimum, cube.GreenMaximum, cube.BlueMinimum)] +
-					moment[Index(cube.AlphaMaximum, cube.RedMinimum, cube.GreenMinimum, cube.BlueMinimum)] +
-					moment[Index(cube.AlphaMinimum, cube.RedMinimum, cube.GreenMaximum, cube.BlueMinimum)] -
-					moment[Index(cube.AlphaMinimum, cube.RedMinimum, cube.GreenMinimum, cube.BlueMinimum)]);
+			return (-moment(cube.AlphaMaximum, cube.RedMinimum, cube.GreenMaximum, cube.BlueMaximum) +
+				moment(cube.AlphaMaximum, cube.RedMinimum, cube.GreenMinimum, cube.BlueMaximum) +
+				moment(cube.AlphaMinimum, cube.RedMinimum, cube.GreenMaximum, cube.BlueMaximum) -
+				moment(cube.AlphaMinimum, cube.RedMinimum, cube.GreenMinimum, cube.BlueMaximum)) -
+				(-moment(cube.AlphaMaximum, cube.RedMinimum, cube.GreenMaximum, cube.BlueMinimum) +
+					moment(cube.AlphaMaximum, cube.RedMinimum, cube.GreenMinimum, cube.BlueMinimum) +
+					moment(cube.AlphaMinimum, cube.RedMinimum, cube.GreenMaximum, cube.BlueMinimum) -
+					moment(cube.AlphaMinimum, cube.RedMinimum, cube.GreenMinimum, cube.BlueMinimum));
 
 		case Green:
-			return (-moment[Index(cube.AlphaMaximum, cube.RedMaximum, cube.GreenMinimum, cube.BlueMaximum)] +
-				moment[Index(cube.AlphaMaximum, cube.RedMinimum, cube.GreenMinimum, cube.BlueMaximum)] +
-				moment[Index(cube.AlphaMinimum, cube.RedMaximum, cube.GreenMinimum, cube.BlueMaximum)] -
-				moment[Index(cube.AlphaMinimum, cube.RedMinimum, cube.GreenMinimum, cube.BlueMaximum)]) -
-				(-moment[Index(cube.AlphaMaximum, cube.RedMaximum, cube.GreenMinimum, cube.BlueMinimum)] +
-					moment[Index(cube.AlphaMaximum, cube.RedMinimum, cube.GreenMinimum, cube.BlueMinimum)] +
-					moment[Index(cube.AlphaMinimum, cube.RedMaximum, cube.GreenMinimum, cube.BlueMinimum)] -
-					moment[Index(cube.AlphaMinimum, cube.RedMinimum, cube.GreenMinimum, cube.BlueMinimum)]);
+			return (-moment(cube.AlphaMaximum, cube.RedMaximum, cube.GreenMinimum, cube.BlueMaximum) +
+				moment(cube.AlphaMaximum, cube.RedMinimum, cube.GreenMinimum, cube.BlueMaximum) +
+				moment(cube.AlphaMinimum, cube.RedMaximum, cube.GreenMinimum, cube.BlueMaximum) -
+				moment(cube.AlphaMinimum, cube.RedMinimum, cube.GreenMinimum, cube.BlueMaximum)) -
+				(-moment(cube.AlphaMaximum, cube.RedMaximum, cube.GreenMinimum, cube.BlueMinimum) +
+					moment(cube.AlphaMaximum, cube.RedMinimum, cube.GreenMinimum, cube.BlueMinimum) +
+					moment(cube.AlphaMinimum, cube.RedMaximum, cube.GreenMinimum, cube.BlueMinimum) -
+					moment(cube.AlphaMinimum, cube.RedMinimum, cube.GreenMinimum, cube.BlueMinimum));
 
 		case Blue:
-			return (-moment[Index(cube.AlphaMaximum, cube.RedMaximum, cube.GreenMaximum, cube.BlueMinimum)] +
-				moment[Index(cube.AlphaMaximum, cube.RedMaximum, cube.GreenMinimum, cube.BlueMinimum)] +
-				moment[Index(cube.AlphaMaximum, cube.RedMinimum, cube.GreenMaximum, cube.BlueMinimum)] -
-				moment[Index(cube.AlphaMaximum, cube.RedMinimum, cube.GreenMinimum, cube.BlueMinimum)]) -
-				(-moment[Index(cube.AlphaMinimum, cube.RedMaximum, cube.GreenMaximum, cube.BlueMinimum)] +
-					moment[Index(cube.AlphaMinimum, cube.RedMaximum, cube.GreenMinimum, cube.BlueMinimum)] +
-					moment[Index(cube.AlphaMinimum, cube.RedMinimum, cube.GreenMaximum, cube.BlueMinimum)] -
-					moment[Index(cube.AlphaMinimum, cube.RedMinimum, cube.GreenMinimum, cube.BlueMinimum)]);
+			return (-moment(cube.AlphaMaximum, cube.RedMaximum, cube.GreenMaximum, cube.BlueMinimum) +
+				moment(cube.AlphaMaximum, cube.RedMaximum, cube.GreenMinimum, cube.BlueMinimum) +
+				moment(cube.AlphaMaximum, cube.RedMinimum, cube.GreenMaximum, cube.BlueMinimum) -
+				moment(cube.AlphaMaximum, cube.RedMinimum, cube.GreenMinimum, cube.BlueMinimum)) -
+				(-moment(cube.AlphaMinimum, cube.RedMaximum, cube.GreenMaximum, cube.BlueMinimum) +
+					moment(cube.AlphaMinimum, cube.RedMaximum, cube.GreenMinimum, cube.BlueMinimum) +
+					moment(cube.AlphaMinimum, cube.RedMinimum, cube.GreenMaximum, cube.BlueMinimum) -
+					moment(cube.AlphaMinimum, cube.RedMinimum, cube.GreenMinimum, cube.BlueMinimum));
 
 		default:
 			return 0;
 		}
-	}	
+	}
 
-	void Histogram3d(ColorData& colorData, const Color& color, const BYTE alphaThreshold, const BYTE alphaFader)
+	bool ReadPixels(PixelData& pixelData, const BYTE alphaThreshold, const BYTE alphaFader)
 	{
-		BYTE pixelBlue = color.GetB();
-		BYTE pixelGreen = color.GetG();
-		BYTE pixelRed = color.GetR();
-		BYTE pixelAlpha = color.GetA();
-
-		BYTE indexAlpha = static_cast<BYTE>((pixelAlpha >> SIDEPIXSHIFT) + 1);
-		BYTE indexRed = static_cast<BYTE>((pixelRed >> SIDEPIXSHIFT) + 1);
-		BYTE indexGreen = static_cast<BYTE>((pixelGreen >> SIDEPIXSHIFT) + 1);
-		BYTE indexBlue = static_cast<BYTE>((pixelBlue >> SIDEPIXSHIFT) + 1);
-
-		if (pixelAlpha > alphaThreshold) {
-			if (pixelAlpha < BYTE_MAX) {
+		auto sourceImage = pixelData.pSource;
+		const UINT bitDepth = GetPixelFormatSize(sourceImage->GetPixelFormat());
+		const UINT bitmapWidth = sourceImage->GetWidth();
+		const UINT bitmapHeight = sourceImage->GetHeight();
+		const int pixelsCount = pixelData.pixelsCount;
+
+		if (bitDepth <= 16) {
+			pixelData.buffer = make_unique<ARGB[]>(pixelsCount);
+			int pixelIndex = 0;
+			for (UINT y = 0; y < bitmapHeight; ++y) {
+				for (UINT x = 0; x < bitmapWidth; ++x, ++pixelIndex) {
+					Color color;
+					sourceImage->GetPixel(x, y, &color);
+					pixelData.buffer[pixelIndex] = color.GetValue();
+				}
+			}
+		}
+		else {
+			auto& data = pixelData.data;
+			Status status = sourceImage->LockBits(&Rect(0, 0, bitmapWidth, bitmapHeight), ImageLockModeRead, PixelFormat32bppARGB, &data);
+			if (status != Ok)
+				return false;
+
+			// Read straight from the locked bits unless the rows are padded, upside down or have to be faded
+			if (alphaFader <= 1 && data.Stride == bitmapWidth * sizeof(ARGB)) {
+				pixelData.locked = true;
+				pixelData.pixels = (const ARGB*) data.Scan0;
+			}
+			else {
+				auto pRowSource = (LPBYTE)data.Scan0;
+				UINT strideSource;
+
+				if (data.Stride > 0) strideSource = data.Stride;
+				else
+				{
+					// Compensate for possible negative stride
+					pRowSource += bitmapHeight * data.Stride;
+					strideSource = -data.Stride;
+				}
+
+				pixelData.buffer = make_unique<ARGB[]>(pixelsCount);
+				#pragma omp parallel for
+				for (int y = 0; y < bitmapHeight; ++y)	// For each row...
+				{
+					auto pPixelSource = pRowSource + y * strideSource;
+					int pixelIndex = y * bitmapWidth;
+
+					for (UINT x = 0; x < bitmapWidth; ++x, ++pixelIndex)	// ...for each pixel...
+					{
+						BYTE pixelBlue = *pPixelSource++;
+						BYTE pixelGreen = *pPixelSource++;
+						BYTE pixelRed = *pPixelSource++;
+						BYTE pixelAlpha = *pPixelSource++;
+						pixelData.buffer[pixelIndex] = Color::MakeARGB(pixelAlpha, pixelRed, pixelGreen, pixelBlue);
+					}
+				}
+				sourceImage->UnlockBits(&data);
+			}
+		}
+
+		bool semiTransparency = false;
+		auto pixels = pixelData.buffer.get();
+		#pragma omp parallel for reduction(||: semiTransparency)
+		for (int pixelIndex = 0; pixelIndex < pixelsCount; ++pixelIndex) {
+			Color color(pixels ? pixels[pixelIndex] : pixelData.pixels[pixelIndex]);
+			BYTE pixelAlpha = color.GetA();
+			if (pixelAlpha < 0xE0 && pixelAlpha > 0 && pixelAlpha > alphaThreshold)
+				semiTransparency = true;
+
+			if (pixels && pixelAlpha > alphaThreshold && pixelAlpha < BYTE_MAX) {
 				short alpha = pixelAlpha + (pixelAlpha % alphaFader);
 				pixelAlpha = static_cast<BYTE>(alpha > BYTE_MAX ? BYTE_MAX : alpha);
-				indexAlpha = static_cast<BYTE>((pixelAlpha >> 3) + 1);
+				pixels[pixelIndex] = Color::MakeARGB(pixelAlpha, color.GetR(), color.GetG(), color.GetB());
 			}
+		}
 
-			const int index = Index(indexAlpha, indexRed, indexGreen, indexBlue);
-			if (index < TOTAL_SIDESIZE) {
-				colorData.weights[index]++;
-				colorData.momentsRed[index] += pixelRed;
-				colorData.momentsGreen[index] += pixelGreen;
-				colorData.momentsBlue[index] += pixelBlue;
-				colorData.momentsAlpha[index] += pixelAlpha;
-				colorData.moments[index] += sqr(pixelAlpha) + sqr(pixelRed) + sqr(pixelGreen) + sqr(pixelBlue);
+		if (pixels)
+			pixelData.pixels = pixels;
+		if (semiTransparency)
+			hasSemiTransparency = true;
+
+		for (int pixelIndex = pixelsCount - 1; pixelIndex >= 0; --pixelIndex) {
+			Color color(pixelData.pixels[pixelIndex]);
+			if (color.GetA() == 0) {
+				m_transparentPixelIndex = pixelIndex;
+				m_transparentColor = color.GetValue();
+				break;
 			}
-		}		
-
-		colorData.AddPixel(Color::MakeARGB(pixelAlpha, pixelRed, pixelGreen, pixelBlue));
+		}
+		return true;
 	}
 
-	void AdjustMoments(const ColorData& colorData, const UINT& nMaxColors)
+	template <typename T>
+	void AdjustMoments(const ColorData<T>& colorData, const UINT& nMaxColors)
 	{
 		vector<int> indices;
 		for (int i = 0; i < TOTAL_SIDESIZE; ++i) {
-			double d = colorData.weights[i];
+			double d = colorData.moments[i].weight;
 			if (d > 0)
 				indices.emplace_back(i);
 		}
@@ -295,167 +364,129 @@ namespace nQuant
 			return;
 
 		for (const auto& i : indices) {
-			double d = colorData.weights[i];
-			d = (colorData.weights[i] = _sqrt(d)) / d;
-			colorData.momentsRed[i] *= d;
-			colorData.momentsGreen[i] *= d;
-			colorData.momentsBlue[i] *= d;
-			colorData.momentsAlpha[i] *= d;
-			colorData.moments[i] *= d;
+			auto& moment = colorData.moments[i];
+			double d = moment.weight;
+			d = (moment.weight = _sqrt(d)) / d;
+			moment.momentRed *= d;
+			moment.momentGreen *= d;
+			moment.momentBlue *= d;
+			moment.momentAlpha *= d;
+			moment.moment *= d;
 		}
 	}
 
-	void BuildHistogram(ColorData& colorData, Bitmap* sourceImage, const UINT& nMaxColors, BYTE alphaThreshold, BYTE alphaFader)
+	template <typename T>
+	void BuildHistogram(ColorData<T>& colorData, const PixelData& pixelData, const UINT& nMaxColors, BYTE alphaThreshold)
 	{
-		const UINT bitDepth = GetPixelFormatSize(sourceImage->GetPixelFormat());
-		const UINT bitmapWidth = sourceImage->GetWidth();
-		const UINT bitmapHeight = sourceImage->GetHeight();
-
-		int pixelIndex = 0;
-		if (bitDepth <= 16) {
-			for (UINT y = 0; y < bitmapHeight; ++y) {
-				for (UINT x = 0; x < bitmapWidth; ++x, ++pixelIndex) {
-					Color color;
-					sourceImage->GetPixel(x, y, &color);
-					if (color.GetA() < 0xE0) {
-						if (color.GetA() == 0) {
-							m_transparentPixelIndex = pixelIndex;
-							m_transparentColor = color.GetValue();
-						}
-						else if (color.GetA() > alphaThreshold)
-							hasSemiTransparency = true;
-					}
-					Histogram3d(colorData, color, alphaThreshold, alphaFader);
-				}
+		const int pixelsCount = pixelData.pixelsCount;
+		auto pixels = pixelData.pixels;
+
+		// The bin of every pixel is found once, -1 if the pixel is too transparent to count
+		vector<int> bins(pixelsCount);
+		#pragma omp parallel for
+		for (int pixelIndex = 0; pixelIndex < pixelsCount; ++pixelIndex) {
+			Color color(pixels[pixelIndex]);
+			BYTE pixelAlpha = color.GetA();
+			if (pixelAlpha <= alphaThreshold) {
+				bins[pixelIndex] = -1;
+				continue;
 			}
 
-			AdjustMoments(colorData, nMaxColors);
-			return;
+			BYTE indexAlpha = static_cast<BYTE>((pixelAlpha >> SIDEPIXSHIFT) + 1);
+			BYTE indexRed = static_cast<BYTE>((color.GetR() >> SIDEPIXSHIFT) + 1);
+			BYTE indexGreen = static_cast<BYTE>((color.GetG() >> SIDEPIXSHIFT) + 1);
+			BYTE indexBlue = static_cast<BYTE>((color.GetB() >> SIDEPIXSHIFT) + 1);
+			bins[pixelIndex] = Index(indexAlpha, indexRed, indexGreen, indexBlue);
 		}
 
-		BitmapData data;
-		Status status = sourceImage->LockBits(&Rect(0, 0, bitmapWidth, bitmapHeight), ImageLockModeRead, PixelFormat32bppARGB, &data);
-		if (status != Ok)
-			return;
-
-		auto pRowSource = (LPBYTE)data.Scan0;
-		UINT strideSource;
+		// Each part owns a contiguous range of the cube. A stable counting sort hands every part
+		// its own pixels in order, so the float moments are summed in exactly the same sequence as a serial pass.
+		const int nParts = max(1, omp_get_max_threads());
+		auto partOf = [nParts](const int bin) -> int {
+			return (int) ((long long) bin * nParts / TOTAL_SIDESIZE);
+		};
+		vector<int> starts(nParts + 1), order(pixelsCount);
+		for (const auto bin : bins) {
+			if (bin >= 0)
+				++starts[partOf(bin) + 1];
+		}
+		for (int part = 0; part < nParts; ++part)
+			starts[part + 1] += starts[part];
 
-		if (data.Stride > 0) strideSource = data.Stride;
-		else
-		{
-			// Compensate for possible negative stride
-			// (not needed for first loop, but we have to do it
-			// for second loop anyway)
-			pRowSource += bitmapHeight * data.Stride;
-			strideSource = -data.Stride;
+		vector<int> next(starts.begin(), starts.end() - 1);
+		for (int pixelIndex = 0; pixelIndex < pixelsCount; ++pixelIndex) {
+			if (bins[pixelIndex] >= 0)
+				order[next[partOf(bins[pixelIndex])]++] = pixelIndex;
 		}
 
-		// First loop: gather color information
-		for (UINT y = 0; y < bitmapHeight; ++y)	// For each row...
-		{
-			auto pPixelSource = pRowSource;
-
-			for (UINT x = 0; x < bitmapWidth; ++x, ++pixelIndex)	// ...for each pixel...
-			{
-				BYTE pixelBlue = *pPixelSource++;
-				BYTE pixelGreen = *pPixelSource++;
-				BYTE pixelRed = *pPixelSource++;
-				BYTE pixelAlpha = *pPixelSource++;
-
-				Color color(Color::MakeARGB(pixelAlpha, pixelRed, pixelGreen, pixelBlue));
-				if (color.GetA() < 0xE0) {
-					if (pixelAlpha == 0) {
-						m_transparentPixelIndex = pixelIndex;
-						m_transparentColor = color.GetValue();
-					}
-					else if (color.GetA() > alphaThreshold)
-						hasSemiTransparency = true;
-				}
-				Histogram3d(colorData, color, alphaThreshold, alphaFader);
+		#pragma omp parallel for schedule(dynamic)
+		for (int part = 0; part < nParts; ++part) {
+			for (int k = starts[part]; k < starts[part + 1]; ++k) {
+				const int pixelIndex = order[k];
+				Color color(pixels[pixelIndex]);
+				BYTE pixelBlue = color.GetB();
+				BYTE pixelGreen = color.GetG();
+				BYTE pixelRed = color.GetR();
+				BYTE pixelAlpha = color.GetA();
+
+				auto& moment = colorData.moments[bins[pixelIndex]];
+				moment.weight++;
+				moment.momentRed += pixelRed;
+				moment.momentGreen += pixelGreen;
+				moment.momentBlue += pixelBlue;
+				moment.momentAlpha += pixelAlpha;
+				moment.moment += sqr(pixelAlpha) + sqr(pixelRed) + sqr(pixelGreen) + sqr(pixelBlue);
 			}
-
-			pRowSource += strideSource;
 		}
-
-		sourceImage->UnlockBits(&data);
-		AdjustMoments(colorData, nMaxColors);
 	}
 
-	void CalculateMoments(ColorData& data)
+	template <typename T>
+	void CumulateMoment(Moment<T>* moments, const UINT outerStride, const UINT axisStride, const UINT innerStride, const UINT lineStride)
 	{
-		const UINT SIDESIZE_3 = SIDESIZE * SIDESIZE * SIDESIZE;
-		for (BYTE alphaIndex = 1; alphaIndex <= MAXSIDEINDEX; ++alphaIndex)
-		{
-			auto xarea = make_unique<UINT[]>(SIDESIZE_3);
-			auto xareaAlpha = make_unique<UINT[]>(SIDESIZE_3);
-			auto xareaRed = make_unique<UINT[]>(SIDESIZE_3);
-			auto xareaGreen = make_unique<UINT[]>(SIDESIZE_3);
-			auto xareaBlue = make_unique<UINT[]>(SIDESIZE_3);
-			auto xarea2 = make_unique<float[]>(SIDESIZE_3);
-
-			for (BYTE redIndex = 1; redIndex <= MAXSIDEINDEX; ++redIndex)
-			{
-				UINT area[SIDESIZE] = { 0 };
-				UINT areaAlpha[SIDESIZE] = { 0 };
-				UINT areaRed[SIDESIZE] = { 0 };
-				UINT areaGreen[SIDESIZE] = { 0 };
-				UINT areaBlue[SIDESIZE] = { 0 };
-				float area2[SIDESIZE] = { 0 };
-
-				for (BYTE greenIndex = 1; greenIndex <= MAXSIDEINDEX; ++greenIndex) {
-					UINT line = 0;
-					UINT lineAlpha = 0;
-					UINT lineRed = 0;
-					UINT lineGreen = 0;
-					UINT lineBlue = 0;
-					float line2 = 0.0f;
-
-					for (BYTE blueIndex = 1; blueIndex <= MAXSIDEINDEX; ++blueIndex) {
-						const UINT index = Index(alphaIndex, redIndex, greenIndex, blueIndex);
-						line += data.weights[index];
-						lineAlpha += data.momentsAlpha[index];
-						lineRed += data.momentsRed[index];
-						lineGreen += data.momentsGreen[index];
-						lineBlue += data.momentsBlue[index];
-						line2 += data.moments[index];
-
-						area[blueIndex] += line;
-						areaAlpha[blueIndex] += lineAlpha;
-						areaRed[blueIndex] += lineRed;
-						areaGreen[blueIndex] += lineGreen;
-						areaBlue[blueIndex] += lineBlue;
-						area2[blueIndex] += line2;
-
-						const UINT rgbIndex = Index(redIndex, greenIndex, blueIndex);
-						const UINT prevRgbIndex = Index(redIndex - 1, greenIndex, blueIndex);
-						xarea[rgbIndex] = xarea[prevRgbIndex] + area[blueIndex];
-						xareaAlpha[rgbIndex] = xareaAlpha[prevRgbIndex] + areaAlpha[blueIndex];
-						xareaRed[rgbIndex] = xareaRed[prevRgbIndex] + areaRed[blueIndex];
-						xareaGreen[rgbIndex] = xareaGreen[prevRgbIndex] + areaGreen[blueIndex];
-						xareaBlue[rgbIndex] = xareaBlue[prevRgbIndex] + areaBlue[blueIndex];
-						xarea2[rgbIndex] = xarea2[prevRgbIndex] + area2[blueIndex];
-
-						const UINT prevIndex = Index(alphaIndex - 1, redIndex, greenIndex, blueIndex);
-						data.weights[index] = data.weights[prevIndex] + xarea[rgbIndex];
-						data.momentsAlpha[index] = data.momentsAlpha[prevIndex] + xareaAlpha[rgbIndex];
-						data.momentsRed[index] = data.momentsRed[prevIndex] + xareaRed[rgbIndex];
-						data.momentsGreen[index] = data.momentsGreen[prevIndex] + xareaGreen[rgbIndex];
-						data.momentsBlue[index] = data.momentsBlue[prevIndex] + xareaBlue[rgbIndex];
-						data.moments[index] = data.moments[prevIndex] + xarea2[rgbIndex];
+		#pragma omp parallel for
+		for (int outerIndex = 1; outerIndex <= MAXSIDEINDEX; ++outerIndex) {
+			for (UINT axisIndex = 1; axisIndex <= MAXSIDEINDEX; ++axisIndex) {
+				for (UINT innerIndex = 1; innerIndex <= MAXSIDEINDEX; ++innerIndex) {
+					const UINT offset = outerIndex * outerStride + axisIndex * axisStride + innerIndex * innerStride;
+					for (UINT lineIndex = 1; lineIndex <= MAXSIDEINDEX; ++lineIndex) {
+						const UINT index = offset + lineIndex * lineStride;
+						auto& moment = moments[index];
+						const auto& prevMoment = moments[index - axisStride];
+						moment.weight += prevMoment.weight;
+						moment.momentAlpha += prevMoment.momentAlpha;
+						moment.momentRed += prevMoment.momentRed;
+						moment.momentGreen += prevMoment.momentGreen;
+						moment.momentBlue += prevMoment.momentBlue;
+						moment.moment += prevMoment.moment;
 					}
 				}
 			}
 		}
 	}
 
-	CubeCut Maximize(const ColorData& data, const Box& cube, Pixel direction, BYTE first, BYTE last, UINT wholeAlpha, UINT wholeRed, UINT wholeGreen, UINT wholeBlue, UINT wholeWeight)
+	template <typename T>
+	void CalculateMoments(ColorData<T>& data)
 	{
-		auto bottomAlpha = Bottom(cube, direction, data.momentsAlpha.get());
-		auto bottomRed = Bottom(cube, direction, data.momentsRed.get());
-		auto bottomGreen = Bottom(cube, direction, data.momentsGreen.get());
-		auto bottomBlue = Bottom(cube, direction, data.momentsBlue.get());
-		auto bottomWeight = Bottom(cube, direction, data.weights.get());
+		const UINT alphaStride = 1, redStride = SIDESIZE, greenStride = SIDESIZE * SIDESIZE, blueStride = SIDESIZE * SIDESIZE * SIDESIZE;
+		// The running sums are separable, so take them one axis at a time in the order blue, green, red, alpha.
+		// Every element then receives the same additions in the same order as the single nested pass.
+		auto moments = data.moments.get();
+		CumulateMoment(moments, greenStride, blueStride, redStride, alphaStride);
+		CumulateMoment(moments, blueStride, greenStride, redStride, alphaStride);
+		CumulateMoment(moments, blueStride, redStride, greenStride, alphaStride);
+		CumulateMoment(moments, blueStride, alphaStride, greenStride, redStride);
+	}
+
+	template <typename T>
+	CubeCut Maximize(const ColorData<T>& data, const Box& cube, Pixel direction, BYTE first, BYTE last, UINT wholeAlpha, UINT wholeRed, UINT wholeGreen, UINT wholeBlue, UINT wholeWeight)
+	{
+		using M = Moment<T>;
+		auto moments = data.moments.get();
+		auto bottomAlpha = Bottom(cube, direction, moments, &M::momentAlpha);
+		auto bottomRed = Bottom(cube, direction, moments, &M::momentRed);
+		auto bottomGreen = Bottom(cube, direction, moments, &M::momentGreen);
+		auto bottomBlue = Bottom(cube, direction, moments, &M::momentBlue);
+		auto bottomWeight = Bottom(cube, direction, moments, &M::weight);
 
 		bool valid = false;
 		auto result = 0.0f;
@@ -463,11 +494,11 @@ namespace nQuant
 
 		for (int position = first; position < last; ++position)
 		{
-			auto halfAlpha = bottomAlpha + Top(cube, direction, position, data.momentsAlpha.get());
-			auto halfRed = bottomRed + Top(cube, direction, position, data.momentsRed.get());
-			auto halfGreen = bottomGreen + Top(cube, direction, position, data.momentsGreen.get());
-			auto halfBlue = bottomBlue + Top(cube, direction, position, data.momentsBlue.get());
-			auto halfWeight = bottomWeight + Top(cube, direction, position, data.weights.get());
+			auto halfAlpha = bottomAlpha + Top(cube, direction, position, moments, &M::momentAlpha);
+			auto halfRed = bottomRed + Top(cube, direction, position, moments, &M::momentRed);
+			auto halfGreen = bottomGreen + Top(cube, direction, position, moments, &M::momentGreen);
+			auto halfBlue = bottomBlue + Top(cube, direction, position, moments, &M::momentBlue);
+			auto halfWeight = bottomWeight + Top(cube, direction, position, moments, &M::weight);
 
 			if (halfWeight == 0)
 				continue;
@@ -496,13 +527,16 @@ namespace nQuant
 		return CubeCut(valid, cutPoint, result);
 	}
 
-	bool Cut(const ColorData& data, Box& first, Box& second)
+	template <typename T>
+	bool Cut(const ColorData<T>& data, Box& first, Box& second)
 	{
-		auto wholeAlpha = Volume(first, data.momentsAlpha.get());
-		auto wholeRed = Volume(first, data.momentsRed.get());
-		auto wholeGreen = Volume(first, data.momentsGreen.get());
-		auto wholeBlue = Volume(first, data.momentsBlue.get());
-		auto wholeWeight = Volume(first, data.weights.get());
+		using M = Moment<T>;
+		auto moments = data.moments.get();
+		auto wholeAlpha = Volume(first, moments, &M::momentAlpha);
+		auto wholeRed = Volume(first, moments, &M::momentRed);
+		auto wholeGreen = Volume(first, moments, &M::momentGreen);
+		auto wholeBlue = Volume(first, moments, &M::momentBlue);
+		auto wholeWeight = Volume(first, moments, &M::weight);
 
 		auto maxAlpha = Maximize(data, first, Alpha, static_cast<BYTE>(first.AlphaMinimum + 1), first.AlphaMaximum, wholeAlpha, wholeRed, wholeGreen, wholeBlue, wholeWeight);
 		auto maxRed = Maximize(data, first, Red, static_cast<BYTE>(first.RedMinimum + 1), first.RedMaximum, wholeAlpha, wholeRed, wholeGreen, wholeBlue, wholeWeight);
@@ -562,21 +596,25 @@ namespace nQuant
 		return true;
 	}
 
-	float CalculateVariance(const ColorData& data, const Box& cube)
+	template <typename T>
+	float CalculateVariance(const ColorData<T>& data, const Box& cube)
 	{
-		auto volumeAlpha = Volume(cube, data.momentsAlpha.get());
-		auto volumeRed = Volume(cube, data.momentsRed.get());
-		auto volumeGreen = Volume(cube, data.momentsGreen.get());
-		auto volumeBlue = Volume(cube, data.momentsBlue.get());
-		auto volumeMoment = Volume(cube, data.moments.get());
-		auto volumeWeight = Volume(cube, data.weights.get());
+		using M = Moment<T>;
+		auto moments = data.moments.get();
+		auto volumeAlpha = Volume(cube, moments, &M::momentAlpha);
+		auto volumeRed = Volume(cube, moments, &M::momentRed);
+		auto volumeGreen = Volume(cube, moments, &M::momentGreen);
+		auto volumeBlue = Volume(cube, moments, &M::momentBlue);
+		auto volumeMoment = Volume(cube, moments, &M::moment);
+		auto volumeWeight = Volume(cube, moments, &M::weight);
 
 		float distance = sqr(volumeAlpha) + sqr(volumeRed) + sqr(volumeGreen) + sqr(volumeBlue);
 
 		return volumeWeight != 0.0f ? (volumeMoment - distance / volumeWeight) : 0.0f;
 	}
 
-	void SplitData(vector<Box>& boxList, UINT& colorCount, ColorData& data)
+	template <typename T>
+	void SplitData(vector<Box>& boxList, UINT& colorCount, ColorData<T>& data)
 	{
 		int next = 0;
 		auto volumeVariance = make_unique<float[]>(colorCount);
@@ -615,22 +653,25 @@ namespace nQuant
 		boxList.resize(colorCount);
 	}
 
-	void BuildLookups(ColorPalette* pPalette, vector<Box>& cubes, const ColorData& data)
+	template <typename T>
+	void BuildLookups(ColorPalette* pPalette, vector<Box>& cubes, const ColorData<T>& data)
 	{
+		using M = Moment<T>;
+		auto moments = data.moments.get();
 		UINT lookupsCount = 0;
 		if (m_transparentPixelIndex >= 0)
 			pPalette->Entries[lookupsCount++] = m_transparentColor;
 			
 		for (auto const& cube : cubes) {
-			auto weight = Volume(cube, data.weights.get());
+			auto weight = Volume(cube, moments, &M::weight);
 
 			if (weight <= 0)
 				continue;
 
-			BYTE alpha = static_cast<BYTE>(Volume(cube, data.momentsAlpha.get()) / weight);
-			BYTE red = static_cast<BYTE>(Volume(cube, data.momentsRed.get()) / weight);
-			BYTE green = static_cast<BYTE>(Volume(cube, data.momentsGreen.get()) / weight);
-			BYTE blue = static_cast<BYTE>(Volume(cube, data.momentsBlue.get()) / weight);
+			BYTE alpha = static_cast<BYTE>(Volume(cube, moments, &M::momentAlpha) / weight);
+			BYTE red = static_cast<BYTE>(Volume(cube, moments, &M::momentRed) / weight);
+			BYTE green = static_cast<BYTE>(Volume(cube, moments, &M::momentGreen) / weight);
+			BYTE blue = static_cast<BYTE>(Volume(cube, moments, &M::momentBlue) / weight);
 			pPalette->Entries[lookupsCount++] = Color::MakeARGB(alpha, red, green, blue);
 		}
 
@@ -638,6 +679,123 @@ namespace nQuant
 			pPalette->Count = lookupsCount;
 	}
 
+	// Mean colour and pixel count of every occupied histogram cell, kept as separate planes
+	struct Bins {
+		vector<float> alphas, reds, greens, blues, weights;
+	};
+
+	template <typename T>
+	void CollectBins(const ColorData<T>& colorData, Bins& bins)
+	{
+		for (int i = 0; i < TOTAL_SIDESIZE; ++i) {
+			const auto& moment = colorData.moments[i];
+			if (moment.weight == 0)
+				continue;
+
+			const float weight = static_cast<float>(moment.weight);
+			bins.alphas.emplace_back(moment.momentAlpha / weight);
+			bins.reds.emplace_back(moment.momentRed / weight);
+			bins.greens.emplace_back(moment.momentGreen / weight);
+			bins.blues.emplace_back(moment.momentBlue / weight);
+			bins.weights.emplace_back(weight);
+		}
+	}
+
+	// Weighted k-means over the histogram cells, seeded by the Wu palette
+	void RefinePalette(ColorPalette* pPalette, const Bins& bins, const UINT iterations)
+	{
+		const int offset = (m_transparentPixelIndex < 0) ? 0 : 1;
+		const int nColors = (int) pPalette->Count - offset;
+		const int nBins = (int) bins.weights.size();
+		if (nColors < 2 || nBins <= nColors)
+			return;
+
+		vector<float> alphas(nColors), reds(nColors), greens(nColors), blues(nColors);
+		for (int k = 0; k < nColors; ++k) {
+			Color c(pPalette->Entries[k + offset]);
+			alphas[k] = c.GetA();
+			reds[k] = c.GetR();
+			greens[k] = c.GetG();
+			blues[k] = c.GetB();
+		}
+
+		const float pr = static_cast<float>(PR), pg = static_cast<float>(PG), pb = static_cast<float>(PB);
+		vector<int> labels(nBins, -1);
+		for (UINT iter = 0; iter < iterations; ++iter) {
+			int changed = 0;
+			#pragma omp parallel for reduction(+: changed)
+			for (int i = 0; i < nBins; ++i) {
+				const float alpha = bins.alphas[i], red = bins.reds[i], green = bins.greens[i], blue = bins.blues[i];
+				float minDistance = FLT_MAX;
+				int best = 0;
+				for (int k = 0; k < nColors; ++k) {
+					const float da = alphas[k] - alpha, dr = reds[k] - red, dg = greens[k] - green, db = blues[k] - blue;
+					const float distance = da * da + pr * dr * dr + pg * dg * dg + pb * db * db;
+					if (distance < minDistance) {
+						minDistance = distance;
+						best = k;
+					}
+				}
+
+				if (labels[i] != best) {
+					labels[i] = best;
+					++changed;
+				}
+			}
+
+			if (changed == 0)
+				break;
+
+			// Summed serially in bin order so the palette does not depend on the thread count
+			vector<double> sumAlphas(nColors), sumReds(nColors), sumGreens(nColors), sumBlues(nColors), sums(nColors);
+			for (int i = 0; i < nBins; ++i) {
+				const int k = labels[i];
+				const double weight = bins.weights[i];
+				sumAlphas[k] += weight * bins.alphas[i];
+				sumReds[k] += weight * bins.reds[i];
+				sumGreens[k] += weight * bins.greens[i];
+				sumBlues[k] += weight * bins.blues[i];
+				sums[k] += weight;
+			}
+
+			for (int k = 0; k < nColors; ++k) {
+				if (sums[k] <= 0)
+					continue;
+
+				alphas[k] = static_cast<float>(sumAlphas[k] / sums[k]);
+				reds[k] = static_cast<float>(sumReds[k] / sums[k]);
+				greens[k] = static_cast<float>(sumGreens[k] / sums[k]);
+				blues[k] = static_cast<float>(sumBlues[k] / sums[k]);
+			}
+		}
+
+		for (int k = 0; k < nColors; ++k) {
+			pPalette->Entries[k + offset] = Color::MakeARGB(static_cast<BYTE>(alphas[k] + .5f), static_cast<BYTE>(reds[k] + .5f),
+				static_cast<BYTE>(greens[k] + .5f), static_cast<BYTE>(blues[k] + .5f));
+		}
+	}
+
+	template <typename T>
+	size_t BuildPalette(const PixelData& pixelData, ColorPalette* pPalette, UINT& nMaxColors, BYTE alphaThreshold, const UINT kMeansIterations)
+	{
+		ColorData<T> colorData(SIDESIZE);
+		BuildHistogram(colorData, pixelData, nMaxColors, alphaThreshold);
+
+		Bins bins;
+		if (kMeansIterations > 0)
+			CollectBins(colorData, bins);
+
+		AdjustMoments(colorData, nMaxColors);
+		CalculateMoments(colorData);
+		vector<Box> cubes;
+		SplitData(cubes, nMaxColors, colorData);
+
+		BuildLookups(pPalette, cubes, colorData);
+		if (kMeansIterations > 0)
+			RefinePalette(pPalette, bins, kMeansIterations);
+		return TOTAL_SIDESIZE * sizeof(Moment<T>);
+	}
+
 	unsigned short closestColorIndex(const ARGB* pPalette, const UINT nMaxColors, ARGB argb, const UINT pos)
 	{
 		UINT k = 0;
@@ -720,7 +878,7 @@ namespace nQuant
 		return k;
 	}
 
-	void GetQuantizedPalette(const ColorData& data, ColorPalette* pPalette, const UINT colorCount, const BYTE alphaThreshold)
+	void GetQuantizedPalette(const PixelData& data, ColorPalette* pPalette, const UINT colorCount, const BYTE alphaThreshold)
 	{
 		auto alphas = make_unique<UINT[]>(colorCount);
 		auto reds = make_unique<UINT[]>(colorCount);
@@ -868,11 +1026,17 @@ namespace nQuant
 		return true;
 	}
 	
+	void WuQuantizer::setKMeansIterations(UINT iterations)
+	{
+		m_kMeansIterations = iterations;
+	}
+
 	bool WuQuantizer::QuantizeImage(Bitmap* pSource, Bitmap* pDest, UINT& nMaxColors, bool dither, BYTE alphaThreshold, BYTE alphaFader)
 	{
 		const UINT bitmapWidth = pSource->GetWidth();
 		const UINT bitmapHeight = pSource->GetHeight();
 		const auto area = (size_t) (bitmapWidth * bitmapHeight);
+		m_memorySaved = 0;
 
 		auto pPaletteBytes = make_unique<BYTE[]>(sizeof(ColorPalette) + nMaxColors * sizeof(ARGB));
 		auto pPalette = (ColorPalette*)pPaletteBytes.get();
@@ -883,26 +1047,28 @@ namespace nQuant
 
 		auto qPixels = make_unique<unsigned short[]>(area);
 		if (nMaxColors > 2) {
-			ColorData colorData(SIDESIZE, bitmapWidth, bitmapHeight);
-			BuildHistogram(colorData, pSource, nMaxColors, alphaThreshold, alphaFader);
-			CalculateMoments(colorData);
-			vector<Box> cubes;
-			SplitData(cubes, nMaxColors, colorData);
+			PixelData pixelData(pSource);
+			if (!ReadPixels(pixelData, alphaThreshold, alphaFader))
+				return false;
 
-			BuildLookups(pPalette, cubes, colorData);
-			cubes.clear();
+			// Every cumulative moment is bounded by BYTE_MAX per pixel, so 32-bit cells cannot overflow below that size
+			const bool compact = BYTE_MAX * (unsigned long long) area <= UINT_MAX;
+			const size_t cubeSize = compact ? BuildPalette<UINT>(pixelData, pPalette, nMaxColors, alphaThreshold, m_kMeansIterations)
+				: BuildPalette<unsigned long long>(pixelData, pPalette, nMaxColors, alphaThreshold, m_kMeansIterations);
+			const size_t legacySize = TOTAL_SIDESIZE * (5 * sizeof(long) + sizeof(float)) + area * sizeof(ARGB);
+			m_memorySaved = (long long) legacySize - (long long) (cubeSize + (pixelData.buffer ? area * sizeof(ARGB) : 0));
 
 			nMaxColors = pPalette->Count;
 			if (nMaxColors > 16 && nMaxColors <= 256 && pDest->GetPixelFormat() != PixelFormat8bppIndexed)
 				pDest->ConvertFormat(PixelFormat8bppIndexed, DitherTypeSolid, PaletteTypeCustom, pPalette, 0);
 
-			GetQuantizedPalette(colorData, pPalette, nMaxColors, alphaThreshold);
+			GetQuantizedPalette(pixelData, pPalette, nMaxColors, alphaThreshold);
 			if (nMaxColors > 256) {
 				auto qPixels = make_unique<ARGB[]>(area);
-				dithering_image(colorData.GetPixels(), pPalette, closestColorIndex, hasSemiTransparency, m_transparentPixelIndex, nMaxColors, qPixels.get(), bitmapWidth, bitmapHeight);
+				dithering_image(pixelData.pixels, pPalette, closestColorIndex, hasSemiTransparency, m_transparentPixelIndex, nMaxColors, qPixels.get(), bitmapWidth, bitmapHeight);
 				return ProcessImagePixels(pDest, qPixels.get(), hasSemiTransparency, m_transparentPixelIndex);
 			}			
-			quantize_image(colorData.GetPixels(), pPalette, qPixels.get(), bitmapWidth, bitmapHeight, dither, alphaThreshold);
+			quantize_image(pixelData.pixels, pPalette, qPixels.get(), bitmapWidth, bitmapHeight, dither, alphaThreshold);
 		}
 		else {
 			vector<ARGB> pixels(area);
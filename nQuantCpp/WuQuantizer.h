@@ -26,7 +26,15 @@ namespace nQuant
 
 	class WuQuantizer
 	{
+		private:
+			long long m_memorySaved = 0;
+			UINT m_kMeansIterations = 0;
+
 		public:
+			// Refine the Wu palette by weighted k-means over the histogram cells, 0 keeps the plain Wu palette
+			void setKMeansIterations(UINT iterations);
 			bool QuantizeImage(Bitmap* pSource, Bitmap* pDest, UINT& nMaxColors, bool dither = true, BYTE alphaThreshold = 0, BYTE alphaFader = 1);
+			// Bytes saved by the last run against six separate long/float moment cubes plus a full pixel copy
+			long long GetMemorySaved() const { return m_memorySaved; }
 	};
 }
\ No newline at end of file
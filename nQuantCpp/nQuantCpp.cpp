@@ -28,6 +28,7 @@ namespace fs = std::filesystem;
 #include "MedianCut.h"
 #include "Otsu.h"
 #include "GifWriter.h"
+#include "ImageCodec.h"
 #include <unordered_map>
 
 #ifdef _DEBUG
@@ -37,8 +38,9 @@ namespace fs = std::filesystem;
 GdiplusStartupInput  m_gdiplusStartupInput;
 ULONG_PTR m_gdiplusToken;
 
-wstring algs[] = { L"PNN", L"PNNLAB", L"PNNLAB+", L"NEU", L"WU", L"EAS", L"SPA", L"DIV", L"DL3", L"MMC", L"OTSU" };
+wstring algs[] = { L"PNN", L"PNNLAB", L"PNNLAB+", L"NEU", L"WU", L"WU+", L"EAS", L"SPA", L"DIV", L"DL3", L"MMC", L"OTSU" };
 unordered_map<LPCWSTR, CLSID> extensionMap;
+UINT pngLevel = 6;
 
 void PrintUsage()
 {
@@ -54,6 +56,14 @@ void PrintUsage()
 	wcout << "  /m : Max Colors (pixel-depth) - Maximum number of colors for the output format to support. The default is 256 (8-bit)." << endl;
 	wcout << "  /d : Dithering or not? y or n." << endl;
 	wcout << "  /f : Frame delay in milliseconds for PNNLAB+ only." << endl;
+	wcout << "  /t : Time budget in seconds for PNNLAB+ only. The default is no limit." << endl;
+	wcout << "  /p : Split clusters in parallel for DIV, sweep pixels in parallel for SPA? y or n. The default is n." << endl;
+	wcout << "  /s : Speed tier for DIV only, from 0 (best quality, the default) to 3 (fastest preview)." << endl;
+	wcout << "  /k : Most likely colors kept per pixel for SPA only, up to 16. The default 0 keeps all of them." << endl;
+	wcout << "  /l : Tile size in pixels for local thresholds of OTSU only, e.g. 256 for unevenly lit scans. The default 0 uses one global threshold." << endl;
+	wcout << "  /n : Samples trained per mini-batch for NEU only, e.g. 64 to train in parallel. The default 0 trains one sample at a time." << endl;
+	wcout << "  /z : Compression level of PNG output, from 0 (fastest) to 9 (smallest). The default is 6." << endl;
+	wcout << "  /b : Time the native image codecs against GDI+ over the given number of runs instead of quantizing." << endl;
 	wcout << "  /o : Output image file dir. The default is <source image path directory>" << endl;
 }
 
@@ -74,7 +84,7 @@ bool isAlgo(const wstring& alg) {
 	return false;
 }
 
-bool ProcessArgs(int argc, wstring& algo, UINT& nMaxColors, bool& dither, wstring& targetPath, wstring* argv, long& delay)
+bool ProcessArgs(int argc, wstring& algo, UINT& nMaxColors, bool& dither, wstring& targetPath, wstring* argv, long& delay, double& timeBudget, bool& parallel, UINT& speedTier, UINT& topColors, UINT& tileSize, UINT& batchSize, UINT& pngLevel, UINT& benchmarkRuns)
 {
 	for (int index = 1; index < argc; ++index) {
 		auto currentArg = argv[index];
@@ -124,6 +134,66 @@ bool ProcessArgs(int argc, wstring& algo, UINT& nMaxColors, bool& dither, wstrin
 				}
 				delay = stol(argv[index + 1].c_str());
 			}
+			else if (currentArg[1] == L'T') {
+				// seconds, fractions included
+				wchar_t* pEnd = nullptr;
+				timeBudget = wcstod(argv[index + 1].c_str(), &pEnd);
+				if (*pEnd != L'\0' || !(timeBudget > 0)) {
+					PrintUsage();
+					return false;
+				}
+			}
+			else if (currentArg[1] == L'P') {
+				auto strParallel = argv[index + 1];
+				transform(strParallel.begin(), strParallel.end(), strParallel.begin(), ::toupper);
+				if (!(strParallel == L"Y" || strParallel == L"N")) {
+					PrintUsage();
+					return false;
+				}
+				parallel = strParallel == L"Y";
+			}
+			else if (currentArg[1] == L'S') {
+				if (!isdigit(argv[index + 1].c_str()) || stoi(argv[index + 1].c_str()) > 3) {
+					PrintUsage();
+					return false;
+				}
+				speedTier = stoi(argv[index + 1].c_str());
+			}
+			else if (currentArg[1] == L'K') {
+				if (!isdigit(argv[index + 1].c_str()) || stoi(argv[index + 1].c_str()) > 16) {
+					PrintUsage();
+					return false;
+				}
+				topColors = stoi(argv[index + 1].c_str());
+			}
+			else if (currentArg[1] == L'L') {
+				if (!isdigit(argv[index + 1].c_str())) {
+					PrintUsage();
+					return false;
+				}
+				tileSize = stoi(argv[index + 1].c_str());
+			}
+			else if (currentArg[1] == L'N') {
+				if (!isdigit(argv[index + 1].c_str())) {
+					PrintUsage();
+					return false;
+				}
+				batchSize = stoi(argv[index + 1].c_str());
+			}
+			else if (currentArg[1] == L'Z') {
+				if (!isdigit(argv[index + 1].c_str()) || stoi(argv[index + 1].c_str()) > 9) {
+					PrintUsage();
+					return false;
+				}
+				pngLevel = stoi(argv[index + 1].c_str());
+			}
+			else if (currentArg[1] == L'B') {
+				if (!isdigit(argv[index + 1].c_str())) {
+					PrintUsage();
+					return false;
+				}
+				benchmarkRuns = stoi(argv[index + 1].c_str());
+			}
 			else if (currentArg[1] == L'O') {
 				auto szPath = argv[index + 1].c_str();
 				wstring tmpPath(szPath, szPath + wcslen(szPath));
@@ -143,16 +213,15 @@ inline bool fileExists(const wstring& path)
 	return fs::exists(fs::path(path));
 }
 
-bool OutputImage(const fs::path& sourcePath, const wstring& algorithm, const UINT& nMaxColors, wstring& targetDir, Bitmap* pDest, LPCWSTR defaultExtension = L".png")
+// Decodes PNG, GIF and BMP natively, other formats through GDI+
+static Bitmap* ReadImage(const wstring& path)
 {
-	auto fileName = sourcePath.filename().wstring();
-	fileName = fileName.substr(0, fileName.find_last_of(L'.'));
+	auto pBitmap = ImageCodec::FromFile(path);
+	return pBitmap ? pBitmap : Bitmap::FromFile(path.c_str());
+}
 
-	targetDir = fileExists(targetDir) ? fs::canonical(fs::path(targetDir)) : fs::current_path();
-	auto destPath = targetDir + L"/" + fileName + L"-";
-	wstring algo(algorithm.begin(), algorithm.end());
-	destPath += algo + L"quant";
-	
+static void RegisterEncoders()
+{
 	// image/bmp  : {557cf400-1a04-11d3-9a73-0000f81ef32e}
 	const CLSID bmpEncoderClsId = { 0x557cf400, 0x1a04, 0x11d3,{ 0x9a,0x73,0x00,0x00,0xf8,0x1e,0xf3,0x2e } };
 	extensionMap.emplace(L".bmp", bmpEncoderClsId);
@@ -164,10 +233,22 @@ bool OutputImage(const fs::path& sourcePath, const wstring& algorithm, const UIN
 	// image/png  : {557cf406-1a04-11d3-9a73-0000f81ef32e}
 	const CLSID pngEncoderClsId = { 0x557cf406, 0x1a04, 0x11d3,{ 0x9a,0x73,0x00,0x00,0xf8,0x1e,0xf3,0x2e } };
 	extensionMap.emplace(L".png", pngEncoderClsId);
+}
+
+bool OutputImage(const fs::path& sourcePath, const wstring& algorithm, const UINT& nMaxColors, wstring& targetDir, Bitmap* pDest, LPCWSTR defaultExtension = L".png")
+{
+	auto fileName = sourcePath.filename().wstring();
+	fileName = fileName.substr(0, fileName.find_last_of(L'.'));
+
+	targetDir = fileExists(targetDir) ? fs::canonical(fs::path(targetDir)) : fs::current_path();
+	auto destPath = targetDir + L"/" + fileName + L"-";
+	wstring algo(algorithm.begin(), algorithm.end());
+	destPath += algo + L"quant";
+	RegisterEncoders();
 
 	auto targetExtension = (pDest->GetPixelFormat() < PixelFormat16bppARGB1555 && nMaxColors > 256) ? L".bmp" : defaultExtension;
 	destPath += std::to_wstring(nMaxColors) + targetExtension;
-	auto status = pDest->Save(destPath.c_str(), &extensionMap[targetExtension]);
+	auto status = ImageCodec::Save(pDest, destPath, pngLevel) ? Status::Ok : pDest->Save(destPath.c_str(), &extensionMap[targetExtension]);
 	if (status == Status::Ok)
 		wcout << L"Converted image: " << destPath << endl;
 	else
@@ -176,7 +257,76 @@ bool OutputImage(const fs::path& sourcePath, const wstring& algorithm, const UIN
 	return status == Status::Ok;
 }
 
-bool QuantizeImage(const wstring& algorithm, const wstring& sourceFile, wstring& targetDir, shared_ptr<Bitmap> pSource, UINT nMaxColors, bool dither)
+// Average seconds per run, or -1 if a run fails
+static double TimeRuns(const UINT runs, const function<bool()>& fn)
+{
+	auto start = chrono::steady_clock::now();
+	for (UINT i = 0; i < runs; ++i) {
+		if (!fn())
+			return -1;
+	}
+	return chrono::duration_cast<chrono::microseconds>(chrono::steady_clock::now() - start).count() / 1000000.0 / runs;
+}
+
+static void BenchmarkCodecs(const wstring& sourceFile, shared_ptr<Bitmap> pSource, const UINT runs)
+{
+	const auto width = pSource->GetWidth(), height = pSource->GetHeight();
+	const auto megaPixels = (double) width * height / 1000000;
+	auto report = [megaPixels](LPCWSTR label, const double secs, const wstring& path = L"") {
+		wcout << label;
+		if (secs < 0) {
+			wcout << L"not supported" << endl;
+			return;
+		}
+		wcout << secs * 1000 << L" ms, " << megaPixels / secs << L" MP/s";
+		if (!path.empty())
+			wcout << L", " << fs::file_size(fs::path(path)) << L" bytes";
+		wcout << endl;
+	};
+
+	UINT w, h;
+	vector<ARGB> pixels;
+	report(L"Native decode: ", TimeRuns(runs, [&]() { return ImageCodec::decode(sourceFile, w, h, pixels); }));
+	report(L"GDI+ decode:   ", TimeRuns(runs, [&]() {
+		auto pBitmap = unique_ptr<Bitmap>(Bitmap::FromFile(sourceFile.c_str()));
+		BitmapData data;
+		if (pBitmap->GetLastStatus() != Ok || pBitmap->LockBits(&Rect(0, 0, width, height), ImageLockModeRead, PixelFormat32bppARGB, &data) != Ok)
+			return false;
+		return pBitmap->UnlockBits(&data) == Ok;
+	}));
+
+	auto pDest = make_shared<Bitmap>(width, height, PixelFormat8bppIndexed);
+	nQuant::WuQuantizer wuQuantizer;
+	UINT nMaxColors = 256;
+	if (!wuQuantizer.QuantizeImage(pSource.get(), pDest.get(), nMaxColors, false))
+		return;
+
+	RegisterEncoders();
+	auto tempPath = (fs::temp_directory_path() / L"nQuantCpp-benchmark").wstring();
+	for (auto extension : { L".png", L".gif", L".bmp" }) {
+		auto destPath = tempPath + extension;
+		wcout << extension + 1 << L" encode of " << nMaxColors << L" colors" << endl;
+		report(L"  Native: ", TimeRuns(runs, [&]() { return ImageCodec::Save(pDest.get(), destPath, pngLevel); }), destPath);
+		report(L"  GDI+:   ", TimeRuns(runs, [&]() { return pDest->Save(destPath.c_str(), &extensionMap[extension]) == Ok; }), destPath);
+		fs::remove(fs::path(destPath));
+	}
+}
+
+static void PrintStopReason(const nQuantGA::StopReason stopReason, const int generation)
+{
+	wstring reason = L"maximum generations";
+	if (stopReason == nQuantGA::StopReason::MinFitness)
+		reason = L"fitness reached";
+	else if (stopReason == nQuantGA::StopReason::TimeBudget)
+		reason = L"time budget";
+	else if (stopReason == nQuantGA::StopReason::Stagnation)
+		reason = L"stagnation";
+	else if (stopReason == nQuantGA::StopReason::Hypervolume)
+		reason = L"hypervolume converged";
+	wcout << L"Stopped by " << reason << L" after " << generation << L" generations." << endl;
+}
+
+bool QuantizeImage(const wstring& algorithm, const wstring& sourceFile, wstring& targetDir, shared_ptr<Bitmap> pSource, UINT nMaxColors, bool dither, const double timeBudget = 0.0, const bool parallel = false, const UINT speedTier = 0, const UINT topColors = 0, const UINT tileSize = 0, const UINT batchSize = 0)
 {
 	// Create 8 bpp indexed bitmap of the same size
 	auto pDest = make_shared<Bitmap>(pSource->GetWidth(), pSource->GetHeight(), (nMaxColors > 256) ? PixelFormat16bppARGB1555 : (nMaxColors > 16) ? PixelFormat8bppIndexed : (nMaxColors > 2) ? PixelFormat4bppIndexed : PixelFormat1bppIndexed);
@@ -195,20 +345,31 @@ bool QuantizeImage(const wstring& algorithm, const wstring& sourceFile, wstring&
 		vector<shared_ptr<Bitmap> > sources(1, pSource);
 		PnnLABQuant::PnnLABGAQuantizer pnnLABGAQuantizer(pnnLABQuantizer, sources, nMaxColors);
 		nQuantGA::APNsgaIII alg(pnnLABGAQuantizer);
-		alg.run(9999, -numeric_limits<double>::epsilon());
+		alg.run(9999, -numeric_limits<double>::epsilon(), timeBudget);
 		auto pGAq = alg.getResult();
+		if (pGAq == nullptr) {
+			wcout << L"\nNo result was found within the time budget" << endl;
+			return false;
+		}
+
 		wcout << L"\n" << pGAq->getResult().c_str() << endl;
+		PrintStopReason(alg.getStopReason(), alg.getGeneration());
 		vector<shared_ptr<Bitmap> > dests;
 		dests.emplace_back(pDest);
 		bSucceeded = pGAq->QuantizeImage(dests, dither);
 	}
 	else if (algorithm == L"NEU") {
 		NeuralNet::NeuQuantizer neuQuantizer;
+		neuQuantizer.setBatchSize(batchSize);
 		bSucceeded = neuQuantizer.QuantizeImage(pSource.get(), pDest.get(), nMaxColors, dither);
 	}
-	else if (algorithm == L"WU") {
+	else if (algorithm == L"WU" || algorithm == L"WU+") {
 		nQuant::WuQuantizer wuQuantizer;
+		if (algorithm == L"WU+")
+			wuQuantizer.setKMeansIterations(8);
 		bSucceeded = wuQuantizer.QuantizeImage(pSource.get(), pDest.get(), nMaxColors, dither);
+		if (bSucceeded)
+			wcout << L"Memory saved by compact moments: " << wuQuantizer.GetMemorySaved() / 1024 << L" KB" << endl;
 	}
 	else if (algorithm == L"EAS") {
 		EdgeAwareSQuant::EdgeAwareSQuantizer easQuantizer;
@@ -216,10 +377,14 @@ bool QuantizeImage(const wstring& algorithm, const wstring& sourceFile, wstring&
 	}
 	else if (algorithm == L"SPA") {
 		SpatialQuant::SpatialQuantizer spaQuantizer;
+		spaQuantizer.setParallel(parallel);
+		spaQuantizer.setTopColors(topColors);
 		bSucceeded = spaQuantizer.QuantizeImage(pSource.get(), pDest.get(), nMaxColors, dither);
 	}
 	else if (algorithm == L"DIV") {
 		DivQuant::DivQuantizer divQuantizer;
+		divQuantizer.setParallel(parallel);
+		divQuantizer.setSpeedTier(speedTier);
 		bSucceeded = divQuantizer.QuantizeImage(pSource.get(), pDest.get(), nMaxColors, dither);
 	}
 	else if (algorithm == L"DL3") {
@@ -233,6 +398,7 @@ bool QuantizeImage(const wstring& algorithm, const wstring& sourceFile, wstring&
 	else if (algorithm == L"OTSU") {
 		nMaxColors = 2;
 		OtsuThreshold::Otsu otsu;
+		otsu.setTileSize(tileSize);
 		bSucceeded = otsu.ConvertGrayScaleToBinary(pSource.get(), pDest.get());
 	}
 
@@ -243,80 +409,104 @@ bool QuantizeImage(const wstring& algorithm, const wstring& sourceFile, wstring&
 	return OutputImage(sourcePath, algorithm, nMaxColors, targetDir, pDest.get());
 }
 
-static void OutputImages(const fs::path& sourceDir, wstring& targetDir, const UINT& nMaxColors, const bool dither, const wstring& algo, const long& delay)
+static void OutputImages(const fs::path& sourceDir, wstring& targetDir, const UINT& nMaxColors, const bool dither, const wstring& algo, const long& delay, const double timeBudget)
 {
 	auto start = chrono::steady_clock::now();
 
-	vector<fs::path> sourcePaths;
-	vector<shared_ptr<Bitmap> > pSources, pDests;
+	vector<fs::path> paths;
 	for (const auto& entry : fs::recursive_directory_iterator(sourceDir)) {
-		if (entry.is_regular_file() && !entry.is_symlink()) {
-			auto pSource = shared_ptr<Bitmap>(Bitmap::FromFile(entry.path().wstring().c_str()));
-			auto status = pSource->GetLastStatus();
-			if (status != Ok)
-				continue;
-			sourcePaths.emplace_back(entry.path());
-			pSources.emplace_back(pSource);
-			pDests.emplace_back(make_shared<Bitmap>(pSource->GetWidth(), pSource->GetHeight(), (nMaxColors > 256) ? PixelFormat16bppARGB1555
-			: (nMaxColors > 16) ? PixelFormat8bppIndexed : (nMaxColors > 2) ? PixelFormat4bppIndexed : PixelFormat1bppIndexed));
-		}
+		if (entry.is_regular_file() && !entry.is_symlink())
+			paths.emplace_back(entry.path());
 	}
 
+	auto readSource = [](const fs::path& path) -> shared_ptr<Bitmap> {
+		auto pSource = shared_ptr<Bitmap>(ReadImage(path.wstring()));
+		return pSource->GetLastStatus() == Ok ? pSource : nullptr;
+	};
+	auto createDest = [nMaxColors](const Bitmap* pSource) {
+		return make_shared<Bitmap>(pSource->GetWidth(), pSource->GetHeight(), (nMaxColors > 256) ? PixelFormat16bppARGB1555
+			: (nMaxColors > 16) ? PixelFormat8bppIndexed : (nMaxColors > 2) ? PixelFormat4bppIndexed : PixelFormat1bppIndexed);
+	};
+
 	if (algo == L"PNN") {
 		if (nMaxColors > 256 || delay < 0) {
-			int i = 0;
-			for (auto& sourcePath : sourcePaths)
-				QuantizeImage(algo, sourcePath, targetDir, pSources[i], nMaxColors, dither);
+			for (auto& sourcePath : paths) {
+				auto pSource = readSource(sourcePath);
+				if (pSource)
+					QuantizeImage(algo, sourcePath, targetDir, pSource, nMaxColors, dither);
+			}
 		}
 		else {
-			auto fileName = sourcePaths[0].filename().wstring();
-			fileName = fileName.substr(0, fileName.find_last_of(L'.'));
-
 			targetDir = fileExists(targetDir) ? fs::canonical(fs::path(targetDir)) : fs::current_path();
-			auto destPath = targetDir + L"/" + fileName + L"-";
-			if (algo == L"PNNLAB") {
-				destPath += L"PNNLABquant.gif";
-
-				UINT maxColors = nMaxColors;
-				for (int i = 0; i < pSources.size(); ++i) {
-					ostringstream ss;
-					ss << "\r" << i << " of " << pSources.size() << " completed." << showpoint;
-					wcout << ss.str().c_str();
+			wstring destPath;
+			// every source is read, quantized and handed to the writer in turn, so only a batch of frames is held at a time
+			unique_ptr<GifEncode::GifWriter> pGifWriter;
+			bool succeeded = true;
+			UINT maxColors = nMaxColors;
+			for (int i = 0; i < paths.size() && succeeded; ++i) {
+				ostringstream ss;
+				ss << "\r" << i << " of " << paths.size() << " completed." << showpoint;
+				wcout << ss.str().c_str();
+
+				auto pSource = readSource(paths[i]);
+				if (!pSource)
+					continue;
+
+				if (!pGifWriter) {
+					auto fileName = paths[i].filename().wstring();
+					fileName = fileName.substr(0, fileName.find_last_of(L'.'));
+					destPath = targetDir + L"/" + fileName + L"-";
+					destPath += (algo == L"PNNLAB") ? L"PNNLABquant.gif" : L"PNNquant.gif";
+					pGifWriter = make_unique<GifEncode::GifWriter>(destPath, false, abs(delay));
+				}
 
+				auto pDest = createDest(pSource.get());
+				if (algo == L"PNNLAB") {
 					PnnLABQuant::PnnLABQuantizer pnnLABQuantizer;
-					pnnLABQuantizer.QuantizeImage(pSources[i].get(), pDests[i].get(), maxColors, dither);
+					succeeded = pnnLABQuantizer.QuantizeImage(pSource.get(), pDest.get(), maxColors, dither);
 				}
-			}
-			else {
-				destPath += L"PNNquant.gif";
-
-				UINT maxColors = nMaxColors;
-				for (int i = 0; i < pSources.size(); ++i) {
-					ostringstream ss;
-					ss << "\r" << i << " of " << pSources.size() << " completed." << showpoint;
-					wcout << ss.str().c_str();
-
+				else {
 					PnnQuant::PnnQuantizer pnnQuantizer;
-					pnnQuantizer.QuantizeImage(pSources[i].get(), pDests[i].get(), maxColors, dither);
+					succeeded = pnnQuantizer.QuantizeImage(pSource.get(), pDest.get(), maxColors, dither);
 				}
+				succeeded = succeeded && pGifWriter->AddFrame(pDest.get());
 			}
 			wcout << L"\rWell done!!!                             " << endl;
 
-			GifEncode::GifWriter gifWriter(destPath, false, abs(delay));
-			auto status = gifWriter.AddImages(pDests);
-			if (status == Status::Ok)
-				wcout << L"Converted image: " << destPath << endl;
-			else
-				wcout << L"Failed to save image in '" << destPath << L"' file" << endl;
+			if (pGifWriter) {
+				auto status = pGifWriter->Close();
+				if (succeeded && status == Status::Ok)
+					wcout << L"Converted image: " << destPath << endl;
+				else
+					wcout << L"Failed to save image in '" << destPath << L"' file" << endl;
+			}
 		}
 	}
 	else {
+		// the GA evaluates its palettes against all sources together
+		vector<fs::path> sourcePaths;
+		vector<shared_ptr<Bitmap> > pSources, pDests;
+		for (auto& path : paths) {
+			auto pSource = readSource(path);
+			if (!pSource)
+				continue;
+			sourcePaths.emplace_back(path);
+			pSources.emplace_back(pSource);
+			pDests.emplace_back(createDest(pSource.get()));
+		}
+
 		PnnLABQuant::PnnLABQuantizer pnnLABQuantizer;
 		PnnLABQuant::PnnLABGAQuantizer pnnLABGAQuantizer(pnnLABQuantizer, pSources, nMaxColors);
 		nQuantGA::APNsgaIII alg(pnnLABGAQuantizer);
-		alg.run(9999, -numeric_limits<double>::epsilon());
+		alg.run(9999, -numeric_limits<double>::epsilon(), timeBudget);
 		auto pGAq = alg.getResult();
+		if (pGAq == nullptr) {
+			wcout << L"\nNo result was found within the time budget" << endl;
+			return;
+		}
+
 		wcout << L"\n" << pGAq->getResult().c_str() << endl;
+		PrintStopReason(alg.getStopReason(), alg.getGeneration());
 		if (pGAq->QuantizeImage(pDests, dither)) {
 			if (nMaxColors > 256 || delay < 0) {
 				int i = 0;
@@ -362,6 +552,13 @@ int wmain(int argc, wchar_t** argv)
 	bool dither = true;
 	UINT nMaxColors = 256;
 	long delay = -1;
+	double timeBudget = 0.0;
+	bool parallel = false;
+	UINT speedTier = 0;
+	UINT topColors = 0;
+	UINT tileSize = 0;
+	UINT batchSize = 0;
+	UINT benchmarkRuns = 0;
 	wstring algo = L"";
 	wstring targetDir = L"";
 
@@ -373,7 +570,7 @@ int wmain(int argc, wchar_t** argv)
 	wstring sourceFile = szDir + L"/../ImgV64.gif";
 	nMaxColors = 1024;
 #else
-	if (!ProcessArgs(argc, algo, nMaxColors, dither, targetDir, argList.data(), delay))
+	if (!ProcessArgs(argc, algo, nMaxColors, dither, targetDir, argList.data(), delay, timeBudget, parallel, speedTier, topColors, tileSize, batchSize, pngLevel, benchmarkRuns))
 		return 0;
 
 	wstring sourceFile(argv[1], argv[1] + wcslen(argv[1]));
@@ -390,14 +587,16 @@ int wmain(int argc, wchar_t** argv)
 		if(fs::is_directory(fs::status(sourceFile.c_str())) ) {
 			if (!targetDir.empty() && !fileExists(targetDir))
 				fs::create_directories(targetDir);
-			OutputImages(sourceFile, targetDir, nMaxColors, dither, algo, delay);
+			OutputImages(sourceFile, targetDir, nMaxColors, dither, algo, delay, timeBudget);
 			GdiplusShutdown(m_gdiplusToken);
 			return 0;
 		}
 		
-		auto pSource = shared_ptr<Bitmap>(Bitmap::FromFile(sourceFile.c_str()));
+		auto pSource = shared_ptr<Bitmap>(ReadImage(sourceFile));
 		auto status = pSource->GetLastStatus();
-		if (status == Ok) {
+		if (status == Ok && benchmarkRuns > 0)
+			BenchmarkCodecs(sourceFile, pSource, benchmarkRuns);
+		else if (status == Ok) {
 			auto start = chrono::steady_clock::now();
 			if (!fileExists(targetDir))
 				targetDir = fs::path(sourceFile).parent_path().wstring();
@@ -410,7 +609,7 @@ int wmain(int argc, wchar_t** argv)
 			sourceFile = (sourceFile[sourceFile.length() - 1] != L'/' && sourceFile[sourceFile.length() - 1] != L'\\') ? sourceFile : sourceFile.substr(0, sourceFile.find_last_of(L"\\/"));
 			if (algo == L"") {
 				//QuantizeImage(L"MMC", sourceFile, targetDir, pSource, nMaxColors, dither);
-				QuantizeImage(L"DIV", sourceFile, targetDir, pSource, nMaxColors, dither);
+				QuantizeImage(L"DIV", sourceFile, targetDir, pSource, nMaxColors, dither, timeBudget, parallel, speedTier);
 				if (nMaxColors > 32) {
 					QuantizeImage(L"PNN", sourceFile, targetDir, pSource, nMaxColors, dither);
 					QuantizeImage(L"WU", sourceFile, targetDir, pSource, nMaxColors, dither);
@@ -423,7 +622,7 @@ int wmain(int argc, wchar_t** argv)
 				}
 			}
 			else
-				QuantizeImage(algo, sourceFile, targetDir, pSource, nMaxColors, dither);
+				QuantizeImage(algo, sourceFile, targetDir, pSource, nMaxColors, dither, timeBudget, parallel, speedTier, topColors, tileSize, batchSize);
 
 			auto dur = chrono::duration_cast<chrono::microseconds>(chrono::steady_clock::now() - start).count() / 1000000.0;
 			wcout << "Completed in " << dur << " secs." << endl;